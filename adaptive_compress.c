@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <math.h>
 /*
 #if defined(sun) || defined(__sun)
 #include <sys/byteorder.h>
@@ -38,6 +39,7 @@
 #include <pcompress.h>
 #include <allocator.h>
 #include <pc_archive.h>
+#include <lz4.h>
 #include "filters/analyzer/analyzer.h"
 
 static unsigned int lzma_count = 0;
@@ -45,6 +47,7 @@ static unsigned int bzip2_count = 0;
 static unsigned int bsc_count = 0;
 static unsigned int ppmd_count = 0;
 static unsigned int lz4_count = 0;
+static unsigned int zstd_count = 0;
 
 extern int lzma_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *destlen, int level, uchar_t chdr, int btype, void *data);
@@ -84,17 +87,34 @@ extern int lz4_deinit(void **data);
 extern int ppmd_alloc(void *data);
 extern void ppmd_free(void *data);
 extern int ppmd_state_init(void **data, int *level, int alloc);
+extern uint64_t ppmd_state_mem(int level);
+extern uint64_t lzma_state_mem(int level, uint64_t chunksize);
+extern uint64_t lzma_dict_size(int level, uint64_t chunksize);
 
 extern int lz4_buf_extra(uint64_t buflen);
 extern int libbsc_buf_extra(uint64_t buflen);
 
+/*
+ * In adapt2 mode binary data is compressed using Zstd instead of LZMA upto
+ * this level, if Zstd support is present.
+ */
+#define	ADAPT2_ZSTD_MAX_LEVEL	5
+
+/*
+ * The optional estimator looks at these many evenly spaced samples of a chunk.
+ */
+#define	ADAPT_EST_SAMPLES	8
+#define	ADAPT_EST_SAMPLE_SZ	(32 * 1024)
+
 struct adapt_data {
 	void *lzma_data;
 	void *ppmd_data;
 	void *bsc_data;
 	void *lz4_data;
+	void *zstd_data;
 	int adapt_mode;
 	analyzer_ctx_t *actx;
+	uchar_t *est_buf;
 };
 
 void
@@ -104,17 +124,36 @@ adapt_set_analyzer_ctx(void *data, analyzer_ctx_t *actx)
 	adat->actx = actx;
 }
 
+/*
+ * Enable the sample based estimator (--estimate). It is only used in adapt2 mode
+ * and needs a scratch buffer for trial compressing the samples.
+ */
+int
+adapt_set_estimate(void *data)
+{
+	struct adapt_data *adat = (struct adapt_data *)data;
+
+	if (adat->adapt_mode != 2 || adat->est_buf)
+		return (0);
+	adat->est_buf = (uchar_t *)slab_alloc(NULL, LZ4_compressBound(ADAPT_EST_SAMPLE_SZ));
+	if (!adat->est_buf)
+		return (-1);
+	return (0);
+}
+
 void
 adapt_stats(int show)
 {
 	if (show) {
-		if (bzip2_count > 0 || bsc_count > 0 || ppmd_count > 0 || lzma_count > 0) {
+		if (bzip2_count > 0 || bsc_count > 0 || ppmd_count > 0 || lzma_count > 0 ||
+		    zstd_count > 0) {
 			log_msg(LOG_INFO, 0, "Adaptive mode stats:");
 			log_msg(LOG_INFO, 0, "	BZIP2 chunk count: %u", bzip2_count);
 			log_msg(LOG_INFO, 0, "	LIBBSC chunk count: %u", bsc_count);
 			log_msg(LOG_INFO, 0, "	PPMd chunk count: %u", ppmd_count);
 			log_msg(LOG_INFO, 0, "	LZMA chunk count: %u", lzma_count);
 			log_msg(LOG_INFO, 0, "	LZ4 chunk count: %u", lz4_count);
+			log_msg(LOG_INFO, 0, "	ZSTD chunk count: %u", zstd_count);
 		} else {
 			log_msg(LOG_INFO, 0, "\n");
 		}
@@ -124,6 +163,7 @@ adapt_stats(int show)
 	bsc_count = 0;
 	ppmd_count = 0;
 	lz4_count = 0;
+	zstd_count = 0;
 }
 
 void
@@ -133,12 +173,18 @@ adapt_props(algo_props_t *data, int level, uint64_t chunksize)
 
 	data->delta2_span = 200;
 	data->deltac_min_distance = EIGHTM;
+	data->state_mem = ppmd_state_mem(level) + lzma_state_mem(level, chunksize);
+	data->dstate_mem = ppmd_state_mem(level) + lzma_dict_size(level, chunksize);
 	ext1 = lz4_buf_extra(chunksize);
 
 #ifdef ENABLE_PC_LIBBSC
 	ext2 = libbsc_buf_extra(chunksize);
 	if (ext2 > ext1) ext1 = ext2;
 #endif
+#ifdef ENABLE_PC_ZSTD
+	ext2 = zstd_buf_extra(chunksize);
+	if (ext2 > ext1) ext1 = ext2;
+#endif
 
 	data->buf_extra = ext1;
 }
@@ -153,6 +199,8 @@ adapt_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	if (!adat) {
 		adat = (struct adapt_data *)slab_alloc(NULL, sizeof (struct adapt_data));
 		adat->adapt_mode = 1;
+		adat->actx = NULL;
+		adat->est_buf = NULL;
 		rv = ppmd_state_init(&(adat->ppmd_data), level, 0);
 
 		/*
@@ -164,6 +212,7 @@ adapt_init(void **data, int *level, int nthreads, uint64_t chunksize,
 			rv = lz4_init(&(adat->lz4_data), &lv, nthreads, chunksize, file_version, op);
 		adat->lzma_data = NULL;
 		adat->bsc_data = NULL;
+		adat->zstd_data = NULL;
 		*data = adat;
 		if (*level > 9) *level = 9;
 	}
@@ -172,6 +221,7 @@ adapt_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	ppmd_count = 0;
 	bsc_count = 0;
 	lz4_count = 0;
+	zstd_count = 0;
 	return (rv);
 }
 
@@ -185,8 +235,11 @@ adapt2_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	if (!adat) {
 		adat = (struct adapt_data *)slab_alloc(NULL, sizeof (struct adapt_data));
 		adat->adapt_mode = 2;
+		adat->actx = NULL;
+		adat->est_buf = NULL;
 		adat->ppmd_data = NULL;
 		adat->bsc_data = NULL;
+		adat->zstd_data = NULL;
 		lv = *level;
 		if (lv > 10) lv = 10;
 		rv = ppmd_state_init(&(adat->ppmd_data), level, 0);
@@ -197,6 +250,15 @@ adapt2_init(void **data, int *level, int nthreads, uint64_t chunksize,
 #ifdef ENABLE_PC_LIBBSC
 		if (rv == 0)
 			rv = libbsc_init(&(adat->bsc_data), &lv, nthreads, chunksize, file_version, op);
+#endif
+		lv = *level;
+#ifdef ENABLE_PC_ZSTD
+		/*
+		 * Zstd context is always needed when decompressing since a file can
+		 * have Zstd chunks irrespective of level.
+		 */
+		if (rv == 0 && (lv <= ADAPT2_ZSTD_MAX_LEVEL || op == DECOMPRESS))
+			rv = zstd_init(&(adat->zstd_data), &lv, nthreads, chunksize, file_version, op);
 #endif
 		/*
 		 * LZ4 is used to tackle some embedded archive headers and/or zero paddings in
@@ -206,6 +268,7 @@ adapt2_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		lv = 1;
 		if (rv == 0)
 			rv = lz4_init(&(adat->lz4_data), &lv, nthreads, chunksize, file_version, op);
+
 		*data = adat;
 		if (*level > 9) *level = 9;
 	}
@@ -214,6 +277,7 @@ adapt2_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	ppmd_count = 0;
 	bsc_count = 0;
 	lz4_count = 0;
+	zstd_count = 0;
 	return (rv);
 }
 
@@ -229,6 +293,12 @@ adapt_deinit(void **data)
 			rv += lzma_deinit(&(adat->lzma_data));
 		if (adat->lz4_data)
 			rv += lz4_deinit(&(adat->lz4_data));
+#ifdef ENABLE_PC_ZSTD
+		if (adat->zstd_data)
+			rv += zstd_deinit(&(adat->zstd_data));
+#endif
+		if (adat->est_buf)
+			slab_free(NULL, adat->est_buf);
 		slab_free(NULL, adat);
 		*data = NULL;
 	}
@@ -251,26 +321,147 @@ is_bsc_type(int btype)
 	    (mtype & TYPE_BINARY && stype == TYPE_MARKUP));
 }
 
+/*
+ * Order-0 entropy as a fraction of 8 bits per byte, the fraction of 7-bit text
+ * bytes and the LZ4 compression ratio over a few evenly spaced samples of the
+ * buffer.
+ */
+static void
+adapt_sample_stats(struct adapt_data *adat, uchar_t *src, uint64_t srclen, double *h,
+    double *tf, double *lr)
+{
+	uint64_t cnt[256], stride, tot, txt, clen;
+	int i, j, rv;
+
+	memset(cnt, 0, sizeof (cnt));
+	stride = (srclen - ADAPT_EST_SAMPLE_SZ) / (ADAPT_EST_SAMPLES - 1);
+	clen = 0;
+	for (i = 0; i < ADAPT_EST_SAMPLES; i++) {
+		uchar_t *s = src + i * stride;
+
+		for (j = 0; j < ADAPT_EST_SAMPLE_SZ; j++)
+			cnt[s[j]]++;
+		rv = LZ4_compress_limitedOutput((const char *)s, (char *)adat->est_buf,
+		    ADAPT_EST_SAMPLE_SZ, LZ4_compressBound(ADAPT_EST_SAMPLE_SZ));
+		if (rv <= 0)
+			rv = ADAPT_EST_SAMPLE_SZ;
+		clen += rv;
+	}
+
+	tot = ADAPT_EST_SAMPLES * ADAPT_EST_SAMPLE_SZ;
+	txt = cnt['\t'] + cnt['\n'] + cnt['\r'];
+	*h = 0;
+	for (i = 0; i < 256; i++) {
+		if (i >= 32 && i < 127)
+			txt += cnt[i];
+		if (cnt[i]) {
+			double p = (double)cnt[i] / tot;
+			*h -= p * log2(p);
+		}
+	}
+	*h /= 8;
+	*tf = (double)txt / tot;
+	*lr = (double)clen / tot;
+}
+
+/*
+ * Predict the compressed size and the time taken by the LZ (LZMA or Zstd), PPM
+ * and BWT (libbsc) backends for a chunk and pick one. Sizes are natural logs
+ * relative to LZMA and times are natural logs relative to libbsc, both at the
+ * same level. They are linear in the sample LZ4 ratio, order-0 entropy and text
+ * fraction. The weights are fitted from runs of the real backends on 4MB chunks
+ * of mixed data as they reach this point, after Dedupe and Delta2. Text mostly
+ * favors the context modelling backends while LZMA gains where the LZ4 ratio is
+ * low for the entropy. Among the backends predicted to be within a level dependent
+ * slack of the smallest output the fastest one is chosen.
+ */
+static int
+adapt_estimate_algo(struct adapt_data *adat, uchar_t *src, uint64_t srclen, int level)
+{
+	double h, tf, lr, size[3], cost[3], slack, best;
+	int algo[3], i, n, sel;
+
+	adapt_sample_stats(adat, src, srclen, &h, &tf, &lr);
+
+	n = 0;
+	algo[n] = ADAPT_COMPRESS_LZMA;
+	size[n] = 0;
+	cost[n] = 0.388 * lr - 1.160 * h + 0.357 * tf + 1.494;
+	if (adat->zstd_data)
+		cost[n] = -2.0;
+	n++;
+
+	algo[n] = ADAPT_COMPRESS_PPMD;
+	size[n] = -0.208 * lr + 0.248 * h - 0.280 * tf + 0.199;
+	cost[n] = 0.152 * lr + 0.674 * h - 0.918 * tf + 0.116;
+	n++;
+
+#ifdef ENABLE_PC_LIBBSC
+	if (adat->bsc_data) {
+		algo[n] = ADAPT_COMPRESS_BSC;
+		size[n] = 0.183 * lr - 0.025 * h - 0.346 * tf + 0.126;
+		cost[n] = 0;
+		n++;
+	}
+#endif
+
+	best = size[0];
+	for (i = 1; i < n; i++) {
+		if (size[i] < best)
+			best = size[i];
+	}
+
+	/*
+	 * Higher levels trade time for ratio so the slack narrows.
+	 */
+	if (level > 9) level = 9;
+	slack = best + log(1.0 + (10 - level) * 0.005);
+	sel = -1;
+	for (i = 0; i < n; i++) {
+		if (size[i] <= slack && (sel < 0 || cost[i] < cost[sel]))
+			sel = i;
+	}
+	return (algo[sel]);
+}
+
+/*
+ * The estimator only overrides the choice for generic data. Specific media and
+ * data types detected upfront have a better matched backend already.
+ */
+static int
+adapt_estimate_type(int btype)
+{
+	int stype = PC_SUBTYPE(btype);
+
+	return (stype == 0 || stype == TYPE_MARKUP || stype == TYPE_ARCHIVE_TAR ||
+	    stype == TYPE_PDF);
+}
+
 int
 adapt_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data)
 {
 	struct adapt_data *adat = (struct adapt_data *)(data);
-	int rv = 0, bsc_type = 0;
+	int rv = 0, bsc_type = 0, algo;
 	int stype = PC_SUBTYPE(btype);
-	analyzer_ctx_t actx;
+	analyzer_ctx_t actx, *ctx;
 
+	/*
+	 * Use the analyzer results from preprocessing if available, otherwise
+	 * analyze here.
+	 */
+	ctx = adat->actx;
 	if (btype == TYPE_UNKNOWN || PC_TYPE(btype) & TYPE_TEXT ||
 	    stype == TYPE_ARCHIVE_TAR || stype == TYPE_PDF) {
-		if (adat->actx == NULL) {
+		if (ctx == NULL) {
 			analyze_buffer(src, srclen, &actx);
-			adat->actx = &actx;
+			ctx = &actx;
 		}
 		if (adat->adapt_mode == 2) {
-			btype = adat->actx->thirty_pct.btype;
+			btype = ctx->thirty_pct.btype;
 
 		} else if (adat->adapt_mode == 1) {
-			btype = adat->actx->fifty_pct.btype;
+			btype = ctx->fifty_pct.btype;
 		}
 	}
 
@@ -280,59 +471,92 @@ adapt_compress(void *src, uint64_t srclen, void *dst,
 
 	/*
 	 * Use PPMd if some percentage of source is 7-bit textual bytes, otherwise
-	 * use Bzip2 or LZMA. For totally incompressible data we always use LZ4. There
+	 * use Bzip2 or LZMA. Adapt2 uses Zstd instead of LZMA at lower levels if
+	 * available. For totally incompressible data we always use LZ4. There
 	 * is no point trying to compress such data, like Jpegs. However some archive headers
 	 * and zero paddings can exist which LZ4 can easily take care of very fast.
+	 * If the estimator is enabled it decides between the LZ, PPM and BWT backends
+	 * for generic data.
 	 */
 #ifdef ENABLE_PC_LIBBSC
 	bsc_type = is_bsc_type(btype);
 #endif
 	if (is_incompressible(btype) && !bsc_type) {
+		algo = ADAPT_COMPRESS_LZ4;
+
+	} else if (adat->est_buf && adapt_estimate_type(btype) &&
+	    srclen >= ADAPT_EST_SAMPLES * ADAPT_EST_SAMPLE_SZ) {
+		algo = adapt_estimate_algo(adat, src, srclen, level);
+
+	} else if (adat->adapt_mode == 2 && PC_TYPE(btype) & TYPE_BINARY && !bsc_type) {
+		algo = ADAPT_COMPRESS_LZMA;
+
+	} else if (adat->adapt_mode == 1 && PC_TYPE(btype) & TYPE_BINARY && !bsc_type) {
+		algo = ADAPT_COMPRESS_BZIP2;
+
+	} else if (adat->bsc_data && bsc_type) {
+		algo = ADAPT_COMPRESS_BSC;
+
+	} else {
+		algo = ADAPT_COMPRESS_PPMD;
+	}
+
+	if (algo == ADAPT_COMPRESS_LZMA && adat->zstd_data)
+		algo = ADAPT_COMPRESS_ZSTD;
+
+	switch (algo) {
+	case ADAPT_COMPRESS_LZ4:
 		rv = lz4_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->lz4_data);
 		if (rv < 0)
 			return (rv);
-		rv = ADAPT_COMPRESS_LZ4;
 		lz4_count++;
+		break;
 
-	} else if (adat->adapt_mode == 2 && PC_TYPE(btype) & TYPE_BINARY && !bsc_type) {
+	case ADAPT_COMPRESS_ZSTD:
+#ifdef ENABLE_PC_ZSTD
+		rv = zstd_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->zstd_data);
+		if (rv < 0)
+			return (rv);
+		zstd_count++;
+#endif
+		break;
+
+	case ADAPT_COMPRESS_LZMA:
 		rv = lzma_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->lzma_data);
 		if (rv < 0)
 			return (rv);
-		rv = ADAPT_COMPRESS_LZMA;
 		lzma_count++;
+		break;
 
-	} else if (adat->adapt_mode == 1 && PC_TYPE(btype) & TYPE_BINARY && !bsc_type) {
+	case ADAPT_COMPRESS_BZIP2:
 		rv = bzip2_compress(src, srclen, dst, dstlen, level, chdr, btype, NULL);
 		if (rv < 0)
 			return (rv);
-		rv = ADAPT_COMPRESS_BZIP2;
 		bzip2_count++;
+		break;
 
-	} else {
+	case ADAPT_COMPRESS_BSC:
 #ifdef ENABLE_PC_LIBBSC
-		if (adat->bsc_data && bsc_type) {
-			rv = libbsc_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->bsc_data);
-			if (rv < 0)
-				return (rv);
-			rv = ADAPT_COMPRESS_BSC;
-			bsc_count++;
-		} else {
-#endif
-			rv = ppmd_alloc(adat->ppmd_data);
-			if (rv < 0)
-				return (rv);
-			rv = ppmd_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->ppmd_data);
-			ppmd_free(adat->ppmd_data);
-			if (rv < 0)
-				return (rv);
-			rv = ADAPT_COMPRESS_PPMD;
-			ppmd_count++;
-#ifdef ENABLE_PC_LIBBSC
-		}
+		rv = libbsc_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->bsc_data);
+		if (rv < 0)
+			return (rv);
+		bsc_count++;
 #endif
+		break;
+
+	default:
+		rv = ppmd_alloc(adat->ppmd_data);
+		if (rv < 0)
+			return (rv);
+		rv = ppmd_compress(src, srclen, dst, dstlen, level, chdr, btype, adat->ppmd_data);
+		ppmd_free(adat->ppmd_data);
+		if (rv < 0)
+			return (rv);
+		ppmd_count++;
+		break;
 	}
 
-	return (rv);
+	return (algo);
 }
 
 int
@@ -362,6 +586,15 @@ adapt_decompress(void *src, uint64_t srclen, void *dst,
 		ppmd_free(adat->ppmd_data);
 		return (rv);
 
+	} else if (cmp_flags == ADAPT_COMPRESS_ZSTD) {
+#ifdef ENABLE_PC_ZSTD
+		if (adat->zstd_data)
+			return (zstd_decompress(src, srclen, dst, dstlen, level, chdr, btype,
+			    adat->zstd_data));
+#endif
+		log_msg(LOG_ERR, 0, "Cannot decompress chunk. Zstd support not present.\n");
+		return (-1);
+
 	} else if (cmp_flags == ADAPT_COMPRESS_BSC) {
 #ifdef ENABLE_PC_LIBBSC
 		return (libbsc_decompress(src, srclen, dst, dstlen, level, chdr, btype, adat->bsc_data));
@@ -24,15 +24,31 @@
 
 /*
  * A basic slab allocator that uses power of 2 and fixed interval
- * slab sizes and uses integer hashing to track pointers. It uses
- * per-slab and per-hash-bucket locking for scalability. This
+ * slab sizes. Every buffer carries a small header pointing back to
+ * its slab. Each thread keeps a cache of free buffers per slab which
+ * serves its allocations and frees without touching the shared
+ * per-slab lists. Only cache misses and overflows lock those. This
  * allocator is being used in Pcompress as repeated compression of
  * fixed-size chunks causes repeated and predictable memory allocation
- * and freeing patterns. Using pre-allocated buffer pools in this
- * case causes significant speedup.
+ * and freeing patterns, mostly within the same thread. Using
+ * pre-allocated buffer pools in this case causes significant speedup.
  *
- * There is no provision yet to reap buffers from high-usage slabs
- * and return them to the heap.
+ * Free buffers are kept in the slabs and are only returned to the heap
+ * when a limit is reached or at cleanup.
+ *
+ * Every buffer obtained from the heap is kept in a hash table on its
+ * address until it is returned to the heap, so that buffers leaked by
+ * the caller can be released at cleanup. A freed address is looked up
+ * there before its header is used, and an address that is not found is
+ * fatal. Each hash bucket has its own lock, so threads only contend when
+ * their buffers hash to the same bucket. An optional limit caps the
+ * bytes held this way, including free buffers cached in the slabs and
+ * thread caches. When it is reached the cached buffers are returned to
+ * the heap first, then allocations fail like a failed malloc.
+ *
+ * Buffers of 2MB or more can optionally be aligned to huge pages and
+ * advised for Transparent Huge Pages to cut TLB misses in the match
+ * finders and hash tables. They are still released with free().
  */
 
 #include <sys/types.h>
@@ -46,6 +62,9 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <math.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #include "utils.h"
 #include "allocator.h"
 
@@ -67,8 +86,20 @@
 #define	SLAB_START_SZ	64 /* Starting slab size in Bytes. */
 #define	SLAB_START_POW2	6 /* 2 ^ SLAB_START_POW2 = SLAB_START. */
 
-#define	HTABLE_SZ	8192
 #define	ONEM		(1UL * 1024UL * 1024UL)
+#define	HUGE_PAGE_SZ	(2UL * ONEM)
+
+/*
+ * Thread cache limits. All fixed slabs and the first 64 dynamic slabs
+ * are cached. A thread holds at most TCACHE_BUFS free buffers of one
+ * slab and at most TCACHE_BYTES in total, the rest go back to the slab.
+ */
+#define	TCACHE_SLABS	(SLAB_POS_HASH + 64)
+#define	TCACHE_BUFS	16
+#define	TCACHE_BYTES	(64UL * ONEM)
+
+#define	BUF_MAGIC_USED	0x51ABA110C0DEC0DEULL
+#define	BUF_MAGIC_FREE	0x51ABF4EEC0DEC0DEULL
 
 static const unsigned int bv[] = {
 	0xAAAAAAAA,
@@ -83,21 +114,68 @@ struct slabentry {
 	struct slabentry *next;
 	uint64_t sz;
 	uint64_t allocs, hits;
+	int tcindx; /* Slot in the thread caches, -1 if not cached. */
 	pthread_mutex_t slab_lock;
 };
+
+/*
+ * Buffer header placed just before the returned address. It is 48 bytes
+ * so the 16-byte alignment from malloc is retained. The size is that of
+ * the slab, or the requested size for oversize buffers.
+ */
 struct bufentry {
-	void *ptr;
 	struct slabentry *slab;
 	struct bufentry *next;
+	struct bufentry *hnext, *hprev; /* Hash chain of all buffers held. */
+	uint64_t sz;
+	uint64_t magic;
+};
+#define	BUF_HDR_SZ	(sizeof (struct bufentry))
+#define	BUF_PTR(b)	((void *)((uchar_t *)(b) + BUF_HDR_SZ))
+#define	BUF_HDR(p)	((struct bufentry *)((uintptr_t)(p) - BUF_HDR_SZ))
+#define	BUF_HTABLE_SZ	8192
+#define	BUF_HINDX(b)	(hash6432shift((uint64_t)(uintptr_t)(b)) & (BUF_HTABLE_SZ - 1))
+
+struct tcache {
+	struct bufentry *avail[TCACHE_SLABS];
+	uint32_t count[TCACHE_SLABS];
+	uint64_t bytes;
+	uint64_t allocs, frees, hits, oversize;
+	struct tcache *next;
 };
 
 static struct slabentry slabheads[NUM_SLABS];
-static struct bufentry **htable;
-static pthread_mutex_t *hbucket_locks;
-static pthread_mutex_t htable_lock = PTHREAD_MUTEX_INITIALIZER;
-static int inited = 0, bypass = 0;
+static pthread_mutex_t lock_tmpl = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t tcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static struct tcache *tcache_list = NULL;
+static int inited = 0, bypass = 0, next_tcindx;
+static int slab_users = 0;
+static pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bufentry *buf_htable[BUF_HTABLE_SZ];
+static pthread_mutex_t buf_hlocks[BUF_HTABLE_SZ];
+
+static uint64_t total_allocs, total_frees, oversize_allocs, tcache_hits;
+static uint64_t mem_limit = 0, mem_held = 0;
+static int limit_warned = 0;
+static int huge_pages = 0, huge_sample = 0;
+static uint64_t huge_bytes = 0, huge_peak = 0;
+
+static void huge_pages_sample(void);
+static void buf_free(struct bufentry *buf);
 
-static uint64_t total_allocs, oversize_allocs, hash_collisions, hash_entries;
+/*
+ * Count an event in the thread cache, or globally if this thread could
+ * not get a cache.
+ */
+#define	TC_STAT(tc, fld, var) \
+	do { \
+		if (tc) \
+			(tc)->fld++; \
+		else \
+			ATOMIC_ADD(var, 1); \
+	} while (0)
 
 /*
  * Hash function for 64Bit pointers/numbers that generates
@@ -117,6 +195,111 @@ hash6432shift(uint64_t key)
 	return (uint32_t) key;
 }
 
+/*
+ * Move all buffers held in a thread cache back to their slabs.
+ */
+static void
+tcache_flush(struct tcache *tc)
+{
+	struct bufentry *buf, *buf1;
+	struct slabentry *slab;
+	int i;
+
+	for (i = 0; i < TCACHE_SLABS; i++) {
+		buf = tc->avail[i];
+		while (buf) {
+			buf1 = buf->next;
+			slab = buf->slab;
+			pthread_mutex_lock(&(slab->slab_lock));
+			buf->next = slab->avail;
+			slab->avail = buf;
+			pthread_mutex_unlock(&(slab->slab_lock));
+			buf = buf1;
+		}
+		tc->avail[i] = NULL;
+		tc->count[i] = 0;
+	}
+	tc->bytes = 0;
+}
+
+/*
+ * Fold the per-thread counters into the global stats.
+ */
+static void
+tcache_fold(struct tcache *tc)
+{
+	ATOMIC_ADD(total_allocs, tc->allocs);
+	ATOMIC_ADD(total_frees, tc->frees);
+	ATOMIC_ADD(tcache_hits, tc->hits);
+	ATOMIC_ADD(oversize_allocs, tc->oversize);
+	tc->allocs = 0;
+	tc->frees = 0;
+	tc->hits = 0;
+	tc->oversize = 0;
+}
+
+/*
+ * Thread exit destructor for the thread cache.
+ */
+static void
+tcache_destroy(void *arg)
+{
+	struct tcache *tc = (struct tcache *)arg;
+	struct tcache **tcp;
+
+	pthread_mutex_lock(&tcache_lock);
+	for (tcp = &tcache_list; *tcp; tcp = &((*tcp)->next)) {
+		if (*tcp == tc) {
+			*tcp = tc->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tcache_lock);
+	tcache_flush(tc);
+	tcache_fold(tc);
+	free(tc);
+}
+
+static void
+tcache_key_init(void)
+{
+	pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+static struct tcache *
+get_tcache(void)
+{
+	struct tcache *tc;
+
+	if (!inited) return (NULL);
+	tc = (struct tcache *)pthread_getspecific(tcache_key);
+	if (unlikely(tc == NULL)) {
+		tc = (struct tcache *)calloc(1, sizeof (struct tcache));
+		if (!tc) return (NULL);
+		pthread_mutex_lock(&tcache_lock);
+		tc->next = tcache_list;
+		tcache_list = tc;
+		pthread_mutex_unlock(&tcache_lock);
+		pthread_setspecific(tcache_key, tc);
+	}
+	return (tc);
+}
+
+/*
+ * Assign a thread cache slot to a new dynamic slab.
+ */
+static int
+tcache_index(void)
+{
+	int ti = -1;
+
+	pthread_mutex_lock(&tcache_lock);
+	if (next_tcindx < TCACHE_SLABS)
+		ti = next_tcindx++;
+	pthread_mutex_unlock(&tcache_lock);
+	return (ti);
+}
+
 void
 slab_init()
 {
@@ -129,6 +312,18 @@ slab_init()
 		return;
 	}
 
+	/*
+	 * Several library contexts can be alive at once. They share the slabs
+	 * which are set up by the first and torn down by the last.
+	 */
+	pthread_mutex_lock(&users_lock);
+	if (slab_users++ > 0) {
+		pthread_mutex_unlock(&users_lock);
+		return;
+	}
+	pthread_mutex_unlock(&users_lock);
+	pthread_once(&tcache_once, tcache_key_init);
+
 	/* Initialize first NUM_POW2 power of 2 slots. */
 	slab_sz = SLAB_START_SZ;
 	for (i = 0; i < NUM_POW2; i++) {
@@ -136,8 +331,9 @@ slab_init()
 		slabheads[i].sz = slab_sz;
 		slabheads[i].allocs = 0;
 		slabheads[i].hits = 0;
+		slabheads[i].tcindx = i;
 		/* Speed up: Copy from already inited but not yet used lock object. */
-		slabheads[i].slab_lock = htable_lock;
+		slabheads[i].slab_lock = lock_tmpl;
 		slab_sz *= 2;
 	}
 
@@ -149,8 +345,9 @@ slab_init()
 		slabheads[i].sz = slab_sz;
 		slabheads[i].allocs = 0;
 		slabheads[i].hits = 0;
+		slabheads[i].tcindx = i;
 		/* Speed up: Copy from already inited but not yet used lock object. */
-		slabheads[i].slab_lock = htable_lock;
+		slabheads[i].slab_lock = lock_tmpl;
 		slab_sz += ONEM;
 	}
 
@@ -160,18 +357,20 @@ slab_init()
 		slabheads[i].sz = 0;
 		slabheads[i].allocs = 0;
 		slabheads[i].hits = 0;
+		slabheads[i].tcindx = -1;
 		/* Do not init locks here. They will be inited on demand. */
 	}
-	htable = (struct bufentry **)calloc(HTABLE_SZ, sizeof (struct bufentry *));
-	hbucket_locks = (pthread_mutex_t *)malloc(HTABLE_SZ * sizeof (pthread_mutex_t));
+	next_tcindx = SLAB_POS_HASH;
 
-	for (i=0; i<HTABLE_SZ; i++)
-		hbucket_locks[i] = htable_lock;
+	for (i = 0; i < BUF_HTABLE_SZ; i++) {
+		buf_htable[i] = NULL;
+		buf_hlocks[i] = lock_tmpl;
+	}
 
 	total_allocs = 0;
+	total_frees = 0;
 	oversize_allocs = 0;
-	hash_collisions = 0;
-	hash_entries = 0;
+	tcache_hits = 0;
 	inited = 1;
 }
 
@@ -180,11 +379,36 @@ slab_cleanup(int quiet)
 {
 	int i;
 	struct bufentry *buf, *buf1;
-	uint64_t nonfreed_oversize;
+	struct tcache *tc;
+	uint64_t leaked, nonfreed_oversize;
 
 	if (!inited) return;
 	if (bypass) return;
 
+	pthread_mutex_lock(&users_lock);
+	if (--slab_users > 0) {
+		pthread_mutex_unlock(&users_lock);
+		return;
+	}
+	pthread_mutex_unlock(&users_lock);
+
+	/*
+	 * Huge page backing is sampled before any buffer is released.
+	 */
+	if (huge_bytes && !quiet)
+		huge_pages_sample();
+	huge_sample = 0;
+
+	/*
+	 * Pull back buffers held in thread caches and gather their stats.
+	 */
+	pthread_mutex_lock(&tcache_lock);
+	for (tc = tcache_list; tc; tc = tc->next) {
+		tcache_flush(tc);
+		tcache_fold(tc);
+	}
+	pthread_mutex_unlock(&tcache_lock);
+
 	if (!quiet) {
 		log_msg(LOG_INFO, 0, "Slab Allocation Stats\n");
 		log_msg(LOG_INFO, 0, "==================================================================\n");
@@ -203,64 +427,74 @@ slab_cleanup(int quiet)
 					log_msg(LOG_INFO, 0, "%21" PRIu64 " %21" PRIu64 " %21" PRIu64 "\n",slab->sz,
 					slab->allocs, slab->hits);
 				}
-				slab->allocs = 0;
 				buf = slab->avail;
 				do {
 					buf1 = buf->next;
-					free(buf->ptr);
-					free(buf);
+					buf_free(buf);
 					buf = buf1;
 				} while (buf);
+				slab->avail = NULL;
 			}
+			slab->allocs = 0;
 			slab = slab->next;
 		}
 	}
 
+	/*
+	 * Whatever is still held was never freed by the caller. Count these
+	 * per slab for the report and release them.
+	 */
+	leaked = 0;
+	nonfreed_oversize = 0;
+	for (i = 0; i < BUF_HTABLE_SZ; i++) {
+		pthread_mutex_lock(&buf_hlocks[i]);
+		buf = buf_htable[i];
+		buf_htable[i] = NULL;
+		pthread_mutex_unlock(&buf_hlocks[i]);
+		while (buf) {
+			if (buf->slab == NULL)
+				nonfreed_oversize++;
+			else
+				buf->slab->allocs++;
+			leaked++;
+			buf1 = buf->hnext;
+			free(buf);
+			buf = buf1;
+		}
+	}
+	mem_held = 0;
+
 	if (!quiet) {
 		log_msg(LOG_INFO, 0, "==================================================================\n");
 		log_msg(LOG_INFO, 0, "Oversize Allocations  : %" PRIu64 "\n", oversize_allocs);
 		log_msg(LOG_INFO, 0, "Total Requests        : %" PRIu64 "\n", total_allocs);
-		log_msg(LOG_INFO, 0, "Hash collisions       : %" PRIu64 "\n", hash_collisions);
-		log_msg(LOG_INFO, 0, "Leaked allocations    : %" PRIu64 "\n", hash_entries);
+		log_msg(LOG_INFO, 0, "Thread cache hits     : %" PRIu64 "\n", tcache_hits);
+		log_msg(LOG_INFO, 0, "Leaked allocations    : %" PRIu64 "\n", leaked);
+		if (huge_bytes) {
+			log_msg(LOG_INFO, 0, "Huge page advised     : %" PRIu64 "\n", huge_bytes);
+			log_msg(LOG_INFO, 0, "Huge page backed peak : %" PRIu64 "\n", huge_peak);
+		}
 	}
 
-	if (hash_entries > 0) {
-		nonfreed_oversize = 0;
-		for (i=0; i<HTABLE_SZ; i++) {
-			buf = htable[i];
-
-			while (buf) {
-				if (buf->slab == NULL) {
-					nonfreed_oversize++;
-				} else {
-					buf->slab->allocs++;
-				}
-				buf1 = buf->next;
-				free(buf->ptr);
-				free(buf);
-				buf = buf1;
-			}
-		}
-		free(htable);
-		free(hbucket_locks);
-
-		if (!quiet) {
-			log_msg(LOG_INFO, 0, "==================================================================\n");
-			log_msg(LOG_INFO, 0, " Slab Size           | Allocations: leaked |\n");
-			log_msg(LOG_INFO, 0, "==================================================================\n");
-			for (i=0; i<NUM_SLABS; i++)
-			{
-				struct slabentry *slab;
-
-				slab = &slabheads[i];
-				do {
-					if (slab->allocs > 0)
-						log_msg(LOG_INFO, 0, "%21" PRIu64 " %21" PRIu64 "\n", \
-						    slab->sz, slab->allocs);
-					slab = slab->next;
-				} while (slab);
-			}
+	if (leaked > 0 && !quiet) {
+		log_msg(LOG_INFO, 0, "==================================================================\n");
+		log_msg(LOG_INFO, 0, " Slab Size           | Allocations: leaked |\n");
+		log_msg(LOG_INFO, 0, "==================================================================\n");
+		for (i=0; i<NUM_SLABS; i++)
+		{
+			struct slabentry *slab;
+
+			slab = &slabheads[i];
+			do {
+				if (slab->allocs > 0)
+					log_msg(LOG_INFO, 0, "%21" PRIu64 " %21" PRIu64 "\n", \
+					    slab->sz, slab->allocs);
+				slab = slab->next;
+			} while (slab);
 		}
+		if (nonfreed_oversize > 0)
+			log_msg(LOG_INFO, 0, "Oversize leaked       : %" PRIu64 "\n",
+			    nonfreed_oversize);
 	}
 	for (i=0; i<NUM_SLABS; i++)
 	{
@@ -275,17 +509,234 @@ slab_cleanup(int quiet)
 			if (j > 0) free(pslab);
 			j++;
 		} while (slab);
+		slabheads[i].next = NULL;
+		if (i >= SLAB_POS_HASH)
+			slabheads[i].sz = 0;
 	}
+	inited = 0;
 	if (!quiet) log_msg(LOG_INFO, 0, "\n\n");
 }
 
+/*
+ * Enable or disable huge page backing for large buffers. Buffers already
+ * handed out are not affected. With sample set the peak of huge page
+ * backed memory is tracked for the allocation stats. That reads /proc
+ * whenever a large buffer goes back to the system, so it should only be
+ * set when the stats are shown.
+ */
+void
+slab_set_hugepages(int enable, int sample)
+{
+	huge_pages = enable;
+	huge_sample = enable && sample;
+}
+
+int
+slab_hugepages(void)
+{
+	return (huge_pages);
+}
+
+/*
+ * Advise the huge page aligned part of a region for Transparent Huge Pages.
+ * This is meant for large tables that are not slab allocated and have not
+ * been touched yet.
+ */
+void
+slab_hugepage_hint(void *p, size_t len)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	uintptr_t start, end;
+
+	if (!huge_pages || p == NULL)
+		return;
+	start = ((uintptr_t)p + HUGE_PAGE_SZ - 1) & ~(HUGE_PAGE_SZ - 1);
+	end = ((uintptr_t)p + len) & ~(HUGE_PAGE_SZ - 1);
+	if (end > start && madvise((void *)start, end - start, MADV_HUGEPAGE) == 0)
+		ATOMIC_ADD(huge_bytes, end - start);
+#endif
+}
+
+/*
+ * Get memory for a buffer including its header. Large buffers start on a
+ * huge page boundary when huge pages are enabled.
+ */
+static struct bufentry *
+buf_malloc(size_t size)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	void *p;
+
+	if (huge_pages && size >= HUGE_PAGE_SZ) {
+		if (posix_memalign(&p, HUGE_PAGE_SZ, size) == 0) {
+			slab_hugepage_hint(p, size);
+			return ((struct bufentry *)p);
+		}
+	}
+#endif
+	return ((struct bufentry *)malloc(size));
+}
+
+static int limit_charge(uint64_t size);
+
+/*
+ * Get a new buffer of the given size from the heap, charge it to the
+ * bytes held and add it to the table of all buffers.
+ */
+static struct bufentry *
+buf_new(uint64_t sz)
+{
+	struct bufentry *buf;
+	uint32_t hindx;
+
+	if (!limit_charge(sz + BUF_HDR_SZ))
+		return (NULL);
+	buf = buf_malloc(sz + BUF_HDR_SZ);
+	if (!buf) {
+		ATOMIC_SUB(mem_held, sz + BUF_HDR_SZ);
+		return (NULL);
+	}
+	buf->sz = sz;
+	buf->magic = 0;
+	buf->hprev = NULL;
+	hindx = BUF_HINDX(buf);
+	pthread_mutex_lock(&buf_hlocks[hindx]);
+	buf->hnext = buf_htable[hindx];
+	if (buf->hnext)
+		buf->hnext->hprev = buf;
+	buf_htable[hindx] = buf;
+	pthread_mutex_unlock(&buf_hlocks[hindx]);
+	return (buf);
+}
+
+/*
+ * Return a buffer to the heap.
+ */
+static void
+buf_free(struct bufentry *buf)
+{
+	uint32_t hindx;
+
+	hindx = BUF_HINDX(buf);
+	pthread_mutex_lock(&buf_hlocks[hindx]);
+	if (buf->hprev)
+		buf->hprev->hnext = buf->hnext;
+	else
+		buf_htable[hindx] = buf->hnext;
+	if (buf->hnext)
+		buf->hnext->hprev = buf->hprev;
+	pthread_mutex_unlock(&buf_hlocks[hindx]);
+	ATOMIC_SUB(mem_held, buf->sz + BUF_HDR_SZ);
+	if (huge_sample && buf->sz >= HUGE_PAGE_SZ)
+		huge_pages_sample();
+	free(buf);
+}
+
+/*
+ * Return the free buffers cached in the slabs and in this thread's cache
+ * to the heap. Buffers cached by other threads are left alone.
+ */
+static void
+slab_reclaim(void)
+{
+	struct slabentry *slab;
+	struct bufentry *buf, *buf1;
+	struct tcache *tc;
+	int i;
+
+	tc = get_tcache();
+	if (tc)
+		tcache_flush(tc);
+	for (i = 0; i < NUM_SLABS; i++) {
+		slab = &slabheads[i];
+		if (slab->sz == 0)
+			continue;
+		while (slab) {
+			pthread_mutex_lock(&(slab->slab_lock));
+			buf = slab->avail;
+			slab->avail = NULL;
+			pthread_mutex_unlock(&(slab->slab_lock));
+			while (buf) {
+				buf1 = buf->next;
+				ATOMIC_SUB(slab->allocs, 1);
+				buf_free(buf);
+				buf = buf1;
+			}
+			slab = slab->next;
+		}
+	}
+}
+
+/*
+ * Record the peak of anonymous memory backed by huge pages. Large buffers
+ * are mostly returned to the system long before cleanup, so when the stats
+ * are wanted this is also sampled just before such a buffer is freed.
+ */
+static void
+huge_pages_sample(void)
+{
+#ifdef __linux__
+	char line[256];
+	uint64_t kb;
+	FILE *fp;
+
+	fp = fopen("/proc/self/smaps_rollup", "r");
+	if (fp == NULL)
+		return;
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (sscanf(line, "AnonHugePages: %" SCNu64 " kB", &kb) == 1) {
+			if (kb * 1024 > huge_peak)
+				huge_peak = kb * 1024;
+			break;
+		}
+	}
+	fclose(fp);
+#endif
+}
+
+/*
+ * Set the limit on memory held, 0 for no limit. All buffers held by the
+ * allocator count, in use or cached, including those obtained before the
+ * limit was set.
+ */
+void
+slab_set_limit(uint64_t limit)
+{
+	mem_limit = limit;
+	limit_warned = 0;
+}
+
+static int
+limit_charge(uint64_t size)
+{
+	ATOMIC_ADD(mem_held, size);
+	if (mem_limit == 0 || mem_held <= mem_limit)
+		return (1);
+
+	/*
+	 * Give the cached buffers back and check again.
+	 */
+	slab_reclaim();
+	if (mem_held > mem_limit) {
+		ATOMIC_SUB(mem_held, size);
+		if (!limit_warned) {
+			limit_warned = 1;
+			log_msg(LOG_ERR, 0, "Memory budget of %" PRIu64 " bytes exceeded.",
+			    mem_limit);
+		}
+		return (0);
+	}
+	return (1);
+}
+
 void *
 slab_calloc(void *p, size_t items, size_t size) {
 	void *ptr;
 
 	if (bypass) return(calloc(items, size));
 	ptr = slab_alloc(p, items * size);
-	memset(ptr, 0, items * size);
+	if (ptr)
+		memset(ptr, 0, items * size);
 	return (ptr);
 }
 
@@ -356,6 +807,7 @@ slab_cache_add(uint64_t size)
 	if (slabheads[sindx].sz == 0) {
 		pthread_mutex_init(&(slabheads[sindx].slab_lock), NULL);
 		pthread_mutex_lock(&(slabheads[sindx].slab_lock));
+		slabheads[sindx].tcindx = tcache_index();
 		slabheads[sindx].sz = size;
 		pthread_mutex_unlock(&(slabheads[sindx].slab_lock));
 	} else {
@@ -365,6 +817,7 @@ slab_cache_add(uint64_t size)
 		slab->sz = size;
 		slab->allocs = 0;
 		slab->hits = 0;
+		slab->tcindx = tcache_index();
 		pthread_mutex_init(&(slab->slab_lock), NULL);
 
 		pthread_mutex_lock(&(slabheads[sindx].slab_lock));
@@ -380,9 +833,13 @@ slab_alloc(void *p, size_t size)
 {
 	uint64_t div;
 	struct slabentry *slab;
+	struct bufentry *buf;
+	struct tcache *tc;
+	int ti;
 
 	if (bypass) return (malloc(size));
-	ATOMIC_ADD(total_allocs, 1);
+	tc = get_tcache();
+	TC_STAT(tc, allocs, total_allocs);
 	slab = NULL;
 
 	/* First check if we can use a dynamic slab of this size. */
@@ -401,97 +858,104 @@ slab_alloc(void *p, size_t size)
 	}
 
 	if (!slab) {
-		struct bufentry *buf = (struct bufentry *)malloc(sizeof (struct bufentry));
-		uint32_t hindx;
-
-		buf->ptr = malloc(size);
-		buf->slab = NULL;
-		hindx = hash6432shift((unsigned long)(buf->ptr)) & (HTABLE_SZ - 1);
-
-		pthread_mutex_lock(&hbucket_locks[hindx]);
-		buf->next = htable[hindx];
-		htable[hindx] = buf;
-		pthread_mutex_unlock(&hbucket_locks[hindx]);
-		ATOMIC_ADD(oversize_allocs, 1);
-		ATOMIC_ADD(hash_entries, 1);
-		return (buf->ptr);
+		buf = buf_new(size);
+		if (!buf) return (NULL);
+		TC_STAT(tc, oversize, oversize_allocs);
 	} else {
-		struct bufentry *buf;
-		uint32_t hindx;
-
-		pthread_mutex_lock(&(slab->slab_lock));
-		if (slab->avail == NULL) {
-			slab->allocs++;
-			pthread_mutex_unlock(&(slab->slab_lock));
-			buf = (struct bufentry *)malloc(sizeof (struct bufentry));
-			buf->ptr = malloc(slab->sz);
-			buf->slab = slab;
+		buf = NULL;
+		ti = slab->tcindx;
+		if (tc && ti >= 0 && tc->avail[ti]) {
+			/* Lockless fast path from this thread's own free buffers. */
+			buf = tc->avail[ti];
+			tc->avail[ti] = buf->next;
+			tc->count[ti]--;
+			tc->bytes -= slab->sz;
+			tc->hits++;
 		} else {
-			buf = slab->avail;
-			slab->avail = buf->next;
-			slab->hits++;
+			pthread_mutex_lock(&(slab->slab_lock));
+			if (slab->avail) {
+				buf = slab->avail;
+				slab->avail = buf->next;
+				slab->hits++;
+			}
 			pthread_mutex_unlock(&(slab->slab_lock));
 		}
 
-		hindx = hash6432shift((unsigned long)(buf->ptr)) & (HTABLE_SZ - 1);
-		if (htable[hindx]) ATOMIC_ADD(hash_collisions, 1);
-		pthread_mutex_lock(&hbucket_locks[hindx]);
-		buf->next = htable[hindx];
-		htable[hindx] = buf;
-		pthread_mutex_unlock(&hbucket_locks[hindx]);
-		ATOMIC_ADD(hash_entries, 1);
-		return (buf->ptr);
+		if (!buf) {
+			buf = buf_new(slab->sz);
+			if (!buf) return (NULL);
+			ATOMIC_ADD(slab->allocs, 1);
+		}
 	}
+	buf->slab = slab;
+	buf->magic = BUF_MAGIC_USED;
+	return (BUF_PTR(buf));
 }
 
 static void
 slab_free_real(void *p, void *address, int do_free)
 {
-	struct bufentry *buf, *pbuf;
-	int found = 0;
+	struct bufentry *buf, *hbuf;
+	struct slabentry *slab;
+	struct tcache *tc;
+	uint64_t magic;
 	uint32_t hindx;
+	int ti;
 
 	if (!address) return;
 	if (bypass) { free(address); return; }
-	hindx = hash6432shift((uint64_t)(address)) & (HTABLE_SZ - 1);
-
-	pthread_mutex_lock(&hbucket_locks[hindx]);
-	buf = htable[hindx];
-	pbuf = NULL;
-	while (buf) {
-		if (buf->ptr == address) {
-			if (hash_entries <=0) {
-				log_msg(LOG_ERR, 0, "Inconsistent allocation hash\n");
-				abort();
-			}
-			if (pbuf)
-				pbuf->next = buf->next;
-			else
-				htable[hindx] = buf->next;
-			pthread_mutex_unlock(&hbucket_locks[hindx]);
-			found = 1;
-			ATOMIC_SUB(hash_entries, 1);
-
-			if (buf->slab == NULL || do_free) {
-				free(buf->ptr);
-				free(buf);
-			} else {
-				pthread_mutex_lock(&(buf->slab->slab_lock));
-				buf->next = buf->slab->avail;
-				buf->slab->avail = buf;
-				pthread_mutex_unlock(&(buf->slab->slab_lock));
-			}
-			break;
-		}
-		pbuf = buf;
-		buf = buf->next;
+
+	/*
+	 * The header is only read once the buffer is found in the table. There
+	 * need not be any valid memory in front of an unknown address.
+	 */
+	buf = BUF_HDR(address);
+	hindx = BUF_HINDX(buf);
+	magic = 0;
+	pthread_mutex_lock(&buf_hlocks[hindx]);
+	for (hbuf = buf_htable[hindx]; hbuf && hbuf != buf; hbuf = hbuf->hnext);
+	if (hbuf) {
+		magic = buf->magic;
+		buf->magic = BUF_MAGIC_FREE;
 	}
-	if (!found) {
-		pthread_mutex_unlock(&hbucket_locks[hindx]);
+	pthread_mutex_unlock(&buf_hlocks[hindx]);
+	if (!hbuf) {
 		log_msg(LOG_ERR, 0, "Freed buf(%p) not in slab allocations!\n", address);
-		free(address);
 		abort();
-		fflush(stderr);
+	} else if (magic != BUF_MAGIC_USED) {
+		log_msg(LOG_ERR, 0, "Buf(%p) freed twice!\n", address);
+		abort();
+	}
+	tc = get_tcache();
+	TC_STAT(tc, frees, total_frees);
+
+	slab = buf->slab;
+	if (slab == NULL) {
+		buf_free(buf);
+		return;
+	}
+	if (do_free) {
+		ATOMIC_SUB(slab->allocs, 1);
+		buf_free(buf);
+		return;
+	}
+
+	/*
+	 * With a limit large buffers skip the thread cache so that whichever
+	 * thread hits the limit can reclaim them.
+	 */
+	ti = slab->tcindx;
+	if (tc && ti >= 0 && tc->count[ti] < TCACHE_BUFS &&
+	    tc->bytes + slab->sz <= TCACHE_BYTES && (!mem_limit || slab->sz <= ONEM)) {
+		buf->next = tc->avail[ti];
+		tc->avail[ti] = buf;
+		tc->count[ti]++;
+		tc->bytes += slab->sz;
+	} else {
+		pthread_mutex_lock(&(slab->slab_lock));
+		buf->next = slab->avail;
+		slab->avail = buf;
+		pthread_mutex_unlock(&(slab->slab_lock));
 	}
 }
 
@@ -514,6 +978,21 @@ slab_init() {}
 void
 slab_cleanup(int quiet) {}
 
+void
+slab_set_limit(uint64_t limit) {}
+
+void
+slab_set_hugepages(int enable, int sample) {}
+
+int
+slab_hugepages(void)
+{
+	return (0);
+}
+
+void
+slab_hugepage_hint(void *p, size_t len) {}
+
 void
 *slab_alloc(void *p, size_t size)
 {
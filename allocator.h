@@ -36,6 +36,10 @@ void *slab_calloc(void *p, size_t items, size_t size);
 void slab_free(void *p, void *address);
 void slab_release(void *p, void *address);
 int slab_cache_add(uint64_t size);
+void slab_set_limit(uint64_t limit);
+void slab_set_hugepages(int enable, int sample);
+int slab_hugepages(void);
+void slab_hugepage_hint(void *p, size_t len);
 
 #endif
 
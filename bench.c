@@ -0,0 +1,475 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Built-in benchmark. The input file is loaded into an anonymous memory
+ * backed file once and then compressed and decompressed with every
+ * combination of the given algorithms, levels, chunk sizes, thread counts
+ * and feature flags. The full pipeline is used, only the files are replaced
+ * by in-memory ones so that disk speed does not affect the numbers.
+ */
+#ifdef __linux__
+#define	_GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "pcompress.h"
+#include <utils.h>
+
+#define	BENCH_MAX_VALS	32
+#define	BENCH_MAX_ARGS	32
+#define	BENCH_FEATURES	"DGEFLP"
+#define	BENCH_BUFSZ	(1024 * 1024)
+#define	BENCH_MB	(1024.0 * 1024.0)
+
+struct bench_list {
+	char *val[BENCH_MAX_VALS];
+	int n;
+};
+
+struct bench_result {
+	uint64_t ns;
+	uint64_t rss;
+	stage_stats_t st;
+};
+
+static void
+bench_usage(void)
+{
+	fprintf(stderr,
+"Usage: pcompress --bench [-c <algorithms>] [-l <levels>] [-s <chunk sizes>]\n"
+"                         [-t <threads>] [-f <features>] [-S <checksum>]\n"
+"                         [-r <repeat>] [-J] <file>\n\n"
+"    All lists are comma separated. Each feature set is a group of the flag\n"
+"    letters %s, for example D,GD,P or none.\n"
+"    Defaults: -c lz4,zlib -l 6 -s 8m -t <CPUs> -f none -r 1\n\n", BENCH_FEATURES);
+}
+
+/*
+ * Split a comma separated list in place.
+ */
+static int
+bench_split(char *str, struct bench_list *lst)
+{
+	char *tok, *save;
+
+	lst->n = 0;
+	for (tok = strtok_r(str, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (lst->n == BENCH_MAX_VALS) {
+			log_msg(LOG_ERR, 0, "At most %d values allowed in a list.",
+			    BENCH_MAX_VALS);
+			return (-1);
+		}
+		lst->val[lst->n++] = tok;
+	}
+	if (lst->n == 0) {
+		log_msg(LOG_ERR, 0, "Empty list.");
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+bench_load(const char *filename, int fd, uint64_t *size)
+{
+	uchar_t *buf;
+	int64_t rb;
+	int ifd;
+
+	if ((ifd = open(filename, O_RDONLY, 0)) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot open: %s", filename);
+		return (-1);
+	}
+	buf = (uchar_t *)malloc(BENCH_BUFSZ);
+	if (!buf) {
+		log_msg(LOG_ERR, 1, "Out of memory ");
+		close(ifd);
+		return (-1);
+	}
+	*size = 0;
+	while ((rb = Read(ifd, buf, BENCH_BUFSZ)) > 0) {
+		if (Write(fd, buf, rb) != rb) {
+			log_msg(LOG_ERR, 1, "Write ");
+			rb = -1;
+			break;
+		}
+		*size += rb;
+	}
+	if (rb < 0)
+		log_msg(LOG_ERR, 1, "Read ");
+	free(buf);
+	close(ifd);
+	return (rb < 0 ? -1 : 0);
+}
+
+/*
+ * Peak RSS is tracked per run on Linux by resetting the high water mark.
+ * Elsewhere it is the peak of the whole process.
+ */
+static void
+bench_reset_peak(void)
+{
+	int fd;
+
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+	if ((fd = open("/proc/self/clear_refs", O_WRONLY)) != -1) {
+		if (write(fd, "5", 1) != 1)
+			log_msg(LOG_WARN, 1, "Cannot reset peak RSS ");
+		close(fd);
+	}
+}
+
+static uint64_t
+bench_peak_rss(void)
+{
+	struct rusage ru;
+	char line[128];
+	uint64_t kb;
+	FILE *fp;
+
+	kb = 0;
+	if ((fp = fopen("/proc/self/status", "r")) != NULL) {
+		while (fgets(line, sizeof (line), fp)) {
+			if (strncmp(line, "VmHWM:", 6) == 0) {
+				kb = strtoull(line + 6, NULL, 10);
+				break;
+			}
+		}
+		fclose(fp);
+	}
+	if (kb == 0 && getrusage(RUSAGE_SELF, &ru) == 0)
+		kb = ru.ru_maxrss;
+	return (kb * 1024);
+}
+
+static int
+bench_run(char *args[], int nargs, int in_fd, int out_fd, int dump,
+    struct bench_result *res)
+{
+	pc_ctx_t *pctx;
+	uint64_t t0;
+	int err;
+
+	if (lseek(in_fd, 0, SEEK_SET) == -1 || ftruncate(out_fd, 0) == -1 ||
+	    lseek(out_fd, 0, SEEK_SET) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot reset benchmark files ");
+		return (1);
+	}
+	pctx = create_pc_context();
+	if (init_pc_context(pctx, nargs, args) != 0) {
+		destroy_pc_context(pctx);
+		return (1);
+	}
+	pc_set_fds(pctx, in_fd, out_fd);
+	pctx->stage_stats = dump ? STAGE_STATS_DUMP : STAGE_STATS_COLLECT;
+
+	bench_reset_peak();
+	t0 = get_wtime_nanos();
+	err = start_pcompress(pctx);
+	res->ns = get_wtime_nanos() - t0;
+	res->rss = bench_peak_rss();
+	res->st = pctx->stats_total;
+	destroy_pc_context(pctx);
+	return (err);
+}
+
+/*
+ * Run a configuration repeat times and keep the fastest run. Peak RSS is the
+ * highest seen.
+ */
+static int
+bench_best(char *args[], int nargs, int in_fd, int out_fd, int dump, int repeat,
+    struct bench_result *best)
+{
+	struct bench_result res;
+	uint64_t rss;
+	int i;
+
+	rss = 0;
+	memset(best, 0, sizeof (*best));
+	for (i = 0; i < repeat; i++) {
+		if (bench_run(args, nargs, in_fd, out_fd, dump, &res) != 0)
+			return (1);
+		if (i == 0 || res.ns < best->ns)
+			*best = res;
+		if (res.rss > rss)
+			rss = res.rss;
+	}
+	best->rss = rss;
+	return (0);
+}
+
+static int
+bench_verify(int fd1, int fd2, uint64_t size)
+{
+	struct stat sbuf;
+	void *m1, *m2;
+	int rv;
+
+	if (fstat(fd2, &sbuf) == -1 || (uint64_t)sbuf.st_size != size)
+		return (-1);
+	m1 = mmap(NULL, size, PROT_READ, MAP_SHARED, fd1, 0);
+	if (m1 == MAP_FAILED)
+		return (-1);
+	m2 = mmap(NULL, size, PROT_READ, MAP_SHARED, fd2, 0);
+	if (m2 == MAP_FAILED) {
+		munmap(m1, size);
+		return (-1);
+	}
+	rv = memcmp(m1, m2, size) == 0 ? 0 : -1;
+	munmap(m1, size);
+	munmap(m2, size);
+	return (rv);
+}
+
+static double
+bench_mbps(uint64_t bytes, uint64_t ns)
+{
+	if (ns == 0)
+		return (0);
+	return ((double)bytes / BENCH_MB * 1000000000.0 / ns);
+}
+
+static void
+bench_print_stages(const char *op, stage_stats_t *st)
+{
+	int i;
+
+	printf("    %-10s", op);
+	for (i = 0; i < STAGE_MAX; i++) {
+		if (st->ns[i] > 0)
+			printf(" %s %.3fs", stage_names[i], (double)st->ns[i] / 1000000000.0);
+	}
+	printf("\n");
+}
+
+int DLL_EXPORT
+start_bench(int argc, char *argv[])
+{
+	struct bench_list algos, levels, chunks, threads, feats;
+	struct bench_result cres, dres;
+	char *copt, *lopt, *sopt, *topt, *fopt, *cksum;
+	char *args[BENCH_MAX_ARGS], fflags[BENCH_MAX_VALS][3], ncpus[16];
+	char *filename;
+	int a, l, s, t, f, i, nargs, nflags, repeat, dump, err, opt;
+	int ufd, cfd, dfd;
+	uint64_t size;
+	struct stat sbuf;
+
+	copt = strdup("lz4,zlib");
+	lopt = strdup("6");
+	sopt = strdup("8m");
+	snprintf(ncpus, sizeof (ncpus), "%ld", sysconf(_SC_NPROCESSORS_ONLN));
+	topt = strdup(ncpus);
+	fopt = strdup("none");
+	cksum = NULL;
+	repeat = 1;
+	dump = 0;
+	err = 0;
+	ufd = cfd = dfd = -1;
+
+	optind = 0;
+	while ((opt = getopt(argc, argv, "c:l:s:t:f:S:r:J")) != -1) {
+		switch (opt) {
+		    case 'c':
+			free(copt);
+			copt = strdup(optarg);
+			break;
+		    case 'l':
+			free(lopt);
+			lopt = strdup(optarg);
+			break;
+		    case 's':
+			free(sopt);
+			sopt = strdup(optarg);
+			break;
+		    case 't':
+			free(topt);
+			topt = strdup(optarg);
+			break;
+		    case 'f':
+			free(fopt);
+			fopt = strdup(optarg);
+			break;
+		    case 'S':
+			cksum = optarg;
+			break;
+		    case 'r':
+			repeat = atoi(optarg);
+			if (repeat < 1) {
+				log_msg(LOG_ERR, 0, "Repeat count must be at least 1.");
+				err = 1;
+			}
+			break;
+		    case 'J':
+			dump = 1;
+			break;
+		    default:
+			err = 1;
+			break;
+		}
+	}
+	if (err || optind != argc - 1) {
+		bench_usage();
+		err = 1;
+		goto bench_done;
+	}
+	filename = argv[optind];
+	optind = 0;
+
+	if (bench_split(copt, &algos) != 0 || bench_split(lopt, &levels) != 0 ||
+	    bench_split(sopt, &chunks) != 0 || bench_split(topt, &threads) != 0 ||
+	    bench_split(fopt, &feats) != 0) {
+		err = 1;
+		goto bench_done;
+	}
+	for (f = 0; f < feats.n; f++) {
+		if (strcmp(feats.val[f], "none") == 0)
+			continue;
+		if (strspn(feats.val[f], BENCH_FEATURES) != strlen(feats.val[f])) {
+			log_msg(LOG_ERR, 0, "Invalid feature set: %s", feats.val[f]);
+			err = 1;
+			goto bench_done;
+		}
+	}
+
+	if ((ufd = create_mem_file("data")) == -1 || (cfd = create_mem_file("comp")) == -1 ||
+	    (dfd = create_mem_file("decomp")) == -1) {
+		log_msg(LOG_ERR, 1, "Cannot create in-memory file ");
+		err = 1;
+		goto bench_done;
+	}
+	if (bench_load(filename, ufd, &size) != 0) {
+		err = 1;
+		goto bench_done;
+	}
+	if (size == 0) {
+		log_msg(LOG_ERR, 0, "File %s is empty.", filename);
+		err = 1;
+		goto bench_done;
+	}
+
+	/*
+	 * Only warnings and errors from the runs are of interest.
+	 */
+	set_log_level(LOG_WARN);
+	printf("File: %s, %" PRIu64 " bytes\n\n", filename, size);
+	printf("%-8s %5s %6s %4s %-6s %10s %10s %8s %10s %10s\n", "Algo", "Level",
+	    "Chunk", "Thr", "Flags", "Comp MB/s", "Dcmp MB/s", "Ratio", "Comp RSS",
+	    "Dcmp RSS");
+	for (a = 0; a < algos.n; a++)
+	for (l = 0; l < levels.n; l++)
+	for (s = 0; s < chunks.n; s++)
+	for (t = 0; t < threads.n; t++)
+	for (f = 0; f < feats.n; f++) {
+		nargs = 0;
+		args[nargs++] = "pcompress";
+		args[nargs++] = "-c";
+		args[nargs++] = algos.val[a];
+		args[nargs++] = "-l";
+		args[nargs++] = levels.val[l];
+		args[nargs++] = "-s";
+		args[nargs++] = chunks.val[s];
+		args[nargs++] = "-t";
+		args[nargs++] = threads.val[t];
+		if (cksum) {
+			args[nargs++] = "-S";
+			args[nargs++] = cksum;
+		}
+		nflags = 0;
+		if (strcmp(feats.val[f], "none") != 0) {
+			for (i = 0; feats.val[f][i] && nargs < BENCH_MAX_ARGS - 2; i++) {
+				fflags[nflags][0] = '-';
+				fflags[nflags][1] = feats.val[f][i];
+				fflags[nflags][2] = '\0';
+				args[nargs++] = fflags[nflags++];
+			}
+		}
+		args[nargs++] = filename;
+		args[nargs++] = "-";
+
+		printf("%-8s %5s %6s %4s %-6s ", algos.val[a], levels.val[l],
+		    chunks.val[s], threads.val[t], feats.val[f]);
+		fflush(stdout);
+		if (bench_best(args, nargs, ufd, cfd, dump, repeat, &cres) != 0) {
+			printf("compression failed\n");
+			err = 1;
+			continue;
+		}
+		if (fstat(cfd, &sbuf) == -1 || sbuf.st_size == 0) {
+			printf("compression failed\n");
+			err = 1;
+			continue;
+		}
+
+		nargs = 0;
+		args[nargs++] = "pcompress";
+		args[nargs++] = "-d";
+		args[nargs++] = "-t";
+		args[nargs++] = threads.val[t];
+		args[nargs++] = filename;
+		args[nargs++] = "-";
+		if (bench_best(args, nargs, cfd, dfd, dump, repeat, &dres) != 0) {
+			printf("decompression failed\n");
+			err = 1;
+			continue;
+		}
+		if (bench_verify(ufd, dfd, size) != 0) {
+			printf("decompressed data mismatch\n");
+			err = 1;
+			continue;
+		}
+
+		printf("%10.2f %10.2f %8.3f %9.1fM %9.1fM\n", bench_mbps(size, cres.ns),
+		    bench_mbps(size, dres.ns), (double)size / sbuf.st_size,
+		    (double)cres.rss / BENCH_MB, (double)dres.rss / BENCH_MB);
+		bench_print_stages("compress", &cres.st);
+		bench_print_stages("decompress", &dres.st);
+	}
+
+bench_done:
+	set_log_level(LOG_INFO);
+	if (ufd != -1) close(ufd);
+	if (cfd != -1) close(cfd);
+	if (dfd != -1) close(dfd);
+	free(copt);
+	free(lopt);
+	free(sopt);
+	free(topt);
+	free(fopt);
+	return (err);
+}
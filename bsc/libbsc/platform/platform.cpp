@@ -43,6 +43,9 @@ See also the bsc and libbsc web site:
 #if defined(_WIN32)
   #include <windows.h>
   SIZE_T g_LargePageSize = 0;
+#elif defined(__linux__)
+  #include <sys/mman.h>
+  size_t g_LargePageSize = 0;
 #endif
 
 int bsc_platform_init(int features)
@@ -88,6 +91,11 @@ int bsc_platform_init(int features)
         }
     }
 
+#elif defined(__linux__)
+
+    /* Transparent huge pages are requested with madvise on 2MB aligned blocks. */
+    g_LargePageSize = (features & LIBBSC_FEATURE_LARGEPAGES) ? 2 * 1024 * 1024 : 0;
+
 #endif
 
     return LIBBSC_NO_ERROR;
@@ -103,6 +111,17 @@ void * bsc_malloc(size_t size)
     }
     return VirtualAlloc(0, size, MEM_COMMIT, PAGE_READWRITE);
 #else
+#if defined(__linux__)
+    if ((g_LargePageSize != 0) && (size >= g_LargePageSize))
+    {
+        void * address = NULL;
+        if (posix_memalign(&address, g_LargePageSize, size) == 0)
+        {
+            madvise(address, size & (~(g_LargePageSize - 1)), MADV_HUGEPAGE);
+            return address;
+        }
+    }
+#endif
     return malloc(size);
 #endif
 }
@@ -117,6 +136,14 @@ void * bsc_zero_malloc(size_t size)
     }
     return VirtualAlloc(0, size, MEM_COMMIT, PAGE_READWRITE);
 #else
+#if defined(__linux__)
+    if ((g_LargePageSize != 0) && (size >= g_LargePageSize))
+    {
+        void * address = bsc_malloc(size);
+        if (address != NULL) memset(address, 0, size);
+        return address;
+    }
+#endif
     return calloc(1, size);
 #endif
 }
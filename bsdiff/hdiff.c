@@ -0,0 +1,325 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2026 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ * A fast delta encoder for similar dedupe blocks. Unlike bsdiff this does
+ * not build a suffix array over the old block. Every position of the old
+ * block is indexed in a hash table keyed on the next 8 bytes. The new block
+ * is then scanned once, emitting literal runs and copies from the old
+ * block. Among the candidates in a hash bucket the one giving the longest
+ * copy, less the cost of encoding its offset, is used. Before a hash lookup
+ * the position just after the previous copy, adjusted for the pending
+ * literals, is tried. This cheaply follows the old block through byte
+ * substitutions.
+ *
+ * Patch format, all lengths are 32-bit big-endian:
+ *	0	4	length of the patch including this header
+ *	4	4	length of the new block
+ *	8	??	operations
+ *
+ * Each operation is a varint literal length, the literal bytes, a varint
+ * copy length and, if the copy length is non-zero, a zigzag varint giving
+ * the copy source relative to the end of the previous copy plus the
+ * literal length. Operations repeat until the new block is complete.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <allocator.h>
+#include <utils.h>
+
+#define	HDIFF_HDR_SZ		8
+#define	HDIFF_MIN_MATCH		8
+
+/*
+ * Each hash bucket holds the most recent positions of this many 8-byte
+ * strings. Copies that do not continue from the previous copy must be at
+ * least HDIFF_MIN_JUMP long to be worth the source offset.
+ */
+#define	HDIFF_WAYS		4
+#define	HDIFF_MIN_JUMP		12
+#define	HDIFF_MIN_HASH_BITS	10
+#define	HDIFF_MAX_HASH_BITS	20
+#define	HDIFF_HASH_PRIME	0x9E3779B97F4A7C15ULL
+#define	HDIFF_MIN(x, y)		(((x) < (y)) ? (x) : (y))
+
+/*
+ * Maximum encoded size of a varint for a 32-bit value.
+ */
+#define	VARINT_MAX		5
+
+static inline uint32_t
+hdiff_hash(u_char *p, int bits)
+{
+	return ((uint32_t)((U64_P(p) * HDIFF_HASH_PRIME) >> (64 - bits)));
+}
+
+/*
+ * Length of the common prefix of a and b, compared 8 bytes at a time.
+ */
+static inline bsize_t
+hdiff_matchlen(u_char *a, u_char *b, bsize_t max)
+{
+	bsize_t len;
+	uint64_t x;
+
+	len = 0;
+	while (len + 8 <= max) {
+		x = U64_P(a + len) ^ U64_P(b + len);
+		if (x != 0)
+			return (len + (__builtin_ctzll(LE64(x)) >> 3));
+		len += 8;
+	}
+	while (len < max && a[len] == b[len])
+		len++;
+	return (len);
+}
+
+/*
+ * Encoded size of a copy source offset.
+ */
+static inline int
+hdiff_offset_cost(bsize_t d)
+{
+	uint32_t zz;
+	int n;
+
+	zz = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+	for (n = 1; zz >= 0x80; n++)
+		zz >>= 7;
+	return (n);
+}
+
+static inline u_char *
+put_varint(u_char *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return (p);
+}
+
+static inline u_char *
+get_varint(u_char *p, u_char *end, uint32_t *v)
+{
+	uint32_t val;
+	int shift;
+
+	val = 0;
+	for (shift = 0; shift < 35 && p < end; shift += 7) {
+		val |= (uint32_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*v = val;
+			return (p);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Encode the new block as a delta against the old block. The patch is
+ * written to diff which must have room for newsize bytes. Returns the patch
+ * length or 0 if the patch would not be at least 30% smaller than the new
+ * block.
+ */
+bsize_t
+hdiff(u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t newsize,
+    u_char *diff)
+{
+	int32_t *htab, *row;
+	int bits, w;
+	bsize_t i, scan, pos, len, lit, lastpos, expect, minlen, limit, cand;
+	bsize_t clen, score;
+	u_char *op, *oplimit;
+
+	if (oldsize < HDIFF_MIN_MATCH || newsize < HDIFF_MIN_MATCH)
+		return (0);
+
+	bits = HDIFF_MIN_HASH_BITS;
+	while (bits < HDIFF_MAX_HASH_BITS && (1 << bits) < oldsize)
+		bits++;
+	htab = (int32_t *)slab_alloc(NULL, (sizeof (int32_t) * HDIFF_WAYS) << bits);
+	if (htab == NULL)
+		return (0);
+	memset(htab, 0xff, (sizeof (int32_t) * HDIFF_WAYS) << bits);
+	for (i = 0; i + HDIFF_MIN_MATCH <= oldsize; i++) {
+		row = htab + hdiff_hash(oldbuf + i, bits) * HDIFF_WAYS;
+		for (w = HDIFF_WAYS - 1; w > 0; w--)
+			row[w] = row[w - 1];
+		row[0] = i;
+	}
+
+	/*
+	 * Same size threshold as bsdiff. Leave room for the final operation.
+	 */
+	oplimit = diff + newsize / 2 + newsize / 5;
+	op = diff + HDIFF_HDR_SZ;
+	lit = 0;
+	lastpos = 0;
+	scan = 0;
+	while (scan + HDIFF_MIN_MATCH <= newsize) {
+		expect = lastpos + (scan - lit);
+		if (expect + HDIFF_MIN_MATCH <= oldsize &&
+		    U64_P(oldbuf + expect) == U64_P(newbuf + scan)) {
+			pos = expect;
+			minlen = HDIFF_MIN_MATCH;
+			len = HDIFF_MIN_MATCH + hdiff_matchlen(oldbuf + pos + HDIFF_MIN_MATCH,
+			    newbuf + scan + HDIFF_MIN_MATCH,
+			    HDIFF_MIN(oldsize - pos, newsize - scan) - HDIFF_MIN_MATCH);
+		} else {
+			/*
+			 * Pick the longest match among the candidates in the bucket.
+			 */
+			row = htab + hdiff_hash(newbuf + scan, bits) * HDIFF_WAYS;
+			pos = -1;
+			score = 0;
+			for (w = 0; w < HDIFF_WAYS && row[w] >= 0; w++) {
+				cand = row[w];
+				if (U64_P(oldbuf + cand) != U64_P(newbuf + scan))
+					continue;
+				clen = HDIFF_MIN_MATCH + hdiff_matchlen(oldbuf + cand +
+				    HDIFF_MIN_MATCH, newbuf + scan + HDIFF_MIN_MATCH,
+				    HDIFF_MIN(oldsize - cand, newsize - scan) - HDIFF_MIN_MATCH);
+				clen -= hdiff_offset_cost(cand - expect);
+				if (pos < 0 || clen > score) {
+					score = clen;
+					pos = cand;
+				}
+			}
+			if (pos < 0) {
+				scan++;
+				continue;
+			}
+			len = HDIFF_MIN_MATCH + hdiff_matchlen(oldbuf + pos + HDIFF_MIN_MATCH,
+			    newbuf + scan + HDIFF_MIN_MATCH,
+			    HDIFF_MIN(oldsize - pos, newsize - scan) - HDIFF_MIN_MATCH);
+			minlen = HDIFF_MIN_JUMP;
+		}
+
+		/*
+		 * Extend the match backwards into the pending literals.
+		 */
+		for (i = 0; scan - i > lit && pos - i > 0 &&
+		    oldbuf[pos - i - 1] == newbuf[scan - i - 1]; i++)
+			;
+		if (len + i < minlen) {
+			scan++;
+			continue;
+		}
+		scan -= i;
+		pos -= i;
+		len += i;
+
+		if (op + (scan - lit) + VARINT_MAX * 3 > oplimit)
+			goto fail;
+		op = put_varint(op, scan - lit);
+		memcpy(op, newbuf + lit, scan - lit);
+		op += scan - lit;
+		op = put_varint(op, len);
+		i = pos - (lastpos + (scan - lit));
+		op = put_varint(op, ((uint32_t)i << 1) ^ (uint32_t)(i >> 31));
+
+		scan += len;
+		lit = scan;
+		lastpos = pos + len;
+	}
+
+	if (op + (newsize - lit) + VARINT_MAX * 2 > oplimit)
+		goto fail;
+	op = put_varint(op, newsize - lit);
+	memcpy(op, newbuf + lit, newsize - lit);
+	op += newsize - lit;
+	op = put_varint(op, 0);
+	slab_free(NULL, htab);
+
+	limit = op - diff;
+	U32_P(diff) = htonl(limit);
+	U32_P(diff + 4) = htonl(newsize);
+	return (limit);
+
+fail:
+	slab_free(NULL, htab);
+	return (0);
+}
+
+bsize_t
+get_hdiff_sz(u_char *pbuf)
+{
+	return (ntohl(U32_P(pbuf)));
+}
+
+/*
+ * Re-create the new block from the old block and the patch. On entry
+ * _newsize is the space available in newbuf. Returns 1 on success and 0
+ * on a corrupt patch.
+ */
+int
+hpatch(u_char *pbuf, u_char *oldbuf, bsize_t oldsize, u_char *newbuf,
+    bsize_t *_newsize)
+{
+	u_char *p, *end;
+	uint32_t plen, newsize, newpos, lit, len, zz;
+	int64_t pos, lastpos;
+
+	plen = ntohl(U32_P(pbuf));
+	newsize = ntohl(U32_P(pbuf + 4));
+	if (plen < HDIFF_HDR_SZ || newsize > (uint32_t)*_newsize) {
+		log_msg(LOG_ERR, 0, "hpatch: Corrupt patch or output buffer too small.\n");
+		return (0);
+	}
+
+	p = pbuf + HDIFF_HDR_SZ;
+	end = pbuf + plen;
+	newpos = 0;
+	lastpos = 0;
+	while (newpos < newsize) {
+		if ((p = get_varint(p, end, &lit)) == NULL ||
+		    lit > newsize - newpos || lit > end - p)
+			goto corrupt;
+		memcpy(newbuf + newpos, p, lit);
+		p += lit;
+		newpos += lit;
+
+		if ((p = get_varint(p, end, &len)) == NULL || len > newsize - newpos)
+			goto corrupt;
+		if (len == 0)
+			continue;
+		if ((p = get_varint(p, end, &zz)) == NULL)
+			goto corrupt;
+		pos = lastpos + lit + ((int32_t)(zz >> 1) ^ -(int32_t)(zz & 1));
+		if (pos < 0 || pos + len > oldsize)
+			goto corrupt;
+		memcpy(newbuf + newpos, oldbuf + pos, len);
+		newpos += len;
+		lastpos = pos + len;
+	}
+	*_newsize = newsize;
+	return (1);
+
+corrupt:
+	log_msg(LOG_ERR, 0, "hpatch: Corrupt patch.\n");
+	return (0);
+}
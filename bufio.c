@@ -0,0 +1,379 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Buffer and callback interface to the library. The reader thread pulls the
+ * input straight from the caller's buffer or read callback and the writer
+ * thread pushes the output straight into the output buffer or the write
+ * callback, so the full chunk pipeline, file format and options are used
+ * unchanged. Such a context is set up once and can then be used for any
+ * number of calls. The worker threads, codec state and chunk buffers are kept
+ * in the context's slot pool between calls.
+ */
+#ifdef __linux__
+#define	_GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pcompress.h"
+#include <utils.h>
+
+/*
+ * Options that a run adjusts for the data at hand. Small inputs for example
+ * turn off dedupe and threading when compressing, and decompression takes
+ * the algorithm, checksum, dedupe and crypto settings from the header.
+ */
+struct mem_opts {
+	const char *algo;
+	int nthreads;
+	int enable_rabin_scan, enable_rabin_global, enable_rabin_split;
+	int enable_fixed_scan, enable_algo_dict;
+	int adapt_mode, enable_analyzer;
+	int cksum, cksum_bytes, mac_bytes;
+	int encrypt_type, keylen, delta_enc;
+	int meta_stream, pipe_mode;
+};
+
+/*
+ * State of a pc_process_buffer() call. The output goes to the caller's
+ * buffer while it fits, otherwise to a buffer that grows as needed.
+ */
+struct mem_buf {
+	const uchar_t *src;
+	uint64_t srclen, srcpos;
+	uchar_t *dst;
+	uint64_t dstlen, dstsz;
+	int own_dst;
+};
+
+/*
+ * Get an unnamed file that lives entirely in memory.
+ */
+int
+create_mem_file(const char *name)
+{
+#ifdef MFD_CLOEXEC
+	return (memfd_create(name, MFD_CLOEXEC));
+#else
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof (path), "/pcompress-%d-%s", (int)getpid(), name);
+	fd = shm_open(path, O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
+	if (fd != -1)
+		shm_unlink(path);
+	return (fd);
+#endif
+}
+
+/*
+ * Read and write helpers for the pipeline. Like Read() and Write() they
+ * keep calling the callback till the full count is done, end of input is
+ * reached or there is an error.
+ */
+int64_t
+mem_io_read(void *ctx, void *buf, uint64_t count)
+{
+	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
+	int64_t rcount, rem;
+	uchar_t *cbuf;
+
+	rem = count;
+	cbuf = (uchar_t *)buf;
+	while (rem > 0) {
+		rcount = pctx->mem_read(pctx->mem_cookie, cbuf, rem);
+		if (rcount < 0) return (rcount);
+		if (rcount == 0) break;
+		rem = rem - rcount;
+		cbuf += rcount;
+	}
+	return (count - rem);
+}
+
+int64_t
+mem_io_write(void *ctx, const void *buf, uint64_t count)
+{
+	pc_ctx_t *pctx = (pc_ctx_t *)ctx;
+	int64_t wcount, rem;
+	const uchar_t *cbuf;
+
+	rem = count;
+	cbuf = (const uchar_t *)buf;
+	while (rem > 0) {
+		wcount = pctx->mem_write(pctx->mem_cookie, cbuf, rem);
+		if (wcount <= 0) return (-1);
+		rem = rem - wcount;
+		cbuf += wcount;
+	}
+	return (count - rem);
+}
+
+static int64_t
+mem_buf_read(void *cookie, void *buf, uint64_t len)
+{
+	struct mem_buf *mb = (struct mem_buf *)cookie;
+
+	if (len > mb->srclen - mb->srcpos)
+		len = mb->srclen - mb->srcpos;
+	memcpy(buf, mb->src + mb->srcpos, len);
+	mb->srcpos += len;
+	return (len);
+}
+
+static int64_t
+mem_buf_write(void *cookie, const void *buf, uint64_t len)
+{
+	struct mem_buf *mb = (struct mem_buf *)cookie;
+	uint64_t sz;
+	uchar_t *dst;
+
+	if (len > mb->dstsz - mb->dstlen) {
+		sz = mb->dstsz * 2;
+		if (sz < mb->dstlen + len)
+			sz = mb->dstlen + len;
+		if (mb->own_dst) {
+			dst = (uchar_t *)realloc(mb->dst, sz);
+		} else {
+			dst = (uchar_t *)malloc(sz);
+			if (dst != NULL)
+				memcpy(dst, mb->dst, mb->dstlen);
+		}
+		if (dst == NULL)
+			return (-1);
+		mb->dst = dst;
+		mb->dstsz = sz;
+		mb->own_dst = 1;
+	}
+	memcpy(mb->dst + mb->dstlen, buf, len);
+	mb->dstlen += len;
+	return (len);
+}
+
+/*
+ * Global Dedupe references are read back from the output written so far.
+ * A chunk only resolves them after all earlier chunks are written and the
+ * writer holds back later ones till then, so the buffer is not moved by a
+ * concurrent write.
+ */
+static int64_t
+mem_buf_pread(void *cookie, void *buf, uint64_t len, uint64_t off)
+{
+	struct mem_buf *mb = (struct mem_buf *)cookie;
+
+	if (off > mb->dstlen || len > mb->dstlen - off)
+		return (-1);
+	memcpy(buf, mb->dst + off, len);
+	return (len);
+}
+
+/*
+ * Set up a context for the buffer interface. The argument string is the same
+ * as for init_pc_context_argstr() but without filenames, for example
+ * "pcompress -c zstd -l 6" or "pcompress -d". Archiving and pipe mode cannot
+ * be used.
+ */
+int DLL_EXPORT
+init_pc_context_mem(pc_ctx_t *pctx, char *args)
+{
+	pctx->mem_io = 1;
+	return (init_pc_context_argstr(pctx, args));
+}
+
+/*
+ * Bring the options back to the state they had after option parsing. The
+ * first call saves them, later calls put them back. Setters must therefore
+ * be called before the first call.
+ *
+ * The password is the exception. A run zeroes the caller's password buffer
+ * and the password file once the key is derived. The password given with
+ * pc_set_userpw() for the next call is used, the password file only for the
+ * first call. Without a password the run fails.
+ */
+static int
+mem_io_reset(pc_ctx_t *pctx)
+{
+	struct mem_opts *mo;
+
+	if (!pctx->inited || !pctx->mem_io) {
+		log_msg(LOG_ERR, 0, "Context is not set up for the buffer interface.");
+		return (-1);
+	}
+
+	mo = (struct mem_opts *)pctx->mem_opts;
+	if (mo == NULL) {
+		mo = (struct mem_opts *)malloc(sizeof (struct mem_opts));
+		if (mo == NULL) {
+			log_msg(LOG_ERR, 1, "Out of memory ");
+			return (-1);
+		}
+		mo->algo = pctx->algo;
+		mo->nthreads = pctx->nthreads;
+		mo->enable_rabin_scan = pctx->enable_rabin_scan;
+		mo->enable_rabin_global = pctx->enable_rabin_global;
+		mo->enable_rabin_split = pctx->enable_rabin_split;
+		mo->enable_fixed_scan = pctx->enable_fixed_scan;
+		mo->enable_algo_dict = pctx->enable_algo_dict;
+		mo->adapt_mode = pctx->adapt_mode;
+		mo->enable_analyzer = pctx->enable_analyzer;
+		mo->cksum = pctx->cksum;
+		mo->cksum_bytes = pctx->cksum_bytes;
+		mo->mac_bytes = pctx->mac_bytes;
+		mo->encrypt_type = pctx->encrypt_type;
+		mo->keylen = pctx->keylen;
+		mo->delta_enc = pctx->delta_enc;
+		mo->meta_stream = pctx->meta_stream;
+		mo->pipe_mode = pctx->pipe_mode;
+		pctx->mem_opts = mo;
+	} else {
+		free(pctx->pwd_file);
+		pctx->pwd_file = NULL;
+		pctx->algo = mo->algo;
+		pctx->nthreads = mo->nthreads;
+		pctx->enable_rabin_scan = mo->enable_rabin_scan;
+		pctx->enable_rabin_global = mo->enable_rabin_global;
+		pctx->enable_rabin_split = mo->enable_rabin_split;
+		pctx->enable_fixed_scan = mo->enable_fixed_scan;
+		pctx->enable_algo_dict = mo->enable_algo_dict;
+		pctx->adapt_mode = mo->adapt_mode;
+		pctx->enable_analyzer = mo->enable_analyzer;
+		pctx->cksum = mo->cksum;
+		pctx->cksum_bytes = mo->cksum_bytes;
+		pctx->mac_bytes = mo->mac_bytes;
+		pctx->encrypt_type = mo->encrypt_type;
+		pctx->keylen = mo->keylen;
+		pctx->delta_enc = mo->delta_enc;
+		pctx->meta_stream = mo->meta_stream;
+		pctx->pipe_mode = mo->pipe_mode;
+	}
+	pctx->main_cancel = 0;
+	pctx->t_errored = 0;
+	pctx->progress_total = 0;
+	return (0);
+}
+
+/*
+ * Run the pipeline on the given callbacks. A stream of unknown size is
+ * handled like a pipe.
+ */
+static int
+mem_io_run(pc_ctx_t *pctx, pc_read_func_t rd, pc_write_func_t wr, pc_pread_func_t prd,
+    void *cookie, int64_t insize)
+{
+	int err;
+
+	pctx->mem_read = rd;
+	pctx->mem_write = wr;
+	pctx->mem_pread = prd;
+	pctx->mem_cookie = cookie;
+	pctx->mem_insize = insize;
+	if (insize == -1)
+		pctx->pipe_mode = 1;
+	err = start_pcompress(pctx);
+	pctx->mem_read = NULL;
+	pctx->mem_write = NULL;
+	pctx->mem_pread = NULL;
+	pctx->mem_cookie = NULL;
+	pctx->mem_insize = -1;
+	return (err);
+}
+
+/*
+ * Compress or decompress, depending on how the context was set up, srclen
+ * bytes at src. If *dst is NULL an output buffer is allocated which the
+ * caller must free(). Otherwise *dst is used and *dstlen gives its size. If
+ * that is too small, *dstlen is set to the size needed and -1 is returned.
+ * On success *dstlen is the output size.
+ */
+int DLL_EXPORT
+pc_process_buffer(pc_ctx_t *pctx, const void *src, uint64_t srclen, void **dst,
+    uint64_t *dstlen)
+{
+	struct mem_buf mb;
+	int err;
+
+	if (srclen == 0) {
+		log_msg(LOG_ERR, 0, "Nothing to process.");
+		return (1);
+	}
+	if (mem_io_reset(pctx) == -1)
+		return (1);
+
+	mb.src = (const uchar_t *)src;
+	mb.srclen = srclen;
+	mb.srcpos = 0;
+	mb.dstlen = 0;
+	if (*dst != NULL) {
+		mb.dst = (uchar_t *)*dst;
+		mb.dstsz = *dstlen;
+		mb.own_dst = 0;
+	} else {
+		mb.dst = (uchar_t *)malloc(srclen);
+		if (mb.dst == NULL) {
+			log_msg(LOG_ERR, 1, "Out of memory ");
+			return (1);
+		}
+		mb.dstsz = srclen;
+		mb.own_dst = 1;
+	}
+
+	err = mem_io_run(pctx, mem_buf_read, mem_buf_write, mem_buf_pread, &mb, srclen);
+	if (err == 0 && *dst != NULL && mb.own_dst) {
+		/*
+		 * The output did not fit into the caller's buffer.
+		 */
+		*dstlen = mb.dstlen;
+		err = -1;
+	}
+	if (err != 0) {
+		if (mb.own_dst)
+			free(mb.dst);
+		return (err);
+	}
+	*dst = mb.dst;
+	*dstlen = mb.dstlen;
+	return (0);
+}
+
+/*
+ * Like pc_process_buffer() but the input is pulled from rd until it returns
+ * 0 and the output is pushed to wr as soon as each chunk is done. Global
+ * Dedupe data cannot be decompressed this way since the output that is
+ * referenced cannot be read back.
+ */
+int DLL_EXPORT
+pc_process_stream(pc_ctx_t *pctx, pc_read_func_t rd, pc_write_func_t wr, void *cookie)
+{
+	if (mem_io_reset(pctx) == -1)
+		return (1);
+	return (mem_io_run(pctx, rd, wr, NULL, cookie, -1));
+}
@@ -51,6 +51,8 @@ bzip2_stats(int show)
 
 void
 bzip2_props(algo_props_t *data, int level, uint64_t chunksize) {
+	data->state_mem = 8 * 900 * 1024;
+	data->dstate_mem = 4 * 900 * 1024;
 	data->delta2_span = 200;
 	data->deltac_min_distance = FOURM;
 }
@@ -150,6 +150,9 @@ extern "C" {
   int blake2b_avx( uint8_t *out, const void *in, const void *key, const uint8_t outlen, const uint64_t inlen, uint8_t keylen );
   int blake2bp_avx( uint8_t *out, const void *in, const void *key, const uint8_t outlen, const uint64_t inlen, uint8_t keylen );
 
+  // Multi-buffer API: hash n independent unkeyed messages, 4 at a time
+  int blake2b_mb_avx2( uint8_t *out[], const uint8_t *in[], const uint64_t inlen[], int n, uint8_t outlen );
+
 #if defined(__cplusplus)
 }
 #endif
@@ -45,6 +45,7 @@ extern "C" {
 
   typedef int (*blake2b_funcptr)( uint8_t *out, const void *in, const void *key, const uint8_t outlen, const uint64_t inlen, uint8_t keylen );
   typedef int (*blake2bp_funcptr)( uint8_t *out, const void *in, const void *key, const uint8_t outlen, const uint64_t inlen, uint8_t keylen );
+  typedef int (*blake2b_mb_funcptr)( uint8_t *out[], const uint8_t *in[], const uint64_t inlen[], int n, uint8_t outlen );
 
   /*
    * BLAKE2 function pointers. These are set to the optimized routines
@@ -62,6 +63,7 @@ extern "C" {
 	blake2bp_final_funcptr		blake2bp_final;
 	blake2b_funcptr			blake2b;
 	blake2bp_funcptr			blake2bp;
+	blake2b_mb_funcptr		blake2b_mb;
   };
 
   static void blake2_module_init(struct blake2_dispatch *dsp, processor_cap_t *pc)
@@ -77,6 +79,7 @@ extern "C" {
     dsp->blake2bp_final 		= blake2bp_final_sse2;
     dsp->blake2b			= blake2b_sse2;
     dsp->blake2bp		= blake2bp_sse2;
+    dsp->blake2b_mb		= NULL;
 
     if (pc->sse_level == 3 && pc->sse_sub_level == 1) {
       dsp->blake2b_init		= blake2b_init_ssse3;
@@ -117,6 +120,9 @@ extern "C" {
       dsp->blake2b		= blake2b_avx;
       dsp->blake2bp		= blake2bp_avx;
     }
+    if (pc->avx_level >= 2) {
+      dsp->blake2b_mb		= blake2b_mb_avx2;
+    }
   }
 
 #if defined(__cplusplus)
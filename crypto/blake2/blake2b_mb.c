@@ -0,0 +1,262 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Multi-buffer BLAKE2b using AVX2. Unlike BLAKE2bp which splits one message
+ * into 4 leaves and produces a different digest, this hashes 4 independent
+ * messages in the 4 64-bit lanes of YMM registers and produces exactly the
+ * same digests as plain sequential BLAKE2b. It is meant for many small
+ * buffers like Dedupe blocks where BLAKE2bp does not help.
+ * This file must be compiled with -mavx2.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "blake2.h"
+
+#define	MB_LANES	4
+
+static const uint64_t blake2b_IV[8] =
+{
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+  0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+  0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t blake2b_sigma[12][16] =
+{
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 } ,
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 } ,
+  { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 } ,
+  {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 } ,
+  {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 } ,
+  {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 } ,
+  { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 } ,
+  { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 } ,
+  {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 } ,
+  { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13 , 0 } ,
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 } ,
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+#define	ADD(a, b)	_mm256_add_epi64((a), (b))
+#define	XOR(a, b)	_mm256_xor_si256((a), (b))
+#define	ROT32(x)	_mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define	ROT24(x)	_mm256_shuffle_epi8((x), r24)
+#define	ROT16(x)	_mm256_shuffle_epi8((x), r16)
+#define	ROT63(x)	_mm256_or_si256(_mm256_srli_epi64((x), 63), ADD((x), (x)))
+
+#define	G(r, i, a, b, c, d) \
+	do { \
+		a = ADD(ADD(a, b), m[blake2b_sigma[r][2 * i]]); \
+		d = ROT32(XOR(d, a)); \
+		c = ADD(c, d); \
+		b = ROT24(XOR(b, c)); \
+		a = ADD(ADD(a, b), m[blake2b_sigma[r][2 * i + 1]]); \
+		d = ROT16(XOR(d, a)); \
+		c = ADD(c, d); \
+		b = ROT63(XOR(b, c)); \
+	} while (0)
+
+/*
+ * Compress one block from each lane. The hash state is laid out word-major,
+ * h[i][lane], so each state word is one vector.
+ */
+static void
+blake2b_x4(uint64_t h[8][MB_LANES], const uint8_t *blk[MB_LANES],
+	   const uint64_t t[MB_LANES], const uint64_t f[MB_LANES])
+{
+	const __m256i r24 = _mm256_setr_epi8(
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	const __m256i r16 = _mm256_setr_epi8(
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	__m256i m[16], v[16], s[8];
+	int i, r;
+
+	/*
+	 * Load 4 message words from every lane at a time and transpose the
+	 * 4x4 matrix of 64-bit words so that m[k] holds word k of every lane.
+	 */
+	for (i = 0; i < 4; i++) {
+		__m256i r0, r1, r2, r3, t0, t1, t2, t3;
+
+		r0 = _mm256_loadu_si256((const __m256i *)(blk[0] + i * 32));
+		r1 = _mm256_loadu_si256((const __m256i *)(blk[1] + i * 32));
+		r2 = _mm256_loadu_si256((const __m256i *)(blk[2] + i * 32));
+		r3 = _mm256_loadu_si256((const __m256i *)(blk[3] + i * 32));
+		t0 = _mm256_unpacklo_epi64(r0, r1);
+		t1 = _mm256_unpackhi_epi64(r0, r1);
+		t2 = _mm256_unpacklo_epi64(r2, r3);
+		t3 = _mm256_unpackhi_epi64(r2, r3);
+		m[i * 4 + 0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+		m[i * 4 + 1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+		m[i * 4 + 2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+		m[i * 4 + 3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+	}
+
+	for (i = 0; i < 8; i++) {
+		s[i] = _mm256_loadu_si256((const __m256i *)h[i]);
+		v[i] = s[i];
+		v[i + 8] = _mm256_set1_epi64x(blake2b_IV[i]);
+	}
+	v[12] = XOR(v[12], _mm256_loadu_si256((const __m256i *)t));
+	v[14] = XOR(v[14], _mm256_loadu_si256((const __m256i *)f));
+
+	for (r = 0; r < 12; r++) {
+		G(r, 0, v[0], v[4], v[ 8], v[12]);
+		G(r, 1, v[1], v[5], v[ 9], v[13]);
+		G(r, 2, v[2], v[6], v[10], v[14]);
+		G(r, 3, v[3], v[7], v[11], v[15]);
+		G(r, 4, v[0], v[5], v[10], v[15]);
+		G(r, 5, v[1], v[6], v[11], v[12]);
+		G(r, 6, v[2], v[7], v[ 8], v[13]);
+		G(r, 7, v[3], v[4], v[ 9], v[14]);
+	}
+
+	for (i = 0; i < 8; i++) {
+		s[i] = XOR(s[i], XOR(v[i], v[i + 8]));
+		_mm256_storeu_si256((__m256i *)h[i], s[i]);
+	}
+}
+
+typedef struct {
+	const uint8_t *data;
+	uint64_t nblks, len, t;
+	uint8_t last[BLAKE2B_BLOCKBYTES];
+	int job;
+} mb_lane_t;
+
+/*
+ * Every block except the last is fed straight from the message. The last,
+ * possibly partial, block is copied out zero padded. An empty message is a
+ * single zero block.
+ */
+static void
+mb_lane_load(mb_lane_t *ln, const uint8_t *data, uint64_t len, int job)
+{
+	uint64_t rem;
+
+	ln->data = data;
+	ln->len = len;
+	ln->t = 0;
+	ln->job = job;
+	ln->nblks = (len > 0) ? (len - 1) / BLAKE2B_BLOCKBYTES : 0;
+	rem = len - ln->nblks * BLAKE2B_BLOCKBYTES;
+	memset(ln->last, 0, BLAKE2B_BLOCKBYTES);
+	memcpy(ln->last, data + ln->nblks * BLAKE2B_BLOCKBYTES, rem);
+}
+
+static void
+mb_lane_init(uint64_t h[8][MB_LANES], int lane, uint8_t outlen)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		h[i][lane] = blake2b_IV[i];
+	/* digest_length = outlen, key_length = 0, fanout = 1, depth = 1 */
+	h[0][lane] ^= 0x01010000ULL | outlen;
+}
+
+int
+blake2b_mb_avx2(uint8_t *out[], const uint8_t *in[], const uint64_t inlen[], int n,
+		uint8_t outlen)
+{
+	static const uint8_t dummy[BLAKE2B_BLOCKBYTES];
+	uint64_t h[8][MB_LANES], t[MB_LANES], f[MB_LANES];
+	const uint8_t *blk[MB_LANES];
+	mb_lane_t lanes[MB_LANES];
+	int j, next, active;
+
+	if (!outlen || outlen > BLAKE2B_OUTBYTES) return -1;
+
+	next = 0;
+	active = 0;
+	for (j = 0; j < MB_LANES; j++) {
+		if (next < n) {
+			mb_lane_load(&lanes[j], in[next], inlen[next], next);
+			mb_lane_init(h, j, outlen);
+			next++;
+			active++;
+		} else {
+			lanes[j].job = -1;
+		}
+	}
+
+	while (active > 0) {
+		for (j = 0; j < MB_LANES; j++) {
+			mb_lane_t *ln = &lanes[j];
+
+			if (ln->job < 0) {
+				blk[j] = dummy;
+				t[j] = 0;
+				f[j] = 0;
+			} else if (ln->nblks > 0) {
+				blk[j] = ln->data;
+				ln->t += BLAKE2B_BLOCKBYTES;
+				t[j] = ln->t;
+				f[j] = 0;
+			} else {
+				blk[j] = ln->last;
+				t[j] = ln->len;
+				f[j] = ~0ULL;
+			}
+		}
+		blake2b_x4(h, blk, t, f);
+
+		for (j = 0; j < MB_LANES; j++) {
+			mb_lane_t *ln = &lanes[j];
+			uint8_t digest[BLAKE2B_OUTBYTES];
+			int i;
+
+			if (ln->job < 0)
+				continue;
+			if (ln->nblks > 0) {
+				ln->data += BLAKE2B_BLOCKBYTES;
+				ln->nblks--;
+				continue;
+			}
+
+			/*
+			 * Last block done. Emit digest and refill the lane.
+			 */
+			for (i = 0; i < 8; i++)
+				memcpy(digest + i * 8, &h[i][j], 8);
+			memcpy(out[ln->job], digest, outlen);
+			if (next < n) {
+				mb_lane_load(ln, in[next], inlen[next], next);
+				mb_lane_init(h, j, outlen);
+				next++;
+			} else {
+				ln->job = -1;
+				active--;
+			}
+		}
+	}
+	return 0;
+}
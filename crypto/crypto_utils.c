@@ -326,6 +326,223 @@ compute_checksum(uchar_t *cksum_buf, int cksum, uchar_t *buf, uint64_t bytes, in
 	return (0);
 }
 
+/*
+ * Compute digests of a batch of independent buffers. This is meant for lots of
+ * small buffers like Dedupe blocks that are individually too small to benefit
+ * from the parallel tree hashing modes. Where available, multi-buffer SIMD
+ * routines hash several buffers together in the lanes of vector registers.
+ * The digests are identical to those produced by compute_checksum() with mt = 0.
+ */
+int
+compute_checksum_mb(uchar_t *cksum_bufs[], int cksum, uchar_t *bufs[], uint64_t bytes[],
+		    int nbufs)
+{
+	int i;
+
+	if (cksum == CKSUM_BLAKE256 || cksum == CKSUM_BLAKE512) {
+		if (bdsp.blake2b_mb) {
+			return (bdsp.blake2b_mb(cksum_bufs, (const uint8_t **)bufs, bytes,
+			    nbufs, cksum == CKSUM_BLAKE256 ? 32 : 64));
+		}
+	} else if (cksum == CKSUM_SHA256 && cksum_provider == PROVIDER_X64_OPT) {
+		opt_SHA512t256_mb(cksum_bufs, (const uint8_t **)bufs, bytes, nbufs);
+		return (0);
+
+	} else if (cksum == CKSUM_SHA512 && cksum_provider == PROVIDER_X64_OPT) {
+		opt_SHA512_mb(cksum_bufs, (const uint8_t **)bufs, bytes, nbufs);
+		return (0);
+	}
+
+	for (i = 0; i < nbufs; i++) {
+		if (compute_checksum(cksum_bufs[i], cksum, bufs[i], bytes[i], 0, 0) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Incremental computation of a chunk digest. This allows the digest to be fed
+ * piecewise while the data is being touched anyway by some other processing,
+ * avoiding a separate pass over the whole chunk. The digest is identical to
+ * that produced by compute_checksum() with mt = 0.
+ */
+int
+cksum_init(cksum_ctx_t *cctx, int cksum)
+{
+	size_t sz;
+
+	cctx->cksum = cksum;
+	cctx->cksum_ctx = NULL;
+	if (cksum == CKSUM_CRC64) {
+		sz = 0;
+	} else if (cksum == CKSUM_BLAKE256 || cksum == CKSUM_BLAKE512) {
+		sz = sizeof (blake2b_state);
+	} else if (cksum == CKSUM_SKEIN256 || cksum == CKSUM_SKEIN512) {
+		sz = sizeof (Skein_512_Ctxt_t);
+	} else if (cksum == CKSUM_SHA256) {
+		if (cksum_provider == PROVIDER_OPENSSL)
+			sz = sizeof (SHA256_CTX);
+		else
+			sz = sizeof (SHA512_Context);
+	} else if (cksum == CKSUM_SHA512) {
+		if (cksum_provider == PROVIDER_OPENSSL)
+			sz = sizeof (SHA512_CTX);
+		else
+			sz = sizeof (SHA512_Context);
+	} else if (cksum == CKSUM_KECCAK256 || cksum == CKSUM_KECCAK512) {
+		sz = sizeof (hashState);
+	} else {
+		return (-1);
+	}
+
+	if (sz > 0) {
+		cctx->cksum_ctx = malloc(sz);
+		if (!cctx->cksum_ctx)
+			return (-1);
+	}
+	return (cksum_reinit(cctx));
+}
+
+int
+cksum_reinit(cksum_ctx_t *cctx)
+{
+	int cksum = cctx->cksum;
+
+	if (cksum == CKSUM_CRC64) {
+		cctx->crc64 = 0;
+
+	} else if (cksum == CKSUM_BLAKE256) {
+		if (bdsp.blake2b_init((blake2b_state *)(cctx->cksum_ctx), 32) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_BLAKE512) {
+		if (bdsp.blake2b_init((blake2b_state *)(cctx->cksum_ctx), 64) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_SKEIN256) {
+		Skein_512_Init((Skein_512_Ctxt_t *)(cctx->cksum_ctx), 256);
+
+	} else if (cksum == CKSUM_SKEIN512) {
+		Skein_512_Init((Skein_512_Ctxt_t *)(cctx->cksum_ctx), 512);
+
+	} else if (cksum == CKSUM_SHA256) {
+		if (cksum_provider == PROVIDER_OPENSSL)
+			SHA256_Init((SHA256_CTX *)(cctx->cksum_ctx));
+		else
+			opt_SHA512t256_Init((SHA512_Context *)(cctx->cksum_ctx));
+
+	} else if (cksum == CKSUM_SHA512) {
+		if (cksum_provider == PROVIDER_OPENSSL)
+			SHA512_Init((SHA512_CTX *)(cctx->cksum_ctx));
+		else
+			opt_SHA512_Init((SHA512_Context *)(cctx->cksum_ctx));
+
+	} else if (cksum == CKSUM_KECCAK256) {
+		if (Keccak_Init((hashState *)(cctx->cksum_ctx), 256) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_KECCAK512) {
+		if (Keccak_Init((hashState *)(cctx->cksum_ctx), 512) != 0)
+			return (-1);
+	} else {
+		return (-1);
+	}
+	return (0);
+}
+
+int
+cksum_update(cksum_ctx_t *cctx, uchar_t *buf, uint64_t bytes)
+{
+	int cksum = cctx->cksum;
+
+	if (cksum == CKSUM_CRC64) {
+		cctx->crc64 = lzma_crc64(buf, bytes, cctx->crc64);
+
+	} else if (cksum == CKSUM_BLAKE256 || cksum == CKSUM_BLAKE512) {
+		if (bdsp.blake2b_update((blake2b_state *)(cctx->cksum_ctx), buf, bytes) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_SKEIN256 || cksum == CKSUM_SKEIN512) {
+		Skein_512_Update((Skein_512_Ctxt_t *)(cctx->cksum_ctx), buf, bytes);
+
+	} else if (cksum == CKSUM_SHA256) {
+		if (cksum_provider == PROVIDER_OPENSSL)
+			SHA256_Update((SHA256_CTX *)(cctx->cksum_ctx), buf, bytes);
+		else
+			opt_SHA512t256_Update((SHA512_Context *)(cctx->cksum_ctx), buf, bytes);
+
+	} else if (cksum == CKSUM_SHA512) {
+		if (cksum_provider == PROVIDER_OPENSSL)
+			SHA512_Update((SHA512_CTX *)(cctx->cksum_ctx), buf, bytes);
+		else
+			opt_SHA512_Update((SHA512_Context *)(cctx->cksum_ctx), buf, bytes);
+
+	} else if (cksum == CKSUM_KECCAK256 || cksum == CKSUM_KECCAK512) {
+		// Keccak takes data length in bits so we have to scale
+		while (bytes > KECCAK_MAX_SEG) {
+			if (Keccak_Update((hashState *)(cctx->cksum_ctx), buf,
+			    KECCAK_MAX_SEG << 3) != 0)
+				return (-1);
+			buf += KECCAK_MAX_SEG;
+			bytes -= KECCAK_MAX_SEG;
+		}
+		if (Keccak_Update((hashState *)(cctx->cksum_ctx), buf, bytes << 3) != 0)
+			return (-1);
+	} else {
+		return (-1);
+	}
+	return (0);
+}
+
+int
+cksum_final(cksum_ctx_t *cctx, uchar_t *cksum_buf)
+{
+	int cksum = cctx->cksum;
+
+	if (cksum == CKSUM_CRC64) {
+		*((uint64_t *)cksum_buf) = cctx->crc64;
+
+	} else if (cksum == CKSUM_BLAKE256) {
+		if (bdsp.blake2b_final((blake2b_state *)(cctx->cksum_ctx), cksum_buf, 32) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_BLAKE512) {
+		if (bdsp.blake2b_final((blake2b_state *)(cctx->cksum_ctx), cksum_buf, 64) != 0)
+			return (-1);
+
+	} else if (cksum == CKSUM_SKEIN256 || cksum == CKSUM_SKEIN512) {
+		Skein_512_Final((Skein_512_Ctxt_t *)(cctx->cksum_ctx), cksum_buf);
+
+	} else if (cksum == CKSUM_SHA256) {
+		if (cksum_provider == PROVIDER_OPENSSL)
+			SHA256_Final(cksum_buf, (SHA256_CTX *)(cctx->cksum_ctx));
+		else
+			opt_SHA512t256_Final((SHA512_Context *)(cctx->cksum_ctx), cksum_buf);
+
+	} else if (cksum == CKSUM_SHA512) {
+		if (cksum_provider == PROVIDER_OPENSSL)
+			SHA512_Final(cksum_buf, (SHA512_CTX *)(cctx->cksum_ctx));
+		else
+			opt_SHA512_Final((SHA512_Context *)(cctx->cksum_ctx), cksum_buf);
+
+	} else if (cksum == CKSUM_KECCAK256 || cksum == CKSUM_KECCAK512) {
+		if (Keccak_Final((hashState *)(cctx->cksum_ctx), cksum_buf) != 0)
+			return (-1);
+	} else {
+		return (-1);
+	}
+	return (0);
+}
+
+void
+cksum_cleanup(cksum_ctx_t *cctx)
+{
+	if (cctx->cksum_ctx) {
+		free(cctx->cksum_ctx);
+		cctx->cksum_ctx = NULL;
+	}
+}
+
 static void
 init_sha512(void)
 {
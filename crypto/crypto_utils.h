@@ -77,10 +77,23 @@ typedef struct {
 	int mac_cksum;
 } mac_ctx_t;
 
+typedef struct {
+	void *cksum_ctx;
+	uint64_t crc64;
+	int cksum;
+} cksum_ctx_t;
+
 /*
  * Generic message digest functions.
  */
 int compute_checksum(uchar_t *cksum_buf, int cksum, uchar_t *buf, uint64_t bytes, int mt, int verbose);
+int compute_checksum_mb(uchar_t *cksum_bufs[], int cksum, uchar_t *bufs[], uint64_t bytes[],
+		       int nbufs);
+int cksum_init(cksum_ctx_t *cctx, int cksum);
+int cksum_reinit(cksum_ctx_t *cctx);
+int cksum_update(cksum_ctx_t *cctx, uchar_t *buf, uint64_t bytes);
+int cksum_final(cksum_ctx_t *cctx, uchar_t *cksum_buf);
+void cksum_cleanup(cksum_ctx_t *cctx);
 void list_checksums(FILE *strm, char *pad);
 int get_checksum_props(const char *name, int *cksum, int *cksum_bytes,
 		      int *mac_bytes, int accept_compatible);
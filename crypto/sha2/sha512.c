@@ -128,11 +128,14 @@ static const uint64_t iv256[SHA512_HASH_WORDS] = {
 };
 
 static update_func_ptr sha512_update_func;
+static int sha512_mb_avx2 = 0;
 
 int
 APS_NAMESPACE(Init_SHA512) (processor_cap_t *pc)
 {
 	if (pc->proc_type == PROC_X64_INTEL || pc->proc_type == PROC_X64_AMD) {
+		if (pc->avx_level > 1)
+			sha512_mb_avx2 = 1;
 		if (pc->avx_level > 0) {
 			sha512_update_func = sha512_avx;
 
@@ -278,6 +281,149 @@ APS_NAMESPACE(SHA512t256_Final) (SHA512_Context *sc, uint8_t hash[SHA512t256_HAS
 	_final (sc, hash, SHA512t256_HASH_WORDS, 0);
 }
 
+/*
+ * Multi-buffer hashing. Up to SHA512_MB_LANES messages are processed together,
+ * one block from each per call of the AVX2 transform. The last partial block
+ * of every message along with the padding and length is prepared upfront in
+ * a per-lane tail buffer, so lanes only ever see whole blocks. When a message
+ * finishes its lane is refilled with the next pending one. Idle lanes, once
+ * the input runs out, crunch a dummy block and their result is discarded.
+ */
+typedef struct {
+	const uint8_t *data;
+	uint64_t nblks;
+	uint8_t tail[SHA512_BLOCK_SIZE * 2];
+	int ntail, tpos, job;
+} mb_lane_t;
+
+static void
+_mb_lane_load (mb_lane_t *ln, const uint8_t *data, uint64_t len, int job)
+{
+	uint64_t rem, lenpad;
+
+	ln->data = data;
+	ln->nblks = len >> 7;
+	ln->job = job;
+	ln->tpos = 0;
+	rem = len & (SHA512_BLOCK_SIZE - 1);
+	ln->ntail = (rem + 17 > SHA512_BLOCK_SIZE) ? 2 : 1;
+
+	memset(ln->tail, 0, sizeof (ln->tail));
+	memcpy(ln->tail, data + (ln->nblks << 7), rem);
+	ln->tail[rem] = 0x80;
+	lenpad = BYTESWAP64(len >> 61);
+	memcpy(ln->tail + ln->ntail * SHA512_BLOCK_SIZE - 16, &lenpad, 8);
+	lenpad = BYTESWAP64(len << 3);
+	memcpy(ln->tail + ln->ntail * SHA512_BLOCK_SIZE - 8, &lenpad, 8);
+}
+
+static void
+_mb_hash (uint8_t *hash[], const uint8_t *data[], const uint64_t len[], int n,
+	  const uint64_t iv[SHA512_HASH_WORDS], int hashWords)
+{
+	static const uint8_t dummy[SHA512_BLOCK_SIZE];
+	uint64_t state[SHA512_HASH_WORDS][SHA512_MB_LANES];
+	const uint8_t *blk[SHA512_MB_LANES];
+	mb_lane_t lanes[SHA512_MB_LANES];
+	int i, j, next, active;
+
+	next = 0;
+	active = 0;
+	for (j = 0; j < SHA512_MB_LANES; j++) {
+		if (next < n) {
+			_mb_lane_load(&lanes[j], data[next], len[next], next);
+			for (i = 0; i < SHA512_HASH_WORDS; i++)
+				state[i][j] = iv[i];
+			next++;
+			active++;
+		} else {
+			lanes[j].job = -1;
+		}
+	}
+
+	while (active > 0) {
+		for (j = 0; j < SHA512_MB_LANES; j++) {
+			mb_lane_t *ln = &lanes[j];
+
+			if (ln->job < 0)
+				blk[j] = dummy;
+			else if (ln->nblks > 0)
+				blk[j] = ln->data;
+			else
+				blk[j] = ln->tail + ln->tpos;
+		}
+		sha512_avx2_x4(state, blk);
+
+		for (j = 0; j < SHA512_MB_LANES; j++) {
+			mb_lane_t *ln = &lanes[j];
+
+			if (ln->job < 0)
+				continue;
+			if (ln->nblks > 0) {
+				ln->data += SHA512_BLOCK_SIZE;
+				ln->nblks--;
+				continue;
+			}
+			ln->tpos += SHA512_BLOCK_SIZE;
+			if (--ln->ntail > 0)
+				continue;
+
+			/*
+			 * Message done. Emit digest and refill the lane.
+			 */
+			for (i = 0; i < hashWords; i++) {
+				uint64_t w = BYTESWAP64(state[i][j]);
+				memcpy(hash[ln->job] + i * 8, &w, 8);
+			}
+			if (next < n) {
+				_mb_lane_load(ln, data[next], len[next], next);
+				for (i = 0; i < SHA512_HASH_WORDS; i++)
+					state[i][j] = iv[i];
+				next++;
+			} else {
+				ln->job = -1;
+				active--;
+			}
+		}
+	}
+}
+
+void
+APS_NAMESPACE(SHA512_mb) (uint8_t *hash[], const uint8_t *data[], const uint64_t len[], int n)
+{
+	int i;
+
+	if (sha512_mb_avx2 && n > 1) {
+		_mb_hash(hash, data, len, n, iv512, SHA512_HASH_WORDS);
+	} else {
+		SHA512_Context sc;
+
+		for (i = 0; i < n; i++) {
+			APS_NAMESPACE(SHA512_Init) (&sc);
+			APS_NAMESPACE(SHA512_Update) (&sc, data[i], len[i]);
+			APS_NAMESPACE(SHA512_Final) (&sc, hash[i]);
+		}
+	}
+}
+
+void
+APS_NAMESPACE(SHA512t256_mb) (uint8_t *hash[], const uint8_t *data[], const uint64_t len[], int n)
+{
+	int i;
+
+	if (sha512_mb_avx2 && n > 1) {
+		_mb_hash(hash, data, len, n, iv256, SHA512t256_HASH_WORDS);
+	} else {
+		SHA512_Context sc;
+
+		for (i = 0; i < n; i++) {
+			APS_NAMESPACE(SHA512t256_Init) (&sc);
+			APS_NAMESPACE(SHA512t256_Update) (&sc, data[i], len[i]);
+			APS_NAMESPACE(SHA512t256_Final) (&sc, hash[i]);
+		}
+	}
+}
+
 #define HASH_CONTEXT SHA512_Context
 #define HASH_INIT APS_NAMESPACE(SHA512_Init)
 #define HASH_UPDATE APS_NAMESPACE(SHA512_Update)
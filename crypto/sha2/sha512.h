@@ -71,6 +71,9 @@
 #define SHA512_HASH_WORDS 8
 #define SHA512t256_HASH_WORDS 4
 
+/* Number of independent messages hashed together by the multi-buffer code */
+#define SHA512_MB_LANES 4
+
 typedef struct _SHA512_Context {
   uint64_t totalLength[2], blocks;
   uint64_t hash[SHA512_HASH_WORDS];
@@ -105,6 +108,13 @@ void APS_NAMESPACE(SHA512t256_Init) (SHA512_Context *sc);
 void APS_NAMESPACE(SHA512t256_Update) (SHA512_Context *sc, const void *data, size_t len);
 void APS_NAMESPACE(SHA512t256_Final) (SHA512_Context *sc, uint8_t hash[SHA512t256_HASH_SIZE]);
 
+/*
+ * Multi-buffer one-shot hashing of n independent buffers. Digests are
+ * identical to the ones produced by the Init/Update/Final sequence.
+ */
+void APS_NAMESPACE(SHA512_mb) (uint8_t *hash[], const uint8_t *data[], const uint64_t len[], int n);
+void APS_NAMESPACE(SHA512t256_mb) (uint8_t *hash[], const uint8_t *data[], const uint64_t len[], int n);
+
 void APS_NAMESPACE(HMAC_SHA512_Init) (HMAC_SHA512_Context *ctxt, const void *key, size_t keyLen);
 void APS_NAMESPACE(HMAC_SHA512_Update) (HMAC_SHA512_Context *ctxt, const void *data, size_t len);
 void APS_NAMESPACE(HMAC_SHA512_Final) (HMAC_SHA512_Context *ctxt, uint8_t hmac[SHA512_HASH_SIZE]);
@@ -122,6 +132,12 @@ void APS_NAMESPACE(HMAC_SHA512t256_Final) (HMAC_SHA512_Context *ctxt, uint8_t hm
 extern void sha512_sse4(const void *input_data, void *digest, uint64_t num_blks);
 extern void sha512_avx(const void *input_data, void *digest, uint64_t num_blks);
 
+/*
+ * AVX2 4-lane block transform used by the multi-buffer routines.
+ */
+extern void sha512_avx2_x4(uint64_t state[SHA512_HASH_WORDS][SHA512_MB_LANES],
+			   const uint8_t *blk[SHA512_MB_LANES]);
+
 #ifdef __cplusplus
 }
 #endif
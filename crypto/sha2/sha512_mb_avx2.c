@@ -0,0 +1,131 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * 4-lane multi-buffer SHA-512 block transform using AVX2. Each 64-bit lane
+ * of a YMM register carries the state of an independent message, so four
+ * unrelated blocks are compressed with a single instruction stream. The lane
+ * scheduling and padding is done by the caller in sha512.c. This file must be
+ * compiled with -mavx2 and is only called when the CPU supports AVX2.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+#include "sha512.h"
+
+static const uint64_t K512[80] __attribute__((aligned(32))) = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+#define	ROTR(x, n)	_mm256_or_si256(_mm256_srli_epi64((x), (n)), \
+				_mm256_slli_epi64((x), 64 - (n)))
+#define	XOR3(a, b, c)	_mm256_xor_si256(_mm256_xor_si256((a), (b)), (c))
+#define	ADD64(a, b)	_mm256_add_epi64((a), (b))
+
+#define	SUM0(x)		XOR3(ROTR(x, 28), ROTR(x, 34), ROTR(x, 39))
+#define	SUM1(x)		XOR3(ROTR(x, 14), ROTR(x, 18), ROTR(x, 41))
+#define	SIG0(x)		XOR3(ROTR(x, 1), ROTR(x, 8), _mm256_srli_epi64((x), 7))
+#define	SIG1(x)		XOR3(ROTR(x, 19), ROTR(x, 61), _mm256_srli_epi64((x), 6))
+#define	CH(e, f, g)	_mm256_xor_si256(_mm256_and_si256((e), (f)), \
+				_mm256_andnot_si256((e), (g)))
+#define	MAJ(a, b, c)	_mm256_or_si256(_mm256_and_si256((a), (b)), \
+				_mm256_and_si256(_mm256_or_si256((a), (b)), (c)))
+
+static inline uint64_t
+load_be64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof (v));
+	return (__builtin_bswap64(v));
+}
+
+/*
+ * Compress one 128-byte block for each of the 4 lanes. State is laid out
+ * word-major: state[i][lane] so that each hash word loads into one vector.
+ */
+void
+sha512_avx2_x4(uint64_t state[SHA512_HASH_WORDS][SHA512_MB_LANES],
+	       const uint8_t *blk[SHA512_MB_LANES])
+{
+	__m256i W[16];
+	__m256i a, b, c, d, e, f, g, h, t1, t2;
+	__m256i s[SHA512_HASH_WORDS];
+	int i;
+
+	for (i = 0; i < SHA512_HASH_WORDS; i++)
+		s[i] = _mm256_loadu_si256((const __m256i *)state[i]);
+	a = s[0]; b = s[1]; c = s[2]; d = s[3];
+	e = s[4]; f = s[5]; g = s[6]; h = s[7];
+
+	for (i = 0; i < 80; i++) {
+		__m256i w;
+
+		if (i < 16) {
+			w = _mm256_set_epi64x(load_be64(blk[3] + i * 8),
+					      load_be64(blk[2] + i * 8),
+					      load_be64(blk[1] + i * 8),
+					      load_be64(blk[0] + i * 8));
+		} else {
+			w = ADD64(ADD64(SIG1(W[(i - 2) & 15]), W[(i - 7) & 15]),
+				ADD64(SIG0(W[(i - 15) & 15]), W[i & 15]));
+		}
+		W[i & 15] = w;
+
+		t1 = ADD64(ADD64(h, SUM1(e)), ADD64(CH(e, f, g),
+		    ADD64(_mm256_set1_epi64x(K512[i]), w)));
+		t2 = ADD64(SUM0(a), MAJ(a, b, c));
+		h = g; g = f; f = e;
+		e = ADD64(d, t1);
+		d = c; c = b; b = a;
+		a = ADD64(t1, t2);
+	}
+
+	s[0] = ADD64(s[0], a); s[1] = ADD64(s[1], b);
+	s[2] = ADD64(s[2], c); s[3] = ADD64(s[3], d);
+	s[4] = ADD64(s[4], e); s[5] = ADD64(s[5], f);
+	s[6] = ADD64(s[6], g); s[7] = ADD64(s[7], h);
+	for (i = 0; i < SHA512_HASH_WORDS; i++)
+		_mm256_storeu_si256((__m256i *)state[i], s[i]);
+}
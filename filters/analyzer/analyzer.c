@@ -22,45 +22,429 @@
  * moinakg@belenix.org, http://moinakg.wordpress.com/
  */
 
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "utils.h"
+#include "allocator.h"
 #include "analyzer.h"
 
 #define	FIFTY_PCT(x)	((((double)x)/10) * 5)
 #define	THIRTY_PCT(x)	((((double)x)/10) * 3)
 #define	TEN_PCT(x)	(((double)x)/10)
 
+/*
+ * The buffer is processed in blocks of this size. Each block is fingerprinted
+ * to detect exact repeats.
+ */
+#define	ANALYZE_BLK		512
+#define	ANALYZE_DUP_TAB_MAX	(1 << 16)
+#define	ANALYZE_FP_PRIME	0x9E3779B97F4A7C15ULL
+
+/*
+ * Byte counts are kept in 32-bit counters that are folded into the totals
+ * after every segment of this size.
+ */
+#define	ANALYZE_SEG		(1ULL << 30)
+
+/*
+ * Sampling parameters for stride detection. Only runs of this many bytes or
+ * more with a constant difference are considered, like Delta2.
+ */
+#define	DELTA_SAMPLE_BLK	4096
+#define	DELTA_SAMPLES		64
+#define	DELTA_MIN_RUN		64
+#define	DELTA_MIN_STRIDE	2
+#define	DELTA_MAX_STRIDE	8
+
+/*
+ * Transpose stride detection uses the same sample blocks. A stride is only
+ * chosen if grouping bytes by their position within the record lowers the
+ * average order-0 entropy by at least this many bits per byte.
+ */
+#define	TRANSP_MIN_GAIN		0.5
+#define	TRANSP_MAX_STRIDE	8
+
+/*
+ * Count closing tags of the form '</' and '/>' around a '/' at pos. Spaces in
+ * between are ignored.
+ */
+static inline uint64_t
+count_close_tag(uchar_t *src, uint64_t srclen, uint64_t pos)
+{
+	uint64_t j, n;
+
+	n = 0;
+	j = pos;
+	while (j > 0 && src[j - 1] == ' ')
+		j--;
+	n += (j > 0 && src[j - 1] == '<');
+	j = pos + 1;
+	while (j < srclen && src[j] == ' ')
+		j++;
+	n += (j < srclen && src[j] == '>');
+	return (n);
+}
+
+/*
+ * Scan a region for '/' bytes and count the closing tags around them.
+ */
+static uint64_t
+scan_close_tags(uchar_t *src, uint64_t srclen, uint64_t start, uint64_t end)
+{
+	uint64_t i, n;
+
+	n = 0;
+	i = start;
+#ifdef __SSE2__
+	{
+		__m128i slash = _mm_set1_epi8('/');
+
+		for (; i + 16 <= end; i += 16) {
+			__m128i v = _mm_loadu_si128((__m128i *)(src + i));
+			unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, slash));
+
+			while (m) {
+				n += count_close_tag(src, srclen, i + __builtin_ctz(m));
+				m &= m - 1;
+			}
+		}
+	}
+#endif
+	for (; i < end; i++) {
+		if (src[i] == '/')
+			n += count_close_tag(src, srclen, i);
+	}
+	return (n);
+}
+
+/*
+ * Check whether a sample of the buffer has long runs of values with a
+ * constant difference at any stride. This includes runs of repeating values
+ * since Delta2 encodes those as well. At least 1% of the sampled data must be
+ * in such runs at one stride. The scan stops as soon as one stride gets there.
+ */
+static int
+find_delta_runs(uchar_t *src, uint64_t srclen)
+{
+	uint64_t nblks, step, b, score[DELTA_MAX_STRIDE + 1], need;
+	int st;
+
+	nblks = srclen / DELTA_SAMPLE_BLK;
+	if (nblks == 0)
+		return (0);
+	step = nblks / DELTA_SAMPLES;
+	if (step == 0)
+		step = 1;
+
+	need = ((nblks + step - 1) / step) * DELTA_SAMPLE_BLK / 100;
+	memset(score, 0, sizeof (score));
+	for (b = 0; b < nblks; b += step) {
+		uchar_t *blk = src + b * DELTA_SAMPLE_BLK;
+
+		for (st = DELTA_MIN_STRIDE; st <= DELTA_MAX_STRIDE; st++) {
+			uint64_t mask, v, prev, d, pd, run, pos;
+
+			mask = (st == 8) ? ~0ULL : ((1ULL << (st << 3)) - 1);
+			prev = 0;
+			pd = 0;
+			run = 0;
+			for (pos = 0; pos + sizeof (uint64_t) <= DELTA_SAMPLE_BLK; pos += st) {
+				v = LE64(U64_P(blk + pos)) & mask;
+				d = v - prev;
+				if (d == pd) {
+					run += st;
+				} else {
+					if (run >= DELTA_MIN_RUN)
+						score[st] += run;
+					run = 0;
+				}
+				pd = d;
+				prev = v;
+			}
+			if (run >= DELTA_MIN_RUN)
+				score[st] += run;
+			if (score[st] > need)
+				return (1);
+		}
+	}
+	return (0);
+}
+
+static double
+hist_entropy(uint64_t *cnt, uint64_t tot)
+{
+	double ent, p;
+	int j;
+
+	ent = 0;
+	for (j = 0; j < 256; j++) {
+		if (cnt[j]) {
+			p = (double)cnt[j] / tot;
+			ent -= p * log2(p);
+		}
+	}
+	return (ent);
+}
+
+/*
+ * Entropy of the bytes at offset k within records of the given stride. The
+ * 8 sampled columns are folded together for the narrower strides.
+ */
+static double
+column_entropy(uint64_t col[][256], int stride, int k, uint64_t tot)
+{
+	uint64_t cnt[256];
+	int c, j;
+
+	memset(cnt, 0, sizeof (cnt));
+	for (c = k; c < TRANSP_MAX_STRIDE; c += stride) {
+		for (j = 0; j < 256; j++)
+			cnt[j] += col[c][j];
+	}
+	return (hist_entropy(cnt, tot / stride));
+}
+
+/*
+ * Average information shared by adjacent bytes within a record. Records
+ * like decimal values stored as doubles have bytes that depend strongly on
+ * each other. A transpose separates those bytes and hurts compression.
+ */
+static double
+record_mutual_info(uchar_t *src, uint64_t nblks, uint64_t step, uint64_t col[][256],
+    int stride, uint64_t tot)
+{
+	uint32_t *pairs;
+	uint64_t b, pos, n;
+	double mi, hp, p;
+	int k, j;
+
+	pairs = (uint32_t *)slab_calloc(NULL, 65536, sizeof (uint32_t));
+	if (pairs == NULL)
+		return (0);
+
+	n = tot / stride;
+	mi = 0;
+	for (k = 1; k < stride; k++) {
+		for (b = 0; b < nblks; b += step) {
+			uchar_t *blk = src + b * DELTA_SAMPLE_BLK;
+
+			for (pos = 0; pos < DELTA_SAMPLE_BLK; pos += stride)
+				pairs[((uint32_t)blk[pos + k - 1] << 8) | blk[pos + k]]++;
+		}
+		hp = 0;
+		for (j = 0; j < 65536; j++) {
+			if (pairs[j]) {
+				p = (double)pairs[j] / n;
+				hp -= p * log2(p);
+			}
+		}
+		mi += column_entropy(col, stride, k - 1, tot) +
+		    column_entropy(col, stride, k, tot) - hp;
+		memset(pairs, 0, 65536 * sizeof (uint32_t));
+	}
+	slab_free(NULL, pairs);
+	return (mi / (stride - 1));
+}
+
+/*
+ * Look for fixed width records of 2, 4 or 8 bytes in a sample of the buffer.
+ * Bytes are counted by their offset within an 8-byte word. The narrower
+ * strides fold these columns together. If the bytes at each record offset
+ * have a much narrower distribution than the data as a whole, grouping them
+ * by a transpose gives the compressor longer runs of similar bytes.
+ */
+static int
+find_transpose_stride(uchar_t *src, uint64_t srclen)
+{
+	uint64_t nblks, step, b, pos, tot;
+	uint64_t col[TRANSP_MAX_STRIDE][256], cnt[256];
+	double all, ent, gain, best, best_gain;
+	int st, k, j, stride;
+
+	nblks = srclen / DELTA_SAMPLE_BLK;
+	if (nblks == 0)
+		return (0);
+	step = nblks / DELTA_SAMPLES;
+	if (step == 0)
+		step = 1;
+
+	memset(col, 0, sizeof (col));
+	tot = 0;
+	for (b = 0; b < nblks; b += step) {
+		uchar_t *blk = src + b * DELTA_SAMPLE_BLK;
+
+		for (pos = 0; pos < DELTA_SAMPLE_BLK; pos += TRANSP_MAX_STRIDE) {
+			for (k = 0; k < TRANSP_MAX_STRIDE; k++)
+				col[k][blk[pos + k]]++;
+		}
+		tot += DELTA_SAMPLE_BLK;
+	}
+
+	memset(cnt, 0, sizeof (cnt));
+	for (k = 0; k < TRANSP_MAX_STRIDE; k++) {
+		for (j = 0; j < 256; j++)
+			cnt[j] += col[k][j];
+	}
+	all = hist_entropy(cnt, tot);
+
+	/*
+	 * A wider stride must do noticeably better to be preferred, since
+	 * splitting into more columns always lowers the sampled entropy a bit.
+	 */
+	stride = 0;
+	best = TRANSP_MIN_GAIN;
+	best_gain = 0;
+	for (st = 2; st <= TRANSP_MAX_STRIDE; st <<= 1) {
+		ent = 0;
+		for (k = 0; k < st; k++)
+			ent += column_entropy(col, st, k, tot);
+		gain = all - ent / st;
+		if (gain > best) {
+			best = gain + TRANSP_MIN_GAIN / 4;
+			best_gain = gain;
+			stride = st;
+		}
+	}
+
+	if (stride > 0 && record_mutual_info(src, nblks, step, col, stride, tot) >= best_gain)
+		stride = 0;
+	return (stride);
+}
+
+/*
+ * Single pass analysis of the buffer. Byte frequencies are gathered in four
+ * interleaved tables to avoid stalls on repeated bytes. All the byte class
+ * counts used by the type heuristics and the entropy are derived from these.
+ * Each block is also checked for zero words and closing tags and
+ * fingerprinted for repeat detection while it is in cache.
+ *
+ * The histogram is kept scalar. SSE2 and AVX2 have no scatter or conflict
+ * detection, so vector loads only add lane extracts in front of the same
+ * table updates, which is slower than these interleaved tables.
+ */
 void
 analyze_buffer(void *src, uint64_t srclen, analyzer_ctx_t *actx)
 {
 	uchar_t *src1 = (uchar_t *)src;
-	uint64_t i, tot8b, tot_8b, lbytes, spc;
-	uchar_t cur_byte, prev_byte;
+	uint64_t i, j, tot8b, tot_8b, lbytes, spc, zbytes, seg;
 	uint64_t tag1, tag2, tag3;
+	uint64_t cnt[256], *fptab, tabsz, nfp, ndup, nblks;
+	uint32_t c[4][256];
 	double tagcnt, pct_tag;
 
+	memset(actx, 0, sizeof (analyzer_ctx_t));
+	memset(cnt, 0, sizeof (cnt));
+	memset(c, 0, sizeof (c));
+	zbytes = 0;
+	tag3 = 0;
+	nfp = 0;
+	ndup = 0;
+
+	nblks = srclen / ANALYZE_BLK;
+	tabsz = 0;
+	fptab = NULL;
+	if (nblks > 1) {
+		tabsz = 2;
+		while (tabsz < nblks * 2 && tabsz < ANALYZE_DUP_TAB_MAX)
+			tabsz <<= 1;
+		fptab = (uint64_t *)slab_calloc(NULL, tabsz, sizeof (uint64_t));
+	}
+
+	seg = 0;
+	for (i = 0; i + ANALYZE_BLK <= srclen; i += ANALYZE_BLK) {
+		uchar_t *blk = src1 + i;
+		uint64_t h1, h2, zw;
+
+		h1 = 0;
+		h2 = 0;
+		zw = 0;
+		for (j = 0; j < ANALYZE_BLK; j += 16) {
+			uint64_t w1 = U64_P(blk + j);
+			uint64_t w2 = U64_P(blk + j + 8);
+
+			c[0][w1 & 0xff]++;
+			c[1][(w1 >> 8) & 0xff]++;
+			c[2][(w1 >> 16) & 0xff]++;
+			c[3][(w1 >> 24) & 0xff]++;
+			c[0][(w1 >> 32) & 0xff]++;
+			c[1][(w1 >> 40) & 0xff]++;
+			c[2][(w1 >> 48) & 0xff]++;
+			c[3][w1 >> 56]++;
+			c[0][w2 & 0xff]++;
+			c[1][(w2 >> 8) & 0xff]++;
+			c[2][(w2 >> 16) & 0xff]++;
+			c[3][(w2 >> 24) & 0xff]++;
+			c[0][(w2 >> 32) & 0xff]++;
+			c[1][(w2 >> 40) & 0xff]++;
+			c[2][(w2 >> 48) & 0xff]++;
+			c[3][w2 >> 56]++;
+			zw += (w1 == 0) + (w2 == 0);
+			h1 = (h1 ^ w1) * ANALYZE_FP_PRIME;
+			h2 = (h2 ^ w2) * ANALYZE_FP_PRIME;
+		}
+		zbytes += zw * sizeof (uint64_t);
+		tag3 += scan_close_tags(src1, srclen, i, i + ANALYZE_BLK);
+
+		/*
+		 * All zero blocks are accounted for in zero_frac.
+		 */
+		if (fptab && zw < ANALYZE_BLK / sizeof (uint64_t)) {
+			uint64_t fp, slot;
+
+			fp = (h1 ^ (h2 >> 29) ^ (h2 << 35)) | 1;
+			slot = (fp >> 16) & (tabsz - 1);
+			while (fptab[slot] != 0 && fptab[slot] != fp)
+				slot = (slot + 1) & (tabsz - 1);
+			if (fptab[slot] == fp) {
+				ndup++;
+			} else if (nfp < (tabsz >> 1)) {
+				fptab[slot] = fp;
+			}
+			nfp++;
+		}
+
+		seg += ANALYZE_BLK;
+		if (seg >= ANALYZE_SEG) {
+			for (j = 0; j < 256; j++) {
+				cnt[j] += (uint64_t)c[0][j] + c[1][j] + c[2][j] + c[3][j];
+			}
+			memset(c, 0, sizeof (c));
+			seg = 0;
+		}
+	}
+	for (j = 0; j < 256; j++) {
+		cnt[j] += (uint64_t)c[0][j] + c[1][j] + c[2][j] + c[3][j];
+	}
+	for (; i < srclen; i++)
+		cnt[src1[i]]++;
+	tag3 += scan_close_tags(src1, srclen, srclen - (srclen % ANALYZE_BLK), srclen);
+	if (fptab)
+		slab_free(NULL, fptab);
+
 	/*
 	 * Count number of 8-bit binary bytes and XML tags in source.
 	 */
 	tot8b = 0;
-	tag1 = 0;
-	tag2 = 0;
-	tag3 = 0;
 	lbytes = 0;
-	spc = 0;
-	prev_byte = cur_byte = 0;
-	memset(actx, 0, sizeof (analyzer_ctx_t));
-	for (i = 0; i < srclen; i++) {
-		cur_byte = src1[i];
-		tot8b += (cur_byte > 127);
-		lbytes += (cur_byte < 32);
-		spc += (cur_byte == ' ');
-		tag1 += (cur_byte == '<');
-		tag2 += (cur_byte == '>');
-		tag3 += ((prev_byte == '<') & (cur_byte == '/'));
-		tag3 += ((prev_byte == '/') & (cur_byte == '>'));
-		if (cur_byte != ' ')
-			prev_byte = cur_byte;
+	for (j = 0; j < 256; j++) {
+		if (j < 32)
+			lbytes += cnt[j];
+		else if (j > 127)
+			tot8b += cnt[j];
+	}
+	spc = cnt[' '];
+	tag1 = cnt['<'];
+	tag2 = cnt['>'];
+	if (srclen > 0) {
+		actx->entropy = hist_entropy(cnt, srclen);
+		actx->zero_frac = (double)zbytes / srclen;
 	}
+	if (nfp > 0)
+		actx->dup_frac = (double)ndup / nfp;
+	actx->delta_runs = find_delta_runs(src1, srclen);
+	actx->transpose_stride = find_transpose_stride(src1, srclen);
 
 	/*
 	 * Heuristics for detecting BINARY vs generic TEXT vs XML data at various
@@ -108,18 +492,30 @@ analyze_buffer_simple(void *src, uint64_t srclen)
 	 */
 	tot8b = 0;
 	lbytes = 0;
-	for (i = 0; i < srclen; i++) {
+	i = 0;
+#ifdef __SSE2__
+	{
+		__m128i hi3 = _mm_set1_epi8((char)0xE0), zero = _mm_setzero_si128();
+
+		for (; i + 16 <= srclen; i += 16) {
+			__m128i v = _mm_loadu_si128((__m128i *)(src1 + i));
+
+			tot8b += __builtin_popcount(_mm_movemask_epi8(v));
+			lbytes += __builtin_popcount(_mm_movemask_epi8(
+			    _mm_cmpeq_epi8(_mm_and_si128(v, hi3), zero)));
+		}
+	}
+#endif
+	for (; i < srclen; i++) {
 		cur_byte = src1[i];
-		tot8b += (cur_byte & 0x80); // This way for possible auto-vectorization
+		tot8b += (cur_byte >> 7);
 		lbytes += (cur_byte < 32);
 	}
 	/*
 	 * Heuristics for detecting BINARY vs generic TEXT
 	 */
-	tot8b /= 0x80;
 	if (tot8b <= TEN_PCT((double)srclen) && lbytes < ((srclen>>1) + (srclen>>2) + (srclen>>3))) {
 		btype = TYPE_TEXT;
 	}
 	return (btype);
 }
-
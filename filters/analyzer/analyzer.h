@@ -33,10 +33,30 @@ struct significance_value {
 	int btype;
 };
 
+/*
+ * Besides the type classification the analyzer also gathers some statistics
+ * in the same pass, and looks at a sample of the buffer for hints used by the
+ * preprocessing stages.
+ *
+ * entropy:      Order-0 entropy in bits per byte.
+ * zero_frac:    Fraction of bytes that are part of 8-byte aligned zero words.
+ * dup_frac:     Fraction of non-zero 512-byte blocks that exactly repeat an
+ *               earlier block. An indication of how much Dedupe can find.
+ * delta_runs:   Non-zero if a sample of the buffer has long arithmetic
+ *               sequences, as seen by Delta2, at a stride of 2 to 8 bytes.
+ * transpose_stride: Record width of 2, 4 or 8 bytes if the bytes at each
+ *               offset within a record are much more alike than the data as
+ *               a whole. Zero if none.
+ */
 typedef struct _analyzer_ctx {
 	struct significance_value ten_pct;
 	struct significance_value thirty_pct;
 	struct significance_value fifty_pct;
+	double entropy;
+	double zero_frac;
+	double dup_frac;
+	int delta_runs;
+	int transpose_stride;
 } analyzer_ctx_t;
 
 void analyze_buffer(void *src, uint64_t srclen, analyzer_ctx_t *actx);
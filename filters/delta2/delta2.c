@@ -32,6 +32,9 @@
  * reduction. A span length threshold in bytes is used. Byte spans
  * less than this threshold are ignored.
  * Bytes are packed into integers in little-endian format.
+ * For each stride the positions where the delta between consecutive
+ * values changes are first located, using AVX2 when available. Both the
+ * estimate and the encoding then only walk over these positions.
  *
  * After an optimal stride length has been identified the encoder
  * performs a delta run length encoding on the spans. Two types of
@@ -58,6 +61,10 @@
 #include <transpose.h>
 #include "delta2.h"
 
+#if defined(__USE_SSE_INTRIN__) && defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 // Size of original data. 64 bits.
 #define	MAIN_HDR	(sizeof (uint64_t))
 
@@ -216,6 +223,208 @@ delta2_encode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen,
 	return (0);
 }
 
+/*
+ * Upto this many values are examined per block, for the smallest stride.
+ * A bitmap with one bit per value marks the values where the delta from the
+ * previous value changes, which is where a new run starts. Both the stride
+ * estimation and the actual encoding only need to look at these positions.
+ */
+#define	MAX_VALS	(DELTA2_CHUNK / STRIDE_MIN)
+#define	BREAK_WORDS	((MAX_VALS + 63) / 64)
+
+static inline uint64_t
+stride_mask(int stride)
+{
+	uint64_t val;
+
+	val = stride;
+	val = ((val << 3) - 1);
+	val = (1ULL << val);
+	val |= (val - 1);
+	return (val);
+}
+
+/*
+ * Value at index k, with the values before the start of the block being 0.
+ */
+static inline uint64_t
+stride_val(uchar_t *src, int64_t k, int stride, uint64_t mask)
+{
+	if (k < 0)
+		return (0);
+	return (LE64(U64_P(src + k * stride)) & mask);
+}
+
+/*
+ * Compute the bitmap of delta changes for nvals values of the given stride.
+ * Values are first unpacked into 64-bit integers so that the deltas of all
+ * strides can then be compared 4 at a time.
+ */
+static void
+delta2_breaks(uchar_t *src, uint64_t nvals, int stride, uint64_t *bits)
+{
+	uint64_t vals[MAX_VALS + 2], *v, mask;
+	uint64_t k;
+
+	mask = stride_mask(stride);
+	vals[0] = 0;
+	vals[1] = 0;
+	v = vals + 2;
+	k = 0;
+#if defined(__USE_SSE_INTRIN__) && defined(__AVX2__)
+	if (stride == 2) {
+		for (; k + 4 <= nvals; k += 4) {
+			__m128i w = _mm_loadl_epi64((__m128i *)(src + k * 2));
+			_mm256_storeu_si256((__m256i *)(v + k), _mm256_cvtepu16_epi64(w));
+		}
+	} else if (stride == 4) {
+		for (; k + 4 <= nvals; k += 4) {
+			__m128i w = _mm_loadu_si128((__m128i *)(src + k * 4));
+			_mm256_storeu_si256((__m256i *)(v + k), _mm256_cvtepu32_epi64(w));
+		}
+	} else if (stride == 8) {
+		for (; k + 4 <= nvals; k += 4) {
+			__m256i w = _mm256_loadu_si256((__m256i *)(src + k * 8));
+			_mm256_storeu_si256((__m256i *)(v + k), w);
+		}
+	} else {
+		__m256i idx, inc, m;
+
+		idx = _mm256_setr_epi64x(0, stride, stride * 2, stride * 3);
+		inc = _mm256_set1_epi64x(stride * 4);
+		m = _mm256_set1_epi64x(mask);
+		for (; k + 4 <= nvals; k += 4) {
+			__m256i w = _mm256_i64gather_epi64((const long long *)src, idx, 1);
+			_mm256_storeu_si256((__m256i *)(v + k), _mm256_and_si256(w, m));
+			idx = _mm256_add_epi64(idx, inc);
+		}
+	}
+#endif
+	for (; k < nvals; k++)
+		v[k] = LE64(U64_P(src + k * stride)) & mask;
+
+	memset(bits, 0, ((nvals + 63) / 64) * sizeof (uint64_t));
+	k = 0;
+#if defined(__USE_SSE_INTRIN__) && defined(__AVX2__)
+	for (; k + 4 <= nvals; k += 4) {
+		__m256i v0, v1, v2, eq;
+		uint64_t ne;
+
+		v2 = _mm256_loadu_si256((__m256i *)(v + k));
+		v1 = _mm256_loadu_si256((__m256i *)(v + k - 1));
+		v0 = _mm256_loadu_si256((__m256i *)(v + k - 2));
+		eq = _mm256_cmpeq_epi64(_mm256_sub_epi64(v2, v1), _mm256_sub_epi64(v1, v0));
+		ne = (~_mm256_movemask_pd(_mm256_castsi256_pd(eq))) & 0xf;
+		bits[k >> 6] |= ne << (k & 63);
+	}
+#endif
+	for (; k < nvals; k++) {
+		uint64_t ne = ((v[k] - v[k - 1]) != (v[k - 1] - v[k - 2]));
+		bits[k >> 6] |= ne << (k & 63);
+	}
+}
+
+/*
+ * Estimate the encoded size of a block from its bitmap of delta changes.
+ * Runs that exceed rle_thresh become delta runs, everything else literals.
+ * A run of consecutive changes can never be a delta run, so full words of
+ * changes, typical for non-tabular data, are accounted in one step.
+ * Also returns the next scan point if the block ends within a table and the
+ * pending literal count, as needed by the caller.
+ */
+static uint64_t
+delta2_cost(uint64_t *bits, uint64_t nvals, int stride, int rle_thresh,
+	    uint64_t *nextval, uint64_t *pending)
+{
+	uint64_t gtot, tot, last, snum, b, w, nwords, i;
+
+	gtot = LIT_HDR;
+	tot = 0;
+	last = 0;
+	nwords = (nvals + 63) / 64;
+	for (i = 0; i < nwords; i++) {
+		w = bits[i];
+		if (w == ~0ULL && (last + 1 == i * 64 || (last == 0 && i == 0))) {
+			snum = (i * 64 + 63 - last) * stride;
+			gtot += snum;
+			tot += snum;
+			last = i * 64 + 63;
+			continue;
+		}
+		while (w) {
+			b = i * 64 + __builtin_ctzll(w);
+			w &= (w - 1);
+			snum = (b - last) * stride;
+			if (snum > rle_thresh) {
+				gtot += (LIT_HDR * (tot > 0));
+				tot = 0;
+				gtot += DELTA_HDR;
+			} else {
+				gtot += snum;
+				tot += snum;
+			}
+			last = b;
+		}
+	}
+
+	*nextval = 0;
+	snum = (nvals - last) * stride;
+	if (snum > rle_thresh) {
+		gtot += DELTA_HDR;
+		/*
+		 * If this ended into another table reset next scan
+		 * point to beginning of the table.
+		 */
+		*nextval = nvals * stride - snum;
+	} else {
+		gtot += snum;
+		/*
+		 * If this ended into another table reset next scan
+		 * point to beginning of the table.
+		 */
+		if (snum >= (MIN_THRESH>>1))
+			*nextval = nvals * stride - snum;
+	}
+	*pending = tot;
+	return (gtot);
+}
+
+/*
+ * Emit a pending literal run followed by a delta run.
+ */
+static uchar_t *
+delta2_emit(uchar_t *pos2, uchar_t *lit, uint64_t litlen, int stride, uint64_t snum,
+	    uint64_t sval, uint64_t delta, int *hdr_ovr)
+{
+	uint64_t hdr;
+
+	if (litlen > 0) {
+		litlen &= MSB_SETZERO_MASK;
+		U64_P(pos2) = LE64(litlen);
+		pos2 += sizeof (uint64_t);
+		DEBUG_STAT_EN(*hdr_ovr += LIT_HDR);
+		memcpy(pos2, lit, litlen);
+		pos2 += litlen;
+	}
+
+	/*
+	 * RLE Encode delta series. Store total number of bytes,
+	 * stride length, starting value and difference between
+	 * the terms.
+	 */
+	hdr = stride;
+	hdr <<= MSB_SHIFT;
+	hdr |= (snum & MSB_SETZERO_MASK);
+	U64_P(pos2) = LE64(hdr);
+	pos2 += sizeof (uint64_t);
+	U64_P(pos2) = LE64(sval);
+	pos2 += sizeof (uint64_t);
+	U64_P(pos2) = LE64(delta);
+	pos2 += sizeof (uint64_t);
+	DEBUG_STAT_EN(*hdr_ovr += DELTA_HDR);
+	return (pos2);
+}
+
 /*
  * Process one block of data upto 4K in size.
  */
@@ -223,77 +432,33 @@ static int
 delta2_encode_real(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen,
 		   int rle_thresh, int last_encode, int *hdr_ovr, int nstrides)
 {
-	uint64_t snum, gtot1, gtot2, tot;
-	uint64_t cnt, val, sval;
-	uint64_t vl1, vl2, vld1, vld2;
+	uint64_t bits[NSTRIDES][BREAK_WORDS];
+	uint64_t gtot1, gtot2, tot, val, nextval, snum, nvals, mask;
+	uint64_t b, w, i, last, nwords;
 	uchar_t *pos, *pos2, stride, st1;
-	int st;
+	int st, sti;
 
 	assert(srclen == *dstlen);
 	gtot1 = ULL_MAX;
 	stride = 0;
+	sti = 0;
 	tot = 0;
 
 	/*
 	 * Estimate which stride length gives the max reduction given rle_thresh.
 	 */
 	for (st = 0; st < nstrides; st++) {
-		int gt;
-
-		snum = 0;
-		gtot2 = LIT_HDR;
-		vl1 = 0;
-		vld1 = 0;
-		tot = 0;
-		pos = src;
 		st1 = strides[st];
-		sval = st1;
-		sval = ((sval << 3) - 1);
-		sval = (1ULL << sval);
-		sval |= (sval - 1);
-		val = 0;
-		for (cnt = 0; cnt < (srclen - sizeof (cnt)); cnt += st1) {
-			vl2 = U64_P(pos);
-			vl2 = LE64(vl2);
-			vl2 &= sval;
-			vld2 = vl2 - vl1;
-			if (vld1 != vld2) {
-				if (snum > rle_thresh) {
-					gt = (tot > 0);
-					gtot2 += (LIT_HDR * gt);
-					tot = 0;
-					gtot2 += DELTA_HDR;
-				} else {
-					gtot2 += snum;
-					tot += snum;
-				}
-				snum = 0;
-			}
-			snum += st1;
-			vld1 = vld2;
-			vl1 = vl2;
-			pos += st1;
-		}
-		if (snum > rle_thresh) {
-			gtot2 += DELTA_HDR;
-			/*
-			 * If this ended into another table reset next scan
-			 * point to beginning of the table.
-			 */
-			val = cnt - snum;
-		} else {
-			gtot2 += snum;
-			/*
-			 * If this ended into another table reset next scan
-			 * point to beginning of the table.
-			 */
-			if (snum >= (MIN_THRESH>>1))
-				val = cnt - snum;
-		}
+		nvals = 0;
+		if (srclen > sizeof (uint64_t))
+			nvals = (srclen - sizeof (uint64_t) + st1 - 1) / st1;
+		delta2_breaks(src, nvals, st1, bits[st]);
+		gtot2 = delta2_cost(bits[st], nvals, st1, rle_thresh, &nextval, &tot);
 		if (gtot2 < gtot1) {
 			gtot1 = gtot2;
 			stride = st1;
-			tot = val;
+			sti = st;
+			tot = nextval;
 		}
 	}
 
@@ -310,97 +475,55 @@ delta2_encode_real(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen
 	}
 
 	/*
-	 * Now perform encoding using the stride length.
+	 * Now perform encoding using the stride length. Only the runs that
+	 * end at a delta change need to be looked at, gtot1 accumulates the
+	 * literal bytes in between.
 	 */
-	snum = 0;
-	vl1 = 0;
-	vld1 = 0;
+	nvals = 0;
+	if (srclen > sizeof (uint64_t))
+		nvals = (srclen - sizeof (uint64_t) + stride - 1) / stride;
+	nwords = (nvals + 63) / 64;
+	mask = stride_mask(stride);
 	gtot1 = 0;
-	pos = src;
+	last = 0;
 	pos2 = dst;
 
-	vl2 = U64_P(pos);
-	vl2 = LE64(vl2);
-	val = stride;
-	val = ((val << 3) - 1);
-	val = (1ULL << val);
-	val |= (val - 1);
-	vl2 &= val;
-	sval = vl2;
-
-	for (cnt = 0; cnt < (srclen - sizeof (cnt)); cnt += stride) {
-		vl2 = U64_P(pos);
-		vl2 = LE64(vl2);
-		vl2 &= val;
-		vld2 = vl2 - vl1;
-		if (vld1 != vld2) {
+	for (i = 0; i < nwords; i++) {
+		w = bits[sti][i];
+		while (w) {
+			b = i * 64 + __builtin_ctzll(w);
+			w &= (w - 1);
+			snum = (b - last) * stride;
 			if (snum > rle_thresh) {
 				/*
-				 * We have a series but there is some pending literal data
-				 * to be copied before the series begins. First copy that
-				 * as a literal sequence.
+				 * We have a series but there may be some pending literal
+				 * data to be copied before the series begins.
 				 */
-				if (gtot1 > 0) {
-					gtot1 &= MSB_SETZERO_MASK;
-					U64_P(pos2) = LE64(gtot1);
-					pos2 += sizeof (uint64_t);
-					DEBUG_STAT_EN(*hdr_ovr += LIT_HDR);
-					memcpy(pos2, pos - (gtot1+snum), gtot1);
-					pos2 += gtot1;
-					gtot1 = 0;
-				}
-
-				/*
-				 * RLE Encode delta series. Store total number of bytes,
-				 * stride length, starting value and difference between
-				 * the terms.
-				 */
-				gtot2 = stride;
-				gtot2 <<= MSB_SHIFT;
-				gtot2 |= (snum & MSB_SETZERO_MASK);
-				U64_P(pos2) = LE64(gtot2);
-				pos2 += sizeof (uint64_t);
-				U64_P(pos2) = LE64(sval);
-				pos2 += sizeof (uint64_t);
-				U64_P(pos2) = LE64(vld1);
-				pos2 += sizeof (uint64_t);
-				DEBUG_STAT_EN(*hdr_ovr += DELTA_HDR);
+				pos = src + b * stride;
+				pos2 = delta2_emit(pos2, pos - (gtot1+snum), gtot1, stride, snum,
+				    stride_val(src, last, stride, mask),
+				    stride_val(src, b - 1, stride, mask) -
+				    stride_val(src, (int64_t)b - 2, stride, mask), hdr_ovr);
+				gtot1 = 0;
 			} else {
 				gtot1 += snum;
 			}
-			snum = 0;
-			sval = vl2;
+			last = b;
 		}
-		snum += stride;
-		vld1 = vld2;
-		vl1 = vl2;
-		pos += stride;
 	}
 
 	/*
 	 * Encode final sequence, if any.
 	 */
+	pos = src + nvals * stride;
+	snum = (nvals - last) * stride;
 	if (snum > 0) {
 		if (snum > rle_thresh) {
-			if (gtot1 > 0) {
-				gtot1 &= MSB_SETZERO_MASK;
-				U64_P(pos2) = LE64(gtot1);
-				pos2 += sizeof (uint64_t);
-				DEBUG_STAT_EN(*hdr_ovr += LIT_HDR);
-				memcpy(pos2, pos - (gtot1+snum), gtot1);
-				pos2 += gtot1;
-				gtot1 = 0;
-			}
-			gtot2 = stride;
-			gtot2 <<= MSB_SHIFT;
-			gtot2 |= (snum & MSB_SETZERO_MASK);
-			U64_P(pos2) = LE64(gtot2);
-			pos2 += sizeof (uint64_t);
-			U64_P(pos2) = LE64(sval);
-			pos2 += sizeof (uint64_t);
-			U64_P(pos2) = LE64(vld1);
-			pos2 += sizeof (uint64_t);
-			DEBUG_STAT_EN(*hdr_ovr += DELTA_HDR);
+			pos2 = delta2_emit(pos2, pos - (gtot1+snum), gtot1, stride, snum,
+			    stride_val(src, last, stride, mask),
+			    stride_val(src, nvals - 1, stride, mask) -
+			    stride_val(src, (int64_t)nvals - 2, stride, mask), hdr_ovr);
+			gtot1 = 0;
 
 		} else if (last_encode) {
 			gtot1 += snum;
@@ -425,10 +548,8 @@ delta2_encode_real(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen
 			val &= MSB_SETZERO_MASK;
 			U64_P(pos2) = LE64(val);
 			pos2 += sizeof (uint64_t);
-			for (cnt = 0; cnt < val; cnt++) {
-				*pos2 = *pos;
-				++pos2; ++pos;
-			}
+			memcpy(pos2, pos, val);
+			pos2 += val;
 			DEBUG_STAT_EN(*hdr_ovr += LIT_HDR);
 		}
 		val = 0;
@@ -507,7 +628,49 @@ delta2_decode(uchar_t *src, uint64_t srclen, uchar_t *dst, uint64_t *dstlen)
 			 * Recover original bytes from the arithmetic series using
 			 * length, starting value and delta.
 			 */
-			for (cnt = 0; cnt < rcnt/stride; cnt++) {
+			cnt = 0;
+#if defined(__USE_SSE_INTRIN__) && defined(__AVX2__)
+			/*
+			 * For power of 2 strides the values are just the low bits of
+			 * the series, so 32 bytes of them can be computed in vector
+			 * lanes of the stride width.
+			 */
+			if (stride == 2 || stride == 4 || stride == 8) {
+				__m256i vals, step;
+				uint64_t nvec;
+
+				if (stride == 2) {
+					vals = _mm256_mullo_epi16(_mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6,
+					    7, 8, 9, 10, 11, 12, 13, 14, 15), _mm256_set1_epi16(delta));
+					vals = _mm256_add_epi16(vals, _mm256_set1_epi16(sval));
+					step = _mm256_set1_epi16(delta << 4);
+				} else if (stride == 4) {
+					vals = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6,
+					    7), _mm256_set1_epi32(delta));
+					vals = _mm256_add_epi32(vals, _mm256_set1_epi32(sval));
+					step = _mm256_set1_epi32(delta << 3);
+				} else {
+					vals = _mm256_setr_epi64x(sval, sval + delta, sval + delta * 2,
+					    sval + delta * 3);
+					step = _mm256_set1_epi64x(delta << 2);
+				}
+				nvec = (rcnt / stride) / (32 / stride);
+				for (; cnt < nvec; cnt++) {
+					_mm256_storeu_si256((__m256i *)pos1, vals);
+					if (stride == 2)
+						vals = _mm256_add_epi16(vals, step);
+					else if (stride == 4)
+						vals = _mm256_add_epi32(vals, step);
+					else
+						vals = _mm256_add_epi64(vals, step);
+					pos1 += 32;
+				}
+				cnt = nvec * (32 / stride);
+				out += cnt * stride;
+				sval += delta * cnt;
+			}
+#endif
+			for (; cnt < rcnt/stride; cnt++) {
 				val = (sval & vl);
 				U64_P(pos1) = LE64(val);
 				out += stride;
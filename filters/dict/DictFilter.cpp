@@ -22,23 +22,24 @@
  * moinakg@gmail.com, http://moinakg.wordpress.com/
  */
 
+
 /*
  * Dictionary preprocessor for text files. It uses some ideas from
  * the following paper:
  * http://pskibinski.pl/papers/05-RevisitingDictCompr.pdf
  *
  * However the implementation here is quite different from that
- * described in the paper. A simple hash table is used for the
- * word dictionary. A min-LRU based aging mechanism is used to evict
- * words with low frequency to make way for newer words. The min-LRU
- * aging kicks in after at least 50% of the data is processed and the
- * hash table is full. The hash table size is derived from the data
- * size.
+ * described in the paper. Words are counted in a flat open-addressed
+ * hash table. Text is split into sub-blocks of about 1MB, always ending
+ * just after a separator character. Words are counted in each sub-block
+ * in parallel and the counts of repeated words from all sub-blocks are
+ * then merged into one table.
  * After scanning the data, words with occurrence X word size less
  * than a threshold are evicted from the final dictionary. The
  * dictionary is then prefixed to the encoded data. The words in the
  * final dictionary are sorted based on occurrence X word size value
- * and then alphabetically.
+ * and then alphabetically. The dictionary size is derived from the
+ * data size.
  *
  * Words are extracted by splitting text on a few separator characters.
  * Proper case capital conversion is done. So the dictionary only
@@ -53,6 +54,10 @@
  * Since words are only encoded on a separator boundary, any lieral
  * prefix characters following a separator boundary are escaped using
  * a back-slash (\).
+ * Sub-blocks are encoded in parallel against the shared dictionary.
+ * Since encoding state resets at every separator, each sub-block is
+ * decodable on its own. A table of encoded and decoded sub-block
+ * lengths lets decoding run in parallel as well.
  *
  * The separators are prefix characters have been exprimentally
  * selected to benefit context based compressors like PPM and Libbsc.
@@ -69,6 +74,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <new>
 #include "DictFilter.h"
 #include "utils.h"
 #include "allocator.h"
@@ -76,35 +82,48 @@
 
 #define	WORD_MIN	3
 #define	WORD_MAX	50
-#define	LIST_LRU_NUM	15
 
-typedef struct dict_entry {
+/*
+ * Sub-block size for parallel word counting and encoding. Word tables are
+ * sized from the data and kept between these slot count limits.
+ */
+#define	DICT_BLOCK_SZ	(1024 * 1024)
+#define	DICT_SLOTS_MIN	1024
+#define	DICT_SLOTS_MAX	(1024 * 1024)
+
+/*
+ * Encoded data type byte.
+ */
+#define	DICT_TYPE_TEXT		0
+#define	DICT_TYPE_FASTA		1
+#define	DICT_TYPE_TEXT_SPLIT	2
+
+typedef struct word_slot {
 	unsigned char *word;
+	uint32_t hash;
+	uint32_t occur;
+	uint32_t indx;
 	unsigned char sz;
 	unsigned char lcfirst;
-	uint32_t indx;
-	uint32_t occur;
-	struct dict_entry *next;
-	struct dict_entry *list_next;
-} dict_entry_t;
-
-typedef struct hash_context_s {
-	dict_entry_t    **dict;
-	uint32_t        dictcount;
-	uint32_t        dictsize;
-	uint32_t        cur_indx;
-	uint32_t        collisions;
-	dict_entry_t    *sentinel;
-} hash_context_t;
-
-typedef struct list_context_s {
-	dict_entry_t    *head;
-	dict_entry_t    *tail;
-	uint32_t        listcount;
-	uint32_t        listsize;
-	uint32_t        aged_entries;
-	uint32_t        aging_requests;
-} list_context_t;
+} word_slot_t;
+
+typedef struct word_table {
+	word_slot_t	*slots;
+	uint32_t	mask;
+	uint32_t	count;
+	uint32_t	limit;
+} word_table_t;
+
+typedef struct dict_block {
+	uint32_t	start;
+	uint32_t	len;
+	uint8_t		*out;
+	uint32_t	outlen;
+	uint32_t	outcap;
+	word_slot_t	*words;
+	uint32_t	nwords;
+	int		rv;
+} dict_block_t;
 
 typedef struct decode_dict_entry_s {
 	uint32_t	sz;
@@ -185,8 +204,8 @@ _zero:
  */
 static int
 cmpoccur(const void *a, const void *b) {
-	dict_entry_t *de1 = *((dict_entry_t **)a);
-	dict_entry_t *de2 = *((dict_entry_t **)b);
+	word_slot_t *de1 = *((word_slot_t **)a);
+	word_slot_t *de2 = *((word_slot_t **)b);
 	uint64_t a1, b1;
 
 	a1 = ((uint64_t)(de1->occur) - 1) * (de1->sz - 1);
@@ -219,8 +238,10 @@ cmpoccur(const void *a, const void *b) {
 class DictFilter
 {
 public:
-	int Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize);
-	int Inverse_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize);
+	int Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize,
+	    int nthreads);
+	int Inverse_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize,
+	    int split, int nthreads);
 
 	int Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize);
 	int Inverse_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize);
@@ -238,21 +259,21 @@ protected:
 	~DictFilter();
 	DictFilter();
 
-	dict_entry_t *find_string(dict_entry_t *de, uint8_t *str, uint32_t sz,
-	    uint8_t lcfirst);
-	void hash_context_init(hash_context_t *hctx, uint32_t dictsize);
-	void hash_context_delete(hash_context_t *hctx);
-	dict_entry_t *hash_lookup(hash_context_t *hctx, uint8_t *word, uint32_t wordsize,
-	    uint8_t lcfirst);
-	dict_entry_t *hash_add(hash_context_t *hctx, uint8_t *word, uint32_t wordsize,
-	    dict_entry_t *_de);
-	dict_entry_t *hash_remove(hash_context_t *hctx, uint8_t *word, uint32_t wordsize,
-	    dict_entry_t *r_de);
-
-	void list_context_init(list_context_t *lctx, uint32_t listsize);
-	void list_context_delete(list_context_t *lctx);
-	dict_entry_t *list_push(list_context_t *lctx, dict_entry_t *de);
-	dict_entry_t *list_pop_lru_min(list_context_t *lctx);
+	void word_table_init(word_table_t *wt, uint64_t nslots);
+	void word_table_delete(word_table_t *wt);
+	uint32_t word_hash(uint8_t *word, uint32_t wordsize, uint8_t lcfirst);
+	word_slot_t *word_find(word_table_t *wt, uint8_t *word, uint32_t wordsize,
+	    uint8_t lcfirst, uint32_t hash);
+	word_slot_t *word_add(word_table_t *wt, uint8_t *word, uint32_t wordsize,
+	    uint8_t lcfirst, uint32_t hash, uint32_t occur);
+	word_slot_t *word_lookup(word_table_t *wt, uint8_t *word, uint32_t wordsize);
+
+	void count_block(uint8_t *src, dict_block_t *blk);
+	void select_words(word_table_t *wt, word_table_t *dt, uint32_t size,
+	    word_slot_t ***sorted, uint32_t *pos, uint32_t *num_entries);
+	int encode_block(uint8_t *src, dict_block_t *blk, word_table_t *wt);
+	int decode_block(uint8_t *src, uint32_t srclen, uint8_t *dst, uint32_t *dstsize,
+	    decode_dict_entry_t *w_dict, uint32_t numWords);
 
 	uint8_t *to_base_enc(uint32_t number, uint8_t *str, int sz);
 	uint32_t from_base_enc(uint8_t *dnum, int sz);
@@ -354,10 +375,6 @@ DictFilter::DictFilter()
 	flag = '`';
 	flag1 = '!';
 	flag2 = '$';
-
-	/*slab_cache_add(sizeof (dict_entry_t));
-	slab_cache_add(sizeof (hash_context_t));
-	slab_cache_add(sizeof (list_context_t));*/
 }
 
 DictFilter::~DictFilter()
@@ -402,257 +419,162 @@ DictFilter::from_base_enc(uint8_t *dnum, int sz)
 }
 
 /*
- * Search for a string in the hash table bucket chain. The first letter is
- * always lower-cased for Proper-case capital-converted comparison.
+ * Word tables are open-addressed with linear probing. The size is a power
+ * of 2 and a table is never filled beyond half.
  */
-dict_entry_t *
-DictFilter::find_string(dict_entry_t *de, uint8_t *str, unsigned int sz, uint8_t lcfirst)
-{
-	uint8_t c1 = lcfirst;
-	while(de) {
-		if (de->sz == sz) {
-			uint8_t c2 = de->lcfirst;
-			if (c1 == c2) {
-				if (eq_bytes(de->word+1, str+1, sz-1) == 0)
-					return (de);
-			}
-		}
-		de = de->next;
-	}
-	return (NULL);
-}
-
 void
-DictFilter::hash_context_init(hash_context_t *hctx, uint32_t dictsize)
+DictFilter::word_table_init(word_table_t *wt, uint64_t nslots)
 {
-	hctx->dict = new dict_entry_t* [dictsize]();
-	hctx->dictcount = 0;
-	hctx->dictsize = dictsize;
-	hctx->collisions = 0;
-	hctx->sentinel = new dict_entry_t[1]();
+	uint32_t sz;
+
+	sz = DICT_SLOTS_MIN;
+	while (sz < nslots && sz < DICT_SLOTS_MAX)
+		sz <<= 1;
+	wt->slots = new word_slot_t[sz]();
+	wt->mask = sz - 1;
+	wt->count = 0;
+	wt->limit = sz >> 1;
 }
 
 void
-DictFilter::hash_context_delete(hash_context_t *hctx) {
-	uint32_t i;
-
-	for (i=0; i<hctx->dictsize; i++) {
-		if (hctx->dict[i]) {
-			dict_entry_t *de, *de1;
-
-			de = hctx->dict[i];
-			while (de) {
-				de1 = de->next;
-				delete de;
-				de = de1;
-			}
-		}
-	}
-	delete hctx->dict;
-	delete hctx->sentinel;
-	hctx->dictcount = 0;
-	hctx->collisions = 0;
-}
-
-dict_entry_t *
-DictFilter::hash_lookup(hash_context_t *hctx, uint8_t *word, uint32_t wordsize, uint8_t lcfirst)
+DictFilter::word_table_delete(word_table_t *wt)
 {
-	uint32_t indx;
-
-	indx = XXH32(word+1, wordsize-1, lcfirst) % hctx->dictsize;
-	hctx->cur_indx = indx;
-	return (find_string(hctx->dict[indx], word, wordsize, lcfirst));
+	delete [] wt->slots;
+	wt->slots = NULL;
+	wt->count = 0;
 }
 
-dict_entry_t *
-DictFilter::hash_add(hash_context_t *hctx, uint8_t *word, uint32_t wordsize, dict_entry_t *_de)
+uint32_t
+DictFilter::word_hash(uint8_t *word, uint32_t wordsize, uint8_t lcfirst)
 {
-	dict_entry_t *de;
-	uint8_t lcfirst;
-
-	lcfirst = tolower(word[0]);
-
-	/*
-	 * As of now non-NULL _de means a lookup was already done and match was not found
-	 * and the hash table is full.
-	 * So we are adding a new entry with a aged out node. No need to do another lookup.
-	 */
-	if (!_de) {
-		de = hash_lookup(hctx, word, wordsize, lcfirst);
-		if (de) {
-			de->occur++;
-			return (hctx->sentinel);
-		}
-
-		if (hctx->dictcount == hctx->dictsize)
-			return (NULL);
-	} else {
-		hctx->cur_indx = XXH32(word+1, wordsize-1, lcfirst) % hctx->dictsize;
-	}
-
-	if (_de)
-		de = _de;
-	else
-		de = new dict_entry_t[1]();
-	de->word = word;
-	de->sz = wordsize;
-	de->lcfirst = lcfirst;
-	de->occur = 1;
-	de->indx = hctx->cur_indx;
-	if (hctx->dict[hctx->cur_indx])
-		hctx->collisions++;
-
-	de->next = hctx->dict[hctx->cur_indx];
-	hctx->dict[hctx->cur_indx] = de;
-	hctx->dictcount++;
-	return (de);
+	return (XXH32(word+1, wordsize-1, lcfirst));
 }
 
-dict_entry_t *
-DictFilter::hash_remove(hash_context_t *hctx, uint8_t *word, uint32_t wordsize, dict_entry_t *r_de)
+/*
+ * Return the slot holding the word or the empty slot where it belongs. The
+ * first letter is always lower-cased for Proper-case capital-converted
+ * comparison.
+ */
+word_slot_t *
+DictFilter::word_find(word_table_t *wt, uint8_t *word, uint32_t wordsize, uint8_t lcfirst,
+    uint32_t hash)
 {
-	dict_entry_t *de;
-	uint8_t lcfirst;
-
-	if (!r_de) {
-		lcfirst = tolower(word[0]);
-		de = hash_lookup(hctx, word, wordsize, lcfirst);
-	} else {
-		de = r_de;
-		hctx->cur_indx = de->indx;
-	}
-	if (de) {
-		dict_entry_t *c_de, *p_de;
-		de->indx = UINT32_MAX;
-
-		c_de = hctx->dict[hctx->cur_indx];
-		if (c_de == de) {
-			hctx->dict[hctx->cur_indx] = c_de->next;
-			hctx->dictcount--;
-			return (de);
-		}
+	word_slot_t *ws;
+	uint32_t i;
 
-		p_de = c_de;
-		c_de = c_de->next;
-		while (c_de) {
-			if (c_de == de) {
-				p_de->next = c_de->next;
-				hctx->dictcount--;
-				return (de);
-			}
-			p_de = c_de;
-			c_de = c_de->next;
-		}
-		assert(0 == 1); // Fail, corrupted hash
+	i = hash & wt->mask;
+	for (;;) {
+		ws = &(wt->slots[i]);
+		if (ws->sz == 0)
+			return (ws);
+		if (ws->hash == hash && ws->sz == wordsize && ws->lcfirst == lcfirst &&
+		    eq_bytes(ws->word+1, word+1, wordsize-1) == 0)
+			return (ws);
+		i = (i + 1) & wt->mask;
 	}
-	return (NULL);
 }
 
-void
-DictFilter::list_context_init(list_context_t *lctx, uint32_t listsize)
+/*
+ * Add occurrences of a word. Once the table is full new words are dropped.
+ * The table is sized so that this only affects rare words that are unlikely
+ * to make it into the dictionary.
+ */
+word_slot_t *
+DictFilter::word_add(word_table_t *wt, uint8_t *word, uint32_t wordsize, uint8_t lcfirst,
+    uint32_t hash, uint32_t occur)
 {
-	lctx->head = new dict_entry_t[1]();
-	lctx->tail = lctx->head;
-	lctx->listcount = 0;
-	lctx->listsize = listsize;
-	lctx->aged_entries = 0;
-}
+	word_slot_t *ws;
 
-void
-DictFilter::list_context_delete(list_context_t *lctx)
-{
-	delete lctx->head;
-	lctx->listcount = 0;
-	lctx->aged_entries = 0;
+	ws = word_find(wt, word, wordsize, lcfirst, hash);
+	if (ws->sz) {
+		ws->occur += occur;
+		return (ws);
+	}
+	if (wt->count == wt->limit)
+		return (NULL);
+	ws->word = word;
+	ws->sz = wordsize;
+	ws->lcfirst = lcfirst;
+	ws->hash = hash;
+	ws->occur = occur;
+	wt->count++;
+	return (ws);
 }
 
-dict_entry_t *
-DictFilter::list_push(list_context_t *lctx, dict_entry_t *de)
+/*
+ * Look up a word selected for the final dictionary.
+ */
+word_slot_t *
+DictFilter::word_lookup(word_table_t *wt, uint8_t *word, uint32_t wordsize)
 {
-	if (lctx->listcount == lctx->listsize)
-		return (NULL);
-
-	lctx->tail->list_next = de;
-	de->list_next = NULL;
-	lctx->tail = de;
-	lctx->listcount++;
+	word_slot_t *ws;
+	uint8_t lcfirst;
 
-	return (de);
+	lcfirst = tolower(word[0]);
+	ws = word_find(wt, word, wordsize, lcfirst, word_hash(word, wordsize, lcfirst));
+	if (ws->sz && ws->occur > 1)
+		return (ws);
+	return (NULL);
 }
 
 /*
- * Identify a dictionary entry to evict from the N least recently used
- * entries at the list head. The entry with the lowest occurrence count
- * which is below a given threshold is evicted.
- * If no such entry can be found then the current lru aging request is not
- * fulfilled. Also, all the N entries are rotated to the tail of the list.
- * This increases the likelihood of finding an entry to evict for the next
- * request. This allows incremental sequential probing of the list without
- * incurring the cost of very large sequential scans, but at the cost of
- * missing some interesting words.
- * N is kept a small positive number.
+ * Count words in one sub-block. Only words repeated within the sub-block are
+ * kept for merging.
  */
-dict_entry_t *
-DictFilter::list_pop_lru_min(list_context_t *lctx)
+void
+DictFilter::count_block(uint8_t *src, dict_block_t *blk)
 {
-	dict_entry_t *p_de, *c_de;
-	dict_entry_t *min, *min_p;
-	uint32_t list_scan, occur, maxoccur;
+	word_table_t wt;
+	uint32_t i, pos, end, n;
 
-	if (lctx->listcount == 0)
-		return (NULL);
+	word_table_init(&wt, blk->len >> 4);
+	pos = blk->start;
+	end = blk->start + blk->len;
+	for (i = pos; i < end; i++) {
+		uint8_t c = src[i];
+
+		if (SEPARATOR[c] & 1) {
+			size_t toklen = i - pos;
 
-	lctx->aging_requests++;
-	p_de = lctx->head;
-	c_de = lctx->head->list_next;
-	min = NULL;
+			if (toklen >= WORD_MIN && toklen <= WORD_MAX) {
+				uint8_t lcfirst = tolower(src[pos]);
 
-	if (lctx->listcount > LIST_LRU_NUM)
-		list_scan = LIST_LRU_NUM;
-	else
-		list_scan = lctx->listcount;
-
-	occur = UINT32_MAX;
-	maxoccur = 0;
-	while (c_de && c_de != lctx->tail && list_scan > 0) {
-		if (c_de->occur < occur) {
-			min = c_de;
-			min_p = p_de;
-			occur = c_de->occur;
+				word_add(&wt, src+pos, toklen, lcfirst,
+				    word_hash(src+pos, toklen, lcfirst), 1);
+			}
+			pos = i+1;
 		}
-		list_scan--;
-		p_de = c_de;
-		c_de = c_de->list_next;
 	}
 
-	if (min && min->occur * min->sz < 2048) {
-		min_p->list_next = min->list_next;
-		lctx->aged_entries++;
-		lctx->listcount--;
-		return (min);
+	n = 0;
+	for (i = 0; i <= wt.mask; i++) {
+		if (wt.slots[i].occur > 1)
+			n++;
 	}
-
-	if (lctx->listcount > LIST_LRU_NUM) {
-		lctx->tail->list_next = lctx->head->list_next;
-		lctx->head->list_next = c_de;
-		p_de->list_next = NULL;
+	blk->words = new word_slot_t[n + 1];
+	blk->nwords = 0;
+	for (i = 0; i <= wt.mask; i++) {
+		if (wt.slots[i].occur > 1)
+			blk->words[blk->nwords++] = wt.slots[i];
 	}
-	return (NULL);
+	word_table_delete(&wt);
 }
 
-int
-DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize)
+/*
+ * Choose the dictionary words. Words below the occurrence X word size
+ * threshold, and words whose encoded representation would be larger than the
+ * original, get a zero occurrence count. The chosen words are numbered in
+ * sorted order and sorted holds a flattened view of the candidates. The
+ * chosen words are also put into a small separate table used for lookups
+ * while encoding.
+ */
+void
+DictFilter::select_words(word_table_t *wt, word_table_t *dt, uint32_t size,
+    word_slot_t ***sorted, uint32_t *npos, uint32_t *num_entries)
 {
-	uint32_t dstSize = 0, dictSize, i, pos, num_entries;
-	hash_context_t hctx;
-	list_context_t lctx;
-	dict_entry_t **sorted_dict;
-	uint8_t num_dict[10], *numd;
+	uint32_t i, pos, dictSize;
+	word_slot_t **sorted_dict;
 	ssize_t new_size;
-	int rv, sz;
-
-	if (size < 1024)
-		return 0;
 
 	if (size > 20000) {
 		dictSize = size / 10000;
@@ -662,86 +584,36 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 	}
 	dictSize++;
 
+	sorted_dict = new word_slot_t* [wt->count + 1];
 	pos = 0;
-	rv = 0;
-	hash_context_init(&hctx, dictSize);
-	list_context_init(&lctx, dictSize);
-	sorted_dict = new dict_entry_t* [dictSize];
-
-	/*
-	 * Scan words in the data and build the dictionary.
-	 */
-	for (i=0; i<size; i++) {
-		uint8_t c = src[i];
-
-		if (SEPARATOR[c] & 1) {
-			dict_entry_t *de;
-			size_t toklen = i - pos;
-
-			if (toklen < WORD_MIN || toklen > WORD_MAX) {
-				pos = i+1;
-				continue;
-			}
-
-			de = hash_add(&hctx, src+pos, toklen, NULL);
-			if (!de && i > (size>>1)) {
-				de = list_pop_lru_min(&lctx);
-				if (de) {
-					dict_entry_t *de1;
-					de1 = hash_remove(&hctx, de->word, de->sz, de);
-					assert(de1 == de);
-					de1 = hash_add(&hctx, src+pos, toklen, de);
-					assert(de1 != NULL);
-					assert(de1 != hctx.sentinel);
-					list_push(&lctx, de1);
-				}
-			} else if (de != hctx.sentinel) {
-				list_push(&lctx, de);
-			}
-			pos = i+1;
-		}
-	}
-
-	/*
-	 * Mark below-threshold entries in the dictionary. Also sorted_dict holds a
-	 * flattened view of the hash.
-	 */
-	pos = 0;
-	for (i=0; i<dictSize; i++) {
-		if (hctx.dict[i]) {
-			dict_entry_t *de;
-
-			de = hctx.dict[i];
-			while (de) {
-				ssize_t val;
-
-				val = (size_t)de->occur * (size_t)de->sz;
-				if (val <= 4500) {
-					de->occur = 0;
-					de = de->next;
-					continue;
-				}
-
-				sorted_dict[pos++] = de;
-				de = de->next;
-			}
+	for (i = 0; i <= wt->mask; i++) {
+		word_slot_t *de = &(wt->slots[i]);
+		ssize_t val;
+
+		if (de->sz == 0)
+			continue;
+		val = (size_t)de->occur * (size_t)de->sz;
+		if (val <= 4500) {
+			de->occur = 0;
+			continue;
 		}
+		sorted_dict[pos++] = de;
 	}
 
 	/*
 	 * Sort the flattened view of the hash in descending order of
 	 * occurrence X word size.
 	 */
-	qsort(sorted_dict, pos, sizeof (dict_entry_t *), cmpoccur);
-	num_entries = 0;
+	qsort(sorted_dict, pos, sizeof (word_slot_t *), cmpoccur);
+	*num_entries = 0;
 	new_size = size;
 
 	for (i=0; i<pos; i++) {
-		dict_entry_t *de;
+		word_slot_t *de;
 		ssize_t prev_size;
 
 		de = sorted_dict[i];
-		if (de->occur > 1) {
+		if (de->occur > 1 && *num_entries < dictSize) {
 			ssize_t val;
 
 			/*
@@ -751,13 +623,13 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 			prev_size = new_size;
 			val = (size_t)de->occur * (size_t)de->sz;
 			new_size -= val;
-			if (num_entries == 0)
+			if (*num_entries == 0)
 				new_size += ((size_t)de->sz + (size_t)de->occur * 1);
-			else if (num_entries < NUMERAL_BASE)
+			else if (*num_entries < NUMERAL_BASE)
 				new_size += ((size_t)de->sz + (size_t)de->occur * 2);
-			else if (num_entries < NUMERAL_BASE * NUMERAL_BASE)
+			else if (*num_entries < NUMERAL_BASE * NUMERAL_BASE)
 				new_size += ((size_t)de->sz + (size_t)de->occur * 3);
-			else if (num_entries < NUMERAL_BASE * NUMERAL_BASE * NUMERAL_BASE)
+			else if (*num_entries < NUMERAL_BASE * NUMERAL_BASE * NUMERAL_BASE)
 				new_size += ((size_t)de->sz + (size_t)de->occur * 4);
 			else
 				new_size += ((size_t)de->sz + (size_t)de->occur * 5);
@@ -767,45 +639,48 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 				continue;
 			}
 
-			de->indx = num_entries;
-			num_entries++;
+			de->indx = *num_entries;
+			(*num_entries)++;
 		} else {
 			de->occur = 0;
 		}
 	}
 
-	sz = sizeof (num_dict);
-	numd = to_base_enc(num_entries, num_dict, sz);
-	dstSize = num_dict+sz-numd-1;
-	copy_bytes(dst, numd, dstSize);
-	dst[dstSize++] = ' ';
-
-	/*
-	 * Copy the dictionary to the output buffer.
-	 */
-	for (i=0; i<pos && dstSize<*dstsize; i++) {
-		dict_entry_t *de;
+	word_table_init(dt, (uint64_t)(*num_entries) * 2);
+	for (i=0; i<pos; i++) {
+		word_slot_t *de, *ws;
 
 		de = sorted_dict[i];
 		if (de->occur > 1) {
-			dst[dstSize++] = de->lcfirst;
-			if (dstSize + de->sz + 1 >= *dstsize) {
-				goto bail;
-			}
-
-			copy_bytes(&dst[dstSize], de->word+1, de->sz-1);
-			dstSize += (de->sz-1);
-			dst[dstSize++] = ' ';
+			ws = word_add(dt, de->word, de->sz, de->lcfirst, de->hash, de->occur);
+			if (ws)
+				ws->indx = de->indx;
 		}
 	}
+	*sorted = sorted_dict;
+	*npos = pos;
+}
 
-	pos = 0;
-	for (i=0; i<size && dstSize<*dstsize; i++) {
+/*
+ * Encode one text sub-block into blk->out.
+ */
+int
+DictFilter::encode_block(uint8_t *src, dict_block_t *blk, word_table_t *wt)
+{
+	uint32_t dstSize, i, pos, end;
+	uint8_t *dst;
+	int sz;
+
+	dst = blk->out;
+	dstSize = 0;
+	pos = blk->start;
+	end = blk->start + blk->len;
+	for (i=pos; i<end && dstSize<blk->outcap; i++) {
 		uint8_t *tok, c;
 
 		c = src[i];
 		if (SEPARATOR[c] & 1) {
-			dict_entry_t *de;
+			word_slot_t *de;
 			size_t toklen = i - pos;
 
 			if (toklen < WORD_MIN || toklen > WORD_MAX) {
@@ -813,8 +688,8 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 				    *(src+pos) == flag2 || *(src+pos) == '\\') {
 					dst[dstSize++] = '\\';
 				}
-				if (dstSize + toklen + 1 > *dstsize) {
-					goto bail;
+				if (dstSize + toklen + 1 > blk->outcap) {
+					return (0);
 				}
 				copy_bytes(&dst[dstSize], src+pos, toklen+1);
 				dstSize += (toklen+1);
@@ -823,9 +698,9 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 			}
 
 			tok = src+pos;
-			de = hash_lookup(&hctx, tok, toklen, tolower(tok[0]));
-			if (de != NULL && de->occur > 1) {
-				uint16_t val;
+			de = word_lookup(wt, tok, toklen);
+			if (de != NULL) {
+				uint32_t val;
 				unsigned char tok_hdr[10], *dnum;
 
 				/*
@@ -842,8 +717,8 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 				}
 
 				val = tok_hdr+sz - dnum-1;
-				if (dstSize + val + 1 > *dstsize) {
-					goto bail;
+				if (dstSize + val + 1 > blk->outcap) {
+					return (0);
 				}
 				copy_bytes(&dst[dstSize], dnum, val);
 				dstSize += val;
@@ -871,8 +746,8 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 						*dnum = flag2;
 
 						val = tok_hdr+sz - dnum-1;
-						if (dstSize + val + 1 > *dstsize) {
-							goto bail;
+						if (dstSize + val + 1 > blk->outcap) {
+							return (0);
 						}
 						copy_bytes(&dst[dstSize], dnum, val);
 						dstSize += val;
@@ -885,8 +760,8 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 					    *(src+pos) == flag2 || *(src+pos) == '\\') {
 						dst[dstSize++] = '\\';
 					}
-					if (dstSize + toklen + 1 > *dstsize) {
-						goto bail;
+					if (dstSize + toklen + 1 > blk->outcap) {
+						return (0);
 					}
 					copy_bytes(&dst[dstSize], src+pos, toklen+1);
 					dstSize += (toklen+1);
@@ -895,23 +770,171 @@ DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *ds
 			pos = i+1;
 		}
 	}
-	if (pos < size) {
-		uint32_t sz = size - pos;
+	if (pos < end) {
+		uint32_t sz = end - pos;
 
-		if (dstSize + sz > *dstsize) {
-			goto bail;
+		if (dstSize + sz > blk->outcap) {
+			return (0);
 		}
 		copy_bytes(&dst[dstSize], src+pos, sz);
 		dstSize += sz;
 	}
+	blk->outlen = dstSize;
+	return (1);
+}
+
+/*
+ * Encoded text layout following the type byte. Data split into more than one
+ * sub-block is preceded by the sub-block count and the encoded and original
+ * length of each sub-block, all 4-byte little-endian. Then the word count and
+ * dictionary words follow, each terminated by a space, and then the encoded
+ * sub-blocks.
+ */
+int
+DictFilter::Forward_Dict(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize,
+    int nthreads)
+{
+	uint32_t dstSize = 0, i, pos, num_entries, nblks, start, total;
+	word_table_t wt, dt;
+	word_slot_t **sorted_dict;
+	dict_block_t *blks;
+	uint8_t num_dict[10], *numd;
+	int rv, sz, j;
+
+	if (size < 1024)
+		return 0;
+
+	/*
+	 * Split into sub-blocks, each ending just after a separator.
+	 */
+	blks = new dict_block_t[size / DICT_BLOCK_SZ + 1]();
+	nblks = 0;
+	start = 0;
+	while (start < size) {
+		uint32_t end;
+
+		if (size - start <= DICT_BLOCK_SZ + (DICT_BLOCK_SZ >> 2)) {
+			end = size;
+		} else {
+			end = start + DICT_BLOCK_SZ;
+			while (end < size && !(SEPARATOR[src[end-1]] & 1))
+				end++;
+		}
+		blks[nblks].start = start;
+		blks[nblks].len = end - start;
+		nblks++;
+		start = end;
+	}
+
+#if defined(_OPENMP)
+#	pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+	for (j = 0; j < (int)nblks; j++) {
+		count_block(src, &blks[j]);
+	}
+
+	/*
+	 * Merge the per sub-block counts in order.
+	 */
+	total = 0;
+	for (i = 0; i < nblks; i++)
+		total += blks[i].nwords;
+	word_table_init(&wt, (uint64_t)total * 2);
+	for (i = 0; i < nblks; i++) {
+		word_slot_t *ws = blks[i].words;
+		uint32_t k;
+
+		for (k = 0; k < blks[i].nwords; k++) {
+			word_add(&wt, ws[k].word, ws[k].sz, ws[k].lcfirst, ws[k].hash,
+			    ws[k].occur);
+		}
+		delete [] blks[i].words;
+		blks[i].words = NULL;
+	}
+
+	rv = 0;
+	select_words(&wt, &dt, size, &sorted_dict, &pos, &num_entries);
+
+	if (nblks > 1) {
+		dst[dstSize++] = DICT_TYPE_TEXT_SPLIT;
+		U32_P(&dst[dstSize]) = LE32(nblks);
+		dstSize += 4 + nblks * 8;
+	} else {
+		dst[dstSize++] = DICT_TYPE_TEXT;
+	}
+	if (dstSize + sizeof (num_dict) >= *dstsize)
+		goto bail;
+
+	sz = sizeof (num_dict);
+	numd = to_base_enc(num_entries, num_dict, sz);
+	copy_bytes(&dst[dstSize], numd, num_dict+sz-numd-1);
+	dstSize += num_dict+sz-numd-1;
+	dst[dstSize++] = ' ';
+
+	/*
+	 * Copy the dictionary to the output buffer.
+	 */
+	for (i=0; i<pos && dstSize<*dstsize; i++) {
+		word_slot_t *de;
+
+		de = sorted_dict[i];
+		if (de->occur > 1) {
+			dst[dstSize++] = de->lcfirst;
+			if (dstSize + de->sz + 1 >= *dstsize) {
+				goto bail;
+			}
+
+			copy_bytes(&dst[dstSize], de->word+1, de->sz-1);
+			dstSize += (de->sz-1);
+			dst[dstSize++] = ' ';
+		}
+	}
+	if (dstSize >= *dstsize)
+		goto bail;
+
+	/*
+	 * The first sub-block is encoded in place, the rest into their own
+	 * buffers and then appended.
+	 */
+	blks[0].out = &dst[dstSize];
+	blks[0].outcap = *dstsize - dstSize;
+	for (i = 1; i < nblks; i++) {
+		blks[i].outcap = blks[i].len + (blks[i].len >> 2) + 16;
+		blks[i].out = new uint8_t[blks[i].outcap];
+	}
+
+#if defined(_OPENMP)
+#	pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+	for (j = 0; j < (int)nblks; j++) {
+		blks[j].rv = encode_block(src, &blks[j], &dt);
+	}
+
+	for (i = 0; i < nblks; i++) {
+		if (!blks[i].rv)
+			goto bail;
+		if (i > 0) {
+			if (dstSize + blks[i].outlen > *dstsize)
+				goto bail;
+			memcpy(&dst[dstSize], blks[i].out, blks[i].outlen);
+		}
+		dstSize += blks[i].outlen;
+		if (nblks > 1) {
+			U32_P(&dst[1 + 4 + i * 8]) = LE32(blks[i].outlen);
+			U32_P(&dst[1 + 4 + i * 8 + 4]) = LE32(blks[i].len);
+		}
+	}
 
 	*dstsize = dstSize;
 	rv = 1;
 
 bail:
-	hash_context_delete(&hctx);
-	list_context_delete(&lctx);
-	delete sorted_dict;
+	for (i = 1; i < nblks; i++)
+		delete [] blks[i].out;
+	delete [] blks;
+	word_table_delete(&wt);
+	word_table_delete(&dt);
+	delete [] sorted_dict;
 
 	return rv;
 }
@@ -919,31 +942,21 @@ bail:
 int
 DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t *dstsize)
 {
-	uint32_t dstSize = 0, dictSize, i, pos, num_entries;
-	hash_context_t hctx;
-	list_context_t lctx;
-	dict_entry_t **sorted_dict;
+	uint32_t dstSize = 0, i, pos, num_entries;
+	word_table_t wt, dt;
+	word_slot_t **sorted_dict;
 	uint8_t num_dict[10], *numd;
-	ssize_t new_size;
 	int rv, sz, j;
 
 	if (size < 1024)
 		return 0;
 
-	if (size > 20000) {
-		dictSize = size / 10000;
-		dictSize += (dictSize >> 1);
-	} else {
-		dictSize = (size >> 1);
-	}
-	dictSize++;
-
 	pos = 0;
 	rv = 0;
 	j = 0;
-	hash_context_init(&hctx, dictSize);
-	list_context_init(&lctx, dictSize);
-	sorted_dict = new dict_entry_t* [dictSize];
+	sorted_dict = NULL;
+	dt.slots = NULL;
+	word_table_init(&wt, size >> 3);
 
 	/*
 	 * Scan words in the data and build the dictionary.
@@ -957,8 +970,8 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 
 		is_sep = SEPARATOR[c] & 1;
 		if (is_sep || j == 4) {
-			dict_entry_t *de;
 			size_t toklen = i - pos;
+			uint8_t lcfirst;
 
 			if (j == 4 && !is_sep) {
 				unsigned char *bf = src+pos;
@@ -983,21 +996,8 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 				continue;
 			}
 
-			de = hash_add(&hctx, src+pos, toklen, NULL);
-			if (!de && i > (size>>1)) {
-				de = list_pop_lru_min(&lctx);
-				if (de) {
-					dict_entry_t *de1;
-					de1 = hash_remove(&hctx, de->word, de->sz, de);
-					assert(de1 == de);
-					de1 = hash_add(&hctx, src+pos, toklen, de);
-					assert(de1 != NULL);
-					assert(de1 != hctx.sentinel);
-					list_push(&lctx, de1);
-				}
-			} else if (de != hctx.sentinel) {
-				list_push(&lctx, de);
-			}
+			lcfirst = tolower(src[pos]);
+			word_add(&wt, src+pos, toklen, lcfirst, word_hash(src+pos, toklen, lcfirst), 1);
 			if (is_sep) {
 				pos = i+1;
 				j--;
@@ -1008,82 +1008,13 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 		j++;
 	}
 
-	/*
-	 * Mark below-threshold entries in the dictionary. Also sorted_dict holds a
-	 * flattened view of the hash.
-	 */
-	pos = 0;
-	for (i=0; i<dictSize; i++) {
-		if (hctx.dict[i]) {
-			dict_entry_t *de;
-
-			de = hctx.dict[i];
-			while (de) {
-				ssize_t val;
-
-				val = (size_t)de->occur * (size_t)de->sz;
-				if (val <= 4500) {
-					de->occur = 0;
-					de = de->next;
-					continue;
-				}
-
-				sorted_dict[pos++] = de;
-				de = de->next;
-			}
-		}
-	}
-
-	/*
-	 * Sort the flattened view of the hash in descending order of
-	 * occurrence X word size.
-	 */
-	qsort(sorted_dict, pos, sizeof (dict_entry_t *), cmpoccur);
-	num_entries = 0;
-	new_size = size;
-
-	for (i=0; i<pos; i++) {
-		dict_entry_t *de;
-		ssize_t prev_size;
-
-		de = sorted_dict[i];
-		if (de->occur > 1) {
-			ssize_t val;
-
-			/*
-			 * Mark entries for which the encoded representation will be
-			 * larger than the original.
-			 */
-			prev_size = new_size;
-			val = (size_t)de->occur * (size_t)de->sz;
-			new_size -= val;
-			if (num_entries == 0)
-				new_size += ((size_t)de->sz + (size_t)de->occur * 1);
-			else if (num_entries < NUMERAL_BASE)
-				new_size += ((size_t)de->sz + (size_t)de->occur * 2);
-			else if (num_entries < NUMERAL_BASE * NUMERAL_BASE)
-				new_size += ((size_t)de->sz + (size_t)de->occur * 3);
-			else if (num_entries < NUMERAL_BASE * NUMERAL_BASE * NUMERAL_BASE)
-				new_size += ((size_t)de->sz + (size_t)de->occur * 4);
-			else
-				new_size += ((size_t)de->sz + (size_t)de->occur * 5);
-			if (new_size >= prev_size) {
-				new_size = prev_size;
-				de->occur = 0;
-				continue;
-			}
-
-			de->indx = num_entries;
-			num_entries++;
-		} else {
-			de->occur = 0;
-		}
-	}
+	select_words(&wt, &dt, size, &sorted_dict, &pos, &num_entries);
 
+	dst[dstSize++] = DICT_TYPE_FASTA;
 	sz = sizeof (num_dict);
 	numd = to_base_enc(num_entries, num_dict, sz);
-	dstSize = num_dict+sz-numd-1;
-	copy_bytes(dst, numd, dstSize);
+	copy_bytes(&dst[dstSize], numd, num_dict+sz-numd-1);
+	dstSize += num_dict+sz-numd-1;
 	dst[dstSize++] = ' ';
 
 	// Copy the flags
@@ -1096,7 +1027,7 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 	 * Copy the dictionary to the output buffer.
 	 */
 	for (i=0; i<pos && dstSize<*dstsize; i++) {
-		dict_entry_t *de;
+		word_slot_t *de;
 
 		de = sorted_dict[i];
 		if (de->occur > 1) {
@@ -1120,7 +1051,7 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 		c = src[i];
 		is_sep = SEPARATOR[c] & 1;
 		if (is_sep || j == 4) {
-			dict_entry_t *de;
+			word_slot_t *de;
 			size_t toklen = i - pos;
 
 			if (j == 4 && !is_sep) {
@@ -1157,9 +1088,9 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 			}
 
 			tok = src+pos;
-			de = hash_lookup(&hctx, tok, toklen, tolower(tok[0]));
-			if (de != NULL && de->occur > 1) {
-				uint16_t val;
+			de = word_lookup(&dt, tok, toklen);
+			if (de != NULL) {
+				uint32_t val;
 				unsigned char tok_hdr[10], *dnum;
 
 				/*
@@ -1225,45 +1156,24 @@ DictFilter::Forward_Dict_Fasta(uint8_t *src, uint32_t size, uint8_t *dst, uint32
 	rv = 1;
 
 bail:
-	hash_context_delete(&hctx);
-	list_context_delete(&lctx);
-	delete sorted_dict;
+	word_table_delete(&wt);
+	word_table_delete(&dt);
+	delete [] sorted_dict;
 
 	return rv;
 }
 
+/*
+ * Decode one run of encoded text. The run must start just after a separator
+ * or at the beginning of the encoded data.
+ */
 int
-DictFilter::Inverse_Dict(uint8_t *src, uint32_t srclen, uint8_t *dst, uint32_t *dstsize)
+DictFilter::decode_block(uint8_t *srcpos, uint32_t enclen, uint8_t *dst, uint32_t *dstsize,
+    decode_dict_entry_t *w_dict, uint32_t numWords)
 {
-	uint32_t numWords, i, enclen, pos;
-	uint8_t *srcpos, *end, *dstpos, *dstend, c;
-	decode_dict_entry_t *w_dict;
-
-	end = src + srclen;
-	srcpos = (uint8_t *)memchr((const void *)src, ' ', WORD_MAX);
-	if (srcpos - src > 12) {
-		return (0);
-	}
+	uint32_t i, pos;
+	uint8_t *dstpos, *dstend, c;
 
-	numWords = from_base_enc(src, srcpos - src);
-	srcpos++;
-	w_dict = new decode_dict_entry_t[numWords];
-	for (i = 0; i < numWords && srcpos < end; i++) {
-		uint8_t *w_src = srcpos;
-		size_t limit;
-
-		limit = end - srcpos;
-		if (limit > WORD_MAX+1) limit = WORD_MAX+1;
-		srcpos = (uint8_t *)memchr((const void *)srcpos, ' ', limit);
-		if (srcpos - w_src > WORD_MAX)
-			return (0);
-
-		w_dict[i].sz = srcpos - w_src;
-		w_dict[i].word = w_src;
-		srcpos++;
-	}
-
-	enclen = srclen - (srcpos - src);
 	dstpos = dst;
 	dstend = dst + *dstsize;
 	pos = 0;
@@ -1290,7 +1200,7 @@ DictFilter::Inverse_Dict(uint8_t *src, uint32_t srclen, uint8_t *dst, uint32_t *
 				toklen--;
 				dpos = from_base_enc(srcpos+pos+1, toklen);
 
-				if (dstpos + w_dict[dpos].sz > dstend) {
+				if (dpos >= numWords || dstpos + w_dict[dpos].sz + 1 > dstend) {
 					log_msg(LOG_ERR, 0, "Overflow in DICT decode.\n");
 					return (0);
 				}
@@ -1302,7 +1212,7 @@ DictFilter::Inverse_Dict(uint8_t *src, uint32_t srclen, uint8_t *dst, uint32_t *
 				toklen--;
 				dpos = from_base_enc(srcpos+pos+1, toklen);
 
-				if (dstpos + w_dict[dpos].sz > dstend) {
+				if (dpos >= numWords || dstpos + w_dict[dpos].sz + 1 > dstend) {
 					log_msg(LOG_ERR, 0, "Overflow in DICT decode.\n");
 					return (0);
 				}
@@ -1349,18 +1259,139 @@ DictFilter::Inverse_Dict(uint8_t *src, uint32_t srclen, uint8_t *dst, uint32_t *
 	return (1);
 }
 
+int
+DictFilter::Inverse_Dict(uint8_t *src, uint32_t srclen, uint8_t *dst, uint32_t *dstsize,
+    int split, int nthreads)
+{
+	uint32_t numWords, i, enclen, nblks, so, dof;
+	uint32_t *slen, *dlen, *soff, *doff;
+	uint8_t *srcpos, *end, *tbl;
+	decode_dict_entry_t *w_dict;
+	int j, err;
+
+	end = src + srclen;
+	nblks = 1;
+	tbl = NULL;
+	if (split) {
+		if (srclen < 4)
+			return (0);
+		nblks = LE32(U32_P(src));
+		if (nblks < 2 || nblks > (srclen - 4) / 8)
+			return (0);
+		tbl = src + 4;
+		src += 4 + nblks * 8;
+	}
+
+	srcpos = (uint8_t *)memchr((const void *)src, ' ', end - src < WORD_MAX ?
+	    end - src : WORD_MAX);
+	if (srcpos == NULL || srcpos - src > 12) {
+		return (0);
+	}
+
+	numWords = from_base_enc(src, srcpos - src);
+	srcpos++;
+
+	/*
+	 * Every dictionary entry takes at least one byte, so a word count
+	 * beyond the remaining data is corrupt.
+	 */
+	if (numWords > (uint32_t)(end - srcpos))
+		return (0);
+	w_dict = new (std::nothrow) decode_dict_entry_t[numWords + 1];
+	if (w_dict == NULL)
+		return (0);
+	for (i = 0; i < numWords && srcpos < end; i++) {
+		uint8_t *w_src = srcpos;
+		size_t limit;
+
+		limit = end - srcpos;
+		if (limit > WORD_MAX+1) limit = WORD_MAX+1;
+		srcpos = (uint8_t *)memchr((const void *)srcpos, ' ', limit);
+		if (srcpos == NULL || srcpos - w_src > WORD_MAX) {
+			delete [] w_dict;
+			return (0);
+		}
+
+		w_dict[i].sz = srcpos - w_src;
+		w_dict[i].word = w_src;
+		srcpos++;
+	}
+	if (i < numWords) {
+		delete [] w_dict;
+		return (0);
+	}
+
+	enclen = end - srcpos;
+	if (!split) {
+		err = !decode_block(srcpos, enclen, dst, dstsize, w_dict, numWords);
+		delete [] w_dict;
+		return (!err);
+	}
+
+	/*
+	 * Validate the sub-block table before decoding in parallel.
+	 */
+	slen = new (std::nothrow) uint32_t[nblks * 4];
+	if (slen == NULL) {
+		delete [] w_dict;
+		return (0);
+	}
+	dlen = slen + nblks;
+	soff = dlen + nblks;
+	doff = soff + nblks;
+	so = 0;
+	dof = 0;
+	err = 0;
+	for (i = 0; i < nblks; i++) {
+		slen[i] = LE32(U32_P(tbl + i * 8));
+		dlen[i] = LE32(U32_P(tbl + i * 8 + 4));
+		if (slen[i] > enclen - so || dlen[i] > *dstsize - dof) {
+			err = 1;
+			break;
+		}
+		soff[i] = so;
+		doff[i] = dof;
+		so += slen[i];
+		dof += dlen[i];
+	}
+
+	if (!err) {
+#if defined(_OPENMP)
+#		pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+		for (j = 0; j < (int)nblks; j++) {
+			uint32_t dl = dlen[j];
+
+			if (!decode_block(srcpos + soff[j], slen[j], dst + doff[j], &dl,
+			    w_dict, numWords) || dl != dlen[j]) {
+#if defined(_OPENMP)
+#				pragma omp atomic
+#endif
+				err++;
+			}
+		}
+	}
+	delete [] slen;
+	delete [] w_dict;
+	if (err)
+		return (0);
+	*dstsize = dof;
+	return (1);
+}
+
 int
 DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint32_t *dstsize)
 {
 	uint32_t numWords, i, enclen, pos;
 	uint8_t *srcpos, *end, *dstpos, *dstend, c;
 	decode_dict_entry_t *w_dict;
-	int flag, flag1, flag2;
+	int flag, flag1, flag2, rv;
 	uint8_t separator[256];
 
 	end = src + srclen;
-	srcpos = (uint8_t *)memchr((const void *)src, ' ', WORD_MAX);
-	if (srcpos - src > 12) {
+	srcpos = (uint8_t *)memchr((const void *)src, ' ', srclen < WORD_MAX ?
+	    srclen : WORD_MAX);
+	if (srcpos == NULL || srcpos - src > 12) {
 		return (0);
 	}
 
@@ -1383,7 +1414,12 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 	separator[flag1] = 1;
 	separator[flag2] = 1;
 
-	w_dict = new decode_dict_entry_t[numWords];
+	if (numWords > (uint32_t)(end - srcpos))
+		return (0);
+	w_dict = new (std::nothrow) decode_dict_entry_t[numWords + 1];
+	if (w_dict == NULL)
+		return (0);
+	rv = 0;
 	for (i = 0; i < numWords && srcpos < end; i++) {
 		size_t limit;
 		uint8_t *w_src;
@@ -1392,13 +1428,15 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 		limit = end - srcpos;
 		if (limit > WORD_MAX+1) limit = WORD_MAX+1;
 		srcpos = (uint8_t *)memchr((const void *)srcpos, ' ', limit);
-		if (srcpos - w_src > WORD_MAX)
-			return (0);
+		if (srcpos == NULL || srcpos - w_src > WORD_MAX)
+			goto bail;
 
 		w_dict[i].sz = srcpos - w_src;
 		w_dict[i].word = w_src;
 		srcpos++;
 	}
+	if (i < numWords)
+		goto bail;
 
 	enclen = srclen - (srcpos - src);
 	dstpos = dst;
@@ -1418,9 +1456,9 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 				toklen --;
 				dpos = from_base_enc(srcpos+pos+1, toklen);
 
-				if (dstpos + w_dict[dpos].sz > dstend) {
+				if (dpos >= numWords || dstpos + w_dict[dpos].sz > dstend) {
 					log_msg(LOG_ERR, 0, "1: Overflow in DICT decode.");
-					return (0);
+					goto bail;
 				}
 				copy_bytes(dstpos, w_dict[dpos].word, w_dict[dpos].sz);
 				dstpos += w_dict[dpos].sz;
@@ -1429,9 +1467,9 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 				toklen --;
 				dpos = from_base_enc(srcpos+pos+1, toklen);
 
-				if (dstpos + w_dict[dpos].sz > dstend) {
+				if (dpos >= numWords || dstpos + w_dict[dpos].sz > dstend) {
 					log_msg(LOG_ERR, 0, "2: Overflow in DICT decode.");
-					return (0);
+					goto bail;
 				}
 				*dstpos++ = toupper(*(w_dict[dpos].word));
 				copy_bytes(dstpos, w_dict[dpos].word+1, w_dict[dpos].sz-1);
@@ -1442,7 +1480,7 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 				if (toklen > 0) {
 					if (dstpos + toklen > dstend) {
 						log_msg(LOG_ERR, 0, "3: Overflow in DICT decode.");
-						return (0);
+						goto bail;
 					}
 					copy_bytes(dstpos, srcpos+pos+1, toklen);
 					dstpos += toklen;
@@ -1450,7 +1488,7 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 			} else {
 				if (dstpos + toklen > dstend) {
 					log_msg(LOG_ERR, 0, "4: Overflow in DICT decode.");
-					return (0);
+					goto bail;
 				}
 				copy_bytes(dstpos, srcpos+pos, toklen);
 				dstpos += toklen;
@@ -1470,9 +1508,9 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 			toklen --;
 			dpos = from_base_enc(srcpos+pos+1, toklen);
 
-			if (dstpos + w_dict[dpos].sz > dstend) {
+			if (dpos >= numWords || dstpos + w_dict[dpos].sz > dstend) {
 				log_msg(LOG_ERR, 0, "5: Overflow in DICT decode.\n");
-				return (0);
+				goto bail;
 			}
 			copy_bytes(dstpos, w_dict[dpos].word, w_dict[dpos].sz);
 			dstpos += w_dict[dpos].sz;
@@ -1481,9 +1519,9 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 			toklen --;
 			dpos = from_base_enc(srcpos+pos+1, toklen);
 
-			if (dstpos + w_dict[dpos].sz > dstend) {
+			if (dpos >= numWords || dstpos + w_dict[dpos].sz > dstend) {
 				log_msg(LOG_ERR, 0, "6: Overflow in DICT decode.\n");
-				return (0);
+				goto bail;
 			}
 			*dstpos++ = toupper(*(w_dict[dpos].word));
 			copy_bytes(dstpos, w_dict[dpos].word+1, w_dict[dpos].sz-1);
@@ -1494,7 +1532,7 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 			if (toklen > 0) {
 				if (dstpos + toklen > dstend) {
 					log_msg(LOG_ERR, 0, "7: Overflow in DICT decode.\n");
-					return (0);
+					goto bail;
 				}
 				copy_bytes(dstpos, srcpos+pos+1, toklen);
 				dstpos += toklen;
@@ -1502,7 +1540,7 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 		} else {
 			if (dstpos + toklen > dstend) {
 				log_msg(LOG_ERR, 0, "8: Overflow in DICT decode.\n");
-				return (0);
+				goto bail;
 			}
 			copy_bytes(dstpos, srcpos+pos, toklen);
 			dstpos += toklen;
@@ -1510,15 +1548,20 @@ DictFilter::Inverse_Dict_Fasta(uint8_t *src, uint32_t srclen, uint8_t *dst, uint
 	}
 
 	*dstsize = dstpos - dst;
-	return (1);
+	rv = 1;
+bail:
+	delete [] w_dict;
+	return (rv);
 }
 
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
 
 int
-dict_encode(uint8_t *from, uint64_t fromlen, uint8_t *to, uint64_t *dstlen, int is_fasta)
+dict_encode(uint8_t *from, uint64_t fromlen, uint8_t *to, uint64_t *dstlen, int is_fasta,
+    int nthreads)
 {
 	DictFilter *df = DictFilter::getInstance();
 	u32 fl;
@@ -1540,16 +1583,12 @@ dict_encode(uint8_t *from, uint64_t fromlen, uint8_t *to, uint64_t *dstlen, int
 	dst = to + 4;
 	dl -= 4;
 	if (!is_fasta) {
-		*dst++ = 0;
-		dl--;
-		rv = df->Forward_Dict(from, fl, dst, &dl);
+		rv = df->Forward_Dict(from, fl, dst, &dl, nthreads);
 	} else {
-		*dst++ = 1;
-		dl--;
 		rv = df->Forward_Dict_Fasta(from, fl, dst, &dl);
 	}
 	if (rv) {
-		*dstlen = dl + 5;
+		*dstlen = dl + 4;
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "DICT: fromlen: %" PRIu64 ", dstlen: %" PRIu64 "\n",
 				      fromlen, *dstlen));
@@ -1562,13 +1601,13 @@ dict_encode(uint8_t *from, uint64_t fromlen, uint8_t *to, uint64_t *dstlen, int
 }
 
 int
-dict_decode(uint8_t *from, uint64_t fromlen, uint8_t *to, uint64_t *dstlen)
+dict_decode(uint8_t *from, uint64_t fromlen, uint8_t *to, uint64_t *dstlen, int nthreads)
 {
 	DictFilter *df = DictFilter::getInstance();
 	u32 fl;
 	u32 dl;
 	u8 *src;
-	int rv, is_fasta;
+	int rv, type;
 	DEBUG_STAT_EN(double strt, en);
 
 	if (fromlen > UINT32_MAX) {
@@ -1578,7 +1617,7 @@ dict_decode(uint8_t *from, uint64_t fromlen, uint8_t *to, uint64_t *dstlen)
 
 	fl = (u32)fromlen;
 	DEBUG_STAT_EN(strt = get_wtime_millis());
-	dl = U32_P(from);
+	dl = LE32(U32_P(from));
 	if (dl > *dstlen) {
 		log_msg(LOG_ERR, 0, "Destination overflow in dict_decode. Need: %" PRIu64 ", Got: %" PRIu64 "\n",
 		    dl, *dstlen);
@@ -1587,13 +1626,16 @@ dict_decode(uint8_t *from, uint64_t fromlen, uint8_t *to, uint64_t *dstlen)
 	*dstlen = dl;
 	src = from + 4;
 	fl -= 4;
-	is_fasta = *src++;
+	type = *src++;
 	fl--;
 
-	if (!is_fasta)
-		rv = df->Inverse_Dict(src, fl, to, &dl);
-	else
+	if (type == DICT_TYPE_FASTA)
 		rv = df->Inverse_Dict_Fasta(src, fl, to, &dl);
+	else if (type == DICT_TYPE_TEXT || type == DICT_TYPE_TEXT_SPLIT)
+		rv = df->Inverse_Dict(src, fl, to, &dl, (type == DICT_TYPE_TEXT_SPLIT),
+		    nthreads);
+	else
+		rv = 0;
 	if (!rv) {
 		log_msg(LOG_ERR, 0, "dict_decode: Failed.\n");
 		return (-1);
@@ -58,11 +58,6 @@ See also the bsc and libbsc web site:
 
 --*/
 
-/*
- *  TODO: Port the parallel implementation.
- */
-#undef LZP_OPENMP
-
 #ifndef __STDC_FORMAT_MACROS
 #define	__STDC_FORMAT_MACROS	1
 #endif
@@ -73,6 +68,7 @@ See also the bsc and libbsc web site:
 #include <allocator.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <utils.h>
 
 #include "lzp.h"
@@ -240,9 +236,20 @@ int bsc_lzp_decode_block(const unsigned char * input, const unsigned char * inpu
                         reference -= offset[output - reference];
                     }
 
-                    while (output < outputEnd) { *(unsigned int *)output = *(unsigned int*)reference; output += 4; reference += 4; }
+                    /*
+                     * The distance to the reference is now a multiple of the
+                     * repeat period, so copy non-overlapping, growing runs. This
+                     * never writes past outputEnd, which matters when adjacent
+                     * blocks are decoded by different threads.
+                     */
+                    while (output < outputEnd)
+                    {
+                        int64_t run = output - reference;
+                        if (run > outputEnd - output) run = outputEnd - output;
+                        memcpy(output, reference, run); output += run;
+                    }
 
-                    output = outputEnd; context = output[-1] | (output[-2] << 8) | (output[-3] << 16) | (output[-4] << 24);
+                    context = output[-1] | (output[-2] << 8) | (output[-3] << 16) | (output[-4] << 24);
                 }
                 else
                 {
@@ -312,104 +319,197 @@ int64_t bsc_lzp_compress_serial(const unsigned char * input, unsigned char * out
     return outputPtr;
 }
 
-#ifdef LZP_OPENMP
-
-static
-int bsc_lzp_compress_parallel(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen)
+/*
+ * Sub-blocks are independent of each other, so they can be processed by
+ * separate threads. Block j is handled by thread (j % nthreads).
+ */
+typedef struct {
+    const unsigned char *input;
+    unsigned char *output;
+    unsigned char *buffer;
+    int64_t *inputPtr;
+    int64_t *outputPtr;
+    int *blockSize;
+    int *result;
+    int nBlocks;
+    int hashSize;
+    int minLen;
+    int tid;
+    int nthreads;
+} lzp_thread_t;
+
+static void *
+lzp_encode_thread(void *dat)
 {
-    if (unsigned char * buffer = (unsigned char *)bsc_malloc(n * sizeof(unsigned char)))
+    lzp_thread_t *lt = (lzp_thread_t *)dat;
+    int blockId;
+
+    for (blockId = lt->tid; blockId < lt->nBlocks; blockId += lt->nthreads)
     {
-        int compressionResult[ALPHABET_SIZE];
+        int64_t blockStart = lt->inputPtr[blockId];
+        int     blockSize  = lt->blockSize[blockId];
 
-        int nBlocks   = bsc_lzp_num_blocks(n);
-        int result    = LZP_NO_ERROR;
-        int chunkSize = n / nBlocks;
+        lt->result[blockId] = bsc_lzp_encode_block(lt->input + blockStart, lt->input + blockStart + blockSize, lt->buffer + blockStart, lt->buffer + blockStart + blockSize, lt->hashSize, lt->minLen);
+    }
+    return (NULL);
+}
+
+static void *
+lzp_decode_thread(void *dat)
+{
+    lzp_thread_t *lt = (lzp_thread_t *)dat;
+    int blockId;
 
-        int numThreads = omp_get_max_threads();
-        if (numThreads > nBlocks) numThreads = nBlocks;
+    for (blockId = lt->tid; blockId < lt->nBlocks; blockId += lt->nthreads)
+    {
+        int64_t inputPtr   = lt->inputPtr[blockId];
+        int64_t outputPtr  = lt->outputPtr[blockId];
+        int     inputSize  = *(int *)(lt->input + 1 + 8 * blockId + 4);
+        int     outputSize = lt->blockSize[blockId];
 
-        output[0] = nBlocks;
-        #pragma omp parallel num_threads(numThreads) if(numThreads > 1)
+        if (inputSize != outputSize)
         {
-            if (omp_get_num_threads() == 1)
-            {
-                result = bsc_lzp_compress_serial(input, output, n, hashSize, minLen);
-            }
-            else
-            {
-                #pragma omp for schedule(dynamic)
-                for (int blockId = 0; blockId < nBlocks; ++blockId)
-                {
-                    int blockStart   = blockId * chunkSize;
-                    int blockSize    = blockId != nBlocks - 1 ? chunkSize : n - blockStart;
+            lt->result[blockId] = bsc_lzp_decode_block(lt->input + inputPtr, lt->input + inputPtr + inputSize, lt->output + outputPtr, lt->hashSize, lt->minLen);
+        }
+        else
+        {
+            lt->result[blockId] = inputSize; memcpy(lt->output + outputPtr, lt->input + inputPtr, inputSize);
+        }
+    }
+    return (NULL);
+}
 
-                    compressionResult[blockId] = bsc_lzp_encode_block(input + blockStart, input + blockStart + blockSize, buffer + blockStart, buffer + blockStart + blockSize, hashSize, minLen);
-                    if (compressionResult[blockId] < LZP_NO_ERROR) compressionResult[blockId] = blockSize;
+/*
+ * Run the given worker over all blocks using upto nthreads threads. The
+ * calling thread does its share of the work as well. If a thread cannot
+ * be created its share of blocks is done by the calling thread.
+ */
+static void
+lzp_run_threads(lzp_thread_t *proto, int nthreads, void *(*worker)(void *))
+{
+    lzp_thread_t lt[ALPHABET_SIZE];
+    pthread_t thr[ALPHABET_SIZE];
+    int created[ALPHABET_SIZE];
+    int t;
 
-                    *(int *)(output + 1 + 8 * blockId + 0) = blockSize;
-                    *(int *)(output + 1 + 8 * blockId + 4) = compressionResult[blockId];
-                }
+    if (nthreads > proto->nBlocks) nthreads = proto->nBlocks;
+    for (t = 0; t < nthreads; ++t)
+    {
+        lt[t] = *proto;
+        lt[t].tid = t;
+        lt[t].nthreads = nthreads;
+        created[t] = 0;
+        if (t > 0 && pthread_create(&thr[t], NULL, worker, &lt[t]) == 0)
+            created[t] = 1;
+    }
 
-                #pragma omp single
-                {
-                    result = 1 + 8 * nBlocks;
-                    for (int blockId = 0; blockId < nBlocks; ++blockId)
-                    {
-                        result += compressionResult[blockId];
-                    }
+    for (t = 0; t < nthreads; ++t)
+    {
+        if (!created[t]) worker(&lt[t]);
+    }
+    for (t = 1; t < nthreads; ++t)
+    {
+        if (created[t]) pthread_join(thr[t], NULL);
+    }
+}
 
-                    if (result >= n) result = LZP_NOT_COMPRESSIBLE;
-                }
+static
+int64_t bsc_lzp_compress_parallel(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int nthreads)
+{
+    int compressionResult[ALPHABET_SIZE], blockSize[ALPHABET_SIZE];
+    int64_t inputPtr[ALPHABET_SIZE];
+    int nBlocks   = bsc_lzp_num_blocks(n);
+    int64_t chunkSize, outputPtr;
+    int blockId;
+    lzp_thread_t lt;
+    unsigned char *buffer;
+    DEBUG_STAT_EN(double strt, en);
 
-                if (result >= LZP_NO_ERROR)
-                {
-                    #pragma omp for schedule(dynamic)
-                    for (int blockId = 0; blockId < nBlocks; ++blockId)
-                    {
-                        int blockStart   = blockId * chunkSize;
-                        int blockSize    = blockId != nBlocks - 1 ? chunkSize : n - blockStart;
-
-                        int outputPtr = 1 + 8 * nBlocks;
-                        for (int p = 0; p < blockId; ++p) outputPtr += compressionResult[p];
-
-                        if (compressionResult[blockId] != blockSize)
-                        {
-                            memcpy(output + outputPtr, buffer + blockStart, compressionResult[blockId]);
-                        }
-                        else
-                        {
-                            memcpy(output + outputPtr, input + blockStart, compressionResult[blockId]);
-                        }
-                    }
-                }
+    if (nBlocks >= ALPHABET_SIZE)
+        return bsc_lzp_compress_serial(input, output, n, hashSize, minLen);
+
+    buffer = (unsigned char *)slab_alloc(NULL, n);
+    if (buffer == NULL)
+        return LZP_NOT_ENOUGH_MEMORY;
+
+    DEBUG_STAT_EN(strt = get_wtime_millis());
+    if (n > LZP_MAX_BLOCK)
+        chunkSize = LZP_MAX_BLOCK;
+    else
+        chunkSize = n / nBlocks;
+
+    for (blockId = 0; blockId < nBlocks; ++blockId)
+    {
+        inputPtr[blockId]  = blockId * chunkSize;
+        blockSize[blockId] = blockId != nBlocks - 1 ? chunkSize : n - inputPtr[blockId];
+    }
+
+    lt.input = input;
+    lt.output = output;
+    lt.buffer = buffer;
+    lt.inputPtr = inputPtr;
+    lt.outputPtr = NULL;
+    lt.blockSize = blockSize;
+    lt.result = compressionResult;
+    lt.nBlocks = nBlocks;
+    lt.hashSize = hashSize;
+    lt.minLen = minLen;
+    lzp_run_threads(&lt, nthreads, lzp_encode_thread);
+
+    /*
+     * Assemble the blocks in order. Blocks that did not compress are
+     * stored as-is, just like the serial version.
+     */
+    output[0] = nBlocks;
+    outputPtr = 1 + 8 * nBlocks;
+    for (blockId = 0; blockId < nBlocks; ++blockId)
+    {
+        int result = compressionResult[blockId];
+
+        if (result < LZP_NO_ERROR || result >= blockSize[blockId])
+        {
+            result = blockSize[blockId];
+            if (outputPtr + result >= n)
+            {
+                slab_free(NULL, buffer);
+                return LZP_NOT_COMPRESSIBLE;
             }
+            memcpy(output + outputPtr, input + inputPtr[blockId], result);
+        }
+        else
+        {
+            if (outputPtr + result >= n)
+            {
+                slab_free(NULL, buffer);
+                return LZP_NOT_COMPRESSIBLE;
+            }
+            memcpy(output + outputPtr, buffer + inputPtr[blockId], result);
         }
 
-        bsc_free(buffer);
+        *(int *)(output + 1 + 8 * blockId + 0) = blockSize[blockId];
+        *(int *)(output + 1 + 8 * blockId + 4) = result;
 
-        return result;
+        outputPtr += result;
     }
-    return LZP_NOT_ENOUGH_MEMORY;
-}
+    slab_free(NULL, buffer);
+    DEBUG_STAT_EN(en = get_wtime_millis());
 
-#endif
+    DEBUG_STAT_EN(fprintf(stderr, "LZP: Insize: %" PRId64 ", Outsize: %" PRId64 "\n", n, outputPtr));
+    DEBUG_STAT_EN(fprintf(stderr, "LZP: Processed at %.3f MB/s\n", get_mb_s(n, strt, en)));
+    return outputPtr;
+}
 
-int64_t lzp_compress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features)
+int64_t lzp_compress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features, int nthreads)
 {
-
-#ifdef LZP_OPENMP
-
-    if ((bsc_lzp_num_blocks(n) != 1) && (features & LZP_FEATURE_MULTITHREADING))
+    if ((bsc_lzp_num_blocks(n) != 1) && nthreads > 1)
     {
-        return bsc_lzp_compress_parallel(input, output, n, hashSize, minLen);
+        return bsc_lzp_compress_parallel(input, output, n, hashSize, minLen, nthreads);
     }
 
-#endif
-
     return bsc_lzp_compress_serial(input, output, n, hashSize, minLen);
 }
 
-int64_t lzp_decompress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features)
+int64_t lzp_decompress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features, int nthreads)
 {
     int nBlocks = input[0];
 
@@ -418,64 +518,54 @@ int64_t lzp_decompress(const unsigned char * input, unsigned char * output, int6
         return bsc_lzp_decode_block(input + 1, input + n, output, hashSize, minLen);
     }
 
-    int decompressionResult[ALPHABET_SIZE];
+    int decompressionResult[ALPHABET_SIZE], blockSize[ALPHABET_SIZE];
+    int64_t inputPtr[ALPHABET_SIZE], outputPtr[ALPHABET_SIZE];
+    int64_t ip, op;
+    int blockId;
+    lzp_thread_t lt;
 
-#ifdef LZP_OPENMP
+    if (nBlocks == 0 || 1 + 8 * nBlocks > n)
+        return LZP_UNEXPECTED_EOB;
 
-    if (features & LZP_FEATURE_MULTITHREADING)
+    ip = 1 + 8 * nBlocks;
+    op = 0;
+    for (blockId = 0; blockId < nBlocks; ++blockId)
     {
-        #pragma omp parallel for schedule(dynamic)
-        for (int blockId = 0; blockId < nBlocks; ++blockId)
-        {
-            int inputPtr = 0;  for (int p = 0; p < blockId; ++p) inputPtr  += *(int *)(input + 1 + 8 * p + 4);
-            int outputPtr = 0; for (int p = 0; p < blockId; ++p) outputPtr += *(int *)(input + 1 + 8 * p + 0);
-
-            inputPtr += 1 + 8 * nBlocks;
-
-            int inputSize  = *(int *)(input + 1 + 8 * blockId + 4);
-            int outputSize = *(int *)(input + 1 + 8 * blockId + 0);
+        int inputSize  = *(int *)(input + 1 + 8 * blockId + 4);
+        int outputSize = *(int *)(input + 1 + 8 * blockId + 0);
+
+        if (inputSize < 0 || outputSize < 0 || inputSize > n - ip)
+            return LZP_UNEXPECTED_EOB;
+        inputPtr[blockId]  = ip;
+        outputPtr[blockId] = op;
+        blockSize[blockId] = outputSize;
+        ip += inputSize;
+        op += outputSize;
+    }
 
-            if (inputSize != outputSize)
-            {
-                decompressionResult[blockId] = bsc_lzp_decode_block(input + inputPtr, input + inputPtr + inputSize, output + outputPtr, hashSize, minLen);
-            }
-            else
-            {
-                decompressionResult[blockId] = inputSize; memcpy(output + outputPtr, input + inputPtr, inputSize);
-            }
-        }
+    lt.input = input;
+    lt.output = output;
+    lt.buffer = NULL;
+    lt.inputPtr = inputPtr;
+    lt.outputPtr = outputPtr;
+    lt.blockSize = blockSize;
+    lt.result = decompressionResult;
+    lt.nBlocks = nBlocks;
+    lt.hashSize = hashSize;
+    lt.minLen = minLen;
+    if (nthreads > 1)
+    {
+        lzp_run_threads(&lt, nthreads, lzp_decode_thread);
     }
     else
-
-#endif
-
     {
-	int blockId, p;
-
-        for (blockId = 0; blockId < nBlocks; ++blockId)
-        {
-            int64_t inputPtr = 0;  for (p = 0; p < blockId; ++p) inputPtr  += *(int *)(input + 1 + 8 * p + 4);
-            int64_t outputPtr = 0; for (p = 0; p < blockId; ++p) outputPtr += *(int *)(input + 1 + 8 * p + 0);
-
-            inputPtr += 1 + 8 * nBlocks;
-
-            int inputSize  = *(int *)(input + 1 + 8 * blockId + 4);
-            int outputSize = *(int *)(input + 1 + 8 * blockId + 0);
-
-            if (inputSize != outputSize)
-            {
-                decompressionResult[blockId] = bsc_lzp_decode_block(input + inputPtr, input + inputPtr + inputSize, output + outputPtr, hashSize, minLen);
-            }
-            else
-            {
-                decompressionResult[blockId] = inputSize; memcpy(output + outputPtr, input + inputPtr, inputSize);
-            }
-        }
+        lt.tid = 0;
+        lt.nthreads = 1;
+        lzp_decode_thread(&lt);
     }
 
     int64_t dataSize = 0;
     int result = LZP_NO_ERROR;
-    int blockId;
     for (blockId = 0; blockId < nBlocks; ++blockId)
     {
         if (decompressionResult[blockId] < LZP_NO_ERROR) result = decompressionResult[blockId];
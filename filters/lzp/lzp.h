@@ -86,9 +86,10 @@ extern "C" {
     * @param hashSize   - the hash table size.
     * @param minLen     - the minimum match length.
     * @param features   - the set of additional features.
+    * @param nthreads   - the maximum number of threads to use for independent sub-blocks.
     * @return The length of preprocessed memory block if no error occurred, error code otherwise.
     */
-    int64_t lzp_compress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features);
+    int64_t lzp_compress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features, int nthreads);
 
     /**
     * Reconstructs the original memory block after LZP algorithm.
@@ -98,9 +99,10 @@ extern "C" {
     * @param hashSize   - the hash table size.
     * @param minLen     - the minimum match length.
     * @param features   - the set of additional features.
+    * @param nthreads   - the maximum number of threads to use for independent sub-blocks.
     * @return The length of original memory block if no error occurred, error code otherwise.
     */
-    int64_t lzp_decompress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features);
+    int64_t lzp_decompress(const unsigned char * input, unsigned char * output, int64_t n, int hashSize, int minLen, int features, int nthreads);
 
     int lzp_hash_size(int level);
 #ifdef __cplusplus
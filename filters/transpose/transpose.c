@@ -22,33 +22,281 @@
  * moinakg@belenix.org, http://moinakg.wordpress.com/
  */
 
+#include <string.h>
 #include "transpose.h"
 
+#if defined(__USE_SSE_INTRIN__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__USE_SSE_INTRIN__) && defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+/*
+ * Tile size for the generic transpose. A 64x64 tile of source and target
+ * bytes stays within L1 cache.
+ */
+#define	TRANSP_TILE	64
+
+/*
+ * Records are processed in groups of this many with SIMD.
+ */
+#define	TRANSP_GRP	16
+
+/*
+ * Transpose a matrix of nrows rows of ncols bytes each, so that the bytes
+ * of column c end up in row c of the target: to[c * nrows + r] =
+ * from[r * ncols + c]. The matrix is processed in tiles so that neither the
+ * source nor the target is accessed with a large stride across the whole
+ * buffer. Only rows from r0 and columns from c0 onwards are processed.
+ */
+static void
+transpose_tiled(unsigned char *from, unsigned char *to, uint64_t nrows, uint64_t ncols,
+		uint64_t r0, uint64_t c0)
+{
+	uint64_t rt, ct, r, c, re, ce;
+
+	for (rt = r0; rt < nrows; rt += TRANSP_TILE) {
+		re = rt + TRANSP_TILE;
+		if (re > nrows)
+			re = nrows;
+		for (ct = c0; ct < ncols; ct += TRANSP_TILE) {
+			ce = ct + TRANSP_TILE;
+			if (ce > ncols)
+				ce = ncols;
+			for (c = ct; c < ce; c++) {
+				unsigned char *t = to + c * nrows;
+
+				for (r = rt; r < re; r++)
+					t[r] = from[r * ncols + c];
+			}
+		}
+	}
+}
+
+/*
+ * Split 16 records of 2, 4 or 8 bytes into their byte columns. Column c of
+ * the records is written to to + c * nrows. Returns the number of records
+ * processed.
+ */
+static uint64_t
+split_records(unsigned char *from, unsigned char *to, uint64_t nrows, uint64_t stride)
+{
+	uint64_t r = 0;
+
+#if defined(__USE_SSE_INTRIN__) && defined(__SSE2__)
+	if (stride == 2) {
+		__m128i m = _mm_set1_epi16(0xff);
+
+		for (; r + TRANSP_GRP <= nrows; r += TRANSP_GRP) {
+			__m128i a = _mm_loadu_si128((__m128i *)(from + r * 2));
+			__m128i b = _mm_loadu_si128((__m128i *)(from + r * 2 + 16));
+
+			_mm_storeu_si128((__m128i *)(to + r), _mm_packus_epi16(
+			    _mm_and_si128(a, m), _mm_and_si128(b, m)));
+			_mm_storeu_si128((__m128i *)(to + nrows + r), _mm_packus_epi16(
+			    _mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+		}
+	}
+#endif
+#if defined(__USE_SSE_INTRIN__) && defined(__SSSE3__)
+	if (stride == 4) {
+		__m128i shuf = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14,
+		    3, 7, 11, 15);
+
+		for (; r + TRANSP_GRP <= nrows; r += TRANSP_GRP) {
+			__m128i x0, x1, x2, x3, t0, t1, t2, t3;
+			unsigned char *f = from + r * 4;
+
+			x0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)f), shuf);
+			x1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(f + 16)), shuf);
+			x2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(f + 32)), shuf);
+			x3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(f + 48)), shuf);
+			t0 = _mm_unpacklo_epi32(x0, x1);
+			t1 = _mm_unpackhi_epi32(x0, x1);
+			t2 = _mm_unpacklo_epi32(x2, x3);
+			t3 = _mm_unpackhi_epi32(x2, x3);
+			_mm_storeu_si128((__m128i *)(to + r), _mm_unpacklo_epi64(t0, t2));
+			_mm_storeu_si128((__m128i *)(to + nrows + r), _mm_unpackhi_epi64(t0, t2));
+			_mm_storeu_si128((__m128i *)(to + nrows * 2 + r), _mm_unpacklo_epi64(t1, t3));
+			_mm_storeu_si128((__m128i *)(to + nrows * 3 + r), _mm_unpackhi_epi64(t1, t3));
+		}
+
+	} else if (stride == 8) {
+		__m128i shuf = _mm_setr_epi8(0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13,
+		    6, 14, 7, 15);
+
+		for (; r + TRANSP_GRP <= nrows; r += TRANSP_GRP) {
+			__m128i x[8], a[8], b[8];
+			unsigned char *f = from + r * 8;
+			int k;
+
+			for (k = 0; k < 8; k++)
+				x[k] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(f + k * 16)), shuf);
+			for (k = 0; k < 8; k += 2) {
+				a[k] = _mm_unpacklo_epi16(x[k], x[k + 1]);
+				a[k + 1] = _mm_unpackhi_epi16(x[k], x[k + 1]);
+			}
+			for (k = 0; k < 8; k += 4) {
+				b[k] = _mm_unpacklo_epi32(a[k], a[k + 2]);
+				b[k + 1] = _mm_unpackhi_epi32(a[k], a[k + 2]);
+				b[k + 2] = _mm_unpacklo_epi32(a[k + 1], a[k + 3]);
+				b[k + 3] = _mm_unpackhi_epi32(a[k + 1], a[k + 3]);
+			}
+			for (k = 0; k < 4; k++) {
+				_mm_storeu_si128((__m128i *)(to + nrows * (k * 2) + r),
+				    _mm_unpacklo_epi64(b[k], b[k + 4]));
+				_mm_storeu_si128((__m128i *)(to + nrows * (k * 2 + 1) + r),
+				    _mm_unpackhi_epi64(b[k], b[k + 4]));
+			}
+		}
+	}
+#endif
+	return (r);
+}
+
+/*
+ * Inverse of split_records(). Interleave 16 bytes from each of the 2, 4 or 8
+ * byte columns at from + c * ncols back into records. Returns the number of
+ * records processed.
+ */
+static uint64_t
+join_records(unsigned char *from, unsigned char *to, uint64_t ncols, uint64_t stride)
+{
+	uint64_t r = 0;
+
+#if defined(__USE_SSE_INTRIN__) && defined(__SSE2__)
+	if (stride == 2) {
+		for (; r + TRANSP_GRP <= ncols; r += TRANSP_GRP) {
+			__m128i c0 = _mm_loadu_si128((__m128i *)(from + r));
+			__m128i c1 = _mm_loadu_si128((__m128i *)(from + ncols + r));
+
+			_mm_storeu_si128((__m128i *)(to + r * 2), _mm_unpacklo_epi8(c0, c1));
+			_mm_storeu_si128((__m128i *)(to + r * 2 + 16), _mm_unpackhi_epi8(c0, c1));
+		}
+
+	} else if (stride == 4) {
+		for (; r + TRANSP_GRP <= ncols; r += TRANSP_GRP) {
+			__m128i c0, c1, c2, c3, t0, t1, t2, t3;
+			unsigned char *t = to + r * 4;
+
+			c0 = _mm_loadu_si128((__m128i *)(from + r));
+			c1 = _mm_loadu_si128((__m128i *)(from + ncols + r));
+			c2 = _mm_loadu_si128((__m128i *)(from + ncols * 2 + r));
+			c3 = _mm_loadu_si128((__m128i *)(from + ncols * 3 + r));
+			t0 = _mm_unpacklo_epi8(c0, c1);
+			t1 = _mm_unpackhi_epi8(c0, c1);
+			t2 = _mm_unpacklo_epi8(c2, c3);
+			t3 = _mm_unpackhi_epi8(c2, c3);
+			_mm_storeu_si128((__m128i *)t, _mm_unpacklo_epi16(t0, t2));
+			_mm_storeu_si128((__m128i *)(t + 16), _mm_unpackhi_epi16(t0, t2));
+			_mm_storeu_si128((__m128i *)(t + 32), _mm_unpacklo_epi16(t1, t3));
+			_mm_storeu_si128((__m128i *)(t + 48), _mm_unpackhi_epi16(t1, t3));
+		}
+
+	} else if (stride == 8) {
+		for (; r + TRANSP_GRP <= ncols; r += TRANSP_GRP) {
+			__m128i c[8], t[8], u[8];
+			unsigned char *o = to + r * 8;
+			int k;
+
+			for (k = 0; k < 8; k++)
+				c[k] = _mm_loadu_si128((__m128i *)(from + ncols * k + r));
+			for (k = 0; k < 8; k += 2) {
+				t[k] = _mm_unpacklo_epi8(c[k], c[k + 1]);
+				t[k + 1] = _mm_unpackhi_epi8(c[k], c[k + 1]);
+			}
+			for (k = 0; k < 8; k += 4) {
+				u[k] = _mm_unpacklo_epi16(t[k], t[k + 2]);
+				u[k + 1] = _mm_unpackhi_epi16(t[k], t[k + 2]);
+				u[k + 2] = _mm_unpacklo_epi16(t[k + 1], t[k + 3]);
+				u[k + 3] = _mm_unpackhi_epi16(t[k + 1], t[k + 3]);
+			}
+			for (k = 0; k < 4; k++) {
+				_mm_storeu_si128((__m128i *)(o + k * 32), _mm_unpacklo_epi32(u[k], u[k + 4]));
+				_mm_storeu_si128((__m128i *)(o + k * 32 + 16), _mm_unpackhi_epi32(u[k], u[k + 4]));
+			}
+		}
+	}
+#endif
+	return (r);
+}
+
 /*
  * Perform a simple matrix transpose of the given buffer in "from".
  * If the buffer contains tables of numbers or structured data a
  * transpose can potentially help improve compression ratio by
  * bringing repeating values in columns into row ordering.
+ * Strides of 2, 4 and 8 bytes use SIMD byte shuffles, other strides use
+ * a cache blocked loop. Any trailing partial row is not copied.
  */
 void
 transpose(unsigned char *from, unsigned char *to, uint64_t buflen, uint64_t stride, rowcol_t rc)
 {
-	uint64_t rows, cols, i, j, k, l;
+	uint64_t rows, cols, r, c;
 
 	if (rc == ROW) {
 		rows = buflen / stride;
 		cols = stride;
+		r = split_records(from, to, rows, stride);
+		transpose_tiled(from, to, rows, cols, r, 0);
 	} else {
 		cols = buflen / stride;
 		rows = stride;
+		c = join_records(from, to, cols, stride);
+		if (rows < TRANSP_TILE) {
+			uint64_t i, j;
+
+			for (j = 0; j < rows; j++) {
+				for (i = c; i < cols; i++)
+					to[j + i * rows] = from[i + j * cols];
+			}
+		} else {
+			transpose_tiled(from, to, rows, cols, 0, c);
+		}
 	}
-	k = 0;
-	for (j = 0; j < rows; j++) {
-		l = 0;
-		for (i = 0; i < cols; i++) {
-			to[j + l] = from[i + k];
-			l += rows;
-		}
-		k += cols;
-	}
+}
+
+/*
+ * Preprocessing filter for fixed width binary records. The output is a
+ * 1 Byte stride followed by the transposed records. Any trailing bytes that
+ * do not make up a full record are copied as is.
+ */
+int
+transpose_encode(unsigned char *src, uint64_t srclen, unsigned char *dst,
+		 uint64_t *dstlen, int stride)
+{
+	uint64_t len;
+
+	if ((stride != 2 && stride != 4 && stride != 8) || srclen < TRANSP_TILE ||
+	    *dstlen < srclen + 1)
+		return (-1);
+
+	len = srclen - (srclen % stride);
+	dst[0] = stride;
+	transpose(src, dst + 1, len, stride, ROW);
+	memcpy(dst + 1 + len, src + len, srclen - len);
+	*dstlen = srclen + 1;
+	return (0);
+}
+
+int
+transpose_decode(unsigned char *src, uint64_t srclen, unsigned char *dst,
+		 uint64_t *dstlen)
+{
+	uint64_t len;
+	int stride;
+
+	if (srclen < 1)
+		return (-1);
+	stride = src[0];
+	srclen--;
+	if ((stride != 2 && stride != 4 && stride != 8) || *dstlen < srclen)
+		return (-1);
+
+	len = srclen - (srclen % stride);
+	transpose(src + 1, dst, len, stride, COL);
+	memcpy(dst + len, src + 1 + len, srclen - len);
+	*dstlen = srclen;
+	return (0);
 }
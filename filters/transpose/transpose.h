@@ -40,6 +40,10 @@ typedef enum {
 
 void transpose(unsigned char *from, unsigned char *to, uint64_t buflen,
 	       uint64_t stride, rowcol_t rc);
+int transpose_encode(unsigned char *src, uint64_t srclen, unsigned char *dst,
+		     uint64_t *dstlen, int stride);
+int transpose_decode(unsigned char *src, uint64_t srclen, unsigned char *dst,
+		     uint64_t *dstlen);
 
 #ifdef	__cplusplus
 }
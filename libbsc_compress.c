@@ -89,6 +89,8 @@ libbsc_props(algo_props_t *data, int level, uint64_t chunksize) {
 	data->buf_extra = 0;
 	data->c_max_threads = 8;
 	data->d_max_threads = 8;
+	data->state_mem = chunksize * 6; /* Approximate BWT and LZP working memory. */
+	data->dstate_mem = data->state_mem;
 	data->delta2_span = 150;
 	if (chunksize > (EIGHTM * 2)) 
 		data->deltac_min_distance = FOURM;
@@ -111,6 +113,7 @@ libbsc_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	bscdat = slab_alloc(NULL, sizeof (struct libbsc_params));
 
 	bscdat->features = LIBBSC_FEATURE_FASTMODE;
+	bscdat->oldversion = 0;
 	if (nthreads > 1)
 		bscdat->features |= LIBBSC_FEATURE_MULTITHREADING;
 
@@ -137,7 +140,12 @@ libbsc_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		bscdat->oldversion = 1;
 	}
 	*data = bscdat;
-	rv = bsc_init(bscdat->features);
+
+	/*
+	 * Features are recorded in the compressed block, so large pages are only
+	 * requested at init time where they affect allocation alone.
+	 */
+	rv = bsc_init(bscdat->features | (slab_hugepages() ? LIBBSC_FEATURE_LARGEPAGES : 0));
 	if (rv != LIBBSC_NO_ERROR) {
 		libbsc_err(rv);
 		return (-1);
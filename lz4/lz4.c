@@ -702,6 +702,230 @@ int LZ4_compress(const char* source,
 
 
 
+//****************************
+// Accelerated and Dictionary compression
+//****************************
+
+// Positions are tracked as U32 indexes into a virtual stream in which the
+// dictionary occupies [0, dictSize) and the source block follows it. The
+// dictionary does not have to be contiguous with the source in memory.
+// The dictionary and the block share one table, so the larger table of
+// the 64K block compressor is used.
+
+struct dictTables
+{
+    U32 hashTable[HASH64KTABLESIZE];
+};
+
+#define LZ4_DICT_CLAMP(d,s)   if ((s) > LZ4_DICT_MAX) { (d) += (s) - LZ4_DICT_MAX; (s) = LZ4_DICT_MAX; }
+
+int LZ4_sizeofDictState(void) { return sizeof(struct dictTables); }
+
+void LZ4_loadDict(void* state, const char* dict, int dictSize)
+{
+    U32* const HashTable = ((struct dictTables*)state)->hashTable;
+    const BYTE* p;
+    const BYTE* dend;
+
+    LZ4_DICT_CLAMP(dict, dictSize);
+    memset((void*)HashTable, 0, sizeof(struct dictTables));
+    if (dictSize < MINMATCH) return;
+
+    p = (const BYTE*)dict;
+    dend = p + dictSize - MINMATCH;
+    for ( ; p <= dend; p++) HashTable[LZ4_HASH64K_VALUE(p)] = (U32)(p - (const BYTE*)dict);
+}
+
+static inline const BYTE* LZ4_countMatch(const BYTE* ip, const BYTE* ref, const BYTE* const limit)
+{
+    while likely(ip<limit-(STEPSIZE-1))
+    {
+        UARCH diff = AARCH(ref) ^ AARCH(ip);
+        if (!diff) { ip+=STEPSIZE; ref+=STEPSIZE; continue; }
+        return ip + LZ4_NbCommonBytes(diff);
+    }
+    if (LZ4_ARCH64) if ((ip<(limit-3)) && (A32(ref) == A32(ip))) { ip+=4; ref+=4; }
+    if ((ip<(limit-1)) && (A16(ref) == A16(ip))) { ip+=2; ref+=2; }
+    if ((ip<limit) && (*ref == *ip)) ip++;
+    return ip;
+}
+
+static inline int LZ4_compressDictCtx(const struct dictTables* state,
+                 const char* dict,
+                 int dictSize,
+                 const char* source,
+                 char* dest,
+                 int isize,
+                 int maxOutputSize,
+                 int acceleration)
+{
+    U32 HashTable[HASH64KTABLESIZE];
+
+    const BYTE* const dictStart = (const BYTE*) dict;
+    const BYTE* const dictEnd = dictStart + dictSize;
+    const U32 dictLen = (U32)dictSize;
+    const BYTE* const src = (const BYTE*) source;
+    const BYTE* ip = src;
+    const BYTE* anchor = ip;
+    const BYTE* const iend = ip + isize;
+    const BYTE* const mflimit = iend - MFLIMIT;
+#define matchlimit (iend - LASTLITERALS)
+#define DICT_IDX(p)  ((U32)((p) - src) + dictLen)
+#define DICT_REF(i)  (((i) < dictLen) ? dictStart + (i) : src + ((i) - dictLen))
+
+    BYTE* op = (BYTE*) dest;
+    BYTE* const oend = op + maxOutputSize;
+
+    int len, length;
+    const int skipStrength = SKIPSTRENGTH;
+    U32 forwardH;
+
+
+    // Init
+    if (state) memcpy(HashTable, state->hashTable, sizeof(HashTable));
+    else LZ4_loadDict(HashTable, dict, dictSize);
+    if (isize<MINLENGTH) goto _last_literals;
+
+    // First Byte
+    HashTable[LZ4_HASH64K_VALUE(ip)] = DICT_IDX(ip);
+    ip++; forwardH = LZ4_HASH64K_VALUE(ip);
+
+    // Main Loop
+    for ( ; ; )
+    {
+        int findMatchAttempts = (acceleration << skipStrength) + 3;
+        const BYTE* forwardIp = ip;
+        const BYTE* ref;
+        U32 refIdx;
+        BYTE* token;
+
+        // Find a match
+        do {
+            U32 h = forwardH;
+            int step = findMatchAttempts++ >> skipStrength;
+            ip = forwardIp;
+            forwardIp = ip + step;
+
+            if unlikely(forwardIp > mflimit) { goto _last_literals; }
+
+            forwardH = LZ4_HASH64K_VALUE(forwardIp);
+            refIdx = HashTable[h];
+            ref = DICT_REF(refIdx);
+            HashTable[h] = DICT_IDX(ip);
+
+        } while ((DICT_IDX(ip) - refIdx > MAX_DISTANCE) || (A32(ref) != A32(ip)));
+
+        // Catch up
+        {
+            const BYTE* const lowRef = (refIdx < dictLen) ? dictStart : src;
+            while ((ip>anchor) && (ref>lowRef) && unlikely(ip[-1]==ref[-1])) { ip--; ref--; refIdx--; }
+        }
+
+        // Encode Literal length
+        length = (int)(ip - anchor);
+        token = op++;
+        if unlikely(op + length + (2 + 1 + LASTLITERALS) + (length>>8) > oend) return 0; 		// Check output limit
+        if (length>=(int)RUN_MASK) { *token=(RUN_MASK<<ML_BITS); len = length-RUN_MASK; for(; len > 254 ; len-=255) *op++ = 255; *op++ = (BYTE)len; }
+        else *token = (length<<ML_BITS);
+
+        // Copy Literals
+        LZ4_BLINDCOPY(anchor, op, length);
+
+_next_match:
+        // Encode Offset
+        LZ4_WRITE_LITTLEENDIAN_16(op,(U16)(DICT_IDX(ip)-refIdx));
+
+        // Start Counting. A match in the dictionary can run on into the source.
+        if (refIdx < dictLen)
+        {
+            const BYTE* limit = ip + (dictEnd - ref);
+            if (limit > matchlimit) limit = matchlimit;
+            ip+=MINMATCH; anchor = ip;
+            ip = LZ4_countMatch(ip, ref+MINMATCH, limit);
+            if ((ip == limit) && (limit < matchlimit)) ip = LZ4_countMatch(ip, src, matchlimit);
+        }
+        else
+        {
+            ip+=MINMATCH; anchor = ip;
+            ip = LZ4_countMatch(ip, ref+MINMATCH, matchlimit);
+        }
+
+        // Encode MatchLength
+        len = (int)(ip - anchor);
+        if unlikely(op + (1 + LASTLITERALS) + (len>>8) > oend) return 0; 		// Check output limit
+        if (len>=(int)ML_MASK) { *token+=ML_MASK; len-=ML_MASK; for(; len > 509 ; len-=510) { *op++ = 255; *op++ = 255; } if (len > 254) { len-=255; *op++ = 255; } *op++ = (BYTE)len; }
+        else *token += len;
+
+        // Test end of chunk
+        if (ip > mflimit) { anchor = ip;  break; }
+
+        // Fill table
+        HashTable[LZ4_HASH64K_VALUE(ip-2)] = DICT_IDX(ip-2);
+
+        // Test next position
+        {
+            U32 h = LZ4_HASH64K_VALUE(ip);
+            refIdx = HashTable[h];
+            ref = DICT_REF(refIdx);
+            HashTable[h] = DICT_IDX(ip);
+        }
+        if ((DICT_IDX(ip) - refIdx <= MAX_DISTANCE) && (A32(ref) == A32(ip))) { token = op++; *token=0; goto _next_match; }
+
+        // Prepare next loop
+        anchor = ip++;
+        forwardH = LZ4_HASH64K_VALUE(ip);
+    }
+
+_last_literals:
+    // Encode Last Literals
+    {
+        int lastRun = (int)(iend - anchor);
+        if (((char*)op - dest) + lastRun + 1 + ((lastRun+255-RUN_MASK)/255) > (U32)maxOutputSize) return 0;
+        if (lastRun>=(int)RUN_MASK) { *op++=(RUN_MASK<<ML_BITS); lastRun-=RUN_MASK; for(; lastRun > 254 ; lastRun-=255) *op++ = 255; *op++ = (BYTE) lastRun; }
+        else *op++ = (lastRun<<ML_BITS);
+        memcpy(op, anchor, iend - anchor);
+        op += iend-anchor;
+    }
+
+    // End
+    return (int) (((char*)op)-dest);
+#undef DICT_IDX
+#undef DICT_REF
+}
+
+
+int LZ4_compress_fast_usingDict(const void* state,
+                                const char* dict,
+                                int dictSize,
+                                const char* source,
+                                char* dest,
+                                int isize,
+                                int maxOutputSize,
+                                int acceleration)
+{
+    if (acceleration < 1) acceleration = 1;
+    LZ4_DICT_CLAMP(dict, dictSize);
+
+    // Hash table entries point into the dictionary, so a state is only
+    // meaningful together with a usable dictionary.
+    if (dictSize < MINMATCH) { dictSize = 0; state = NULL; }
+    return LZ4_compressDictCtx((const struct dictTables*)state, dict, dictSize,
+                               source, dest, isize, maxOutputSize, acceleration);
+}
+
+
+int LZ4_compress_fast(const char* source,
+                      char* dest,
+                      int isize,
+                      int maxOutputSize,
+                      int acceleration)
+{
+    if (acceleration <= 1) return LZ4_compress_limitedOutput(source, dest, isize, maxOutputSize);
+    return LZ4_compressDictCtx(NULL, NULL, 0, source, dest, isize, maxOutputSize, acceleration);
+}
+
+
+
 
 //****************************
 // Decompression functions
@@ -886,3 +1110,112 @@ _output_error:
     return (int) (-(((char*)ip)-source));
 }
 
+
+
+int LZ4_uncompress_unknownOutputSize_usingDict(
+                const char* source,
+                char* dest,
+                int isize,
+                int maxOutputSize,
+                const char* dict,
+                int dictSize)
+{
+    // Local Variables
+    const BYTE* restrict ip = (const BYTE*) source;
+    const BYTE* const iend = ip + isize;
+    const BYTE* ref;
+    const BYTE* dictEnd;
+
+    BYTE* op = (BYTE*) dest;
+    BYTE* const oend = op + maxOutputSize;
+    BYTE* cpy;
+
+    size_t dec32table[] = {0, 3, 2, 3, 0, 0, 0, 0};
+#if LZ4_ARCH64
+    size_t dec64table[] = {0, 0, 0, -1, 0, 1, 2, 3};
+#endif
+
+    LZ4_DICT_CLAMP(dict, dictSize);
+    dictEnd = (const BYTE*)dict + dictSize;
+
+    // Main Loop
+    while (ip<iend)
+    {
+        unsigned token;
+        size_t length;
+
+        // get runlength
+        token = *ip++;
+        if ((length=(token>>ML_BITS)) == RUN_MASK) { int s=255; while ((ip<iend) && (s==255)) { s=*ip++; length += s; } }
+
+        // copy literals
+        cpy = op+length;
+        if ((cpy>oend-COPYLENGTH) || (ip+length>iend-COPYLENGTH))
+        {
+            if (cpy > oend) goto _output_error;          // Error : writes beyond output buffer
+            if (ip+length != iend) goto _output_error;   // Error : LZ4 format requires to consume all input at this stage
+            memcpy(op, ip, length);
+            op += length;
+            break;                                       // Necessarily EOF, due to parsing restrictions
+        }
+        LZ4_WILDCOPY(ip, op, cpy); ip -= (op-cpy); op = cpy;
+
+        // get offset
+        LZ4_READ_LITTLEENDIAN_16(ref,cpy,ip); ip+=2;
+
+        // get matchlength
+        if ((length=(token&ML_MASK)) == ML_MASK) { while (ip<iend) { int s = *ip++; length +=s; if (s==255) continue; break; } }
+
+        if unlikely(ref < (BYTE* const)dest)
+        {
+            // Match starts in the dictionary and can run on into dest. This only
+            // happens within the first 64KB of output so a bytewise copy is fine.
+            size_t back = (size_t)((BYTE* const)dest - ref);
+            const BYTE* dref;
+
+            if (back > (size_t)dictSize) goto _output_error;   // Error : offset reaches beyond the dictionary
+            length += MINMATCH;
+            if (length > (size_t)(oend - op)) goto _output_error;
+            dref = dictEnd - back;
+            ref = (BYTE*)dest;
+            while (length--) *op++ = (dref < dictEnd) ? *dref++ : *ref++;
+            continue;
+        }
+
+        // copy repeated sequence
+        if unlikely(op-ref<STEPSIZE)
+        {
+#if LZ4_ARCH64
+            size_t dec64 = dec64table[op-ref];
+#else
+            const int dec64 = 0;
+#endif
+			op[0] = ref[0];
+            op[1] = ref[1];
+            op[2] = ref[2];
+            op[3] = ref[3];
+            op += 4, ref += 4; ref -= dec32table[op-ref];
+            A32(op) = A32(ref); 
+			op += STEPSIZE-4; ref -= dec64;
+        } else { LZ4_COPYSTEP(ref,op); }
+        cpy = op + length - (STEPSIZE-4);
+        if (cpy>oend-COPYLENGTH)
+        {
+            if (cpy > oend) goto _output_error;    // Error : request to write outside of destination buffer
+            LZ4_SECURECOPY(ref, op, (oend-COPYLENGTH));
+            while(op<cpy) *op++=*ref++;
+            op=cpy;
+            if (op == oend) goto _output_error;    // Check EOF (should never happen, since last 5 bytes are supposed to be literals)
+            continue;
+        }
+        LZ4_SECURECOPY(ref, op, cpy);
+        op=cpy;		// correction
+    }
+
+    // end of decoding
+    return (int) (((char*)op)-dest);
+
+    // write overflow error detected
+_output_error:
+    return (int) (-(((char*)ip)-source));
+}
@@ -148,6 +148,49 @@ LZ4_uncompress_unknownOutputSize() :
 */
 
 
+//****************************
+// Acceleration and Dictionary Functions
+//****************************
+
+#define LZ4_DICT_MAX (64 * 1024)
+
+int LZ4_compress_fast (const char* source, char* dest, int isize, int maxOutputSize, int acceleration);
+
+/*
+LZ4_compress_fast() :
+    Same as LZ4_compress_limitedOutput(), but trades compression ratio for speed.
+    acceleration : 1 is the default speed, each successive value skips ahead faster
+                   over data that does not produce matches.
+    return : the number of bytes written in buffer 'dest'
+             or 0 if the compression fails
+*/
+
+
+int  LZ4_sizeofDictState (void);
+void LZ4_loadDict (void* state, const char* dict, int dictSize);
+int  LZ4_compress_fast_usingDict (const void* state, const char* dict, int dictSize,
+                                  const char* source, char* dest, int isize, int maxOutputSize, int acceleration);
+int  LZ4_uncompress_unknownOutputSize_usingDict (const char* source, char* dest, int isize, int maxOutputSize,
+                                                 const char* dict, int dictSize);
+
+/*
+LZ4_compress_fast_usingDict() :
+    Compresses 'source' as if it were preceded by 'dict'. Matches may point back into
+    the dictionary upto the 64KB window. Only the last LZ4_DICT_MAX bytes of a larger
+    dictionary are used. The dictionary need not be contiguous with 'source'.
+    state  : a hash table primed from 'dict' by LZ4_loadDict(), of LZ4_sizeofDictState()
+             bytes. This allows priming once and reusing for many blocks. It is only read.
+             If NULL the dictionary is loaded on every call.
+    return : the number of bytes written in buffer 'dest'
+             or 0 if the compression fails
+
+LZ4_uncompress_unknownOutputSize_usingDict() :
+    Decodes data produced by LZ4_compress_fast_usingDict(). The same dictionary must be
+    given. Has the same safety properties as LZ4_uncompress_unknownOutputSize().
+*/
+
+
+
 #if defined (__cplusplus)
 }
 #endif
@@ -719,3 +719,23 @@ int LZ4_compressHC(const char* source,
 }
 
 
+int LZ4_compressHC_withPrefix(const char* source, 
+				 char* dest,
+				 int isize,
+				 int prefixSize)
+{
+	const BYTE* base;
+	LZ4HC_Data_Structure* ctx;
+	int result;
+
+	if (prefixSize > MAX_DISTANCE + 1) prefixSize = MAX_DISTANCE + 1;
+	base = (const BYTE*)source - prefixSize;
+	ctx = LZ4HC_Create(base);
+
+	// Index the prefix so that matches can reach back into it
+	LZ4HC_Insert(ctx, (const BYTE*)source);
+	result = LZ4_compressHCCtx(ctx, source, dest, isize);
+	LZ4HC_Free (&ctx);
+
+	return result;
+}
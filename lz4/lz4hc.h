@@ -74,6 +74,15 @@ LZ4_compressHC :
 		Worst case size evaluation is provided by function LZ4_compressBound() (see "lz4.h")
 */
 
+int LZ4_compressHC_withPrefix (const char* source, char* dest, int isize, int prefixSize);
+
+/*
+LZ4_compressHC_withPrefix :
+	Same as LZ4_compressHC() but the 'prefixSize' bytes immediately preceding 'source'
+	in memory are used as a dictionary. At most the last 64KB of the prefix are useful.
+	Decode with LZ4_uncompress_unknownOutputSize_usingDict() (see "lz4.h").
+*/
+
 
 /* Note :
 Decompression functions are provided within regular LZ4 source code (see "lz4.h") (BSD license)
@@ -24,7 +24,9 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <strings.h>
 #include <string.h>
 #include <limits.h>
@@ -36,8 +38,36 @@
 
 #define	LZ4_MAX_CHUNK	2147450621L
 
+/*
+ * Chunks larger than LZ4_MAX_CHUNK are split into sub-blocks of this size.
+ * Each sub-block is stored with a 4-byte compressed length prefix and uses
+ * the tail of the previous sub-block as a dictionary.
+ */
+#define	LZ4_SUBBLOCK_SZ		(1UL << 30)
+#define	LZ4_ACCEL_DEFAULT	8
+#define	LZ4_ACCEL_MAX		64
+
+/*
+ * Shared dictionary training parameters. Upto LZ4_TRAIN_SAMPLE bytes of the
+ * held out sample are trial compressed to size the dictionary.
+ */
+#define	LZ4_DICT_SEG		1024
+#define	LZ4_TRAIN_MAX		(16 * 1024 * 1024)
+#define	LZ4_TRAIN_HASH_BITS	18
+#define	LZ4_TRAIN_SAMPLE	ALGO_DICT_SAMPLE
+#define	LZ4_TRAIN_CHUNKS	ALGO_DICT_CHUNKS
+
 struct lz4_params {
 	int level;
+	int accel;
+	compress_op_t op;
+	uint64_t blksz;
+	uchar_t *scratch;
+	uint64_t scratch_len;
+	uchar_t *dict;
+	int dictlen;
+	void *dict_state;
+	uchar_t *stage;
 };
 
 void
@@ -48,9 +78,13 @@ lz4_stats(int show)
 int
 lz4_buf_extra(uint64_t buflen)
 {
-	if (buflen > LZ4_MAX_CHUNK)
-		buflen = LZ4_MAX_CHUNK;
-	return (LZ4_compressBound(buflen) - buflen + sizeof(int));
+	uint64_t nblks;
+
+	if (buflen <= LZ4_MAX_CHUNK)
+		return (LZ4_compressBound(buflen) - buflen + sizeof(int));
+	nblks = (buflen + LZ4_SUBBLOCK_SZ - 1) / LZ4_SUBBLOCK_SZ;
+	return (nblks * (LZ4_compressBound(LZ4_SUBBLOCK_SZ) - LZ4_SUBBLOCK_SZ +
+	    2 * sizeof (int)));
 }
 
 void
@@ -68,17 +102,51 @@ lz4_init(void **data, int *level, int nthreads, uint64_t chunksize,
 {
 	struct lz4_params *lzdat;
 	int lev;
+	char *accel;
 
-	if (chunksize > LZ4_MAX_CHUNK) {
-		log_msg(LOG_ERR, 0, "Max allowed chunk size for LZ4 is: %ld \n",
-		    LZ4_MAX_CHUNK);
+	lzdat = (struct lz4_params *)slab_alloc(NULL, sizeof (struct lz4_params));
+	if (!lzdat) {
+		log_msg(LOG_ERR, 0, "LZ4: Out of memory.");
 		return (1);
 	}
-	lzdat = (struct lz4_params *)slab_alloc(NULL, sizeof (struct lz4_params));
+	memset(lzdat, 0, sizeof (struct lz4_params));
 
 	lev = *level;
 	if (lev > 3) lev = 3;
 	lzdat->level = lev;
+	lzdat->op = op;
+	lzdat->blksz = chunksize;
+	if (chunksize > LZ4_MAX_CHUNK)
+		lzdat->blksz = LZ4_SUBBLOCK_SZ;
+
+	/*
+	 * Level 0 is level 1 with a higher acceleration. Acceleration only
+	 * affects compression, the output format is unchanged.
+	 */
+	lzdat->accel = (lev == 0) ? LZ4_ACCEL_DEFAULT : 1;
+	if ((accel = getenv("PCOMPRESS_LZ4_ACCEL")) != NULL) {
+		lev = atoi(accel);
+		if (lev < 1 || lev > LZ4_ACCEL_MAX) {
+			log_msg(LOG_WARN, 0, "LZ4 acceleration must be in range 1 - %d, "
+			    "ignoring.", LZ4_ACCEL_MAX);
+		} else {
+			lzdat->accel = lev;
+		}
+	}
+
+	/*
+	 * Level 2 passes the output of a fast pass through HC. Keep a per-thread
+	 * buffer for the intermediate data instead of allocating per chunk.
+	 */
+	if (lzdat->level == 2) {
+		lzdat->scratch_len = LZ4_compressBound(lzdat->blksz);
+		lzdat->scratch = (uchar_t *)slab_alloc(NULL, lzdat->scratch_len);
+		if (!lzdat->scratch) {
+			slab_free(NULL, lzdat);
+			log_msg(LOG_ERR, 0, "LZ4: Out of memory.");
+			return (1);
+		}
+	}
 	*data = lzdat;
 
 	if (*level > 9) *level = 9;
@@ -91,44 +159,427 @@ lz4_deinit(void **data)
 	struct lz4_params *lzdat = (struct lz4_params *)(*data);
 
 	if (lzdat) {
+		if (lzdat->scratch)
+			slab_free(NULL, lzdat->scratch);
+		if (lzdat->dict_state)
+			slab_free(NULL, lzdat->dict_state);
+		if (lzdat->stage)
+			slab_free(NULL, lzdat->stage);
 		slab_free(NULL, lzdat);
 	}
 	*data = NULL;
 	return (0);
 }
 
+static int
+lz4_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *((const uint64_t *)a), y = *((const uint64_t *)b);
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * Compressed size of a sample primed with the given dictionary, or without
+ * one if dictlen is 0. Level 3 uses HC, the lower levels the fast compressor.
+ * HC needs the dictionary right before the sample in the stage buffer.
+ */
+static uint64_t
+lz4_dict_trial(uchar_t *sample, int samplelen, uchar_t *dict, int dictlen,
+    int level, uchar_t *out, uchar_t *stage, void *state)
+{
+	int outlen = LZ4_compressBound(samplelen);
+
+	if (level >= 3) {
+		if (dictlen == 0)
+			return (LZ4_compressHC((const char *)sample, (char *)out, samplelen));
+		memcpy(stage, dict, dictlen);
+		memcpy(stage + dictlen, sample, samplelen);
+		return (LZ4_compressHC_withPrefix((const char *)(stage + dictlen),
+		    (char *)out, samplelen, dictlen));
+	}
+	if (dictlen == 0)
+		return (LZ4_compress_limitedOutput((const char *)sample, (char *)out,
+		    samplelen, outlen));
+	LZ4_loadDict(state, (const char *)dict, dictlen);
+	return (LZ4_compress_fast_usingDict(state, (const char *)dict, dictlen,
+	    (const char *)sample, (char *)out, samplelen, outlen, 1));
+}
+
+/*
+ * Build a shared dictionary of upto LZ4_DICT_MAX bytes. The buffer holds
+ * samples of samplelen bytes taken from consecutive chunks of the input,
+ * nchunks is the expected number of chunks or 0 if not known. The level
+ * selects the compressor used to size the dictionary.
+ *
+ * The samples are cut into segments and each segment is scored by how many
+ * of its 8-byte sequences also occur in other samples, so that content that
+ * repeats across chunks is preferred over content that only repeats within
+ * one chunk. With a single sample, repeats within it are counted instead.
+ * The best distinct segments are concatenated with the highest scores last,
+ * so they stay nearest to the data and survive when the dictionary is cut.
+ *
+ * The last sample is held out of the scoring. The dictionary is cut to the
+ * size that saves the most on it, counting that saving for every chunk
+ * against the cost of storing the dictionary once. The net saving must be
+ * at least a quarter of the dictionary size to allow for the estimate being
+ * off. Otherwise no dictionary is returned.
+ */
+int
+lz4_train_dict(uchar_t *buf, uint64_t buflen, uint64_t samplelen, uint64_t nchunks,
+    int level, uchar_t *dict)
+{
+	uint16_t *counts, *last;
+	uint32_t *scores, hist[LZ4_DICT_SEG + 1];
+	uint64_t *sums, *picked, i, nsegs, want, pos, trainlen, testlen;
+	uint32_t h, prev, thresh, taken, j, nsamples, sample;
+	uchar_t *test, *out, *stage;
+	void *state;
+	int dictlen, bestlen, len;
+	int64_t gain, best;
+	uint64_t plain;
+
+	if (buflen > LZ4_TRAIN_MAX)
+		buflen = LZ4_TRAIN_MAX;
+	if (samplelen == 0 || samplelen > buflen)
+		samplelen = buflen;
+	nsamples = (buflen + samplelen - 1) / samplelen;
+
+	/*
+	 * Hold out the last sample to size the dictionary.
+	 */
+	test = NULL;
+	testlen = 0;
+	trainlen = buflen;
+	if (nsamples > 1) {
+		test = buf + (nsamples - 1) * samplelen;
+		testlen = buflen - (nsamples - 1) * samplelen;
+		trainlen = test - buf;
+		nsamples--;
+	}
+	if (trainlen <= LZ4_DICT_MAX && test == NULL) {
+		memcpy(dict, buf, trainlen);
+		return (trainlen);
+	}
+
+	nsegs = trainlen / LZ4_DICT_SEG;
+	want = LZ4_DICT_MAX / LZ4_DICT_SEG;
+	if (want > nsegs)
+		want = nsegs;
+	counts = (uint16_t *)calloc(1 << LZ4_TRAIN_HASH_BITS, sizeof (uint16_t));
+	last = (uint16_t *)malloc((1 << LZ4_TRAIN_HASH_BITS) * sizeof (uint16_t));
+	scores = (uint32_t *)malloc((nsegs + 1) * sizeof (uint32_t));
+	sums = (uint64_t *)malloc((want + 1) * sizeof (uint64_t));
+	picked = (uint64_t *)malloc((want + 1) * sizeof (uint64_t));
+	if (!counts || !last || !scores || !sums || !picked) {
+		free(counts);
+		free(last);
+		free(scores);
+		free(sums);
+		free(picked);
+		log_msg(LOG_WARN, 0, "LZ4: Out of memory, not training a dictionary.");
+		return (0);
+	}
+
+#define	TRAIN_HASH(p)	((U64_P(p) * 0x9E3779B97F4A7C15ULL) >> (64 - LZ4_TRAIN_HASH_BITS))
+	memset(last, 0xff, (1 << LZ4_TRAIN_HASH_BITS) * sizeof (uint16_t));
+	for (i = 0; i + sizeof (uint64_t) <= trainlen; i++) {
+		h = TRAIN_HASH(buf + i);
+		sample = i / samplelen;
+		if (nsamples > 1 && last[h] == sample)
+			continue;
+		last[h] = sample;
+		if (counts[h] < UINT16_MAX) counts[h]++;
+	}
+
+	memset(hist, 0, sizeof (hist));
+	for (i = 0; i < nsegs; i++) {
+		uchar_t *seg = buf + i * LZ4_DICT_SEG;
+		uint32_t score = 0;
+
+		prev = UINT32_MAX;
+		for (j = 0; j <= LZ4_DICT_SEG - sizeof (uint64_t); j++) {
+			h = TRAIN_HASH(seg + j);
+			if (h != prev && counts[h] > 1) score++;
+			prev = h;
+		}
+		scores[i] = score;
+		hist[score]++;
+	}
+#undef	TRAIN_HASH
+
+	/*
+	 * Find the score threshold that selects roughly 'want' segments.
+	 * Segments that share nothing with the rest are never picked.
+	 */
+	taken = 0;
+	for (thresh = LZ4_DICT_SEG; thresh > 1; thresh--) {
+		taken += hist[thresh];
+		if (taken >= want) break;
+	}
+
+	taken = 0;
+	for (pos = 0; pos < 2 && taken < want; pos++) {
+		for (i = 0; i < nsegs && taken < want; i++) {
+			uchar_t *seg = buf + i * LZ4_DICT_SEG;
+			uint64_t sum;
+
+			/*
+			 * First pass picks segments above the threshold, second pass
+			 * fills up with segments at the threshold.
+			 */
+			if ((pos == 0 && scores[i] <= thresh) ||
+			    (pos == 1 && scores[i] != thresh))
+				continue;
+
+			/* Skip exact duplicates of already picked segments. */
+			sum = 14695981039346656037ULL;
+			for (j = 0; j < LZ4_DICT_SEG; j += sizeof (uint64_t))
+				sum = (sum ^ U64_P(seg + j)) * 1099511628211ULL;
+			for (j = 0; j < taken; j++) {
+				if (sums[j] == sum) break;
+			}
+			if (j < taken) continue;
+			sums[j] = sum;
+			picked[taken++] = ((uint64_t)scores[i] << 32) | i;
+		}
+	}
+
+	/*
+	 * Copy picked segments in ascending score order, ties in buffer order.
+	 */
+	qsort(picked, taken, sizeof (uint64_t), lz4_cmp_u64);
+	dictlen = 0;
+	for (j = 0; j < taken; j++) {
+		i = picked[j] & UINT32_MAX;
+		memcpy(dict + dictlen, buf + i * LZ4_DICT_SEG, LZ4_DICT_SEG);
+		dictlen += LZ4_DICT_SEG;
+	}
+	free(counts);
+	free(last);
+	free(scores);
+	free(sums);
+	free(picked);
+	if (test == NULL || dictlen == 0)
+		return (dictlen);
+
+	/*
+	 * Try the full dictionary and its last half and quarter, the parts
+	 * nearest to the data, on the held out sample.
+	 */
+	if (testlen > LZ4_TRAIN_SAMPLE)
+		testlen = LZ4_TRAIN_SAMPLE;
+	if (nchunks == 0)
+		nchunks = LZ4_TRAIN_CHUNKS;
+	out = (uchar_t *)malloc(LZ4_compressBound(testlen));
+	stage = (uchar_t *)malloc(dictlen + testlen);
+	state = malloc(LZ4_sizeofDictState());
+	if (!out || !stage || !state) {
+		free(out);
+		free(stage);
+		free(state);
+		return (0);
+	}
+	plain = lz4_dict_trial(test, testlen, NULL, 0, level, out, stage, state);
+	best = 0;
+	bestlen = 0;
+	for (len = dictlen; len >= LZ4_DICT_SEG && len * 4 >= dictlen; len /= 2) {
+		gain = (int64_t)plain - (int64_t)lz4_dict_trial(test, testlen,
+		    dict + dictlen - len, len, level, out, stage, state);
+		gain = gain * (int64_t)nchunks - len;
+		if (gain > best && gain >= len / 4) {
+			best = gain;
+			bestlen = len;
+		}
+	}
+	free(out);
+	free(stage);
+	free(state);
+	if (bestlen < dictlen)
+		memmove(dict, dict + dictlen - bestlen, bestlen);
+	return (bestlen);
+}
+
+/*
+ * Attach a shared dictionary to the per-thread state. The dictionary buffer
+ * is owned by the caller and must stay valid until lz4_deinit().
+ */
+int
+lz4_set_dict(void *data, uchar_t *dict, int dictlen)
+{
+	struct lz4_params *lzdat = (struct lz4_params *)data;
+
+	if (dictlen > LZ4_DICT_MAX) {
+		dict += dictlen - LZ4_DICT_MAX;
+		dictlen = LZ4_DICT_MAX;
+	}
+	lzdat->dict = dict;
+	lzdat->dictlen = dictlen;
+	if (dictlen == 0 || lzdat->op != COMPRESS)
+		return (0);
+
+	/*
+	 * Prime the match finder hash table once. Every chunk then just copies
+	 * it. HC needs the dictionary to precede the data in memory so a staging
+	 * buffer is set up for level 3.
+	 */
+	lzdat->dict_state = slab_alloc(NULL, LZ4_sizeofDictState());
+	if (!lzdat->dict_state) {
+		log_msg(LOG_ERR, 0, "LZ4: Out of memory.");
+		return (1);
+	}
+	LZ4_loadDict(lzdat->dict_state, (const char *)dict, dictlen);
+	if (lzdat->level == 3) {
+		lzdat->stage = (uchar_t *)slab_alloc(NULL, lzdat->blksz + dictlen);
+		if (!lzdat->stage) {
+			log_msg(LOG_ERR, 0, "LZ4: Out of memory.");
+			return (1);
+		}
+		memcpy(lzdat->stage, dict, dictlen);
+	}
+	return (0);
+}
+
+/*
+ * Compress one LZ4 block. The dictionary, if any, is either the shared
+ * dictionary or the tail of the previous sub-block which then immediately
+ * precedes src in memory. Returns the compressed length or 0 on failure.
+ */
+static int
+lz4_compress_block(struct lz4_params *lzdat, uchar_t *src, int srclen, uchar_t *dst,
+    int dstlen, const uchar_t *dict, int dictlen, void *dict_state)
+{
+	int rv;
+
+	if (lzdat->level < 2) {
+		if (dictlen > 0)
+			return (LZ4_compress_fast_usingDict(dict_state, (const char *)dict,
+			    dictlen, (const char *)src, (char *)dst, srclen, dstlen,
+			    lzdat->accel));
+		return (LZ4_compress_fast((const char *)src, (char *)dst, srclen, dstlen,
+		    lzdat->accel));
+
+	} else if (lzdat->level == 2) {
+		int sz1;
+
+		if (dictlen > 0)
+			sz1 = LZ4_compress_fast_usingDict(dict_state, (const char *)dict,
+			    dictlen, (const char *)src, (char *)lzdat->scratch, srclen,
+			    dstlen - sizeof (int), 1);
+		else
+			sz1 = LZ4_compress_limitedOutput((const char *)src,
+			    (char *)lzdat->scratch, srclen, dstlen - sizeof (int));
+		if (sz1 == 0)
+			return (0);
+		*((int *)dst) = htonl(sz1);
+		rv = LZ4_compressHC((const char *)lzdat->scratch, (char *)(dst + sizeof (int)),
+		    sz1);
+		if (rv == 0)
+			return (0);
+		return (rv + sizeof (int));
+	}
+
+	if (dictlen > 0) {
+		if (dict + dictlen == src)
+			return (LZ4_compressHC_withPrefix((const char *)src, (char *)dst,
+			    srclen, dictlen));
+		memcpy(lzdat->stage + dictlen, src, srclen);
+		return (LZ4_compressHC_withPrefix((const char *)(lzdat->stage + dictlen),
+		    (char *)dst, srclen, dictlen));
+	}
+	return (LZ4_compressHC((const char *)src, (char *)dst, srclen));
+}
+
+static int
+lz4_decompress_block(struct lz4_params *lzdat, uchar_t *src, int srclen, uchar_t *dst,
+    int dstlen, const uchar_t *dict, int dictlen)
+{
+	int rv;
+
+	if (lzdat->level == 2) {
+		int sz1;
+
+		sz1 = ntohl(*((int *)src));
+		if (sz1 <= 0 || sz1 > lzdat->scratch_len)
+			return (-1);
+		rv = LZ4_uncompress_unknownOutputSize((const char *)src + sizeof (int),
+		    (char *)lzdat->scratch, srclen - sizeof (int), sz1);
+		if (rv != sz1)
+			return (-1);
+		src = lzdat->scratch;
+		srclen = sz1;
+	}
+
+	if (dictlen > 0) {
+		rv = LZ4_uncompress_unknownOutputSize_usingDict((const char *)src,
+		    (char *)dst, srclen, dstlen, (const char *)dict, dictlen);
+		if (rv != dstlen)
+			return (-1);
+	} else {
+		rv = LZ4_uncompress((const char *)src, (char *)dst, dstlen);
+		if (rv != srclen)
+			return (-1);
+	}
+	return (0);
+}
+
 int
 lz4_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 	       int level, uchar_t chdr, int btype, void *data)
 {
 	int rv;
 	struct lz4_params *lzdat = (struct lz4_params *)data;
-	int _srclen = srclen;
-	uchar_t *dst2;
+	uchar_t *sp, *dp;
+	uint64_t rem, used;
 
-	if (lzdat->level == 1) {
-		rv = LZ4_compress((const char *)src, (char *)dst, _srclen);
-
-	} else if (lzdat->level == 2) {
-		rv = LZ4_compress((const char *)src, (char *)dst, _srclen);
-		if (rv == 0 || rv > *dstlen) {
+	if (srclen <= LZ4_MAX_CHUNK) {
+		rv = lz4_compress_block(lzdat, src, srclen, dst, MIN(*dstlen, INT_MAX),
+		    lzdat->dict, lzdat->dictlen, lzdat->dict_state);
+		if (rv == 0) {
 			return (-1);
 		}
-		dst2 = (uchar_t *)slab_alloc(NULL, rv + sizeof (int) + LZ4_compressBound(rv));
-		*((int *)dst2) = htonl(rv);
-		rv = LZ4_compressHC((const char *)dst, (char *)(dst2 + sizeof (int)), rv);
-		if (rv != 0) {
-			rv += sizeof (int);
-			memcpy(dst, dst2, rv);
-		}
-		slab_free(NULL, dst2);
-	} else {
-		rv = LZ4_compressHC((const char *)src, (char *)dst, _srclen);
+		*dstlen = rv;
+		return (0);
 	}
-	if (rv == 0) {
-		return (-1);
+
+	/*
+	 * Large chunk. Compress in sub-blocks each prefixed by its compressed
+	 * length. Sub-blocks after the first use the previous 64KB of data as
+	 * their dictionary.
+	 */
+	sp = (uchar_t *)src;
+	dp = (uchar_t *)dst;
+	rem = srclen;
+	used = 0;
+	while (rem > 0) {
+		int blen;
+		int64_t avail;
+
+		blen = MIN(rem, LZ4_SUBBLOCK_SZ);
+		avail = *dstlen - used - sizeof (int);
+
+		/*
+		 * HC does not bound its output. Ensure that worst case expansion
+		 * stays within buf_extra headroom.
+		 */
+		if (avail <= 0 || (lzdat->level > 1 && avail < blen))
+			return (-1);
+		if (sp == src)
+			rv = lz4_compress_block(lzdat, sp, blen, dp + sizeof (int),
+			    MIN(avail, INT_MAX), lzdat->dict, lzdat->dictlen,
+			    lzdat->dict_state);
+		else
+			rv = lz4_compress_block(lzdat, sp, blen, dp + sizeof (int),
+			    MIN(avail, INT_MAX), sp - LZ4_DICT_MAX, LZ4_DICT_MAX, NULL);
+		if (rv == 0)
+			return (-1);
+		*((int *)dp) = htonl(rv);
+		dp += rv + sizeof (int);
+		used += rv + sizeof (int);
+		sp += blen;
+		rem -= blen;
 	}
-	*dstlen = rv;
+	*dstlen = used;
 
 	return (0);
 }
@@ -137,29 +588,44 @@ int
 lz4_decompress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
 		 int level, uchar_t chdr, int btype, void *data)
 {
-	int rv;
 	struct lz4_params *lzdat = (struct lz4_params *)data;
-	int _dstlen = *dstlen;
+	uchar_t *sp, *dp;
+	uint64_t rem, used;
 
-	if (lzdat->level == 1 || lzdat->level == 3) {
-		rv = LZ4_uncompress((const char *)src, (char *)dst, _dstlen);
-		if (rv != srclen) {
-			return (-1);
-		}
+	if (*dstlen <= LZ4_MAX_CHUNK) {
+		return (lz4_decompress_block(lzdat, src, srclen, dst, *dstlen,
+		    lzdat->dict, lzdat->dictlen));
+	}
 
-	} else if (lzdat->level == 2) {
-		int sz1;
+	sp = (uchar_t *)src;
+	dp = (uchar_t *)dst;
+	rem = *dstlen;
+	used = 0;
+	while (rem > 0) {
+		int blen, clen, rv;
 
-		sz1 = ntohl(*((int *)src));
-		rv = LZ4_uncompress((const char *)src + sizeof (int), (char *)dst, sz1);
-		if (rv != srclen - sizeof (int)) {
+		blen = MIN(rem, LZ4_SUBBLOCK_SZ);
+		if (srclen - used < sizeof (int))
 			return (-1);
-		}
-		memcpy(src, dst, sz1);
-		rv = LZ4_uncompress((const char *)src, (char *)dst, _dstlen);
-		if (rv != sz1) {
+		clen = ntohl(*((int *)sp));
+		sp += sizeof (int);
+		used += sizeof (int);
+		if (clen <= 0 || clen > srclen - used)
 			return (-1);
-		}
+		if (dp == dst)
+			rv = lz4_decompress_block(lzdat, sp, clen, dp, blen,
+			    lzdat->dict, lzdat->dictlen);
+		else
+			rv = lz4_decompress_block(lzdat, sp, clen, dp, blen,
+			    dp - LZ4_DICT_MAX, LZ4_DICT_MAX);
+		if (rv != 0)
+			return (-1);
+		sp += clen;
+		used += clen;
+		dp += blen;
+		rem -= blen;
 	}
+	if (used != srclen)
+		return (-1);
 	return (0);
 }
@@ -26,6 +26,9 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <strings.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 #include <LzmaEnc.h>
 #include <LzmaDec.h>
 #include <utils.h>
@@ -34,8 +37,30 @@
 
 #define	SZ_ERROR_DESTLEN	100
 #define	LZMA_DEFAULT_DICT	(1 << 24)
+#define	LZMA_MIN_DICT		(1 << 16)
 
-CLzmaEncProps *p = NULL;
+/*
+ * Large lzmaMt chunks are split into independently decodable sub-streams
+ * so that a single chunk can be decompressed by multiple threads. Sub-streams
+ * are at least LZMA_SUBSTREAM_MIN bytes to limit the loss in compression ratio.
+ * The marker value cannot be a valid LZMA properties byte.
+ */
+#define	LZMA_SUBSTREAM_MIN	(32 * 1024 * 1024)
+#define	LZMA_MAX_SUBSTREAMS	8
+#define	LZMA_SUBSTREAM_MARKER	0xFF
+#define	LZMA_SUBSTREAM_HDR(n)	(2 + (n) * 16)
+
+/*
+ * Per-thread LZMA state. The encoder and decoders are created once and reused
+ * across chunks so that match finder hash tables and probability arrays are
+ * not re-allocated for every chunk.
+ */
+struct lzma_params {
+	CLzmaEncProps props;
+	CLzmaEncHandle enc;
+	CLzmaDec *dec;
+	int nthreads;
+};
 
 static ISzAlloc g_Alloc = {
 	slab_alloc,
@@ -48,12 +73,63 @@ lzma_stats(int show)
 {
 }
 
+static int
+lzma_substreams(uint64_t chunksize)
+{
+	uint64_t n;
+
+	n = chunksize / LZMA_SUBSTREAM_MIN;
+	if (n < 2)
+		return (1);
+	if (n > LZMA_MAX_SUBSTREAMS)
+		n = LZMA_MAX_SUBSTREAMS;
+	return ((int)n);
+}
+
+/*
+ * Dictionary size used for a level, never more than the chunk. This is
+ * about what the decoder needs.
+ */
+uint64_t
+lzma_dict_size(int level, uint64_t chunksize)
+{
+	uint64_t dict;
+
+	if (level < 8)
+		dict = LZMA_DEFAULT_DICT;
+	else if (level == 13)
+		dict = (1 << 27);
+	else if (level == 14)
+		dict = (1 << 28);
+	else
+		dict = (1 << 26);
+	if (dict > chunksize)
+		dict = (chunksize < LZMA_MIN_DICT ? LZMA_MIN_DICT:chunksize);
+	return (dict);
+}
+
+/*
+ * Approximate encoder memory for a level. The binary tree match finder needs
+ * about 11.5 times the dictionary size.
+ */
+uint64_t
+lzma_state_mem(int level, uint64_t chunksize)
+{
+	return (lzma_dict_size(level, chunksize) * 23 / 2);
+}
+
 void
 lzma_mt_props(algo_props_t *data, int level, uint64_t chunksize) {
+	int nsub;
+
+	nsub = lzma_substreams(chunksize);
 	data->compress_mt_capable = 1;
-	data->decompress_mt_capable = 0;
-	data->buf_extra = 0;
+	data->decompress_mt_capable = (nsub > 1);
+	data->buf_extra = LZMA_SUBSTREAM_HDR(nsub) + nsub * LZMA_PROPS_SIZE;
 	data->c_max_threads = 2;
+	data->d_max_threads = nsub;
+	data->state_mem = lzma_state_mem(level, chunksize) * data->c_max_threads;
+	data->dstate_mem = lzma_dict_size(level, chunksize);
 	data->delta2_span = 150;
 	if (level < 12)
 		data->deltac_min_distance = (EIGHTM * 16);
@@ -66,6 +142,8 @@ lzma_props(algo_props_t *data, int level, uint64_t chunksize) {
 	data->compress_mt_capable = 0;
 	data->decompress_mt_capable = 0;
 	data->buf_extra = 0;
+	data->state_mem = lzma_state_mem(level, chunksize);
+	data->dstate_mem = lzma_dict_size(level, chunksize);
 	data->delta2_span = 150;
 	if (level < 12)
 		data->deltac_min_distance = (EIGHTM * 16);
@@ -73,15 +151,25 @@ lzma_props(algo_props_t *data, int level, uint64_t chunksize) {
 		data->deltac_min_distance = (EIGHTM * 32);
 }
 
-/*
- * The two functions below are not thread-safe, by design.
- */
 int
 lzma_init(void **data, int *level, int nthreads, uint64_t chunksize,
 	  int file_version, compress_op_t op)
 {
-	if (!p && op == COMPRESS) {
-		p = (CLzmaEncProps *)slab_alloc(NULL, sizeof (CLzmaEncProps));
+	struct lzma_params *lzdat;
+	CLzmaEncProps *p;
+	int i;
+
+	lzdat = (struct lzma_params *)slab_calloc(NULL, 1, sizeof (struct lzma_params));
+	if (!lzdat) {
+		log_msg(LOG_ERR, 0, "LZMA: Out of memory\n");
+		return (-1);
+	}
+	if (nthreads < 1)
+		nthreads = 1;
+	lzdat->nthreads = nthreads;
+
+	if (op == COMPRESS) {
+		p = &(lzdat->props);
 		LzmaEncProps_Init(p);
 		/*
 		 * Set the dictionary size and fast bytes based on level.
@@ -129,19 +217,51 @@ lzma_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		p->level = *level;
 		p->numThreads = nthreads;
 		LzmaEncProps_Normalize(p);
+
+		/*
+		 * A dictionary larger than the chunk only inflates the match finder
+		 * tables that have to be cleared for every chunk.
+		 */
+		if (p->dictSize > chunksize)
+			p->dictSize = (chunksize < LZMA_MIN_DICT ? LZMA_MIN_DICT:chunksize);
 		slab_cache_add(p->litprob_sz);
+
+		lzdat->enc = LzmaEnc_Create(&g_Alloc);
+		if (!lzdat->enc || LzmaEnc_SetProps(lzdat->enc, p) != SZ_OK) {
+			log_msg(LOG_ERR, 0, "LZMA: Unable to create encoder\n");
+			lzma_deinit((void **)&lzdat);
+			return (-1);
+		}
+	} else {
+		lzdat->dec = (CLzmaDec *)slab_alloc(NULL, nthreads * sizeof (CLzmaDec));
+		if (!lzdat->dec) {
+			log_msg(LOG_ERR, 0, "LZMA: Out of memory\n");
+			lzma_deinit((void **)&lzdat);
+			return (-1);
+		}
+		for (i = 0; i < nthreads; i++)
+			LzmaDec_Construct(&(lzdat->dec[i]));
 	}
 	if (*level > 9) *level = 9;
-	*data = p;
+	*data = lzdat;
 	return (0);
 }
 
 int
 lzma_deinit(void **data)
 {
-	if (p) {
-		slab_release(NULL, p);
-		p = NULL;
+	struct lzma_params *lzdat = (struct lzma_params *)(*data);
+	int i;
+
+	if (lzdat) {
+		if (lzdat->enc)
+			LzmaEnc_Destroy(lzdat->enc, &g_Alloc, &g_Alloc);
+		if (lzdat->dec) {
+			for (i = 0; i < lzdat->nthreads; i++)
+				LzmaDec_FreeProbs(&(lzdat->dec[i]), &g_Alloc);
+			slab_release(NULL, lzdat->dec);
+		}
+		slab_release(NULL, lzdat);
 	}
 	*data = NULL;
 	return (0);
@@ -204,7 +324,7 @@ lzma_compress(void *src, uint64_t srclen, void *dst,
 	SizeT props_len = LZMA_PROPS_SIZE;
 	SRes res;
 	Byte *_dst;
-	CLzmaEncProps *props = (CLzmaEncProps *)data;
+	struct lzma_params *lzdat = (struct lzma_params *)data;
 	SizeT dlen;
 
 	if (*dstlen < LZMA_PROPS_SIZE) {
@@ -214,13 +334,17 @@ lzma_compress(void *src, uint64_t srclen, void *dst,
 
 	if (PC_SUBTYPE(btype) == TYPE_COMPRESSED_ZPAQ)
 		return (-1);
-	props->level = level;
 
 	_dst = (Byte *)dst;
+	res = LzmaEnc_WriteProperties(lzdat->enc, _dst, &props_len);
+	if (res != SZ_OK) {
+		lzerr(res, 1);
+		return (-1);
+	}
 	*dstlen -= LZMA_PROPS_SIZE;
 	dlen = *dstlen;
-	res = LzmaEncode(_dst + LZMA_PROPS_SIZE, &dlen, (const uchar_t *)src, srclen,
-	    props, (uchar_t *)_dst, &props_len, 0, NULL, &g_Alloc, &g_Alloc);
+	res = LzmaEnc_MemEncode(lzdat->enc, _dst + LZMA_PROPS_SIZE, &dlen,
+	    (const uchar_t *)src, srclen, 0, NULL, &g_Alloc, &g_Alloc);
 	*dstlen = dlen;
 
 	if (res != 0) {
@@ -232,28 +356,181 @@ lzma_compress(void *src, uint64_t srclen, void *dst,
 	return (0);
 }
 
+/*
+ * Sub-stream format used by lzmaMt for large chunks
+ * -------------------------------------------------
+ * Offset Size Description
+ *  0     1   LZMA_SUBSTREAM_MARKER
+ *  1     1   Number of sub-streams (N)
+ *  2    16N  Original and compressed length of each sub-stream (big endian)
+ *  ...       N LZMA compressed segments in the simplified format above
+ */
 int
-lzma_decompress(void *src, uint64_t srclen, void *dst,
+lzma_mt_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data)
 {
+	uint64_t sublen, slen, clen, rem, hdrlen;
+	uchar_t *sp, *dp, *hp;
+	int i, nsub;
+
+	nsub = lzma_substreams(srclen);
+	if (nsub < 2)
+		return (lzma_compress(src, srclen, dst, dstlen, level, chdr, btype, data));
+
+	hdrlen = LZMA_SUBSTREAM_HDR(nsub);
+	if (*dstlen < hdrlen) {
+		lzerr(SZ_ERROR_DESTLEN, 1);
+		return (-1);
+	}
+	hp = (uchar_t *)dst;
+	hp[0] = LZMA_SUBSTREAM_MARKER;
+	hp[1] = nsub;
+	hp += 2;
+	sp = (uchar_t *)src;
+	dp = (uchar_t *)dst + hdrlen;
+	rem = *dstlen - hdrlen;
+	sublen = srclen / nsub;
+
+	for (i = 0; i < nsub; i++) {
+		slen = (i < nsub - 1) ? sublen : srclen - sublen * i;
+		clen = rem;
+		if (lzma_compress(sp, slen, dp, &clen, level, chdr, btype, data) != 0)
+			return (-1);
+		U64_P(hp) = htonll(slen);
+		U64_P(hp + 8) = htonll(clen);
+		hp += 16;
+		sp += slen;
+		dp += clen;
+		rem -= clen;
+	}
+	*dstlen = dp - (uchar_t *)dst;
+	return (0);
+}
+
+/*
+ * Decode one LZMA segment using the given decoder state. The probability
+ * array is only re-allocated if the properties of the segment differ from
+ * the previous one. Without a decoder state a temporary one is used.
+ */
+static int
+lzma_decode_one(CLzmaDec *dec, uchar_t *src, uint64_t srclen, uchar_t *dst,
+	uint64_t *dstlen)
+{
+	CLzmaDec tdec;
 	SizeT _srclen;
-	const uchar_t *_src;
 	SRes res;
 	ELzmaStatus status;
-	SizeT dlen;
 
-	_srclen = srclen - LZMA_PROPS_SIZE;
-	_src = (uchar_t *)src + LZMA_PROPS_SIZE;
-	dlen = *dstlen;
+	if (srclen < LZMA_PROPS_SIZE) {
+		lzerr(SZ_ERROR_INPUT_EOF, 0);
+		return (-1);
+	}
+	if (!dec) {
+		LzmaDec_Construct(&tdec);
+		dec = &tdec;
+	}
 
-	if ((res = LzmaDecode((uchar_t *)dst, &dlen, _src, &_srclen,
-	    (uchar_t *)src, LZMA_PROPS_SIZE, LZMA_FINISH_ANY,
-	    &status, &g_Alloc)) != SZ_OK) {
-		*dstlen = dlen;
+	res = LzmaDec_AllocateProbs(dec, src, LZMA_PROPS_SIZE, &g_Alloc);
+	if (res == SZ_OK) {
+		dec->dic = dst;
+		dec->dicBufSize = *dstlen;
+		LzmaDec_Init(dec);
+		_srclen = srclen - LZMA_PROPS_SIZE;
+		res = LzmaDec_DecodeToDic(dec, *dstlen, src + LZMA_PROPS_SIZE, &_srclen,
+		    LZMA_FINISH_ANY, &status);
+		if (res == SZ_OK && status == LZMA_STATUS_NEEDS_MORE_INPUT)
+			res = SZ_ERROR_INPUT_EOF;
+		*dstlen = dec->dicPos;
+	}
+	if (dec == &tdec)
+		LzmaDec_FreeProbs(dec, &g_Alloc);
+
+	if (res != SZ_OK) {
 		lzerr(res, 0);
 		return (-1);
 	}
-	*dstlen = dlen;
 	return (0);
 }
 
+static int
+lzma_decompress_substreams(struct lzma_params *lzdat, uchar_t *src, uint64_t srclen,
+	uchar_t *dst, uint64_t *dstlen)
+{
+	uint64_t soff[LZMA_MAX_SUBSTREAMS], doff[LZMA_MAX_SUBSTREAMS];
+	uint64_t slen[LZMA_MAX_SUBSTREAMS], dlen[LZMA_MAX_SUBSTREAMS];
+	uint64_t so, dof;
+	uchar_t *hp;
+	int i, nsub, err, nthreads;
+
+	nsub = src[1];
+	if (nsub < 1 || nsub > LZMA_MAX_SUBSTREAMS || srclen < LZMA_SUBSTREAM_HDR(nsub)) {
+		lzerr(SZ_ERROR_DATA, 0);
+		return (-1);
+	}
+
+	/*
+	 * Validate the offset table before fanning out.
+	 */
+	hp = src + 2;
+	so = LZMA_SUBSTREAM_HDR(nsub);
+	dof = 0;
+	for (i = 0; i < nsub; i++) {
+		dlen[i] = ntohll(U64_P(hp));
+		slen[i] = ntohll(U64_P(hp + 8));
+		hp += 16;
+		if (slen[i] > srclen - so || dlen[i] > *dstlen - dof) {
+			lzerr(SZ_ERROR_DATA, 0);
+			return (-1);
+		}
+		soff[i] = so;
+		doff[i] = dof;
+		so += slen[i];
+		dof += dlen[i];
+	}
+
+	err = 0;
+	if (lzdat && !lzdat->dec)
+		lzdat = NULL;
+	nthreads = (lzdat ? lzdat->nthreads : 1);
+#if defined(_OPENMP)
+#	pragma omp parallel for num_threads(nthreads)
+#endif
+	for (i = 0; i < nsub; i++) {
+		uint64_t _dlen = dlen[i];
+		CLzmaDec *dec = NULL;
+
+		if (lzdat) {
+#if defined(_OPENMP)
+			dec = &(lzdat->dec[omp_get_thread_num()]);
+#else
+			dec = &(lzdat->dec[0]);
+#endif
+		}
+
+		if (lzma_decode_one(dec, src + soff[i], slen[i], dst + doff[i],
+		    &_dlen) != 0 || _dlen != dlen[i]) {
+#if defined(_OPENMP)
+#			pragma omp atomic
+#endif
+			err++;
+		}
+	}
+	if (err)
+		return (-1);
+	*dstlen = dof;
+	return (0);
+}
+
+int
+lzma_decompress(void *src, uint64_t srclen, void *dst,
+	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data)
+{
+	struct lzma_params *lzdat = (struct lzma_params *)data;
+
+	if (srclen > 0 && *((uchar_t *)src) == LZMA_SUBSTREAM_MARKER)
+		return (lzma_decompress_substreams(lzdat, (uchar_t *)src, srclen,
+		    (uchar_t *)dst, dstlen));
+
+	return (lzma_decode_one(lzdat ? lzdat->dec:NULL, (uchar_t *)src, srclen,
+	    (uchar_t *)dst, dstlen));
+}
@@ -45,6 +45,12 @@ main(int argc, char *argv[])
 	int err;
 	pc_ctx_t *pctx;
 
+	/*
+	 * Benchmark mode has its own set of options.
+	 */
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+		return (start_bench(argc - 1, argv + 1));
+
 	err = 0;
 	pctx = create_pc_context();
 
@@ -39,7 +39,9 @@
 #include <limits.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <getopt.h>
 #include <utils.h>
+#include <numa_place.h>
 #include <pcompress.h>
 #include <allocator.h>
 #include <rabin_dedup.h>
@@ -64,6 +66,13 @@
 #define	DEFAULT_CHUNKSIZE	(8 * 1024 * 1024)
 #define	EIGHTY_PCT(x) ((x) - ((x)/5))
 
+/*
+ * With a memory budget (-R) a fixed reserve is kept aside for small allocations
+ * and a quarter of the budget goes to the Global Dedupe index or reference cache.
+ */
+#define	MEM_BUDGET_RESERVE	(16 * 1024 * 1024)
+#define	MEM_BUDGET_INDEX(b)	((b) / 4)
+
 struct wdata {
 	struct cmp_data **dary;
 	int wfd;
@@ -72,8 +81,37 @@ struct wdata {
 	pc_ctx_t *pctx;
 };
 
+/*
+ * Read and write the main input and output streams. With the buffer
+ * interface they go through the caller's callbacks instead of fd.
+ */
+static int64_t
+pc_read(pc_ctx_t *pctx, int fd, void *buf, uint64_t count)
+{
+	if (pctx->mem_io)
+		return (mem_io_read(pctx, buf, count));
+	return (Read(fd, buf, count));
+}
+
+static int64_t
+pc_write(pc_ctx_t *pctx, int fd, const void *buf, uint64_t count)
+{
+	if (pctx->mem_io)
+		return (mem_io_write(pctx, buf, count));
+	return (Write(fd, buf, count));
+}
+
 pthread_mutex_t opt_parse = PTHREAD_MUTEX_INITIALIZER;
 
+static struct option long_opts[] = {
+	{"verify", no_argument, NULL, 'V'},
+	{"progress", optional_argument, NULL, 'g'},
+	{"progress-file", required_argument, NULL, 'o'},
+	{"pipeline", no_argument, NULL, 'u'},
+	{"estimate", no_argument, NULL, 'q'},
+	{NULL, 0, NULL, 0}
+};
+
 static void * writer_thread(void *dat);
 static int init_algo(pc_ctx_t *pctx, const char *algo, int bail);
 extern uint32_t lzma_crc32(const uint8_t *buf, uint64_t size, uint32_t crc);
@@ -109,13 +147,26 @@ usage(pc_ctx_t *pctx)
 "       -v       Enables verbose mode.\n\n"
 "       -t <number>\n"
 "                Sets the number of compression threads. Default: core count.\n"
+"       -R <bytes>\n"
+"                Hard memory budget for compression or decompression. Threads, pipelining\n"
+"                and the Global Dedupe index are sized to fit. Same suffixes as -s.\n"
+"       -N       Spread threads and their chunk buffers over NUMA nodes.\n"
+"       -H       Back large chunk buffers and the dedupe index with huge pages.\n"
+"       --pipeline\n"
+"                With Dedupe or pre-processing, run the dedupe and filter stage and the\n"
+"                compression stage on separate threads. Doubles the chunk buffers.\n"
+"       --estimate\n"
+"                With adapt2, choose the algorithm of generic chunks by predicting the\n"
+"                size and time of each one from a few samples.\n"
 "       -T       Disable separate metadata stream.\n"
 "       -S <chunk checksum>\n"
 "                The chunk verification checksum. Default: BLAKE256. Others are: CRC64, SHA256,\n"
 "                SHA512, KECCAK256, KECCAK512, BLAKE256, BLAKE512.\n"
 "       <archive filename>\n"
 "                Pathname of the resulting archive. A '.pz' extension is automatically added\n"
-"                if not already present. This can be '-' to output to stdout.\n\n"
+"                if not already present. This can be '-' to output to stdout.\n\n",
+	    UTILITY_VERSION, LICENSE_STRING, pctx->exec_name);
+	fprintf(stderr,
 "    Single File Compression\n"
 "    -----------------------\n"
 "       %s -c <algorithm> [-l <compress level>] [-s <chunk size>] [-p] [<file>]\n"
@@ -133,12 +184,15 @@ usage(pc_ctx_t *pctx)
 "                      chunks may not necessarily produce better compression.\n"
 "       -p       Make Pcompress work in streaming mode. Input is stdin, output is stdout.\n\n"
 "       <target file>\n"
-"                Pathname of the compressed file to be created or '-' for stdout.\n\n"
+"                Pathname of the compressed file to be created or '-' for stdout.\n\n",
+	    pctx->exec_name);
+	fprintf(stderr,
 "    Decompression, Listing and Archive extraction\n"
 "    ---------------------------------------------\n"
 "       %s <-d|-i>  [-m] [-K] <compressed file or '-'> [<target file or directory>]\n\n"
 "       -d        Extract archive to target dir or current dir.\n"
-"       -i        Only list contents of the archive, do not extract.\n\n"
+"       -i        Only list contents of the archive, do not extract.\n"
+"       --verify  Only check all chunks of the file or archive, write nothing.\n\n"
 "       -m        Enable restoring *all* permissions, ACLs, Extended Attributes etc.\n"
 "                 Equivalent to the '-p' option in tar.\n"
 "       -K        Do not overwrite newer files.\n"
@@ -152,7 +206,15 @@ usage(pc_ctx_t *pctx)
 "                 Default output name if omitted: <input filename>.out\n\n"
 "                 If Archiving was done then this should be the name of a directory into which\n"
 "                 extracted files are restored. Default if omitted: Current directory.\n\n",
-	    UTILITY_VERSION, LICENSE_STRING, pctx->exec_name, pctx->exec_name, pctx->exec_name);
+	    pctx->exec_name);
+	fprintf(stderr,
+"    Progress\n"
+"    --------\n"
+"       --progress[=<seconds>]\n"
+"                 Print chunks done, bytes, ratio, MB/s and ETA every 5 or <seconds>\n"
+"                 seconds while compressing, decompressing or verifying.\n"
+"       --progress-file=<pathname>\n"
+"                 Keep the same figures as JSON in the given file.\n\n");
 	fprintf(stderr,
 "    Encryption\n"
 "    ----------\n"
@@ -192,6 +254,375 @@ show_compression_stats(pc_ctx_t *pctx)
 	}
 }
 
+const char *stage_names[STAGE_MAX] = {
+	"read", "dedupe", "checksum", "preproc", "codec", "crypto", "hmac", "write",
+	"wait_start", "wait_prep_done", "wait_cmp_done", "wait_write_done"
+};
+
+/*
+ * Advance the fill position of a buffer of size sz by the return value of
+ * snprintf(). A truncated write leaves the position at the terminating NUL.
+ */
+static int
+stats_adv(int n, int w, int sz)
+{
+	if (w < 0)
+		return (n);
+	n += w;
+	return (n < sz ? n : sz - 1);
+}
+
+static int
+stats_json(char *buf, int sz, const char *name, int id, stage_stats_t *st)
+{
+	int i, n;
+
+	n = stats_adv(0, snprintf(buf, sz, "{\"name\":\"%s\"", name), sz);
+	if (id >= 0)
+		n = stats_adv(n, snprintf(buf + n, sz - n, ",\"id\":%d", id), sz);
+	n = stats_adv(n, snprintf(buf + n, sz - n, ",\"chunks\":%" PRIu64
+	    ",\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64 ",\"ns\":{", st->chunks,
+	    st->bytes_in, st->bytes_out), sz);
+	for (i = 0; i < STAGE_MAX; i++) {
+		n = stats_adv(n, snprintf(buf + n, sz - n, "%s\"%s\":%" PRIu64,
+		    i > 0 ? "," : "", stage_names[i], st->ns[i]), sz);
+	}
+	n = stats_adv(n, snprintf(buf + n, sz - n, "}}"), sz);
+	return (n);
+}
+
+/*
+ * Print the stage timing counters as one line of JSON on stderr. The reader
+ * and writer threads are listed first followed by one entry per chunk slot.
+ * With pipelined compression a slot is served by a pair of prep and codec
+ * threads. The totals are also kept in the context. Nothing is printed when
+ * the counters are only being collected.
+ */
+static void
+dump_stage_stats(pc_ctx_t *pctx, const char *event)
+{
+	stage_stats_t total, *st;
+	char *buf;
+	int i, j, n, sz;
+
+	pthread_mutex_lock(&pctx->stats_lock);
+	sz = 1024 + (pctx->stats_nslots + 3) * STATS_ENTRY_SZ;
+	buf = (char *)malloc(sz);
+	if (!buf) {
+		pthread_mutex_unlock(&pctx->stats_lock);
+		return;
+	}
+	memset(&total, 0, sizeof (total));
+	n = stats_adv(0, snprintf(buf, sz, "{\"event\":\"%s\",\"op\":\"%s\",\"elapsed_ns\":%"
+	    PRIu64 ",\"threads\":[", event, pctx->do_compress ? "compress" : "decompress",
+	    get_wtime_nanos() - pctx->stats_start), sz);
+	n += stats_json(buf + n, sz - n, "reader", -1, &pctx->reader_stats);
+	n = stats_adv(n, snprintf(buf + n, sz - n, ","), sz);
+	n += stats_json(buf + n, sz - n, "writer", -1, &pctx->writer_stats);
+	for (i = 0; i < pctx->stats_nslots; i++) {
+		if (pctx->stats_saved)
+			st = &(pctx->stats_saved[i]);
+		else if (pctx->stats_dary[i])
+			st = &(pctx->stats_dary[i]->stats);
+		else
+			continue;
+		n = stats_adv(n, snprintf(buf + n, sz - n, ","), sz);
+		n += stats_json(buf + n, sz - n, "worker", i, st);
+		total.chunks += st->chunks;
+		total.bytes_in += st->bytes_in;
+		total.bytes_out += st->bytes_out;
+		for (j = 0; j < STAGE_MAX; j++)
+			total.ns[j] += st->ns[j];
+	}
+	pthread_mutex_unlock(&pctx->stats_lock);
+	for (j = 0; j < STAGE_MAX; j++) {
+		total.ns[j] += pctx->reader_stats.ns[j];
+		total.ns[j] += pctx->writer_stats.ns[j];
+	}
+	pctx->stats_total = total;
+	if (pctx->stage_stats != STAGE_STATS_DUMP) {
+		free(buf);
+		return;
+	}
+	n = stats_adv(n, snprintf(buf + n, sz - n, "],\"total\":"), sz);
+	n += stats_json(buf + n, sz - n, "total", -1, &total);
+	snprintf(buf + n, sz - n, "}\n");
+	fputs(buf, stderr);
+	fflush(stderr);
+	free(buf);
+}
+
+/*
+ * SIGUSR1 is blocked in all the threads and picked up here, so that a dump
+ * can be requested at any point of a long running operation.
+ */
+static void *
+stage_stats_thread(void *dat)
+{
+	pc_ctx_t *pctx = (pc_ctx_t *)dat;
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (sigwait(&set, &sig) == 0) {
+		if (pctx->stats_done)
+			break;
+		dump_stage_stats(pctx, "signal");
+	}
+	return (NULL);
+}
+
+/*
+ * Must be called before any other threads are created so that they inherit
+ * the blocked SIGUSR1.
+ */
+static void
+start_stage_stats(pc_ctx_t *pctx)
+{
+	sigset_t set;
+
+	pctx->stats_dary = NULL;
+	pctx->stats_saved = NULL;
+	pctx->stats_nslots = 0;
+	pctx->stats_done = 0;
+	pctx->stats_start = get_wtime_nanos();
+	memset(&pctx->reader_stats, 0, sizeof (pctx->reader_stats));
+	memset(&pctx->writer_stats, 0, sizeof (pctx->writer_stats));
+	pthread_mutex_init(&pctx->stats_lock, NULL);
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, &pctx->stats_omask);
+	if (pthread_create(&pctx->stats_thr, NULL, stage_stats_thread, pctx) != 0) {
+		log_msg(LOG_ERR, 1, "Error in thread creation: ");
+		pthread_sigmask(SIG_SETMASK, &pctx->stats_omask, NULL);
+		pthread_mutex_destroy(&pctx->stats_lock);
+		return;
+	}
+	pctx->stats_running = 1;
+}
+
+/*
+ * Attach the per-chunk thread data once all of it is allocated.
+ */
+static void
+set_stage_stats_slots(pc_ctx_t *pctx, struct cmp_data **dary, int nslots)
+{
+	if (!pctx->stats_running)
+		return;
+	pthread_mutex_lock(&pctx->stats_lock);
+	pctx->stats_dary = dary;
+	pctx->stats_nslots = nslots;
+	pthread_mutex_unlock(&pctx->stats_lock);
+}
+
+/*
+ * Keep a copy of the worker counters before the thread data is freed.
+ */
+static void
+save_stage_stats(pc_ctx_t *pctx)
+{
+	int i;
+
+	if (!pctx->stats_running || !pctx->stats_dary)
+		return;
+	pthread_mutex_lock(&pctx->stats_lock);
+	pctx->stats_saved = (stage_stats_t *)calloc(pctx->stats_nslots,
+	    sizeof (stage_stats_t));
+	if (pctx->stats_saved) {
+		for (i = 0; i < pctx->stats_nslots; i++) {
+			if (pctx->stats_dary[i])
+				pctx->stats_saved[i] = pctx->stats_dary[i]->stats;
+		}
+	} else {
+		pctx->stats_nslots = 0;
+	}
+	pctx->stats_dary = NULL;
+	pthread_mutex_unlock(&pctx->stats_lock);
+}
+
+/*
+ * Print the final counters and stop the signal handling thread.
+ */
+static void
+stop_stage_stats(pc_ctx_t *pctx)
+{
+	if (!pctx->stats_running)
+		return;
+	save_stage_stats(pctx);
+	pctx->stats_done = 1;
+	pthread_kill(pctx->stats_thr, SIGUSR1);
+	pthread_join(pctx->stats_thr, NULL);
+	dump_stage_stats(pctx, "exit");
+	pthread_sigmask(SIG_SETMASK, &pctx->stats_omask, NULL);
+	pthread_mutex_destroy(&pctx->stats_lock);
+	free(pctx->stats_saved);
+	pctx->stats_saved = NULL;
+	pctx->stats_nslots = 0;
+	pctx->stats_running = 0;
+}
+
+/*
+ * One progress sample. Throughput and ratio are taken from the chunks the
+ * writer has finished, the ETA from the share of the input consumed so far.
+ * With --progress the line goes through log_msg() so that library callers
+ * get it on their log callback. The stats file is replaced atomically.
+ */
+static void
+report_progress(pc_ctx_t *pctx, const char *state)
+{
+	uint64_t now, chunks, rd, wr, in, out, ubytes, cbytes;
+	double elapsed, rate, ratio;
+	int64_t eta;
+	char eta_str[32], tmpname[MAXPATHLEN];
+	FILE *fp;
+
+	now = get_wtime_nanos();
+	chunks = pctx->writer_stats.chunks;
+	rd = pctx->reader_stats.bytes_in;
+	in = pctx->writer_stats.bytes_in;
+	out = pctx->writer_stats.bytes_out;
+	if (pctx->do_compress) {
+		ubytes = in;
+		cbytes = out;
+	} else {
+		ubytes = out;
+		cbytes = in;
+	}
+	wr = pctx->verify ? 0 : out;
+	ratio = cbytes ? (double)ubytes / (double)cbytes : 0;
+
+	rate = 0;
+	if (now > pctx->progress_last_ns && ubytes >= pctx->progress_last_bytes) {
+		rate = (double)(ubytes - pctx->progress_last_bytes) /
+		    ((double)(now - pctx->progress_last_ns) / 1000000000.0) / 1048576.0;
+	}
+	pctx->progress_last_ns = now;
+	pctx->progress_last_bytes = ubytes;
+
+	elapsed = (double)(now - pctx->progress_start) / 1000000000.0;
+	eta = -1;
+	if (strcmp(state, "running") == 0 && pctx->progress_total > 0 && in > 0) {
+		if (in >= pctx->progress_total)
+			eta = 0;
+		else
+			eta = (int64_t)(elapsed * (double)(pctx->progress_total - in) / (double)in);
+	}
+	if (eta >= 0) {
+		snprintf(eta_str, sizeof (eta_str), "%" PRId64 ":%02d:%02d", eta / 3600,
+		    (int)(eta / 60 % 60), (int)(eta % 60));
+	} else {
+		strcpy(eta_str, "-");
+	}
+
+	if (pctx->progress_log) {
+		log_msg(LOG_INFO, 0, "Progress: %s, %" PRIu64 " chunks, read %.1f MB, "
+		    "written %.1f MB, ratio %.3f, %.1f MB/s, ETA %s", state, chunks,
+		    (double)rd / 1048576.0, (double)wr / 1048576.0, ratio, rate, eta_str);
+	}
+
+	if (pctx->progress_file) {
+		snprintf(tmpname, sizeof (tmpname), "%s.tmp", pctx->progress_file);
+		fp = fopen(tmpname, "w");
+		if (fp == NULL) {
+			log_msg(LOG_WARN, 1, "Cannot write progress file %s ", tmpname);
+			return;
+		}
+		fprintf(fp, "{\"state\":\"%s\",\"op\":\"%s\",\"elapsed_secs\":%.3f"
+		    ",\"chunks\":%" PRIu64 ",\"bytes_read\":%" PRIu64 ",\"bytes_written\":%"
+		    PRIu64 ",\"total_bytes\":%" PRIu64 ",\"ratio\":%.3f,\"mb_per_sec\":%.3f"
+		    ",\"eta_secs\":%" PRId64 "}\n", state, pctx->verify ? "verify" :
+		    (pctx->do_compress ? "compress" : "decompress"), elapsed, chunks, rd,
+		    wr, pctx->progress_total, ratio, rate, eta);
+		if (fclose(fp) != 0 || rename(tmpname, pctx->progress_file) == -1) {
+			log_msg(LOG_WARN, 1, "Cannot write progress file %s ",
+			    pctx->progress_file);
+			unlink(tmpname);
+		}
+	}
+}
+
+static void *
+progress_thread(void *dat)
+{
+	pc_ctx_t *pctx = (pc_ctx_t *)dat;
+	struct timespec ts;
+
+	pthread_mutex_lock(&pctx->progress_lock);
+	while (!pctx->progress_done) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += pctx->progress_secs;
+		pthread_cond_timedwait(&pctx->progress_cv, &pctx->progress_lock, &ts);
+		if (pctx->progress_done)
+			break;
+		report_progress(pctx, "running");
+	}
+	pthread_mutex_unlock(&pctx->progress_lock);
+	return (NULL);
+}
+
+static void
+start_progress(pc_ctx_t *pctx)
+{
+	pctx->progress_done = 0;
+	pctx->progress_start = get_wtime_nanos();
+	pctx->progress_last_ns = pctx->progress_start;
+	pctx->progress_last_bytes = 0;
+	pctx->progress_total = 0;
+	memset(&pctx->reader_stats, 0, sizeof (pctx->reader_stats));
+	memset(&pctx->writer_stats, 0, sizeof (pctx->writer_stats));
+	pthread_mutex_init(&pctx->progress_lock, NULL);
+	pthread_cond_init(&pctx->progress_cv, NULL);
+	if (pthread_create(&pctx->progress_thr, NULL, progress_thread, pctx) != 0) {
+		log_msg(LOG_ERR, 1, "Error in thread creation: ");
+		pthread_cond_destroy(&pctx->progress_cv);
+		pthread_mutex_destroy(&pctx->progress_lock);
+		return;
+	}
+	pctx->progress_running = 1;
+}
+
+/*
+ * Wake up and stop the sampling thread, then give a final report.
+ */
+static void
+stop_progress(pc_ctx_t *pctx, int err)
+{
+	if (!pctx->progress_running)
+		return;
+	pthread_mutex_lock(&pctx->progress_lock);
+	pctx->progress_done = 1;
+	pthread_cond_signal(&pctx->progress_cv);
+	pthread_mutex_unlock(&pctx->progress_lock);
+	pthread_join(pctx->progress_thr, NULL);
+	report_progress(pctx, err ? "failed" : "done");
+	pthread_cond_destroy(&pctx->progress_cv);
+	pthread_mutex_destroy(&pctx->progress_lock);
+	pctx->progress_running = 0;
+}
+
+/*
+ * Work out how many chunk slots fit into the memory budget next to the fixed
+ * allocations. Returns 0 if not even one fits.
+ */
+static int
+budget_slots(pc_ctx_t *pctx, uint64_t fixed_mem, uint64_t slot_mem, int nslots)
+{
+	uint64_t fit;
+
+	if (fixed_mem + slot_mem > pctx->mem_budget) {
+		log_msg(LOG_ERR, 0, "Memory budget too small. At least %s is needed with "
+		    "this chunk size and level.", bytes_to_size(fixed_mem + slot_mem));
+		return (0);
+	}
+	fit = (pctx->mem_budget - fixed_mem) / slot_mem;
+	if (fit < (uint64_t)nslots) {
+		log_msg(LOG_WARN, 0, "Memory budget allows %d threads.", (int)fit);
+		nslots = (int)fit;
+	}
+	return (nslots);
+}
+
 /*
  * Wrapper functions to pre-process the buffer and then call the main compression routine.
  *
@@ -201,34 +632,39 @@ show_compression_stats(pc_ctx_t *pctx)
  * It is possible for a buffer to be only pre-processed and not compressed by the final
  * algorithm if the final one fails to compress for some reason. However the vice versa
  * is not allowed.
+ *
+ * Pre-processing and compression are separate steps so that they can run as different
+ * stages of the chunk pipeline. The filters leave their output in src, using dst as
+ * scratch space, and return the pre-processor type flags. The updated length is
+ * returned in srclen. The analyzer results are kept in actx, which must stay valid
+ * till the chunk is compressed since the adaptive modes refer to them.
  */
-static int
-preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t srclen,
-    void *dst, uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data,
-    algo_props_t *props, int interesting)
+static uchar_t
+preproc_filter(pc_ctx_t *pctx, void *src, uint64_t *srclen, void *dst, int level,
+    int btype, void *data, algo_props_t *props, int interesting, analyzer_ctx_t *actx)
 {
-	uchar_t *dest = (uchar_t *)dst, type = 0;
+	uchar_t type = 0;
 	int result;
 	uint64_t _dstlen, fromlen;
 	uchar_t *from, *to;
 	int stype, analyzed;
-	analyzer_ctx_t actx;
-	DEBUG_STAT_EN(double strt, en);
 
-	_dstlen = *dstlen;
 	from = src;
 	to = dst;
-	fromlen = srclen;
+	fromlen = *srclen;
 	result = 0;
 	stype = PC_SUBTYPE(btype);
 	analyzed = 0;
 
 	if (btype == TYPE_UNKNOWN || stype == TYPE_ARCHIVE_TAR || stype == TYPE_PDF ||
 	    PC_TYPE(btype) & TYPE_TEXT || interesting) {
-		analyze_buffer(src, srclen, &actx);
+		analyze_buffer(src, *srclen, actx);
 		analyzed = 1;
 		if (pctx->adapt_mode)
-			adapt_set_analyzer_ctx(data, &actx);
+			adapt_set_analyzer_ctx(data, actx);
+		DEBUG_STAT_EN(fprintf(stderr, "Analyzer: entropy %.3f, zero %.3f, dup %.3f, "
+		    "delta runs %d, transpose stride %d\n", actx->entropy, actx->zero_frac,
+		    actx->dup_frac, actx->delta_runs, actx->transpose_stride));
 	}
 
 	/*
@@ -283,14 +719,15 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 
 		b_type = btype;
 		if (analyzed) {
-			b_type = actx.ten_pct.btype;
+			b_type = actx->ten_pct.btype;
 		} else {
 			b_type = analyze_buffer_simple(from, fromlen);
 		}
 
 		if (PC_TYPE(b_type) & TYPE_TEXT) {
 			_dstlen = fromlen;
-			result = dict_encode(from, fromlen, to, &_dstlen, (stype == TYPE_DNA_SEQ));
+			result = dict_encode(from, fromlen, to, &_dstlen, (stype == TYPE_DNA_SEQ),
+			    pctx->preproc_nthreads);
 			if (result != -1) {
 				uchar_t *tmp;
 				tmp = from;
@@ -309,13 +746,14 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 
 		b_type = btype;
 		if (analyzed)
-			b_type = actx.thirty_pct.btype;
+			b_type = actx->thirty_pct.btype;
 
 		if (!(PC_TYPE(b_type) & TYPE_BINARY)) {
 			hashsize = lzp_hash_size(level);
 			result = lzp_compress((const uchar_t *)from, to, fromlen,
-					      hashsize, LZP_DEFAULT_LZPMINLEN, 0);
-			if (result >= 0 && result < srclen) {
+					      hashsize, LZP_DEFAULT_LZPMINLEN, 0,
+					      pctx->preproc_nthreads);
+			if (result >= 0 && result < *srclen) {
 				uchar_t *tmp;
 				tmp = from;
 				from = to;
@@ -334,9 +772,28 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 
 		b_type = btype;
 		if (analyzed)
-			b_type = actx.ten_pct.btype;
+			b_type = actx->ten_pct.btype;
 
-		if (!(PC_TYPE(b_type) & TYPE_TEXT)) {
+		/*
+		 * Skip Delta2 if the analyzer did not see any delta runs. Fixed width
+		 * records without delta runs are transposed instead to group bytes
+		 * at the same offset within each record together.
+		 */
+		if (!(PC_TYPE(b_type) & TYPE_TEXT) && analyzed && !actx->delta_runs) {
+			if (actx->transpose_stride > 0 && from == src && fromlen <= *srclen) {
+				_dstlen = fromlen + 1;
+				result = transpose_encode((uchar_t *)from, fromlen, to,
+							  &_dstlen, actx->transpose_stride);
+				if (result != -1) {
+					uchar_t *tmp;
+					tmp = from;
+					from = to;
+					to = tmp;
+					fromlen = _dstlen;
+					type |= PREPROC_TYPE_TRANSPOSE;
+				}
+			}
+		} else if (!(PC_TYPE(b_type) & TYPE_TEXT)) {
 			_dstlen = fromlen;
 			result = delta2_encode((uchar_t *)from, fromlen, to,
 					       &_dstlen, props->delta2_span,
@@ -361,7 +818,18 @@ preproc_compress(pc_ctx_t *pctx, compress_func_ptr cmp_func, void *src, uint64_t
 	if (from == dst) {
 		memcpy(src, dst, fromlen);
 	}
-	srclen = fromlen;
+	*srclen = fromlen;
+	return (type);
+}
+
+static int
+preproc_compress(compress_func_ptr cmp_func, void *src, uint64_t srclen, void *dst,
+    uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data, uchar_t type)
+{
+	uchar_t *dest = (uchar_t *)dst;
+	int result;
+	uint64_t _dstlen;
+	DEBUG_STAT_EN(double strt, en);
 
 	*dest = type;
 	U64_P(dest + 1) = htonll(srclen);
@@ -430,6 +898,19 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 		src = sorc;
 	}
 
+	if (type & PREPROC_TYPE_TRANSPOSE) {
+		result = transpose_decode((uchar_t *)src, srclen, (uchar_t *)dst, &_dstlen);
+		if (result != -1) {
+			memcpy(src, dst, _dstlen);
+			srclen = _dstlen;
+			*dstlen = _dstlen;
+			_dstlen = _dstlen1;
+		} else {
+			log_msg(LOG_ERR, 0, "Transpose decoding failed.");
+			return (result);
+		}
+	}
+
 	if (type & PREPROC_TYPE_DELTA2) {
 		result = delta2_decode((uchar_t *)src, srclen, (uchar_t *)dst, &_dstlen);
 		if (result != -1) {
@@ -449,7 +930,8 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 		int64_t result;
 		hashsize = lzp_hash_size(level);
 		result = lzp_decompress((const uchar_t *)src, (uchar_t *)dst, srclen,
-					hashsize, LZP_DEFAULT_LZPMINLEN, 0);
+					hashsize, LZP_DEFAULT_LZPMINLEN, 0,
+					pctx->preproc_nthreads);
 		if (result > 0) {
 			memcpy(src, dst, result);
 			srclen = result;
@@ -466,7 +948,7 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 	}
 
 	if (type & PREPROC_TYPE_DICT) {
-		result = dict_decode(src, srclen, dst, &_dstlen);
+		result = dict_decode(src, srclen, dst, &_dstlen, pctx->preproc_nthreads);
 		if (result != -1) {
 			memcpy(src, dst, _dstlen);
 			srclen = _dstlen;
@@ -500,7 +982,8 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 	}
 
 	if (!(type & (PREPROC_COMPRESSED|PREPROC_TYPE_DELTA2|PREPROC_TYPE_LZP|
-		      PREPROC_TYPE_DISPACK|PREPROC_TYPE_DICT|PREPROC_TYPE_E8E9))
+		      PREPROC_TYPE_DISPACK|PREPROC_TYPE_DICT|PREPROC_TYPE_E8E9|
+		      PREPROC_TYPE_TRANSPOSE))
 	    && type > 0) {
 		log_msg(LOG_ERR, 0, "Invalid preprocessing flags: %d", type);
 		return (-1);
@@ -508,6 +991,285 @@ preproc_decompress(pc_ctx_t *pctx, compress_func_ptr dec_func, void *src, uint64
 	return (0);
 }
 
+/*
+ * Called by a worker at the end of a run. It waits for the next run of the
+ * pool and returns 0 then, or 1 if the pool is being torn down.
+ */
+static int
+pool_park(pc_ctx_t *pctx, Sem_t *park_sem)
+{
+	struct slot_pool *pool = pctx->pool;
+
+	Sem_Post(&(pool->parked));
+	Sem_Wait(park_sem);
+	return (pool->quit);
+}
+
+/*
+ * Wait for all workers of the pool to finish the current run.
+ */
+static void
+pool_drain(struct slot_pool *pool)
+{
+	uint32_t i;
+
+	for (i = 0; i < pool->nworkers; i++)
+		Sem_Wait(&(pool->parked));
+}
+
+/*
+ * Free the chunk buffers of a pooled slot.
+ */
+static void
+slot_free_bufs(struct slot_pool *pool, struct cmp_data *tdat)
+{
+	if (pool->do_compress) {
+		if (tdat->uncompressed_chunk != (uchar_t *)1)
+			slab_release(NULL, tdat->uncompressed_chunk);
+		if (tdat->cmp_seg != (uchar_t *)1)
+			slab_release(NULL, tdat->cmp_seg);
+		tdat->cmp_seg = NULL;
+	} else {
+		slab_release(NULL, tdat->uncompressed_chunk);
+		slab_release(NULL, tdat->compressed_chunk);
+		tdat->compressed_chunk = NULL;
+	}
+	tdat->uncompressed_chunk = NULL;
+}
+
+/*
+ * Stop the parked workers and free the slots. Per-run state like dedupe
+ * contexts must already have been released by the run.
+ */
+static void
+pool_destroy(pc_ctx_t *pctx)
+{
+	struct slot_pool *pool = pctx->pool;
+	struct cmp_data *tdat;
+	uint32_t i;
+
+	if (pool == NULL)
+		return;
+
+	pool->quit = 1;
+	for (i = 0; i < pool->nworkers; i++) {
+		if (pool->do_compress) {
+			Sem_Post(&(pool->sary[i].park_sem));
+			pthread_join(pool->sary[i].thr, NULL);
+		} else {
+			Sem_Post(&(pool->dary[i]->park_sem));
+			pthread_join(pool->dary[i]->thr, NULL);
+		}
+	}
+
+	for (i = 0; i < pool->nslots; i++) {
+		tdat = pool->dary[i];
+		if (!tdat) continue;
+		slot_free_bufs(pool, tdat);
+		if (pool->deinit)
+			pool->deinit(&(tdat->data));
+		Sem_Destroy(&(tdat->start_sem));
+		Sem_Destroy(&(tdat->cmp_done_sem));
+		Sem_Destroy(&(tdat->write_done_sem));
+		Sem_Destroy(&(tdat->index_sem));
+		if (pool->do_compress)
+			Sem_Destroy(&(tdat->prep_done_sem));
+		else
+			Sem_Destroy(&(tdat->park_sem));
+		slab_release(NULL, tdat);
+	}
+	slab_release(NULL, pool->dary);
+	if (pool->do_compress) {
+		for (i = 0; i < pool->nslots; i++)
+			Sem_Destroy(&(pool->sary[i].park_sem));
+		slab_release(NULL, pool->sary);
+	}
+	slab_release(NULL, pool->spare);
+	Sem_Destroy(&(pool->parked));
+	slab_release(NULL, pool);
+	pctx->pool = NULL;
+}
+
+/*
+ * A run describes the slots it needs in a template pool. If the context
+ * already holds a pool with the same number and layout of slots, the slots
+ * and parked workers are taken over. Buffers that are too small are freed
+ * and the regrow flag set, codec state made for other parameters is freed
+ * and the reinit flag set. The run then sets these up again. Otherwise the
+ * old pool is dropped and an empty one is set up for the run to fill.
+ * Returns 1 if the pool is reused, 0 if it is new and -1 if out of memory.
+ */
+static int
+pool_get(pc_ctx_t *pctx, struct slot_pool *want)
+{
+	struct slot_pool *pool = pctx->pool;
+	uint32_t i;
+
+	if (pool != NULL && (pool->do_compress != want->do_compress ||
+	    pool->nslots != want->nslots || pool->nstages != want->nstages ||
+	    pool->single_chunk != want->single_chunk || pool->dedupe != want->dedupe))
+		pool_destroy(pctx);
+
+	pool = pctx->pool;
+	if (pool != NULL) {
+		pool->regrow = 0;
+		pool->reinit = 0;
+		if (want->cmp_size > pool->cmp_size) {
+			for (i = 0; i < pool->nslots; i++)
+				slot_free_bufs(pool, pool->dary[i]);
+			slab_release(NULL, pool->spare);
+			pool->spare = NULL;
+			pool->cmp_size = want->cmp_size;
+			pool->regrow = 1;
+		}
+		if (pool->level != want->level || pool->version != want->version ||
+		    pool->nthreads != want->nthreads || pool->chunksize != want->chunksize ||
+		    pool->init != want->init || pool->deinit != want->deinit ||
+		    pool->codec != want->codec) {
+			for (i = 0; i < pool->nslots; i++) {
+				if (pool->deinit)
+					pool->deinit(&(pool->dary[i]->data));
+				pool->dary[i]->data = NULL;
+			}
+			pool->level = want->level;
+			pool->version = want->version;
+			pool->nthreads = want->nthreads;
+			pool->chunksize = want->chunksize;
+			pool->init = want->init;
+			pool->deinit = want->deinit;
+			pool->codec = want->codec;
+			pool->reinit = 1;
+		}
+		pool->keep = want->keep;
+		return (1);
+	}
+
+	pool = (struct slot_pool *)slab_alloc(NULL, sizeof (struct slot_pool));
+	if (pool == NULL)
+		return (-1);
+	memcpy(pool, want, sizeof (struct slot_pool));
+	pool->quit = 0;
+	pool->regrow = 1;
+	pool->reinit = 1;
+	pool->nworkers = 0;
+	pool->spare = NULL;
+	pool->sary = NULL;
+	pool->dary = (struct cmp_data **)slab_calloc(NULL, pool->nslots,
+	    sizeof (struct cmp_data *));
+	if (pool->do_compress) {
+		pool->sary = (struct cmp_stage *)slab_calloc(NULL, pool->nslots,
+		    sizeof (struct cmp_stage));
+	}
+	if (pool->dary == NULL || (pool->do_compress && pool->sary == NULL)) {
+		slab_release(NULL, pool->dary);
+		slab_release(NULL, pool->sary);
+		slab_release(NULL, pool);
+		return (-1);
+	}
+	if (pool->do_compress) {
+		for (i = 0; i < pool->nslots; i++)
+			Sem_Init(&(pool->sary[i].park_sem), 0, 0);
+	}
+	Sem_Init(&(pool->parked), 0, 0);
+	pctx->pool = pool;
+	return (0);
+}
+
+/*
+ * Reset the semaphores of a pooled slot for a new run.
+ */
+static void
+slot_sems_reset(struct cmp_data *tdat, int do_compress)
+{
+	Sem_Destroy(&(tdat->start_sem));
+	Sem_Destroy(&(tdat->cmp_done_sem));
+	Sem_Destroy(&(tdat->write_done_sem));
+	Sem_Destroy(&(tdat->index_sem));
+	Sem_Init(&(tdat->start_sem), 0, 0);
+	Sem_Init(&(tdat->cmp_done_sem), 0, 0);
+	Sem_Init(&(tdat->write_done_sem), 0, 1);
+	Sem_Init(&(tdat->index_sem), 0, 0);
+	if (do_compress) {
+		Sem_Destroy(&(tdat->prep_done_sem));
+		Sem_Init(&(tdat->prep_done_sem), 0, 0);
+	}
+}
+
+/*
+ * Hand over a decompressed chunk. Normally the writer thread picks it up in
+ * order. When only verifying there is no writer and the worker frees the slot
+ * itself. With Global Dedupe the chunk is still added to the reference data,
+ * in order, before the next slot may resolve its references.
+ */
+static void
+decompress_done(pc_ctx_t *pctx, struct cmp_data *tdat)
+{
+	int rv;
+
+	if (!pctx->verify) {
+		Sem_Post(&tdat->cmp_done_sem);
+		return;
+	}
+	if (tdat->len_cmp == 0) {
+		pctx->t_errored = 1;
+		pctx->main_cancel = 1;
+	} else {
+		ATOMIC_ADD(pctx->writer_stats.chunks, 1);
+		ATOMIC_ADD(pctx->writer_stats.bytes_in, tdat->in_bytes);
+		ATOMIC_ADD(pctx->writer_stats.bytes_out, tdat->len_cmp);
+	}
+	if (pctx->enable_rabin_global) {
+		if (tdat->len_cmp > 0) {
+			if (pctx->refcache) {
+				rv = refcache_feed(pctx->refcache, tdat->cmp_seg,
+				    tdat->len_cmp);
+			} else {
+				rv = 0;
+				if (Write(pctx->archive_temp_fd, tdat->cmp_seg,
+				    tdat->len_cmp) != tdat->len_cmp)
+					rv = -1;
+			}
+			if (rv == -1) {
+				log_msg(LOG_ERR, 1, "Chunk %d, cannot keep reference data: ",
+				    tdat->id);
+				pctx->t_errored = 1;
+				pctx->main_cancel = 1;
+			}
+		}
+		Sem_Post(tdat->rctx->index_sem_next);
+	}
+	Sem_Post(&tdat->write_done_sem);
+	if (!pctx->enable_rabin_global)
+		Sem_Post(&pctx->free_slots);
+}
+
+/*
+ * Takes the place of the extractor when verifying an archive. Pulls every
+ * chunk of the separate metadata stream through the metadata thread, which
+ * checks it just like an extraction would.
+ */
+static void *
+metadata_verify(void *dat)
+{
+	pc_ctx_t *pctx = (pc_ctx_t *)dat;
+	const void *buf;
+	size_t len;
+
+	if (!pctx->meta_stream)
+		return (NULL);
+	do {
+		buf = NULL;
+		len = 0;
+		if (meta_ctx_send(pctx->meta_ctx, &buf, &len) != 1) {
+			log_msg(LOG_ERR, 0, "Metadata stream verification failed.");
+			pctx->t_errored = 1;
+			pctx->main_cancel = 1;
+			break;
+		}
+	} while (len > 0);
+	return (NULL);
+}
+
 /*
  * This routine is called in multiple threads. Calls the decompression handler
  * as encoded in the file header. For adaptive mode the handler adapt_decompress()
@@ -520,23 +1282,27 @@ perform_decompress(void *dat)
 	struct cmp_data *tdat = (struct cmp_data *)dat;
 	uint64_t _chunksize;
 	uint64_t dedupe_index_sz, dedupe_data_sz, dedupe_index_sz_cmp, dedupe_data_sz_cmp;
-	int rv = 0;
+	int rv = 0, dedupe_cksum;
 	unsigned int blknum;
 	uchar_t checksum[CKSUM_MAX_BYTES];
 	uchar_t HDR;
 	uchar_t *cseg;
 	pc_ctx_t *pctx;
+	uint64_t t0;
 
 	pctx = tdat->pctx;
 redo:
+	t0 = STAGE_CLOCK(pctx);
 	Sem_Wait(&tdat->start_sem);
+	STAGE_ADD(pctx, &tdat->stats, WAIT_START, t0);
 	if (pctx->main_cancel)
-		return (NULL);
+		goto park;
+	dedupe_cksum = 0;
 
 	if (unlikely(tdat->cancel)) {
 		tdat->len_cmp = 0;
 		Sem_Post(&tdat->cmp_done_sem);
-		return (0);
+		goto park;
 	}
 
 	/*
@@ -547,6 +1313,7 @@ redo:
 		goto cont;
 	}
 
+	tdat->stats.bytes_in += tdat->rbytes;
 	cseg = tdat->compressed_chunk + pctx->cksum_bytes + pctx->mac_bytes;
 	HDR = *cseg;
 	cseg += CHUNK_FLAG_SZ;
@@ -569,6 +1336,7 @@ redo:
 		DEBUG_STAT_EN(double strt, en);
 
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		t0 = STAGE_CLOCK(pctx);
 		len = pctx->mac_bytes;
 		deserialize_checksum(checksum, tdat->compressed_chunk + pctx->cksum_bytes,
 		    pctx->mac_bytes);
@@ -582,6 +1350,7 @@ redo:
 			hmac_update(&tdat->chunk_hmac, rseg, ORIGINAL_CHUNKSZ);
 		}
 		hmac_final(&tdat->chunk_hmac, tdat->checksum, &len);
+		STAGE_ADD(pctx, &tdat->stats, STAGE_HMAC, t0);
 		if (memcmp(checksum, tdat->checksum, len) != 0) {
 			/*
 			 * HMAC verification failure is fatal.
@@ -590,8 +1359,8 @@ redo:
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
-			Sem_Post(&tdat->cmp_done_sem);
-			return (NULL);
+			decompress_done(pctx, tdat);
+			goto park;
 		}
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "HMAC Verification speed %.3f MB/s",
@@ -602,7 +1371,9 @@ redo:
 		 * encryption is in-place.
 		 */
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		t0 = STAGE_CLOCK(pctx);
 		rv = crypto_buf(&(pctx->crypto_ctx), cseg, cseg, tdat->len_cmp, tdat->id);
+		STAGE_ADD(pctx, &tdat->stats, STAGE_CRYPTO, t0);
 		if (rv == -1) {
 			/*
 			 * Decryption failure is fatal.
@@ -610,8 +1381,8 @@ redo:
 			log_msg(LOG_ERR, 0, "Chunk %d, Decryption failed", tdat->id);
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
-			Sem_Post(&tdat->cmp_done_sem);
-			return (NULL);
+			decompress_done(pctx, tdat);
+			goto park;
 		}
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "Decryption speed %.3f MB/s\n",
@@ -641,8 +1412,8 @@ redo:
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
-			Sem_Post(&tdat->cmp_done_sem);
-			return (NULL);
+			decompress_done(pctx, tdat);
+			goto park;
 		}
 
 		/*
@@ -652,6 +1423,7 @@ redo:
 		deserialize_checksum(tdat->checksum, tdat->compressed_chunk, pctx->cksum_bytes);
 	}
 
+	t0 = STAGE_CLOCK(pctx);
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global) &&
 	    (HDR & CHUNK_FLAG_DEDUP)) {
 		uchar_t *cmpbuf, *ubuf;
@@ -702,16 +1474,19 @@ redo:
 			/* Index should be at least 90 bytes to have been compressed. */
 			rv = lzma_decompress(cmpbuf, dedupe_index_sz_cmp, ubuf,
 			    &dedupe_index_sz, tdat->rctx->level, 0, TYPE_BINARY, tdat->rctx->lzma_data);
-		} else {
+
+			/*
+			 * Recover from transposed index.
+			 */
+			transpose(ubuf, cmpbuf, dedupe_index_sz, sizeof (uint32_t), COL);
 			memcpy(ubuf, cmpbuf, dedupe_index_sz);
+		} else {
+			/*
+			 * Plain transposed index, recover it directly.
+			 */
+			transpose(cmpbuf, ubuf, dedupe_index_sz, sizeof (uint32_t), COL);
 		}
 
-		/*
-		 * Recover from transposed index.
-		 */
-		transpose(ubuf, cmpbuf, dedupe_index_sz, sizeof (uint32_t), COL);
-		memcpy(ubuf, cmpbuf, dedupe_index_sz);
-
 	} else {
 		if (HDR & COMPRESSED) {
 			if (HDR & CHUNK_FLAG_PREPROC) {
@@ -733,6 +1508,7 @@ redo:
 		}
 	}
 	tdat->len_cmp = _chunksize;
+	STAGE_ADD(pctx, &tdat->stats, STAGE_CODEC, t0);
 
 	if (rv == -1) {
 		tdat->len_cmp = 0;
@@ -748,7 +1524,10 @@ redo:
 		rctx = tdat->rctx;
 		reset_dedupe_context(tdat->rctx);
 		rctx->cbuf = tdat->compressed_chunk;
+		t0 = STAGE_CLOCK(pctx);
 		dedupe_decompress(rctx, tdat->uncompressed_chunk, &(tdat->len_cmp));
+		STAGE_ADD(pctx, &tdat->stats, STAGE_DEDUPE, t0);
+		dedupe_cksum = rctx->data_cksum_done;
 		if (!rctx->valid) {
 			log_msg(LOG_ERR, 0, "ERROR: Chunk %d, dedup recovery failed.", tdat->id);
 			rv = -1;
@@ -779,8 +1558,13 @@ redo:
 		 * If it does not match we set length of chunk to 0 to indicate
 		 * exit to the writer thread.
 		 */
-		compute_checksum(checksum, pctx->cksum, tdat->uncompressed_chunk,
-		    _chunksize, tdat->cksum_mt, 1);
+		t0 = STAGE_CLOCK(pctx);
+		if (dedupe_cksum)
+			cksum_final(tdat->rctx->data_cksum, checksum);
+		else
+			compute_checksum(checksum, pctx->cksum, tdat->uncompressed_chunk,
+			    _chunksize, tdat->cksum_mt, 1);
+		STAGE_ADD(pctx, &tdat->stats, STAGE_CHECKSUM, t0);
 		if (memcmp(checksum, tdat->checksum, pctx->cksum_bytes) != 0) {
 			tdat->len_cmp = 0;
 			log_msg(LOG_ERR, 0, "ERROR: Chunk %d, checksums do not match.", tdat->id);
@@ -789,10 +1573,16 @@ redo:
 		}
 	}
 
+	tdat->stats.chunks++;
+	tdat->stats.bytes_out += _chunksize;
+
 cont:
-	Sem_Post(&tdat->cmp_done_sem);
+	decompress_done(pctx, tdat);
 	if (!pctx->t_errored)
 		goto redo;
+park:
+	if (pool_park(pctx, &tdat->park_sem) == 0)
+		goto redo;
 	return (NULL);
 }
 
@@ -843,23 +1633,36 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	int uncompfd = -1, err, np, bail;
 	int thread = 0, level;
 	uint32_t nprocs = 1, i;
+	uint64_t t0;
 	unsigned short version, flags;
 	int64_t chunksize, compressed_chunksize;
 	struct cmp_data **dary, *tdat;
+	struct slot_pool want, *pool;
 	pthread_t writer_thr;
 	algo_props_t props;
+	int reuse, any_slot, vfail;
+	uint64_t vbytes;
 
 	err = 0;
 	flags = 0;
 	thread = 0;
 	dary = NULL;
+	pool = NULL;
+	reuse = 0;
+	any_slot = 0;
+	vfail = 0;
+	vbytes = 0;
 	init_algo_props(&props);
 
 	/*
-	 * Open files and do sanity checks.
+	 * Open files and do sanity checks. The buffer interface passes the
+	 * input through callbacks.
 	 */
-	if (!pctx->pipe_mode) {
-		if (filename == NULL) {
+	if (pctx->mem_io) {
+		if (!pctx->pipe_mode)
+			pctx->progress_total = pctx->mem_insize;
+	} else if (!pctx->pipe_mode) {
+		if (filename == NULL && pctx->in_fd == -1) {
 			pctx->pipe_mode = 1;
 			compfd = fileno(stdin);
 			if (compfd == -1) {
@@ -868,7 +1671,9 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			}
 			sbuf.st_size = 0;
 		} else {
-			if ((compfd = open(filename, O_RDONLY, 0)) == -1) {
+			if (pctx->in_fd != -1) {
+				compfd = pctx->in_fd;
+			} else if ((compfd = open(filename, O_RDONLY, 0)) == -1) {
 				log_msg(LOG_ERR, 1, "Cannot open: %s", filename);
 				return (1);
 			}
@@ -879,6 +1684,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			}
 			if (sbuf.st_size == 0)
 				return (1);
+			pctx->progress_total = sbuf.st_size;
 		}
 	} else {
 		compfd = fileno(stdin);
@@ -891,7 +1697,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	/*
 	 * Read file header pieces and verify.
 	 */
-	if (Read(compfd, algorithm, ALGO_SZ) < ALGO_SZ) {
+	if (pc_read(pctx, compfd, algorithm, ALGO_SZ) < ALGO_SZ) {
 		log_msg(LOG_ERR, 1, "Read: ");
 		UNCOMP_BAIL;
 	}
@@ -904,10 +1710,10 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	}
 	pctx->algo = algorithm;
 
-	if (Read(compfd, &version, sizeof (version)) < sizeof (version) ||
-	    Read(compfd, &flags, sizeof (flags)) < sizeof (flags) ||
-	    Read(compfd, &chunksize, sizeof (chunksize)) < sizeof (chunksize) ||
-	    Read(compfd, &level, sizeof (level)) < sizeof (level)) {
+	if (pc_read(pctx, compfd, &version, sizeof (version)) < sizeof (version) ||
+	    pc_read(pctx, compfd, &flags, sizeof (flags)) < sizeof (flags) ||
+	    pc_read(pctx, compfd, &chunksize, sizeof (chunksize)) < sizeof (chunksize) ||
+	    pc_read(pctx, compfd, &level, sizeof (level)) < sizeof (level)) {
 		log_msg(LOG_ERR, 1, "Read: ");
 		UNCOMP_BAIL;
 	}
@@ -936,12 +1742,18 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		err = 1;
 		goto uncomp_done;
 	}
-	if (version < VERSION-4) {
+	if (version < MIN_VERSION) {
 		log_msg(LOG_ERR, 0, "Unsupported version: %d", version);
 		err = 1;
 		goto uncomp_done;
 	}
 
+	if ((flags & FLAG_ARCHIVE) && pctx->mem_io) {
+		log_msg(LOG_ERR, 0, "Archives cannot be extracted with the buffer interface.");
+		err = 1;
+		goto uncomp_done;
+	}
+
 	/*
 	 * First check for archive mode. In that case the to_filename must be a directory.
 	 */
@@ -965,7 +1777,11 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			pctx->to_filename = ".";
 		}
 		pctx->archive_mode = 1;
-		if (stat(to_filename, &sbuf) == -1) {
+
+		/*
+		 * Nothing is extracted when verifying, no target directory needed.
+		 */
+		if (!pctx->verify && stat(to_filename, &sbuf) == -1) {
 			if (errno != ENOENT) {
 				log_msg(LOG_ERR, 1, "Target path is not a directory.");
 				err = 1;
@@ -985,7 +1801,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 				goto uncomp_done;
 			}
 		}
-		if (!S_ISDIR(sbuf.st_mode)) {
+		if (!pctx->verify && !S_ISDIR(sbuf.st_mode)) {
 			log_msg(LOG_ERR, 0, "Target path is not a directory.", to_filename);
 			err = 1;
 			goto uncomp_done;
@@ -1011,7 +1827,8 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			err = 1;
 			goto uncomp_done;
 		}
-		if (to_filename == NULL && !pctx->pipe_mode) {
+		if (to_filename == NULL && !pctx->pipe_mode && pctx->out_fd == -1 &&
+		    !pctx->verify && !pctx->mem_io) {
 			char *pos;
 
 			/*
@@ -1040,7 +1857,8 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 				log_msg(LOG_WARN, 0, "Using %s for output file name.", to_filename);
 			}
 		}
-		if (!pctx->pipe_mode) {
+		if (!pctx->pipe_mode && pctx->out_fd == -1 && !pctx->verify &&
+		    !pctx->mem_io) {
 			origf = to_filename;
 			if ((to_filename = realpath(origf, NULL)) != NULL) {
 				free((void *)(to_filename));
@@ -1069,9 +1887,9 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 
 		if (flags & FLAG_DEDUP_FIXED) {
 			if (version > 7) {
-				if (pctx->pipe_mode) {
+				if (pctx->pipe_mode && !pctx->verify) {
 					log_msg(LOG_ERR, 0, "Global Deduplication is not "
-					    "supported with pipe mode.");
+					    "supported with pipe mode or streams.");
 					err = 1;
 					goto uncomp_done;
 				}
@@ -1092,6 +1910,11 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		props.is_single_chunk = 1;
 	}
 
+	if (flags & FLAG_DELTA_HDIFF)
+		pctx->delta_enc = DELTA_ENC_HDIFF;
+	else
+		pctx->delta_enc = DELTA_ENC_BSDIFF;
+
 	pctx->cksum = flags & CKSUM_MASK;
 
 	/*
@@ -1151,21 +1974,21 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 				pctx->encrypt_type);
 			UNCOMP_BAIL;
 		}
-		if (Read(compfd, &saltlen, sizeof (saltlen)) < sizeof (saltlen)) {
+		if (pc_read(pctx, compfd, &saltlen, sizeof (saltlen)) < sizeof (saltlen)) {
 			log_msg(LOG_ERR, 1, "Read: ");
 			UNCOMP_BAIL;
 		}
 		saltlen = ntohl(saltlen);
 		salt1 = (uchar_t *)malloc(saltlen);
 		salt2 = (uchar_t *)malloc(saltlen);
-		if (Read(compfd, salt1, saltlen) < saltlen) {
+		if (pc_read(pctx, compfd, salt1, saltlen) < saltlen) {
 			free(salt1);  free(salt2);
 			log_msg(LOG_ERR, 1, "Read: ");
 			UNCOMP_BAIL;
 		}
 		deserialize_checksum(salt2, salt1, saltlen);
 
-		if (Read(compfd, n1, noncelen) < noncelen) {
+		if (pc_read(pctx, compfd, n1, noncelen) < noncelen) {
 			memset(salt2, 0, saltlen);
 			free(salt2);
 			memset(salt1, 0, saltlen);
@@ -1182,7 +2005,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		}
 
 		if (version > 6) {
-			if (Read(compfd, &(pctx->keylen), sizeof (pctx->keylen)) < sizeof (pctx->keylen)) {
+			if (pc_read(pctx, compfd, &(pctx->keylen), sizeof (pctx->keylen)) < sizeof (pctx->keylen)) {
 				memset(salt2, 0, saltlen);
 				free(salt2);
 				memset(salt1, 0, saltlen);
@@ -1193,7 +2016,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			pctx->keylen = ntohl(pctx->keylen);
 		}
 
-		if (Read(compfd, hdr_hash1, pctx->mac_bytes) < pctx->mac_bytes) {
+		if (pc_read(pctx, compfd, hdr_hash1, pctx->mac_bytes) < pctx->mac_bytes) {
 			memset(salt2, 0, saltlen);
 			free(salt2);
 			memset(salt1, 0, saltlen);
@@ -1204,8 +2027,15 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		deserialize_checksum(hdr_hash2, hdr_hash1, pctx->mac_bytes);
 
 		if (!pctx->pwd_file && !pctx->user_pw) {
-			pw_len = get_pw_string(pw,
-				"Please enter decryption password", 0);
+			/*
+			 * The buffer interface has no terminal to prompt on.
+			 */
+			if (pctx->mem_io) {
+				log_msg(LOG_ERR, 0, "No password set with pc_set_userpw().");
+				pw_len = -1;
+			} else
+				pw_len = get_pw_string(pw,
+					"Please enter decryption password", 0);
 			if (pw_len == -1) {
 				memset(salt2, 0, saltlen);
 				free(salt2);
@@ -1263,6 +2093,8 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 				memset(salt1, 0, saltlen);
 				free(salt1);
 				memset(pctx->user_pw, 0, pctx->user_pw_len);
+				pctx->user_pw = NULL;
+				pctx->user_pw_len = 0;
 				log_msg(LOG_ERR, 0, "Failed to initialize crypto");
 				UNCOMP_BAIL;
 			}
@@ -1329,7 +2161,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		/*
 		 * Verify file header CRC32 in non-crypto mode.
 		 */
-		if (Read(compfd, &crc1, sizeof (crc1)) < sizeof (crc1)) {
+		if (pc_read(pctx, compfd, &crc1, sizeof (crc1)) < sizeof (crc1)) {
 			log_msg(LOG_ERR, 1, "Read: ");
 			UNCOMP_BAIL;
 		}
@@ -1352,31 +2184,113 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		}
 	}
 
-	if (flags & FLAG_ARCHIVE) {
-		if (pctx->enable_rabin_global) {
-			char cwd[MAXPATHLEN];
+	/*
+	 * Read the shared algorithm dictionary if present. It immediately follows
+	 * the header and is protected by its own CRC32.
+	 */
+	if (flags & FLAG_ALGO_DICT) {
+		uint32_t dlen, crc1, crc2;
 
-			if (to_filename[0] != PATHSEP_CHAR) {
-				if (getcwd(cwd, MAXPATHLEN) == NULL) {
-					log_msg(LOG_ERR, 1, "Cannot get current dir");
-					UNCOMP_BAIL;
-				}
+		if (pctx->_dict_set_func == NULL || pctx->encrypt_type) {
+			log_msg(LOG_ERR, 0, "Invalid algorithm dictionary flag in header.");
+			UNCOMP_BAIL;
+		}
+		if (pc_read(pctx, compfd, &dlen, sizeof (dlen)) < sizeof (dlen)) {
+			log_msg(LOG_ERR, 1, "Read: ");
+			UNCOMP_BAIL;
+		}
+		crc2 = lzma_crc32((uchar_t *)&dlen, sizeof (dlen), 0);
+		dlen = ntohl(dlen);
+		if (dlen > ALGO_DICT_MAX) {
+			log_msg(LOG_ERR, 0, "Invalid algorithm dictionary size: %u", dlen);
+			UNCOMP_BAIL;
+		}
+		pctx->algo_dict = (uchar_t *)malloc(dlen + 1);
+		if (!pctx->algo_dict) {
+			log_msg(LOG_ERR, 0, "Out of memory.");
+			UNCOMP_BAIL;
+		}
+		if (pc_read(pctx, compfd, pctx->algo_dict, dlen) < dlen ||
+		    pc_read(pctx, compfd, &crc1, sizeof (crc1)) < sizeof (crc1)) {
+			log_msg(LOG_ERR, 1, "Read: ");
+			UNCOMP_BAIL;
+		}
+		crc2 = lzma_crc32(pctx->algo_dict, dlen, crc2);
+		if (ntohl(crc1) != crc2) {
+			log_msg(LOG_ERR, 0, "Algorithm dictionary verification failed! "
+			    "File corrupt or tampered.");
+			UNCOMP_BAIL;
+		}
+		pctx->algo_dict_len = dlen;
+	}
 
-				snprintf(pctx->archive_temp_file, sizeof (pctx->archive_temp_file),
-				    "%s" PATHSEP_STR "%s" PATHSEP_STR ".data", cwd, to_filename);
-			} else {
-				snprintf(pctx->archive_temp_file, sizeof (pctx->archive_temp_file),
-					 "%s" PATHSEP_STR ".data", to_filename);
+	/*
+	 * Global Dedupe references in archives, and in any file when only verifying,
+	 * are resolved from a temporary copy of the data stream rather than from
+	 * the output. When verifying the copy is made in the temporary directory.
+	 */
+	if (pctx->enable_rabin_global && ((flags & FLAG_ARCHIVE) || pctx->verify)) {
+		char cwd[MAXPATHLEN];
+
+		if (pctx->verify) {
+			char *tmp;
+			int fd;
+
+			tmp = get_temp_dir();
+			snprintf(pctx->archive_temp_file, sizeof (pctx->archive_temp_file),
+			    "%s" PATHSEP_STR ".pcompXXXXXX", tmp);
+			free(tmp);
+			if ((fd = mkstemp(pctx->archive_temp_file)) == -1) {
+				log_msg(LOG_ERR, 1, "mkstemp ");
+				UNCOMP_BAIL;
+			}
+			close(fd);
+		} else if (to_filename[0] != PATHSEP_CHAR) {
+			if (getcwd(cwd, MAXPATHLEN) == NULL) {
+				log_msg(LOG_ERR, 1, "Cannot get current dir");
+				UNCOMP_BAIL;
 			}
+
+			snprintf(pctx->archive_temp_file, sizeof (pctx->archive_temp_file),
+			    "%s" PATHSEP_STR "%s" PATHSEP_STR ".data", cwd, to_filename);
+		} else {
+			snprintf(pctx->archive_temp_file, sizeof (pctx->archive_temp_file),
+				 "%s" PATHSEP_STR ".data", to_filename);
+		}
+
+		/*
+		 * If the archive has a table of cross-chunk references then only
+		 * the referenced blocks need to be kept around, in memory as far
+		 * as possible. The temporary file is then only used for overflow.
+		 * Otherwise, or if the input is not seekable, the entire data
+		 * stream is staged in the temporary file.
+		 */
+		if (flags & FLAG_DEDUPE_REFS) {
+			my_sysinfo msys_info;
+
+			get_sys_limits(&msys_info);
+			msys_info.freeram /= 4;
+			if (pctx->mem_budget)
+				msys_info.freeram = MEM_BUDGET_INDEX(pctx->mem_budget);
+			pctx->refcache = refcache_create(compfd, msys_info.freeram,
+			    pctx->archive_temp_file);
+			if (pctx->refcache == NULL && pctx->verify && !pctx->pipe_mode) {
+				log_msg(LOG_ERR, 0, "Global Dedupe reference table is corrupt.");
+				vfail = 1;
+			}
+		}
+		if (pctx->refcache == NULL) {
 			if ((pctx->archive_temp_fd = open(pctx->archive_temp_file,
 			    O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) == -1) {
 				log_msg(LOG_ERR, 1, "Cannot open temporary data file in "
 				    "target directory.");
 				UNCOMP_BAIL;
 			}
-			add_fname(pctx->archive_temp_file);
 		}
+		add_fname(pctx->archive_temp_file);
+	}
 
+	if (flags & FLAG_ARCHIVE) {
 		/*
 		 * If we are having a metadata stream, get the current position of the main
 		 * fd. The secondary fd must be set to the same position so that metadata
@@ -1403,17 +2317,29 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		}
 
 		uncompfd = -1;
-		if (setup_extractor(pctx) == -1) {
-			log_msg(LOG_ERR, 0, "Setup of extraction context failed.");
-			UNCOMP_BAIL;
-		}
+		if (pctx->verify) {
+			if (pthread_create(&(pctx->archive_thread), NULL, metadata_verify,
+			    (void *)pctx) != 0) {
+				log_msg(LOG_ERR, 1, "Error in thread creation: ");
+				UNCOMP_BAIL;
+			}
+		} else {
+			if (setup_extractor(pctx) == -1) {
+				log_msg(LOG_ERR, 0, "Setup of extraction context failed.");
+				UNCOMP_BAIL;
+			}
 
-		if (start_extractor(pctx) == -1) {
-			log_msg(LOG_ERR, 0, "Unable to start extraction thread.");
-			UNCOMP_BAIL;
+			if (start_extractor(pctx) == -1) {
+				log_msg(LOG_ERR, 0, "Unable to start extraction thread.");
+				UNCOMP_BAIL;
+			}
 		}
 	} else {
-		if (!pctx->pipe_mode) {
+		if (pctx->verify || pctx->mem_io) {
+			uncompfd = -1;
+		} else if (pctx->out_fd != -1) {
+			uncompfd = pctx->out_fd;
+		} else if (!pctx->pipe_mode) {
 			if ((uncompfd = open(to_filename, O_WRONLY|O_CREAT|O_TRUNC,
 			    S_IRUSR|S_IWUSR)) == -1) {
 				log_msg(LOG_ERR, 1, "Cannot open: %s", to_filename);
@@ -1434,7 +2360,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	 */
 
 	nprocs = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
-	if (pctx->archive_mode) {
+	if (pctx->archive_mode && !pctx->verify) {
 		nprocs = nprocs > 1 ? nprocs-1:nprocs;
 	}
 
@@ -1446,6 +2372,30 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	set_threadcounts(&props, &(pctx->nthreads), nprocs, DECOMPRESS_THREADS);
 	if (props.is_single_chunk)
 		pctx->nthreads = 1;
+
+	/*
+	 * Fit the chunk slots into the memory budget next to the reference cache
+	 * and the archive filter scratch space.
+	 */
+	if (pctx->mem_budget) {
+		uint64_t slot_mem, fixed_mem;
+
+		slot_mem = compressed_chunksize + chunksize + props.dstate_mem;
+		if (pctx->enable_rabin_scan || pctx->enable_fixed_scan)
+			slot_mem += dedupe_ctx_mem(chunksize, pctx->rab_blk_size, DECOMPRESS);
+		fixed_mem = MEM_BUDGET_RESERVE;
+		if (pctx->refcache)
+			fixed_mem += MEM_BUDGET_INDEX(pctx->mem_budget);
+		if (pctx->archive_mode)
+			fixed_mem += FILTER_SCRATCH_SIZE_MAX;
+		pctx->nthreads = budget_slots(pctx, fixed_mem, slot_mem, pctx->nthreads);
+		if (pctx->nthreads == 0) {
+			UNCOMP_BAIL;
+		}
+	}
+	pctx->preproc_nthreads = nprocs / pctx->nthreads;
+	if (pctx->preproc_nthreads < 1)
+		pctx->preproc_nthreads = 1;
 	/*
 	 * If we are trying to list the archive contents, and the archive has a
 	 * metadata stream, then we do not do any data decompression. Only
@@ -1466,22 +2416,65 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	slab_cache_add(chunksize);
 	slab_cache_add(sizeof (struct cmp_data));
 
-	dary = (struct cmp_data **)slab_calloc(NULL, nprocs, sizeof (struct cmp_data *));
-	for (i = 0; i < nprocs; i++) {
-		dary[i] = (struct cmp_data *)slab_alloc(NULL, sizeof (struct cmp_data));
-		if (!dary[i]) {
+	/*
+	 * With NUMA placement slot i and its buffers belong to node i. The reader,
+	 * this thread, is kept near the device holding the compressed file.
+	 */
+	if (pctx->numa_place) {
+		int nnodes = numa_topo_init();
+
+		if (nnodes > 1)
+			log_msg(LOG_INFO, 0, "Placing threads on %d NUMA nodes", nnodes);
+		numa_place_thread(pthread_self(), numa_fd_node(compfd));
+	}
+
+	/*
+	 * Take over the slots of the previous run if they fit, otherwise set up
+	 * new ones. See start_compress().
+	 */
+	if (nprocs > 0) {
+		memset(&want, 0, sizeof (want));
+		want.do_compress = 0;
+		want.level = level;
+		want.version = version;
+		want.nthreads = props.nthreads;
+		want.nstages = 1;
+		want.single_chunk = props.is_single_chunk;
+		want.dedupe = (pctx->enable_rabin_scan || pctx->enable_fixed_scan);
+		want.nslots = nprocs;
+		want.chunksize = chunksize;
+		want.cmp_size = compressed_chunksize;
+		want.init = pctx->_init_func;
+		want.deinit = pctx->_deinit_func;
+		want.codec = pctx->_decompress_func;
+		want.keep = !pctx->archive_mode && pctx->algo_dict_len == 0;
+		reuse = pool_get(pctx, &want);
+		if (reuse == -1) {
 			log_msg(LOG_ERR, 0, "1: Out of memory");
 			UNCOMP_BAIL;
 		}
+		pool = pctx->pool;
+		dary = pool->dary;
+	}
+
+	thread = 1;
+	for (i = 0; i < nprocs; i++) {
+		if (!reuse) {
+			dary[i] = (struct cmp_data *)slab_alloc(NULL, sizeof (struct cmp_data));
+			if (!dary[i]) {
+				log_msg(LOG_ERR, 0, "1: Out of memory");
+				UNCOMP_BAIL;
+			}
+		}
 		tdat = dary[i];
 		tdat->pctx = pctx;
-		tdat->compressed_chunk = NULL;
-		tdat->uncompressed_chunk = NULL;
 		tdat->chunksize = chunksize;
 		tdat->compress = pctx->_compress_func;
 		tdat->decompress = pctx->_decompress_func;
 		tdat->cancel = 0;
+		tdat->chunk_cksum.cksum_ctx = NULL;
 		tdat->decompressing = 1;
+		memset(&tdat->stats, 0, sizeof (tdat->stats));
 		if (props.is_single_chunk) {
 			tdat->cksum_mt = 1;
 			if (version == 6) {
@@ -1490,17 +2483,33 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		} else {
 			tdat->cksum_mt = 0;
 		}
-		tdat->level = level;
-		tdat->data = NULL;
+		tdat->rctx = NULL;
 		tdat->props = &props;
-		Sem_Init(&(tdat->start_sem), 0, 0);
-		Sem_Init(&(tdat->cmp_done_sem), 0, 0);
-		Sem_Init(&(tdat->write_done_sem), 0, 1);
-		Sem_Init(&(tdat->index_sem), 0, 0);
-
-		if (pctx->_init_func) {
-			if (pctx->_init_func(&(tdat->data), &(tdat->level), props.nthreads, chunksize,
-			    version, DECOMPRESS) != 0) {
+		if (reuse) {
+			slot_sems_reset(tdat, 0);
+		} else {
+			tdat->compressed_chunk = NULL;
+			tdat->uncompressed_chunk = NULL;
+			tdat->data = NULL;
+			Sem_Init(&(tdat->start_sem), 0, 0);
+			Sem_Init(&(tdat->cmp_done_sem), 0, 0);
+			Sem_Init(&(tdat->write_done_sem), 0, 1);
+			Sem_Init(&(tdat->index_sem), 0, 0);
+			Sem_Init(&(tdat->park_sem), 0, 0);
+		}
+
+		if (pool->reinit) {
+			tdat->level = level;
+			if (pctx->_init_func) {
+				if (pctx->_init_func(&(tdat->data), &(tdat->level), props.nthreads,
+				    chunksize, version, DECOMPRESS) != 0) {
+					UNCOMP_BAIL;
+				}
+			}
+		}
+		if (pctx->algo_dict_len > 0) {
+			if (pctx->_dict_set_func(tdat->data, pctx->algo_dict,
+			    pctx->algo_dict_len) != 0) {
 				UNCOMP_BAIL;
 			}
 		}
@@ -1515,14 +2524,26 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 			if (tdat->rctx == NULL) {
 				UNCOMP_BAIL;
 			}
+			tdat->rctx->delta_enc = pctx->delta_enc;
 			if (pctx->enable_rabin_global) {
-				if (pctx->archive_mode) {
+				if (pctx->refcache) {
+					tdat->rctx->refcache = pctx->refcache;
+				} else if (pctx->archive_mode || pctx->verify) {
 					if ((tdat->rctx->out_fd = open(pctx->archive_temp_file,
 					    O_RDONLY, 0)) == -1) {
 						log_msg(LOG_ERR, 1, "Unable to get new read handle"
 						    " to output file");
 						UNCOMP_BAIL;
 					}
+				} else if (pctx->mem_io) {
+					tdat->rctx->out_pread = pctx->mem_pread;
+					tdat->rctx->out_cookie = pctx->mem_cookie;
+				} else if (pctx->out_fd != -1) {
+					if ((tdat->rctx->out_fd = dup(pctx->out_fd)) == -1) {
+						log_msg(LOG_ERR, 1, "Unable to get new read handle"
+						    " to output file");
+						UNCOMP_BAIL;
+					}
 				} else {
 					if ((tdat->rctx->out_fd = open(to_filename, O_RDONLY, 0))
 					    == -1) {
@@ -1533,6 +2554,14 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 				}
 			}
 			tdat->rctx->index_sem = &(tdat->index_sem);
+
+			/*
+			 * Let dedupe recovery compute the chunk checksum as it
+			 * rebuilds the chunk.
+			 */
+			if (!pctx->encrypt_type && tdat->cksum_mt == 0 &&
+			    cksum_init(&tdat->chunk_cksum, pctx->cksum) == 0)
+				tdat->rctx->data_cksum = &tdat->chunk_cksum;
 		} else {
 			tdat->rctx = NULL;
 		}
@@ -1543,13 +2572,19 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 				UNCOMP_BAIL;
 			}
 		}
+		if (reuse) {
+			Sem_Post(&(tdat->park_sem));
+			continue;
+		}
 		if (pthread_create(&(tdat->thr), NULL, perform_decompress,
 		    (void *)tdat) != 0) {
 			log_msg(LOG_ERR, 1, "Error in thread creation: ");
 			UNCOMP_BAIL;
 		}
+		pool->nworkers++;
+		if (pctx->numa_place)
+			numa_place_thread(tdat->thr, i);
 	}
-	thread = 1;
 
 	if (pctx->enable_rabin_global) {
 		for (i = 0; i < nprocs; i++) {
@@ -1566,7 +2601,16 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		crypto_clean_pkey(&(pctx->crypto_ctx));
 	}
 
-	if (!(pctx->list_mode && pctx->meta_stream)) {
+	/*
+	 * When only verifying, without Global Dedupe the reader can hand out the
+	 * slots in any order. See decompress_done().
+	 */
+	if (pctx->verify && !pctx->enable_rabin_global) {
+		Sem_Init(&(pctx->free_slots), 0, nprocs);
+		any_slot = 1;
+	}
+
+	if (!(pctx->list_mode && pctx->meta_stream) && !pctx->verify) {
 		w.dary = dary;
 		w.wfd = uncompfd;
 		w.nprocs = nprocs;
@@ -1585,6 +2629,7 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 	 * checksum size are read and passed to decompression thread.
 	 * Chunk sequencing is ensured.
 	 */
+	set_stage_stats_slots(pctx, dary, nprocs);
 	pctx->chunk_num = 0;
 	np = 0;
 	bail = 0;
@@ -1596,8 +2641,16 @@ start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename)
 		if (pctx->main_cancel) break;
 		for (p = 0; p < nprocs; p++) {
 			np = p;
-			tdat = dary[p];
-			Sem_Wait(&tdat->write_done_sem);
+			t0 = STAGE_CLOCK(pctx);
+			if (any_slot) {
+				Sem_Wait(&(pctx->free_slots));
+				while (Sem_TryWait(&(dary[np]->write_done_sem)) != 0)
+					np = (np + 1) % nprocs;
+			} else {
+				Sem_Wait(&(dary[np]->write_done_sem));
+			}
+			tdat = dary[np];
+			STAGE_ADD(pctx, &pctx->reader_stats, WAIT_WRITE_DONE, t0);
 			if (pctx->main_cancel) break;
 			tdat->id = pctx->chunk_num;
 			if (tdat->rctx) tdat->rctx->id = tdat->id;
@@ -1606,7 +2659,8 @@ redo:
 			/*
 			 * First read length of compressed chunk.
 			 */
-			rb = Read(compfd, &tdat->len_cmp, sizeof (tdat->len_cmp));
+			t0 = STAGE_CLOCK(pctx);
+			rb = pc_read(pctx, compfd, &tdat->len_cmp, sizeof (tdat->len_cmp));
 			if (rb != sizeof (tdat->len_cmp)) {
 				if (rb < 0) log_msg(LOG_ERR, 1, "Read: ");
 				else
@@ -1643,7 +2697,7 @@ redo:
 				 * If compressed length indicates a metadata chunk. Read it's length
 				 * and skip the chunk.
 				 */
-				rb = Read(compfd, &tdat->len_cmp_be, sizeof (tdat->len_cmp_be));
+				rb = pc_read(pctx, compfd, &tdat->len_cmp_be, sizeof (tdat->len_cmp_be));
 				if (rb != sizeof (tdat->len_cmp_be)) {
 					if (rb < 0) log_msg(LOG_ERR, 1, "Read: ");
 					else
@@ -1674,6 +2728,12 @@ redo:
 					log_msg(LOG_ERR, 0, "2: Out of memory");
 					UNCOMP_BAIL;
 				}
+				if (pctx->numa_place) {
+					numa_place_mem(tdat->compressed_chunk,
+					    compressed_chunksize, np);
+					numa_place_mem(tdat->uncompressed_chunk,
+					    compressed_chunksize, np);
+				}
 				tdat->cmp_seg = tdat->uncompressed_chunk;
 			}
 
@@ -1691,7 +2751,7 @@ redo:
 				 */
 				rb = tdat->len_cmp + pctx->cksum_bytes + pctx->mac_bytes +
 				    CHUNK_FLAG_SZ;
-				tdat->rbytes = Read(compfd, tdat->compressed_chunk, rb);
+				tdat->rbytes = pc_read(pctx, compfd, tdat->compressed_chunk, rb);
 			} else {
 				off_t cpos = lseek(compfd, 0, SEEK_CUR);
 
@@ -1719,6 +2779,10 @@ redo:
 			if (tdat->len_cmp == METADATA_INDICATOR) {
 				goto redo;
 			}
+			STAGE_ADD(pctx, &pctx->reader_stats, STAGE_READ, t0);
+			pctx->reader_stats.chunks++;
+			pctx->reader_stats.bytes_in += tdat->rbytes;
+			tdat->in_bytes = tdat->rbytes;
 			Sem_Post(&tdat->start_sem);
 			++(pctx->chunk_num);
 		}
@@ -1736,15 +2800,16 @@ redo:
 	}
 uncomp_done:
 	if (pctx->t_errored) err = pctx->t_errored;
-	if (thread) {
+	if (thread && pool != NULL) {
 		for (i = 0; i < nprocs; i++) {
 			tdat = dary[i];
+			if (!tdat) continue;
 			tdat->cancel = 1;
 			tdat->len_cmp = 0;
 			Sem_Post(&tdat->start_sem);
 			Sem_Post(&tdat->cmp_done_sem);
-			pthread_join(tdat->thr, NULL);
 		}
+		pool_drain(pool);
 		if (thread == 2)
 			pthread_join(writer_thr, NULL);
 	}
@@ -1757,30 +2822,28 @@ uncomp_done:
 		if (fchown(uncompfd, sbuf.st_uid, sbuf.st_gid) == -1)
 			log_msg(LOG_ERR, 1, "Chown ");
 	}
-	if (dary != NULL) {
+	save_stage_stats(pctx);
+	if (pool != NULL) {
 		for (i = 0; i < nprocs; i++) {
 			if (!dary[i]) continue;
-			if (dary[i]->uncompressed_chunk)
-				slab_release(NULL, dary[i]->uncompressed_chunk);
-			if (dary[i]->compressed_chunk)
-				slab_release(NULL, dary[i]->compressed_chunk);
-			if (pctx->_deinit_func)
-				pctx->_deinit_func(&(dary[i]->data));
+			vbytes += dary[i]->stats.bytes_out;
 			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
 				destroy_dedupe_context(dary[i]->rctx);
+				dary[i]->rctx = NULL;
 			}
-			Sem_Destroy(&(dary[i]->start_sem));
-			Sem_Destroy(&(dary[i]->cmp_done_sem));
-			Sem_Destroy(&(dary[i]->write_done_sem));
-			Sem_Destroy(&(dary[i]->index_sem));
-
-			slab_release(NULL, dary[i]);
+			cksum_cleanup(&(dary[i]->chunk_cksum));
 		}
-		slab_release(NULL, dary);
+		if (err || pctx->main_cancel || !pool->keep)
+			pool_destroy(pctx);
+	}
+	if (pctx->algo_dict) {
+		free(pctx->algo_dict);
+		pctx->algo_dict = NULL;
+		pctx->algo_dict_len = 0;
 	}
 	if (!pctx->pipe_mode) {
-		if (filename && compfd != -1) close(compfd);
-		if (uncompfd != -1) close(uncompfd);
+		if (filename && compfd != -1 && compfd != pctx->in_fd) close(compfd);
+		if (uncompfd != -1 && uncompfd != pctx->out_fd) close(uncompfd);
 	}
 	if (pctx->archive_mode) {
 		pthread_join(pctx->archive_thread, NULL);
@@ -1790,12 +2853,32 @@ uncomp_done:
 				slab_release(NULL, pctx->temp_mmap_buf);
 			}
 		}
-		if (pctx->enable_rabin_global) {
-			close(pctx->archive_temp_fd);
+		if (!pctx->verify) {
+			Sem_Destroy(&(pctx->read_sem));
+			Sem_Destroy(&(pctx->write_sem));
+		}
+	}
+	if (pctx->refcache) {
+		refcache_destroy(pctx->refcache);
+		pctx->refcache = NULL;
+		if (pctx->verify)
 			unlink(pctx->archive_temp_file);
+	} else if (pctx->enable_rabin_global && (pctx->archive_mode || pctx->verify)) {
+		close(pctx->archive_temp_fd);
+		unlink(pctx->archive_temp_file);
+	}
+
+	if (pctx->verify) {
+		if (any_slot)
+			Sem_Destroy(&(pctx->free_slots));
+		if (pctx->t_errored || vfail) err = 1;
+		if (err) {
+			log_msg(LOG_ERR, 0, "%s: verification FAILED",
+			    filename ? filename : "stdin");
+		} else {
+			log_msg(LOG_INFO, 0, "%s: OK, %u chunks, %" PRIu64 " bytes verified",
+			    filename ? filename : "stdin", pctx->chunk_num, vbytes);
 		}
-		Sem_Destroy(&(pctx->read_sem));
-		Sem_Destroy(&(pctx->write_sem));
 	}
 
 	if (!pctx->hide_cmp_stats) show_compression_stats(pctx);
@@ -1803,50 +2886,59 @@ uncomp_done:
 	return (err);
 }
 
-static void *
-perform_compress(void *dat) {
-	struct cmp_data *tdat = (struct cmp_data *)dat;
-	typeof (tdat->chunksize) _chunksize, len_cmp, dedupe_index_sz, index_size_cmp;
-	int type, rv;
+/*
+ * First stage of chunk compression. Computes the chunk checksum, does dedupe
+ * and compresses the dedupe index, then applies the pre-processing filters.
+ * The result is left in uncompressed_chunk for the codec stage.
+ */
+static void
+compress_prep(struct cmp_data *tdat)
+{
+	typeof (tdat->chunksize) _chunksize, dedupe_index_sz, index_size_cmp;
 	uchar_t *compressed_chunk;
 	int64_t rbytes;
 	pc_ctx_t *pctx;
+	uint64_t t0;
+	int rv;
 
 	pctx = tdat->pctx;
-redo:
-	Sem_Wait(&tdat->start_sem);
-	if (unlikely(tdat->cancel)) {
-		tdat->len_cmp = 0;
-		Sem_Post(&tdat->cmp_done_sem);
-		return (0);
-	}
-
 	compressed_chunk = tdat->compressed_chunk + CHUNK_FLAG_SZ;
 	rbytes = tdat->rbytes;
 	dedupe_index_sz = 0;
-	type = COMPRESSED;
+	tdat->preproc_type = 0;
+	tdat->stats.bytes_in += rbytes;
 
 	/* Perform Dedup if enabled. */
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
 		dedupe_context_t *rctx;
 		uint64_t rb = tdat->rbytes;
 
-		/*
-		 * Compute checksum of original uncompressed chunk. When doing dedup
-		 * cmp_seg hold original data instead of uncompressed_chunk. We dedup
-		 * into uncompressed_chunk so that compress transforms uncompressed_chunk
-		 * back into cmp_seg. Avoids an extra memcpy().
-		 */
-		if (!pctx->encrypt_type)
-			compute_checksum(tdat->checksum, pctx->cksum, tdat->cmp_seg, tdat->rbytes,
-					 tdat->cksum_mt, 1);
-
 		rctx = tdat->rctx;
 		reset_dedupe_context(tdat->rctx);
 		rctx->cbuf = tdat->uncompressed_chunk;
+		t0 = STAGE_CLOCK(pctx);
 		dedupe_index_sz = dedupe_compress(tdat->rctx, tdat->cmp_seg, &rb, 0,
 						  NULL, tdat->cksum_mt);
+		STAGE_ADD(pctx, &tdat->stats, STAGE_DEDUPE, t0);
 		tdat->rbytes = rb;
+
+		/*
+		 * Compute checksum of original uncompressed chunk. When doing dedup
+		 * cmp_seg hold original data instead of uncompressed_chunk. We dedup
+		 * into uncompressed_chunk so that compress transforms uncompressed_chunk
+		 * back into cmp_seg. Avoids an extra memcpy().
+		 * Dedupe usually feeds the checksum block by block during its scan,
+		 * otherwise it is computed here in a separate pass.
+		 */
+		if (!pctx->encrypt_type) {
+			t0 = STAGE_CLOCK(pctx);
+			if (rctx->data_cksum_done)
+				cksum_final(rctx->data_cksum, tdat->checksum);
+			else
+				compute_checksum(tdat->checksum, pctx->cksum, tdat->cmp_seg,
+						 rbytes, tdat->cksum_mt, 1);
+			STAGE_ADD(pctx, &tdat->stats, STAGE_CHECKSUM, t0);
+		}
 		if (!rctx->valid) {
 			memcpy(tdat->uncompressed_chunk, tdat->cmp_seg, rbytes);
 			tdat->rbytes = rbytes;
@@ -1855,9 +2947,12 @@ redo:
 		/*
 		 * Compute checksum of original uncompressed chunk.
 		 */
-		if (!pctx->encrypt_type)
+		if (!pctx->encrypt_type) {
+			t0 = STAGE_CLOCK(pctx);
 			compute_checksum(tdat->checksum, pctx->cksum, tdat->uncompressed_chunk,
 					 tdat->rbytes, tdat->cksum_mt, 1);
+			STAGE_ADD(pctx, &tdat->stats, STAGE_CHECKSUM, t0);
+		}
 	}
 
 	/*
@@ -1866,56 +2961,103 @@ redo:
 	 * reducing compression effectiveness of the data chunk. So we separate them.
 	 */
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan) && tdat->rctx->valid) {
-		uint64_t o_chunksize;
 		_chunksize = tdat->rbytes - dedupe_index_sz - RABIN_HDR_SIZE;
 		index_size_cmp = dedupe_index_sz;
 		rv = 0;
 
 		/*
 		 * Do a matrix transpose of the index table with the hope of improving
-		 * compression ratio subsequently.
+		 * compression ratio subsequently. The transposed index is placed
+		 * directly where the plain index goes in the output. The original
+		 * index area is then free to receive the compressed index.
 		 */
 		transpose(tdat->uncompressed_chunk + RABIN_HDR_SIZE,
 		    compressed_chunk + RABIN_HDR_SIZE, dedupe_index_sz,
 		    sizeof (uint32_t), ROW);
-		memcpy(tdat->uncompressed_chunk + RABIN_HDR_SIZE,
-		    compressed_chunk + RABIN_HDR_SIZE, dedupe_index_sz);
 
 		if (dedupe_index_sz >= 90) {
 			/* Compress index if it is at least 90 bytes. */
-			rv = lzma_compress(tdat->uncompressed_chunk + RABIN_HDR_SIZE,
-			    dedupe_index_sz, compressed_chunk + RABIN_HDR_SIZE,
+			rv = lzma_compress(compressed_chunk + RABIN_HDR_SIZE,
+			    dedupe_index_sz, tdat->uncompressed_chunk + RABIN_HDR_SIZE,
 			    &index_size_cmp, tdat->rctx->level, 255, TYPE_BINARY,
 			    tdat->rctx->lzma_data);
 
-			/* 
-			 * If index compression fails or does not produce a smaller result
-			 * retain it as is. In that case compressed size == original size
-			 * and it will be handled correctly during decompression.
-			 */
-			if (rv != 0 || index_size_cmp >= dedupe_index_sz) {
-				index_size_cmp = dedupe_index_sz;
-				goto plain_index;
-			}
-		} else {
-plain_index:
-			memcpy(compressed_chunk + RABIN_HDR_SIZE,
-			    tdat->uncompressed_chunk + RABIN_HDR_SIZE, dedupe_index_sz);
-		}
+			/* 
+			 * If index compression fails or does not produce a smaller result
+			 * retain it as is. In that case compressed size == original size
+			 * and it will be handled correctly during decompression.
+			 */
+			if (rv != 0 || index_size_cmp >= dedupe_index_sz) {
+				index_size_cmp = dedupe_index_sz;
+			} else {
+				memcpy(compressed_chunk + RABIN_HDR_SIZE,
+				    tdat->uncompressed_chunk + RABIN_HDR_SIZE, index_size_cmp);
+			}
+		}
+
+		index_size_cmp += RABIN_HDR_SIZE;
+		dedupe_index_sz += RABIN_HDR_SIZE;
+		memcpy(compressed_chunk, tdat->uncompressed_chunk, RABIN_HDR_SIZE);
+		tdat->dedupe_index_sz = dedupe_index_sz;
+		tdat->index_size_cmp = index_size_cmp;
+
+		if (_chunksize > 0 && pctx->preprocess_mode) {
+			t0 = STAGE_CLOCK(pctx);
+			tdat->preproc_type = preproc_filter(pctx,
+			    tdat->uncompressed_chunk + dedupe_index_sz, &_chunksize,
+			    compressed_chunk + index_size_cmp, tdat->level, tdat->btype,
+			    tdat->data, tdat->props, tdat->interesting, &tdat->actx);
+			STAGE_ADD(pctx, &tdat->stats, STAGE_PREPROC, t0);
+		}
+	} else {
+		_chunksize = tdat->rbytes;
+		if (pctx->preprocess_mode) {
+			t0 = STAGE_CLOCK(pctx);
+			tdat->preproc_type = preproc_filter(pctx, tdat->uncompressed_chunk,
+			    &_chunksize, compressed_chunk, tdat->level, tdat->btype,
+			    tdat->data, tdat->props, tdat->interesting, &tdat->actx);
+			STAGE_ADD(pctx, &tdat->stats, STAGE_PREPROC, t0);
+		}
+	}
+	tdat->prep_len = _chunksize;
+}
+
+/*
+ * Second stage of chunk compression. Runs the compression algorithm on the
+ * prepared data, encrypts it if requested and fills in the chunk header.
+ * Returns -1 on a fatal error.
+ */
+static int
+compress_codec(struct cmp_data *tdat)
+{
+	typeof (tdat->chunksize) _chunksize, len_cmp, dedupe_index_sz, index_size_cmp;
+	int type, rv;
+	uchar_t *compressed_chunk;
+	int64_t rbytes;
+	pc_ctx_t *pctx;
+	uint64_t t0;
+
+	pctx = tdat->pctx;
+	compressed_chunk = tdat->compressed_chunk + CHUNK_FLAG_SZ;
+	type = COMPRESSED;
+	t0 = STAGE_CLOCK(pctx);
 
-		index_size_cmp += RABIN_HDR_SIZE;
-		dedupe_index_sz += RABIN_HDR_SIZE;
-		memcpy(compressed_chunk, tdat->uncompressed_chunk, RABIN_HDR_SIZE);
+	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan) && tdat->rctx->valid) {
+		uint64_t o_chunksize;
+
+		dedupe_index_sz = tdat->dedupe_index_sz;
+		index_size_cmp = tdat->index_size_cmp;
+		_chunksize = tdat->rbytes - dedupe_index_sz;
 		o_chunksize = _chunksize;
 
 		/* Compress data chunk. */
 		if (_chunksize == 0) {
 			rv = -1;
 		} else if (pctx->preprocess_mode) {
-			rv = preproc_compress(pctx, tdat->compress,
-			    tdat->uncompressed_chunk + dedupe_index_sz, _chunksize,
+			rv = preproc_compress(tdat->compress,
+			    tdat->uncompressed_chunk + dedupe_index_sz, tdat->prep_len,
 			    compressed_chunk + index_size_cmp, &_chunksize, tdat->level, 0,
-			    tdat->btype, tdat->data, tdat->props, tdat->interesting);
+			    tdat->btype, tdat->data, tdat->preproc_type);
 		} else {
 			DEBUG_STAT_EN(double strt, en);
 
@@ -1941,9 +3083,9 @@ plain_index:
 	} else {
 		_chunksize = tdat->rbytes;
 		if (pctx->preprocess_mode) {
-			rv = preproc_compress(pctx, tdat->compress, tdat->uncompressed_chunk,
-			    tdat->rbytes, compressed_chunk, &_chunksize, tdat->level, 0,
-			    tdat->btype, tdat->data, tdat->props, tdat->interesting);
+			rv = preproc_compress(tdat->compress, tdat->uncompressed_chunk,
+			    tdat->prep_len, compressed_chunk, &_chunksize, tdat->level, 0,
+			    tdat->btype, tdat->data, tdat->preproc_type);
 		} else {
 			DEBUG_STAT_EN(double strt, en);
 
@@ -1977,6 +3119,7 @@ plain_index:
 		tdat->len_cmp = tdat->rbytes;
 		if (rv < 0) rv = COMPRESS_NONE;
 	}
+	STAGE_ADD(pctx, &tdat->stats, STAGE_CODEC, t0);
 
 	/*
 	 * Now perform encryption on the compressed data, if requested.
@@ -1990,8 +3133,10 @@ plain_index:
 		 * encryption is in-place.
 		 */
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		t0 = STAGE_CLOCK(pctx);
 		ret = crypto_buf(&(pctx->crypto_ctx), compressed_chunk, compressed_chunk,
 			tdat->len_cmp, tdat->id);
+		STAGE_ADD(pctx, &tdat->stats, STAGE_CRYPTO, t0);
 		if (ret == -1) {
 			/*
 			 * Encryption failure is fatal.
@@ -1999,8 +3144,7 @@ plain_index:
 			pctx->main_cancel = 1;
 			tdat->len_cmp = 0;
 			pctx->t_errored = 1;
-			Sem_Post(&tdat->cmp_done_sem);
-			return (0);
+			return (-1);
 		}
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "Encryption speed %.3f MB/s\n",
@@ -2060,12 +3204,14 @@ plain_index:
 
 		/* Clean out mac_bytes to 0 for stable HMAC. */
 		DEBUG_STAT_EN(strt = get_wtime_millis());
+		t0 = STAGE_CLOCK(pctx);
 		mac_ptr = tdat->cmp_seg + sizeof (tdat->len_cmp) + pctx->cksum_bytes;
 		memset(mac_ptr, 0, pctx->mac_bytes);
 		hmac_reinit(&tdat->chunk_hmac);
 		hmac_update(&tdat->chunk_hmac, tdat->cmp_seg, tdat->len_cmp);
 		hmac_final(&tdat->chunk_hmac, chash, &hlen);
 		serialize_checksum(chash, mac_ptr, hlen);
+		STAGE_ADD(pctx, &tdat->stats, STAGE_HMAC, t0);
 		DEBUG_STAT_EN(en = get_wtime_millis());
 		DEBUG_STAT_EN(fprintf(stderr, "HMAC Computation speed %.3f MB/s\n",
 			      get_mb_s(tdat->len_cmp, strt, en)));
@@ -2085,9 +3231,69 @@ plain_index:
 			    ORIGINAL_CHUNKSZ, crc);
 		U32_P(mac_ptr) = htonl(crc);
 	}
+	tdat->stats.chunks++;
+	tdat->stats.bytes_out += tdat->len_cmp;
+
+	return (0);
+}
+
+/*
+ * Chunk compression stage thread. A thread works on every step'th slot of the
+ * chunk ring starting at slot first, so chunks flow through the slots in order.
+ * In pipelined mode one set of threads runs the prep stage and another set the
+ * codec stage. The prep_done_sem of a slot hands the chunk over from one to the
+ * other, so chunk N+1 can be deduped and filtered while chunk N is compressed.
+ * Otherwise a single set of threads runs both stages back to back. At the end
+ * of a run the thread parks in the slot pool until the next run.
+ */
+static void *
+perform_compress(void *dat) {
+	struct cmp_stage *sdat = (struct cmp_stage *)dat;
+	struct cmp_data *tdat;
+	uint64_t t0;
+	uint32_t p;
+
+start:
+	p = sdat->first;
+redo:
+	tdat = sdat->dary[p];
+	t0 = STAGE_CLOCK(sdat->pctx);
+	if (sdat->stage & CMP_STAGE_PREP) {
+		Sem_Wait(&tdat->start_sem);
+		STAGE_ADD(sdat->pctx, &tdat->stats, WAIT_START, t0);
+	} else {
+		Sem_Wait(&tdat->prep_done_sem);
+		STAGE_ADD(sdat->pctx, &tdat->stats, WAIT_PREP_DONE, t0);
+	}
+	if (unlikely(tdat->cancel)) {
+		if (sdat->stage & CMP_STAGE_CODEC) {
+			tdat->len_cmp = 0;
+			Sem_Post(&tdat->cmp_done_sem);
+		} else {
+			Sem_Post(&tdat->prep_done_sem);
+		}
+		goto park;
+	}
+
+	if (sdat->stage & CMP_STAGE_PREP)
+		compress_prep(tdat);
 
-	Sem_Post(&tdat->cmp_done_sem);
+	if (sdat->stage & CMP_STAGE_CODEC) {
+		if (compress_codec(tdat) == -1) {
+			Sem_Post(&tdat->cmp_done_sem);
+			goto park;
+		}
+		Sem_Post(&tdat->cmp_done_sem);
+	} else {
+		Sem_Post(&tdat->prep_done_sem);
+	}
+	p = (p + sdat->step) % sdat->nslots;
 	goto redo;
+
+park:
+	if (pool_park(sdat->pctx, &sdat->park_sem) == 0)
+		goto start;
+	return (0);
 }
 
 static void *
@@ -2097,12 +3303,15 @@ writer_thread(void *dat) {
 	struct cmp_data *tdat;
 	int64_t wbytes;
 	pc_ctx_t *pctx;
+	uint64_t t0;
 
 	pctx = w->pctx;
 repeat:
 	for (p = 0; p < w->nprocs; p++) {
 		tdat = w->dary[p];
+		t0 = STAGE_CLOCK(pctx);
 		Sem_Wait(&tdat->cmp_done_sem);
+		STAGE_ADD(pctx, &pctx->writer_stats, WAIT_CMP_DONE, t0);
 		if (tdat->len_cmp == 0) {
 			goto do_cancel;
 		}
@@ -2115,16 +3324,21 @@ repeat:
 			pctx->avg_chunk += tdat->len_cmp;
 		}
 
+		t0 = STAGE_CLOCK(pctx);
 		if (pctx->archive_mode && tdat->decompressing) {
 			wbytes = archiver_write(pctx, tdat->cmp_seg, tdat->len_cmp);
 		} else {
 			pthread_mutex_lock(&pctx->write_mutex);
-			wbytes = Write(w->wfd, tdat->cmp_seg, tdat->len_cmp);
+			wbytes = pc_write(pctx, w->wfd, tdat->cmp_seg, tdat->len_cmp);
 			pthread_mutex_unlock(&pctx->write_mutex);
 		}
 		if (pctx->archive_temp_fd != -1 && wbytes == tdat->len_cmp) {
 			wbytes = Write(pctx->archive_temp_fd, tdat->cmp_seg, tdat->len_cmp);
+		} else if (pctx->refcache && tdat->decompressing && wbytes == tdat->len_cmp) {
+			if (refcache_feed(pctx->refcache, tdat->cmp_seg, tdat->len_cmp) == -1)
+				wbytes = -1;
 		}
+		STAGE_ADD(pctx, &pctx->writer_stats, STAGE_WRITE, t0);
 		if (unlikely(wbytes != tdat->len_cmp)) {
 			log_msg(LOG_ERR, 1, "Chunk Write (expected: %" PRIu64
 			    ", written: %" PRId64 ") : ", tdat->len_cmp, wbytes);
@@ -2140,6 +3354,9 @@ do_cancel:
 		if (tdat->decompressing && tdat->rctx && pctx->enable_rabin_global) {
 			Sem_Post(tdat->rctx->index_sem_next);
 		}
+		pctx->writer_stats.chunks++;
+		pctx->writer_stats.bytes_in += tdat->in_bytes;
+		pctx->writer_stats.bytes_out += wbytes;
 		Sem_Post(&tdat->write_done_sem);
 	}
 	goto repeat;
@@ -2158,7 +3375,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	struct wdata w;
 	char tmpfile1[MAXPATHLEN], tmpdir[MAXPATHLEN];
 	char to_filename[MAXPATHLEN];
-	uint64_t compressed_chunksize, n_chunksize, file_offset;
+	uint64_t compressed_chunksize, n_chunksize, file_offset, t0;
 	int64_t rbytes, rabin_count;
 	unsigned short version, flags;
 	struct stat sbuf;
@@ -2166,11 +3383,16 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	int thread, bail, single_chunk;
 	uint32_t i, nprocs, np, p, dedupe_flag;
 	struct cmp_data **dary = NULL, *tdat;
+	struct cmp_stage *sary = NULL;
+	struct slot_pool want, *pool = NULL;
+	uint32_t nstages, nstage_thr;
 	pthread_t writer_thr;
 	uchar_t *cread_buf, *pos;
 	dedupe_context_t *rctx;
 	algo_props_t props;
 	my_sysinfo msys_info;
+	uint64_t slot_mem, fixed_mem, index_mem;
+	int reuse;
 
 	init_algo_props(&props);
 	props.cksum = pctx->cksum;
@@ -2190,8 +3412,12 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 
 		compressed_chunksize += pctx->mac_bytes;
 		if (!pctx->pwd_file && !pctx->user_pw) {
-			pw_len = get_pw_string(pw,
-				"Please enter encryption password", 1);
+			if (pctx->mem_io) {
+				log_msg(LOG_ERR, 0, "No password set with pc_set_userpw().");
+				pw_len = -1;
+			} else
+				pw_len = get_pw_string(pw,
+					"Please enter encryption password", 1);
 			if (pw_len == -1) {
 				log_msg(LOG_ERR, 0, "Failed to get password.");
 				return (1);
@@ -2232,6 +3458,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			if (init_crypto(&(pctx->crypto_ctx), pctx->user_pw, pctx->user_pw_len,
 			    pctx->encrypt_type, NULL, 0, pctx->keylen, 0, ENCRYPT_FLAG) == -1) {
 				memset(pctx->user_pw, 0, pctx->user_pw_len);
+				pctx->user_pw = NULL;
+				pctx->user_pw_len = 0;
 				log_msg(LOG_ERR, 0, "Failed to initialize crypto.");
 				return (1);
 			}
@@ -2269,26 +3497,33 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	/* A host of sanity checks. */
 	if (!pctx->pipe_mode) {
 		char *tmp;
-		if (!(pctx->archive_mode)) {
-			if ((uncompfd = open(filename, O_RDONLY, 0)) == -1) {
+		if (pctx->mem_io) {
+			/*
+			 * The input is a buffer of known size.
+			 */
+			sbuf.st_size = pctx->mem_insize;
+		} else if (!(pctx->archive_mode)) {
+			if (pctx->in_fd != -1) {
+				uncompfd = pctx->in_fd;
+			} else if ((uncompfd = open(filename, O_RDONLY, 0)) == -1) {
 				log_msg(LOG_ERR, 1, "Cannot open: %s", filename);
 				return (1);
 			}
 
 			if (fstat(uncompfd, &sbuf) == -1) {
-				close(uncompfd);
+				if (uncompfd != pctx->in_fd) close(uncompfd);
 				log_msg(LOG_ERR, 1, "Cannot stat: %s", filename);
 				return (1);
 			}
 
 			if (!S_ISREG(sbuf.st_mode)) {
-				close(uncompfd);
+				if (uncompfd != pctx->in_fd) close(uncompfd);
 				log_msg(LOG_ERR, 0, "File %s is not a regular file.", filename);
 				return (1);
 			}
 
 			if (sbuf.st_size == 0) {
-				close(uncompfd);
+				if (uncompfd != pctx->in_fd) close(uncompfd);
 				return (1);
 			}
 		} else {
@@ -2297,6 +3532,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				return (1);
 			}
 		}
+		pctx->progress_total = sbuf.st_size;
 
 		/*
 		 * Adjust chunk size for small files. We then get an archive with
@@ -2311,6 +3547,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			single_chunk = 1;
 			props.is_single_chunk = 1;
 			flags |= FLAG_SINGLE_CHUNK;
+			pctx->enable_algo_dict = 0;
 
 			/*
 			 * Disable deduplication if file is too small.
@@ -2349,7 +3586,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			strcpy(tmpfile1, dirname(tmpfile1));
 		} else {
 			char *tmp1;
-			if (!(pctx->archive_mode)) {
+			if (!(pctx->archive_mode) && pctx->in_fd == -1 && !pctx->mem_io) {
 				log_msg(LOG_ERR, 0, "Inconsistent NULL Filename when Not archiving.");
 				COMP_BAIL;
 			}
@@ -2365,7 +3602,11 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			strcpy(tmpdir, tmp);
 		}
 
-		if (pctx->pipe_out) {
+		if (pctx->mem_io) {
+			compfd = -1;
+		} else if (pctx->out_fd != -1) {
+			compfd = pctx->out_fd;
+		} else if (pctx->pipe_out) {
 			compfd = fileno(stdout);
 			if (compfd == -1) {
 				log_msg(LOG_ERR, 1, "fileno ");
@@ -2398,17 +3639,20 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		char *tmp;
 
 		/*
-		 * Use stdin/stdout for pipe mode.
+		 * Use stdin/stdout for pipe mode. Streams of the buffer interface
+		 * go through its callbacks.
 		 */
-		compfd = fileno(stdout);
-		if (compfd == -1) {
-			log_msg(LOG_ERR, 1, "fileno ");
-			COMP_BAIL;
-		}
-		uncompfd = fileno(stdin);
-		if (uncompfd == -1) {
-			log_msg(LOG_ERR, 1, "fileno ");
-			COMP_BAIL;
+		if (!pctx->mem_io) {
+			compfd = fileno(stdout);
+			if (compfd == -1) {
+				log_msg(LOG_ERR, 1, "fileno ");
+				COMP_BAIL;
+			}
+			uncompfd = fileno(stdin);
+			if (uncompfd == -1) {
+				log_msg(LOG_ERR, 1, "fileno ");
+				COMP_BAIL;
+			}
 		}
 
 		/*
@@ -2423,6 +3667,8 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		my_sysinfo msys_info;
 
 		get_sys_limits(&msys_info);
+		if (pctx->mem_budget && msys_info.freeram > MEM_BUDGET_INDEX(pctx->mem_budget))
+			msys_info.freeram = MEM_BUDGET_INDEX(pctx->mem_budget);
 		global_dedupe_bufadjust(pctx->rab_blk_size, &chunksize, 0, pctx->algo,
 		    pctx->cksum, CKSUM_BLAKE256, sbuf.st_size, msys_info.freeram,
 		    pctx->nthreads, pctx->pipe_mode);
@@ -2480,73 +3726,190 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		flags |= pctx->encrypt_type;
 
 	set_threadcounts(&props, &(pctx->nthreads), nprocs, COMPRESS_THREADS);
+
+	/*
+	 * With a memory budget the number of chunk slots, the pipelining and the
+	 * Global Dedupe index are sized together. Each slot holds two chunk
+	 * buffers, the codec state and the dedupe block list. The index gets a
+	 * share of the budget and whatever the slots leave over.
+	 */
+	slot_mem = fixed_mem = index_mem = 0;
+	if (pctx->mem_budget) {
+		slot_mem = 2 * compressed_chunksize + props.state_mem;
+		if (pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->enable_rabin_global)
+			slot_mem += dedupe_ctx_mem(chunksize, pctx->rab_blk_size, COMPRESS);
+		fixed_mem = compressed_chunksize + MEM_BUDGET_RESERVE;
+		if (pctx->enable_packjpg || pctx->enable_wavpack)
+			fixed_mem += FILTER_SCRATCH_SIZE_MAX;
+		if (pctx->enable_rabin_global)
+			index_mem = MEM_BUDGET_INDEX(pctx->mem_budget);
+		pctx->nthreads = budget_slots(pctx, fixed_mem + index_mem, slot_mem,
+		    pctx->nthreads);
+		if (pctx->nthreads == 0) {
+			COMP_BAIL;
+		}
+	}
+	pctx->preproc_nthreads = nprocs / pctx->nthreads;
+	if (pctx->preproc_nthreads < 1)
+		pctx->preproc_nthreads = 1;
 	if (pctx->nthreads * props.nthreads > 1)
 		log_msg(LOG_INFO, 0, "Scaling to %d threads", pctx->nthreads * props.nthreads);
 	else
 		log_msg(LOG_INFO, 0, "Scaling to 1 thread");
 	nprocs = pctx->nthreads;
-	dary = (struct cmp_data **)slab_calloc(NULL, nprocs, sizeof (struct cmp_data *));
-	cread_buf = (uchar_t *)slab_alloc(NULL, compressed_chunksize);
-	if (!cread_buf) {
+
+	/*
+	 * When dedupe or pre-processing is enabled each chunk goes through a
+	 * substantial prep stage before the codec. With --pipeline the prep and
+	 * codec stages are run by separate threads and twice as many chunk slots
+	 * are kept in flight, so that the two stages overlap across chunks. This
+	 * doubles the chunk buffers, so with a memory budget it is only done if
+	 * the doubled slots still fit.
+	 */
+	nstages = 1;
+	if (pctx->pipeline && !single_chunk &&
+	    (pctx->enable_rabin_scan || pctx->enable_fixed_scan || pctx->preprocess_mode)) {
+		if (!pctx->mem_budget ||
+		    fixed_mem + index_mem + 2 * nprocs * slot_mem <= pctx->mem_budget)
+			nstages = 2;
+		else
+			log_msg(LOG_INFO, 0, "Memory budget too small for --pipeline, "
+			    "not pipelining");
+	}
+	nstage_thr = nprocs;
+	nprocs *= nstages;
+
+	/*
+	 * With NUMA placement slot i and its buffers belong to node i % nstage_thr
+	 * so that the prep and codec threads of a slot share the node. The reader,
+	 * this thread, is kept near the device holding the input file.
+	 */
+	if (pctx->numa_place) {
+		int nnodes = numa_topo_init();
+
+		if (nnodes > 1)
+			log_msg(LOG_INFO, 0, "Placing threads on %d NUMA nodes", nnodes);
+		numa_place_thread(pthread_self(), numa_fd_node(uncompfd));
+	}
+
+	/*
+	 * Take over the slots of the previous run if they fit, otherwise set up
+	 * new ones. Pooled slots keep their buffers and codec state and their
+	 * stage threads are parked.
+	 */
+	memset(&want, 0, sizeof (want));
+	want.do_compress = 1;
+	want.level = level;
+	want.version = VERSION;
+	want.nthreads = props.nthreads;
+	want.nstages = nstages;
+	want.single_chunk = single_chunk;
+	want.dedupe = (pctx->enable_rabin_scan || pctx->enable_fixed_scan);
+	want.nslots = nprocs;
+	want.chunksize = chunksize;
+	want.cmp_size = compressed_chunksize;
+	want.init = pctx->_init_func;
+	want.deinit = pctx->_deinit_func;
+	want.codec = pctx->_compress_func;
+	want.keep = !pctx->archive_mode && !pctx->enable_algo_dict;
+	reuse = pool_get(pctx, &want);
+	if (reuse == -1) {
 		log_msg(LOG_ERR, 0, "3: Out of memory");
 		COMP_BAIL;
 	}
+	pool = pctx->pool;
+	dary = pool->dary;
+	sary = pool->sary;
+	cread_buf = pool->spare;
+	pool->spare = NULL;
+	if (cread_buf == NULL) {
+		cread_buf = (uchar_t *)slab_alloc(NULL, compressed_chunksize);
+		if (!cread_buf) {
+			log_msg(LOG_ERR, 0, "3: Out of memory");
+			COMP_BAIL;
+		}
+	}
 
 	for (i = 0; i < nprocs; i++) {
-		dary[i] = (struct cmp_data *)slab_alloc(NULL, sizeof (struct cmp_data));
-		if (!dary[i]) {
-			log_msg(LOG_ERR, 0, "4: Out of memory");
-			COMP_BAIL;
+		if (!reuse) {
+			dary[i] = (struct cmp_data *)slab_alloc(NULL, sizeof (struct cmp_data));
+			if (!dary[i]) {
+				log_msg(LOG_ERR, 0, "4: Out of memory");
+				COMP_BAIL;
+			}
 		}
 		tdat = dary[i];
 		tdat->pctx = pctx;
-		tdat->cmp_seg = NULL;
 		tdat->chunksize = chunksize;
+		memset(&tdat->stats, 0, sizeof (tdat->stats));
 		tdat->compress = pctx->_compress_func;
 		tdat->decompress = pctx->_decompress_func;
-		tdat->uncompressed_chunk = (uchar_t *)1;
-		if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
-			if (single_chunk)
-				tdat->cmp_seg = (uchar_t *)1;
-			else
-				tdat->cmp_seg = (uchar_t *)slab_alloc(NULL, compressed_chunksize);
-			tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL,
-				compressed_chunksize);
-		} else {
-			if (single_chunk)
-				tdat->uncompressed_chunk = (uchar_t *)1;
-			else
-				tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL,
-					compressed_chunksize);
-			tdat->cmp_seg = (uchar_t *)slab_alloc(NULL, compressed_chunksize);
-		}
-		tdat->compressed_chunk = tdat->cmp_seg + COMPRESSED_CHUNKSZ +
-		    pctx->cksum_bytes + pctx->mac_bytes;
-		if (!tdat->cmp_seg || !tdat->uncompressed_chunk) {
-			log_msg(LOG_ERR, 0, "5: Out of memory");
-			COMP_BAIL;
-		}
 		tdat->cancel = 0;
+		tdat->chunk_cksum.cksum_ctx = NULL;
 		tdat->decompressing = 0;
 		if (single_chunk)
 			tdat->cksum_mt = 1;
 		else
 			tdat->cksum_mt = 0;
-		tdat->level = level;
-		tdat->data = NULL;
 		tdat->rctx = NULL;
 		tdat->props = &props;
-		Sem_Init(&(tdat->start_sem), 0, 0);
-		Sem_Init(&(tdat->cmp_done_sem), 0, 0);
-		Sem_Init(&(tdat->write_done_sem), 0, 1);
-		Sem_Init(&(tdat->index_sem), 0, 0);
-
-		if (pctx->_init_func) {
-			if (pctx->_init_func(&(tdat->data), &(tdat->level), props.nthreads,
-			    chunksize, VERSION, COMPRESS) != 0) {
+
+		if (reuse) {
+			slot_sems_reset(tdat, 1);
+		} else {
+			tdat->cmp_seg = NULL;
+			tdat->uncompressed_chunk = NULL;
+			tdat->data = NULL;
+			Sem_Init(&(tdat->start_sem), 0, 0);
+			Sem_Init(&(tdat->cmp_done_sem), 0, 0);
+			Sem_Init(&(tdat->write_done_sem), 0, 1);
+			Sem_Init(&(tdat->index_sem), 0, 0);
+			Sem_Init(&(tdat->prep_done_sem), 0, 0);
+		}
+
+		if (pool->regrow) {
+			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
+				if (single_chunk)
+					tdat->cmp_seg = (uchar_t *)1;
+				else
+					tdat->cmp_seg = (uchar_t *)slab_alloc(NULL,
+					    compressed_chunksize);
+				tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL,
+					compressed_chunksize);
+			} else {
+				if (single_chunk)
+					tdat->uncompressed_chunk = (uchar_t *)1;
+				else
+					tdat->uncompressed_chunk = (uchar_t *)slab_alloc(NULL,
+						compressed_chunksize);
+				tdat->cmp_seg = (uchar_t *)slab_alloc(NULL, compressed_chunksize);
+			}
+			if (!tdat->cmp_seg || !tdat->uncompressed_chunk) {
+				log_msg(LOG_ERR, 0, "5: Out of memory");
 				COMP_BAIL;
 			}
+			if (pctx->numa_place && !single_chunk) {
+				numa_place_mem(tdat->cmp_seg, compressed_chunksize, i % nstage_thr);
+				numa_place_mem(tdat->uncompressed_chunk, compressed_chunksize,
+				    i % nstage_thr);
+			}
+		}
+
+		if (pool->reinit) {
+			tdat->level = level;
+			if (pctx->_init_func) {
+				if (pctx->_init_func(&(tdat->data), &(tdat->level), props.nthreads,
+				    chunksize, VERSION, COMPRESS) != 0) {
+					COMP_BAIL;
+				}
+				if (pctx->adapt_estimate && adapt_set_estimate(tdat->data) != 0) {
+					log_msg(LOG_ERR, 0, "6: Out of memory");
+					COMP_BAIL;
+				}
+			}
 		}
+		tdat->compressed_chunk = tdat->cmp_seg + COMPRESSED_CHUNKSZ +
+		    pctx->cksum_bytes + pctx->mac_bytes;
 
 		if (pctx->encrypt_type) {
 			if (hmac_init(&tdat->chunk_hmac, pctx->cksum, &(pctx->crypto_ctx)) == -1) {
@@ -2554,11 +3917,39 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 				COMP_BAIL;
 			}
 		}
-		if (pthread_create(&(tdat->thr), NULL, perform_compress,
-		    (void *)tdat) != 0) {
+	}
+
+	set_stage_stats_slots(pctx, dary, nprocs);
+
+	/*
+	 * Start the stage threads, or wake the parked ones. Thread i of every
+	 * stage works on slots i, i + nstage_thr and so on.
+	 */
+	thread = 1;
+	for (i = 0; i < nstage_thr * nstages; i++) {
+		struct cmp_stage *sdat = &sary[i];
+
+		if (reuse) {
+			Sem_Post(&(sdat->park_sem));
+			continue;
+		}
+		sdat->dary = dary;
+		sdat->nslots = nprocs;
+		sdat->first = i % nstage_thr;
+		sdat->step = nstage_thr;
+		sdat->pctx = pctx;
+		if (nstages == 1)
+			sdat->stage = CMP_STAGE_ALL;
+		else
+			sdat->stage = (i < nstage_thr) ? CMP_STAGE_PREP : CMP_STAGE_CODEC;
+		if (pthread_create(&(sdat->thr), NULL, perform_compress,
+		    (void *)sdat) != 0) {
 			log_msg(LOG_ERR, 1, "Error in thread creation: ");
 			COMP_BAIL;
 		}
+		pool->nworkers++;
+		if (pctx->numa_place)
+			numa_place_thread(sdat->thr, sdat->first);
 	}
 
 	/*
@@ -2572,7 +3963,6 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			COMP_BAIL;
 		}
 	}
-	thread = 1;
 
 	/*
 	 * initialize Dedupe Context here after all other allocations so that index size can be
@@ -2581,7 +3971,9 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	 */
 	get_sys_limits(&msys_info);
 
-	if (pctx->enable_packjpg || pctx->enable_wavpack) {
+	if (pctx->mem_budget) {
+		msys_info.freeram = pctx->mem_budget - fixed_mem - nprocs * slot_mem;
+	} else if (pctx->enable_packjpg || pctx->enable_wavpack) {
 		if (FILTER_SCRATCH_SIZE_MAX >= msys_info.freeram ||
 		    msys_info.freeram - FILTER_SCRATCH_SIZE_MAX < FILTER_SCRATCH_SIZE_MAX) {
 			log_msg(LOG_WARN, 0, "Not enough memory. Disabling advanced filters.");
@@ -2603,14 +3995,34 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			}
 
 			tdat->rctx->show_chunks = pctx->show_chunks;
+			tdat->rctx->delta_enc = pctx->delta_enc;
 			tdat->rctx->index_sem = &(tdat->index_sem);
 			tdat->rctx->id = i;
+
+			/*
+			 * Let dedupe compute the chunk checksum during its block scan.
+			 */
+			if (!pctx->encrypt_type && tdat->cksum_mt == 0 &&
+			    cksum_init(&tdat->chunk_cksum, pctx->cksum) == 0)
+				tdat->rctx->data_cksum = &tdat->chunk_cksum;
 		}
 	}
 	if (pctx->enable_rabin_global) {
+		/*
+		 * Archives record cross-chunk references so that extraction need
+		 * not keep the whole data stream around.
+		 */
+		if (pctx->archive_mode) {
+			pctx->reftab = reftab_create();
+			if (pctx->reftab == NULL) {
+				log_msg(LOG_ERR, 0, "Out of memory.");
+				COMP_BAIL;
+			}
+		}
 		for (i = 0; i < nprocs; i++) {
 			tdat = dary[i];
 			tdat->rctx->index_sem_next = &(dary[(i + 1) % nprocs]->index_sem);
+			tdat->rctx->reftab = pctx->reftab;
 		}
 		// When doing global dedupe first thread does not wait to access the index.
 		Sem_Post(&(dary[0]->index_sem));
@@ -2636,7 +4048,13 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		flags |= FLAG_ARCHIVE;
 		if (pctx->meta_stream)
 			flags |= FLAG_META_STREAM;
+		if (pctx->reftab)
+			flags |= FLAG_DEDUPE_REFS;
 	}
+	if (pctx->enable_algo_dict)
+		flags |= FLAG_ALGO_DICT;
+	if (pctx->enable_delta_encode && pctx->delta_enc == DELTA_ENC_HDIFF)
+		flags |= FLAG_DELTA_HDIFF;
 
 	/*
 	 * Write out file header. First insert hdr elements into mem buffer
@@ -2680,7 +4098,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		*((int *)pos) = htonl(pctx->keylen);
 		pos += sizeof (int);
 	}
-	if (Write(compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
+	if (pc_write(pctx, compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
 		log_msg(LOG_ERR, 1, "Write ");
 		COMP_BAIL;
 	}
@@ -2707,7 +4125,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		pos = cread_buf;
 		serialize_checksum(hdr_hash, pos, hlen);
 		pos += hlen;
-		if (Write(compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
+		if (pc_write(pctx, compfd, cread_buf, pos - cread_buf) != pos - cread_buf) {
 			log_msg(LOG_ERR, 1, "Write ");
 			COMP_BAIL;
 		}
@@ -2717,7 +4135,7 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 		 */
 		uint32_t crc = lzma_crc32(cread_buf, pos - cread_buf, 0);
 		U32_P(cread_buf) = htonl(crc);
-		if (Write(compfd, cread_buf, sizeof (uint32_t)) != sizeof (uint32_t)) {
+		if (pc_write(pctx, compfd, cread_buf, sizeof (uint32_t)) != sizeof (uint32_t)) {
 			log_msg(LOG_ERR, 1, "Write ");
 			COMP_BAIL;
 		}
@@ -2740,19 +4158,97 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 	 */
 	file_offset = 0;
 	pctx->interesting = 0;
+	t0 = STAGE_CLOCK(pctx);
 	if (pctx->enable_rabin_split) {
 		rctx = create_dedupe_context(chunksize, 0, pctx->rab_blk_size, pctx->algo, &props,
 		    pctx->enable_delta_encode, pctx->enable_fixed_scan, VERSION, COMPRESS, 0, NULL,
 		    pctx->pipe_mode, nprocs, msys_info.freeram);
 		if (pctx->archive_mode)
-			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx, pctx);
+			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx,
+			    archiver_read, pctx);
+		else if (pctx->mem_io)
+			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx,
+			    mem_io_read, pctx);
 		else
-			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx, NULL);
+			rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize, &rabin_count, rctx,
+			    NULL, NULL);
 	} else {
 		if (pctx->archive_mode)
 			rbytes = archiver_read(pctx, cread_buf, chunksize);
 		else
-			rbytes = Read(uncompfd, cread_buf, chunksize);
+			rbytes = pc_read(pctx, uncompfd, cread_buf, chunksize);
+	}
+	STAGE_ADD(pctx, &pctx->reader_stats, STAGE_READ, t0);
+
+	/*
+	 * Train a shared dictionary and write it out right after the header.
+	 * Every compression thread primes each chunk with it. When the input
+	 * is a regular file, samples from the first few chunks are read ahead
+	 * with pread() so that training can prefer data that repeats across
+	 * chunks. Otherwise only the first chunk is used.
+	 */
+	if (pctx->enable_algo_dict) {
+		uchar_t *dpos, *tbuf;
+		uint64_t tlen, slen, nchunks;
+		int64_t n;
+		uint32_t crc;
+
+		pctx->algo_dict = (uchar_t *)malloc(ALGO_DICT_MAX + 2 * sizeof (uint32_t));
+		if (!pctx->algo_dict) {
+			log_msg(LOG_ERR, 0, "Out of memory.");
+			COMP_BAIL;
+		}
+		dpos = pctx->algo_dict + sizeof (uint32_t);
+		pctx->algo_dict_len = 0;
+		tbuf = NULL;
+		tlen = 0;
+		slen = 0;
+		nchunks = 0;
+		if (rbytes > 0 && !pctx->pipe_mode && !pctx->archive_mode &&
+		    !pctx->mem_io && sbuf.st_size > rbytes) {
+			nchunks = (sbuf.st_size + chunksize - 1) / chunksize;
+			slen = MIN(rbytes, ALGO_DICT_SAMPLE);
+			tbuf = (uchar_t *)malloc(slen * MIN(nchunks, ALGO_DICT_CHUNKS));
+			if (tbuf) {
+				memcpy(tbuf, cread_buf, slen);
+				tlen = slen;
+				for (i = 1; i < MIN(nchunks, ALGO_DICT_CHUNKS); i++) {
+					n = pread(uncompfd, tbuf + tlen, slen,
+					    rbytes + (i - 1) * chunksize);
+					if (n <= 0) break;
+					tlen += n;
+					if (n < slen) break;
+				}
+				if (tlen == slen) {
+					free(tbuf);
+					tbuf = NULL;
+				}
+			}
+		}
+		if (tbuf) {
+			pctx->algo_dict_len = pctx->_dict_train_func(tbuf, tlen, slen,
+			    nchunks, pctx->level, dpos);
+			free(tbuf);
+		} else if (rbytes > 0) {
+			pctx->algo_dict_len = pctx->_dict_train_func(cread_buf, rbytes, 0,
+			    nchunks, pctx->level, dpos);
+		}
+		U32_P(pctx->algo_dict) = htonl(pctx->algo_dict_len);
+		crc = lzma_crc32(pctx->algo_dict, pctx->algo_dict_len + sizeof (uint32_t), 0);
+		U32_P(dpos + pctx->algo_dict_len) = htonl(crc);
+		if (pc_write(pctx, compfd, pctx->algo_dict, pctx->algo_dict_len + 2 * sizeof (uint32_t))
+		    != pctx->algo_dict_len + 2 * sizeof (uint32_t)) {
+			log_msg(LOG_ERR, 1, "Write ");
+			COMP_BAIL;
+		}
+		if (pctx->algo_dict_len > 0) {
+			for (i = 0; i < nprocs; i++) {
+				if (pctx->_dict_set_func(dary[i]->data, dpos,
+				    pctx->algo_dict_len) != 0) {
+					COMP_BAIL;
+				}
+			}
+		}
 	}
 
 	while (!bail) {
@@ -2764,7 +4260,9 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			tdat = dary[p];
 			if (pctx->main_cancel) break;
 			/* Wait for previous chunk compression to complete. */
+			t0 = STAGE_CLOCK(pctx);
 			Sem_Wait(&tdat->write_done_sem);
+			STAGE_ADD(pctx, &pctx->reader_stats, WAIT_WRITE_DONE, t0);
 			if (pctx->main_cancel) break;
 
 			if (rbytes == 0) { /* EOF */
@@ -2820,6 +4318,9 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			}
 
 			/* Signal the compression thread to start */
+			pctx->reader_stats.chunks++;
+			pctx->reader_stats.bytes_in += tdat->rbytes;
+			tdat->in_bytes = tdat->rbytes;
 			Sem_Post(&tdat->start_sem);
 			++(pctx->chunk_num);
 
@@ -2833,19 +4334,24 @@ start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int lev
 			 * buffer is in progress.
 			 */
 			pctx->interesting = 0;
+			t0 = STAGE_CLOCK(pctx);
 			if (pctx->enable_rabin_split) {
 				if (pctx->archive_mode)
 					rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize,
-					    &rabin_count, rctx, pctx);
+					    &rabin_count, rctx, archiver_read, pctx);
+				else if (pctx->mem_io)
+					rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize,
+					    &rabin_count, rctx, mem_io_read, pctx);
 				else
 					rbytes = Read_Adjusted(uncompfd, cread_buf, chunksize,
-					    &rabin_count, rctx, NULL);
+					    &rabin_count, rctx, NULL, NULL);
 			} else {
 				if (pctx->archive_mode)
 					rbytes = archiver_read(pctx, cread_buf, chunksize);
 				else
-					rbytes = Read(uncompfd, cread_buf, chunksize);
+					rbytes = pc_read(pctx, uncompfd, cread_buf, chunksize);
 			}
+			STAGE_ADD(pctx, &pctx->reader_stats, STAGE_READ, t0);
 		}
 	}
 
@@ -2866,7 +4372,7 @@ comp_done:
 	 * the archive thread to exit and cleanup.
 	 */
 	if (!pctx->pipe_mode) {
-		if (uncompfd != -1) close(uncompfd);
+		if (uncompfd != -1 && uncompfd != pctx->in_fd) close(uncompfd);
 	}
 	if (pctx->meta_stream) {
 		meta_ctx_done(pctx->meta_ctx);
@@ -2881,16 +4387,19 @@ comp_done:
 			tdat->len_cmp = 0;
 			Sem_Post(&tdat->start_sem);
 			Sem_Post(&tdat->cmp_done_sem);
-			pthread_join(tdat->thr, NULL);
+		}
+		pool_drain(pool);
+		for (i = 0; i < nprocs; i++) {
 			if (pctx->encrypt_type)
-				hmac_cleanup(&tdat->chunk_hmac);
+				hmac_cleanup(&dary[i]->chunk_hmac);
 		}
 		if (thread == 2)
 			pthread_join(writer_thr, NULL);
 	}
 
 	if (err) {
-		if (compfd != -1 && !pctx->pipe_mode && !pctx->pipe_out) {
+		if (compfd != -1 && !pctx->pipe_mode && !pctx->pipe_out &&
+		    compfd != pctx->out_fd) {
 			unlink(tmpfile1);
 			rm_fname(tmpfile1);
 		}
@@ -2903,17 +4412,21 @@ comp_done:
 		* Write a trailer of zero chunk length.
 		*/
 		compressed_chunksize = 0;
-		if (Write(compfd, &compressed_chunksize,
+		if (pc_write(pctx, compfd, &compressed_chunksize,
 		    sizeof (compressed_chunksize)) < 0) {
 			log_msg(LOG_ERR, 1, "Write ");
 			err = 1;
 		}
+		if (!err && pctx->reftab && reftab_write(pctx->reftab, compfd) != 0)
+			err = 1;
 
 		/*
 		 * Rename the temporary file to the actual compressed file
-		 * unless we are in a pipe.
+		 * unless we are in a pipe or writing to a caller supplied descriptor
+		 * or buffer.
 		 */
-		if (!pctx->pipe_mode && !pctx->pipe_out) {
+		if (!pctx->pipe_mode && !pctx->pipe_out && !pctx->mem_io &&
+		    compfd != pctx->out_fd) {
 			/*
 			 * Ownership and mode of target should be same as original.
 			 */
@@ -2933,32 +4446,55 @@ comp_done:
 			}
 		}
 	}
-	if (dary != NULL) {
+	save_stage_stats(pctx);
+	if (pool != NULL) {
 		for (i = 0; i < nprocs; i++) {
 			if (!dary[i]) continue;
-			if (dary[i]->uncompressed_chunk != (uchar_t *)1)
-				slab_release(NULL, dary[i]->uncompressed_chunk);
-			if (dary[i]->cmp_seg != (uchar_t *)1)
-				slab_release(NULL, dary[i]->cmp_seg);
 			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan)) {
 				destroy_dedupe_context(dary[i]->rctx);
+				dary[i]->rctx = NULL;
 			}
-			if (pctx->_deinit_func)
-				pctx->_deinit_func(&(dary[i]->data));
-			Sem_Destroy(&(dary[i]->start_sem));
-			Sem_Destroy(&(dary[i]->cmp_done_sem));
-			Sem_Destroy(&(dary[i]->write_done_sem));
-			Sem_Destroy(&(dary[i]->index_sem));
+			cksum_cleanup(&(dary[i]->chunk_cksum));
+		}
 
-			slab_release(NULL, dary[i]);
+		/*
+		 * A single chunk run leaves the spare buffer in the slot. Move it
+		 * back so that the next run starts from the same layout.
+		 */
+		if (cread_buf == (uchar_t *)1) {
+			tdat = dary[0];
+			if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan ||
+			    pctx->enable_rabin_global)) {
+				cread_buf = tdat->cmp_seg;
+				tdat->cmp_seg = (uchar_t *)1;
+			} else {
+				cread_buf = tdat->uncompressed_chunk;
+				tdat->uncompressed_chunk = (uchar_t *)1;
+			}
 		}
-		slab_release(NULL, dary);
+		pool->spare = cread_buf;
+		cread_buf = NULL;
+
+		/*
+		 * Keep the slots for the next run unless something went wrong.
+		 */
+		if (err || pctx->main_cancel || !pool->keep)
+			pool_destroy(pctx);
+	}
+	if (pctx->algo_dict) {
+		free(pctx->algo_dict);
+		pctx->algo_dict = NULL;
+		pctx->algo_dict_len = 0;
 	}
 	if (pctx->enable_rabin_split) destroy_dedupe_context(rctx);
-	if (cread_buf != (uchar_t *)1)
+	if (pctx->reftab) {
+		reftab_destroy(pctx->reftab);
+		pctx->reftab = NULL;
+	}
+	if (cread_buf != NULL)
 		slab_release(NULL, cread_buf);
 	if (!pctx->pipe_mode) {
-		if (compfd != -1) close(compfd);
+		if (compfd != -1 && compfd != pctx->out_fd) close(compfd);
 	}
 
 	if (pctx->archive_mode) {
@@ -2992,6 +4528,8 @@ init_algo(pc_ctx_t *pctx, const char *algo, int bail)
 	/* Copy given string into known length buffer to avoid memcmp() overruns. */
 	strncpy(algorithm, algo, 8);
 	pctx->_props_func = NULL;
+	pctx->_dict_train_func = NULL;
+	pctx->_dict_set_func = NULL;
 	if (memcmp(algorithm, "zlib", 4) == 0) {
 		pctx->_compress_func = zlib_compress;
 		pctx->_decompress_func = zlib_decompress;
@@ -3002,7 +4540,7 @@ init_algo(pc_ctx_t *pctx, const char *algo, int bail)
 		rv = 0;
 
 	} else if (memcmp(algorithm, "lzmaMt", 6) == 0) {
-		pctx->_compress_func = lzma_compress;
+		pctx->_compress_func = lzma_mt_compress;
 		pctx->_decompress_func = lzma_decompress;
 		pctx->_init_func = lzma_init;
 		pctx->_deinit_func = lzma_deinit;
@@ -3053,6 +4591,8 @@ init_algo(pc_ctx_t *pctx, const char *algo, int bail)
 		pctx->_deinit_func = lz4_deinit;
 		pctx->_stats_func = lz4_stats;
 		pctx->_props_func = lz4_props;
+		pctx->_dict_train_func = lz4_train_dict;
+		pctx->_dict_set_func = lz4_set_dict;
 		rv = 0;
 
 	} else if (memcmp(algorithm, "none", 4) == 0) {
@@ -3086,6 +4626,18 @@ init_algo(pc_ctx_t *pctx, const char *algo, int bail)
 		pctx->adapt_mode = 1;
 		pctx->enable_analyzer = 1;
 		rv = 0;
+
+#ifdef ENABLE_PC_ZSTD
+	} else if (memcmp(algorithm, "zstd", 4) == 0) {
+		pctx->_compress_func = zstd_compress;
+		pctx->_decompress_func = zstd_decompress;
+		pctx->_init_func = zstd_init;
+		pctx->_deinit_func = zstd_deinit;
+		pctx->_stats_func = zstd_stats;
+		pctx->_props_func = zstd_props;
+		rv = 0;
+#endif
+
 #ifdef ENABLE_PC_LIBBSC
 	} else if (memcmp(algorithm, "libbsc", 6) == 0) {
 		pctx->_compress_func = libbsc_compress;
@@ -3120,9 +4672,14 @@ create_pc_context(void)
 	ctx->enable_rabin_split = 1;
 	ctx->rab_blk_size = -1;
 	ctx->archive_temp_fd = -1;
+	ctx->in_fd = -1;
+	ctx->out_fd = -1;
+	ctx->mem_insize = -1;
 	ctx->pagesize = sysconf(_SC_PAGE_SIZE);
 	ctx->btype = TYPE_UNKNOWN;
 	ctx->delta2_nstrides = NSTRIDES_STANDARD;
+	ctx->preproc_nthreads = 1;
+	ctx->delta_enc = DELTA_ENC_HDIFF;
 	pthread_mutex_init(&ctx->write_mutex, NULL);
 
 	return (ctx);
@@ -3135,7 +4692,10 @@ destroy_pc_context(pc_ctx_t *pctx)
 		free((void *)(pctx->filename));
 	if (pctx->pwd_file)
 		free(pctx->pwd_file);
+	free(pctx->progress_file);
 	free((void *)(pctx->exec_name));
+	free(pctx->mem_opts);
+	pool_destroy(pctx);
 	slab_cleanup(pctx->hide_mem_stats);
 	free(pctx);
 }
@@ -3180,7 +4740,8 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 	ff.exe_preprocess = 0;
 
 	pthread_mutex_lock(&opt_parse);
-	while ((opt = getopt(argc, argv, "dc:s:l:pt:MCDGEe:w:LPS:B:Fk:avmKjxiTn")) != -1) {
+	while ((opt = getopt_long(argc, argv, "dc:s:l:pt:MCDGEbe:w:LPS:B:Fk:avmKjxiTnZJR:NH",
+	    long_opts, NULL)) != -1) {
 		int ovr;
 		int64_t chunksize;
 
@@ -3191,6 +4752,36 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->do_uncompress = 1;
 			break;
 
+		    case 'g':
+			pctx->progress_log = 1;
+			pctx->progress_secs = PROGRESS_SECS;
+			if (optarg) {
+				pctx->progress_secs = atoi(optarg);
+				if (pctx->progress_secs < 1) {
+					log_msg(LOG_ERR, 0, "Invalid progress interval %s", optarg);
+					return (1);
+				}
+			}
+			break;
+
+		    case 'o':
+			free(pctx->progress_file);
+			pctx->progress_file = strdup(optarg);
+			break;
+
+		    case 'u':
+			pctx->pipeline = 1;
+			break;
+
+		    case 'q':
+			pctx->adapt_estimate = 1;
+			break;
+
+		    case 'V':
+			pctx->verify = 1;
+			pctx->do_uncompress = 1;
+			break;
+
 		    case 'c':
 			pctx->do_compress = 1;
 			pctx->algo = optarg;
@@ -3280,6 +4871,10 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 				pctx->enable_delta_encode = DELTA_EXTRA;
 			break;
 
+		    case 'b':
+			pctx->delta_enc = DELTA_ENC_BSDIFF;
+			break;
+
 		    case 'e':
 			pctx->encrypt_type = get_crypto_alg(optarg);
 			if (pctx->encrypt_type == 0) {
@@ -3364,6 +4959,31 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 			pctx->enable_archive_sort = -1;
 			break;
 
+		    case 'Z':
+			pctx->enable_algo_dict = 1;
+			break;
+
+		    case 'J':
+			pctx->stage_stats = STAGE_STATS_DUMP;
+			break;
+
+		    case 'R':
+			ovr = parse_numeric(&chunksize, optarg);
+			if (ovr != 0 || chunksize <= 0) {
+				log_msg(LOG_ERR, 0, "Invalid memory budget %s", optarg);
+				return (1);
+			}
+			pctx->mem_budget = chunksize;
+			break;
+
+		    case 'N':
+			pctx->numa_place = 1;
+			break;
+
+		    case 'H':
+			pctx->huge_pages = 1;
+			break;
+
 		    case '?':
 		    default:
 			return (2);
@@ -3383,6 +5003,14 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		return (1);
 	}
 
+	if (pctx->verify && (pctx->list_mode || pctx->pipe_mode)) {
+		log_msg(LOG_ERR, 0, "'--verify' cannot be combined with '-i' or '-p'.");
+		return (1);
+	}
+
+	if (pctx->progress_file && !pctx->progress_secs)
+		pctx->progress_secs = PROGRESS_SECS;
+
 	if (pctx->archive_mode && pctx->pipe_mode) {
 		log_msg(LOG_ERR, 0, "Full pipeline mode is meaningless with archiver.");
 		return (1);
@@ -3396,6 +5024,11 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		init_algo(pctx, pctx->algo, 1);
 	}
 
+	if (pctx->adapt_estimate && (!pctx->do_compress || pctx->adapt_mode != 2)) {
+		log_msg(LOG_ERR, 0, "'--estimate' is only meaningful when compressing with adapt2.");
+		return (1);
+	}
+
 	if (pctx->level == -1 && pctx->do_compress) {
 		if (memcmp(pctx->algo, "lz4", 3) == 0) {
 			pctx->level = 1;
@@ -3436,6 +5069,10 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		log_msg(LOG_ERR, 0, "Filename(s) unexpected for pipe mode");
 		return (1);
 	}
+	if (pctx->verify && num_rem != 1) {
+		log_msg(LOG_ERR, 0, "Verify mode takes just the compressed file.");
+		return (1);
+	}
 
 	if ((pctx->enable_rabin_scan || pctx->enable_fixed_scan) && !pctx->do_compress) {
 		log_msg(LOG_ERR, 0, "Deduplication is only used during compression.");
@@ -3460,6 +5097,22 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		return (1);
 	}
 
+	if (pctx->enable_algo_dict) {
+		if (!pctx->do_compress) {
+			log_msg(LOG_ERR, 0, "Shared dictionary only makes sense when compressing!");
+			return (1);
+		}
+		if (pctx->_dict_set_func == NULL) {
+			log_msg(LOG_ERR, 0, "Algorithm %s does not support a shared dictionary.",
+			    pctx->algo);
+			return (1);
+		}
+		if (pctx->encrypt_type) {
+			log_msg(LOG_ERR, 0, "Shared dictionary cannot be used with encryption.");
+			return (1);
+		}
+	}
+
 	/*
 	 * Global Deduplication can use Rabin or Fixed chunking. Default, if not specified,
 	 * is to use Rabin.
@@ -3469,6 +5122,11 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		pctx->enable_rabin_split = 1;
 	}
 
+	if (pctx->delta_enc == DELTA_ENC_BSDIFF && !pctx->enable_delta_encode) {
+		log_msg(LOG_ERR, 0, "Option -b is only meaningful with Delta Compression (-E).");
+		return (1);
+	}
+
 	if (pctx->enable_rabin_global && pctx->enable_delta_encode) {
 		log_msg(LOG_ERR, 0, "Global Deduplication does not support Delta Compression.");
 		return (1);
@@ -3484,7 +5142,13 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		return (1);
 	}
 
-	if (num_rem == 0 && !pctx->pipe_mode) {
+	if (pctx->mem_io) {
+		if (num_rem > 0 || pctx->pipe_mode || pctx->archive_mode) {
+			log_msg(LOG_ERR, 0, "Filenames, pipe mode and archiving are not "
+			    "valid with the buffer interface.");
+			return (1);
+		}
+	} else if (num_rem == 0 && !pctx->pipe_mode) {
 		log_msg(LOG_ERR, 0, "Expected at least one filename.");
 		return (1);
 
@@ -3651,6 +5315,13 @@ init_pc_context(pc_ctx_t *pctx, int argc, char *argv[])
 		if (pctx->pipe_mode)
 			pctx->meta_stream = 0;
 
+		/*
+		 * The shared dictionary must be written before any chunk so a separate
+		 * metadata stream cannot be used.
+		 */
+		if (pctx->enable_algo_dict)
+			pctx->meta_stream = 0;
+
 		/*
 		 * Auto-select filters and preprocessing modes based on compresion level.
 		 * This is not done if user explicitly specified advanced options.
@@ -3720,11 +5391,23 @@ start_pcompress(pc_ctx_t *pctx)
 		return (1);
 
 	handle_signals();
+	if (pctx->stage_stats)
+		start_stage_stats(pctx);
+	if (pctx->progress_secs)
+		start_progress(pctx);
 	err = 0;
+	slab_set_limit(pctx->mem_budget);
+	slab_set_hugepages(pctx->huge_pages, !pctx->hide_mem_stats);
 	if (pctx->do_compress)
 		err = start_compress(pctx, pctx->filename, pctx->chunksize, pctx->level);
 	else if (pctx->do_uncompress)
 		err = start_decompress(pctx, pctx->filename, pctx->to_filename);
+	slab_set_limit(0);
+	slab_set_hugepages(0, 0);
+	if (pctx->numa_place)
+		numa_place_thread(pthread_self(), -1);
+	stop_progress(pctx, err);
+	stop_stage_stats(pctx);
 	return (err);
 }
 
@@ -3737,3 +5420,33 @@ pc_set_userpw(pc_ctx_t *pctx, unsigned char *pwdata, int pwlen)
 	pctx->user_pw = pwdata;
 	pctx->user_pw_len = pwlen;
 }
+
+/*
+ * Use already open descriptors instead of the input and output files. Input
+ * must be a regular file positioned at the start. Output must be a regular
+ * file open for reading and writing if Global Dedupe data is decompressed.
+ * The caller retains ownership of both descriptors.
+ */
+void DLL_EXPORT
+pc_set_fds(pc_ctx_t *pctx, int in_fd, int out_fd)
+{
+	pctx->in_fd = in_fd;
+	pctx->out_fd = out_fd;
+}
+
+/*
+ * Report progress every secs seconds while a file or buffer is processed.
+ * With log_line set each report is a LOG_INFO message, which goes to the
+ * callback given to set_log_dest(). If path is not NULL the report is also
+ * kept as a line of JSON in that file. A secs value of 0 turns it off.
+ */
+void DLL_EXPORT
+pc_set_progress(pc_ctx_t *pctx, int secs, int log_line, const char *path)
+{
+	pctx->progress_secs = secs;
+	pctx->progress_log = log_line;
+	free(pctx->progress_file);
+	pctx->progress_file = NULL;
+	if (path)
+		pctx->progress_file = strdup(path);
+}
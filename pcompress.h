@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <signal.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -42,12 +43,20 @@ extern "C" {
 #define	CHUNK_FLAG_SZ	1
 #define	ALGO_SZ		8
 #define	MIN_CHUNK	2048
-#define	VERSION		10
+#define	VERSION		11
+#define	MIN_VERSION	6
 #define	FLAG_DEDUP	1
 #define	FLAG_DEDUP_FIXED	2
 #define	FLAG_SINGLE_CHUNK	4
 #define FLAG_META_STREAM	4096
 #define	FLAG_ARCHIVE	2048
+#define	FLAG_ALGO_DICT	8192
+#define	FLAG_DELTA_HDIFF	16384
+#define	FLAG_DEDUPE_REFS	32768
+#define	ALGO_DICT_MAX	(64 * 1024)
+#define	ALGO_DICT_SAMPLE	(256 * 1024)
+#define	ALGO_DICT_CHUNKS	8
+#define	PROGRESS_SECS	5
 #define	UTILITY_VERSION	"3.1"
 #define	MASK_CRYPTO_ALG	0x30
 #define	MAX_LEVEL	14
@@ -72,6 +81,7 @@ extern "C" {
 #define	PREPROC_TYPE_DISPACK	4
 #define	PREPROC_TYPE_DICT	8
 #define	PREPROC_TYPE_E8E9	16
+#define	PREPROC_TYPE_TRANSPOSE	32
 #define	PREPROC_COMPRESSED	128
 
 /*
@@ -96,6 +106,11 @@ extern "C" {
  * fastest algo at our disposal for these cases.
  */
 #define	ADAPT_COMPRESS_LZ4	5
+/*
+ * Used in adapt2 mode for binary data at the lower compression levels where
+ * it decompresses much faster than LZMA for a similar ratio.
+ */
+#define	ADAPT_COMPRESS_ZSTD	6
 #define	CHDR_ALGO_MASK	7
 #define	CHDR_ALGO(x) (((x)>>4) & CHDR_ALGO_MASK)
 
@@ -106,6 +121,8 @@ extern int zlib_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *destlen, int level, uchar_t chdr, int btype, void *data);
 extern int lzma_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *destlen, int level, uchar_t chdr, int btype, void *data);
+extern int lzma_mt_compress(void *src, uint64_t srclen, void *dst,
+	uint64_t *destlen, int level, uchar_t chdr, int btype, void *data);
 extern int bzip2_compress(void *src, uint64_t srclen, void *dst,
 	uint64_t *destlen, int level, uchar_t chdr, int btype, void *data);
 extern int adapt_compress(void *src, uint64_t srclen, void *dst,
@@ -155,6 +172,7 @@ extern int lz4_init(void **data, int *level, int nthreads, uint64_t chunksize,
 extern int none_init(void **data, int *level, int nthreads, uint64_t chunksize,
 		     int file_version, compress_op_t op);
 extern void adapt_set_analyzer_ctx(void *data, analyzer_ctx_t *actx);
+extern int adapt_set_estimate(void *data);
 
 extern void lzma_props(algo_props_t *data, int level, uint64_t chunksize);
 extern void lzma_mt_props(algo_props_t *data, int level, uint64_t chunksize);
@@ -172,6 +190,9 @@ extern int lzma_deinit(void **data);
 extern int ppmd_deinit(void **data);
 extern int lz_fx_deinit(void **data);
 extern int lz4_deinit(void **data);
+extern int lz4_train_dict(uchar_t *buf, uint64_t buflen, uint64_t samplelen,
+	uint64_t nchunks, int level, uchar_t *dict);
+extern int lz4_set_dict(void *data, uchar_t *dict, int dictlen);
 extern int none_deinit(void **data);
 
 extern void adapt_stats(int show);
@@ -195,6 +216,81 @@ extern int libbsc_deinit(void **data);
 extern void libbsc_stats(int show);
 #endif
 
+#ifdef ENABLE_PC_ZSTD
+extern int zstd_compress(void *src, uint64_t srclen, void *dst,
+	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data);
+extern int zstd_decompress(void *src, uint64_t srclen, void *dst,
+	uint64_t *dstlen, int level, uchar_t chdr, int btype, void *data);
+extern int zstd_init(void **data, int *level, int nthreads, uint64_t chunksize,
+	int file_version, compress_op_t op);
+extern void zstd_props(algo_props_t *data, int level, uint64_t chunksize);
+extern int zstd_deinit(void **data);
+extern void zstd_stats(int show);
+extern int zstd_buf_extra(uint64_t buflen);
+#endif
+
+/*
+ * Per-stage timing counters collected with -J. Times are in nanoseconds.
+ * Every counter set is only updated by the one thread that owns it, so no
+ * locking is needed. A dump taken from the signal handling thread may be
+ * a little behind.
+ */
+enum {
+	STAGE_READ = 0,
+	STAGE_DEDUPE,
+	STAGE_CHECKSUM,
+	STAGE_PREPROC,
+	STAGE_CODEC,
+	STAGE_CRYPTO,
+	STAGE_HMAC,
+	STAGE_WRITE,
+	WAIT_START,
+	WAIT_PREP_DONE,
+	WAIT_CMP_DONE,
+	WAIT_WRITE_DONE,
+	STAGE_MAX
+};
+
+typedef struct {
+	uint64_t ns[STAGE_MAX];
+	uint64_t chunks, bytes_in, bytes_out;
+} stage_stats_t;
+
+/*
+ * Values of stage_stats. Collected counters are only available to callers
+ * of the library through stats_total.
+ */
+#define	STAGE_STATS_DUMP	1
+#define	STAGE_STATS_COLLECT	2
+
+/*
+ * Room for one thread's counters in the JSON dump. Every counter fits in 20
+ * digits, the longest entry is a little over 500 bytes.
+ */
+#define	STATS_ENTRY_SZ		1024
+
+extern const char *stage_names[STAGE_MAX];
+
+#define	STAGE_CLOCK(pctx)	((pctx)->stage_stats ? get_wtime_nanos() : 0)
+#define	STAGE_ADD(pctx, st, stage, t0) \
+	do { \
+		if ((pctx)->stage_stats) \
+			(st)->ns[stage] += get_wtime_nanos() - (t0); \
+	} while (0)
+
+/*
+ * Callbacks for pc_process_stream(). They return the number of bytes read
+ * or written, 0 at end of input or -1 on error.
+ */
+typedef int64_t (*pc_read_func_t)(void *cookie, void *buf, uint64_t len);
+typedef int64_t (*pc_write_func_t)(void *cookie, const void *buf, uint64_t len);
+
+/*
+ * Reads back len bytes of output already written, at offset off. Returns
+ * the number of bytes read or -1 on error.
+ */
+typedef int64_t (*pc_pread_func_t)(void *cookie, void *buf, uint64_t len, uint64_t off);
+
 typedef struct pc_ctx {
 	compress_func_ptr _compress_func;
 	compress_func_ptr _decompress_func;
@@ -202,6 +298,8 @@ typedef struct pc_ctx {
 	deinit_func_ptr _deinit_func;
 	stats_func_ptr _stats_func;
 	props_func_ptr _props_func;
+	dict_train_func_ptr _dict_train_func;
+	dict_set_func_ptr _dict_set_func;
 
 	int inited;
 	int main_cancel;
@@ -214,6 +312,7 @@ typedef struct pc_ctx {
 	int enable_rabin_scan;
 	int enable_rabin_global;
 	int enable_delta_encode;
+	int delta_enc;
 	int enable_delta2_encode;
 	int delta2_nstrides;
 	int enable_rabin_split;
@@ -222,6 +321,7 @@ typedef struct pc_ctx {
 	int preprocess_mode;
 	int lzp_preprocess;
 	int exe_preprocess;
+	int preproc_nthreads;
 	int encrypt_type;
 	int archive_mode;
 	int enable_archive_sort;
@@ -230,6 +330,9 @@ typedef struct pc_ctx {
 	int no_overwrite_newer;
 	int advanced_opts;
 	int meta_stream;
+	int enable_algo_dict;
+	uchar_t *algo_dict;
+	int algo_dict_len;
 
 	/*
 	 * Archiving related context data.
@@ -241,6 +344,8 @@ typedef struct pc_ctx {
 	pthread_t archive_thread;
 	char archive_temp_file[MAXPATHLEN];
 	int archive_temp_fd;
+	reftab_t *reftab;
+	refcache_t *refcache;
 	uint64_t archive_temp_size, archive_size;
 	uchar_t *temp_mmap_buf;
 	uint64_t temp_mmap_pos, temp_file_pos;
@@ -276,6 +381,72 @@ typedef struct pc_ctx {
 	int user_pw_len;
 	char *pwd_file, *f_name;
 	meta_ctx_t *meta_ctx;
+
+	/*
+	 * Stage timing. The reader and writer have their own counters, workers
+	 * keep theirs in the per-chunk thread data.
+	 */
+	int stage_stats, stats_running, stats_done;
+	stage_stats_t reader_stats, writer_stats;
+	struct cmp_data **stats_dary;
+	stage_stats_t *stats_saved;
+	int stats_nslots;
+	pthread_mutex_t stats_lock;
+	uint64_t stats_start;
+	pthread_t stats_thr;
+	sigset_t stats_omask;
+	stage_stats_t stats_total;
+	uint64_t mem_budget;	/* Hard memory limit (-R), 0 if not set. */
+	int numa_place;		/* Spread threads and buffers over NUMA nodes (-N). */
+	int huge_pages;		/* Huge page backing for large buffers (-H). */
+	int pipeline;		/* Run prep and codec stages on separate threads. */
+	int adapt_estimate;	/* Sample based backend choice in adapt2 (--estimate). */
+
+	/*
+	 * Verify only (--verify). Workers hand back their slots themselves and
+	 * post free_slots, the reader takes whichever slot is free first.
+	 */
+	int verify;
+	Sem_t free_slots;
+
+	/*
+	 * Progress reporting (--progress, --progress-file). A thread samples
+	 * the reader and writer counters every progress_secs seconds.
+	 */
+	int progress_secs, progress_log;
+	char *progress_file;
+	int progress_running, progress_done;
+	uint64_t progress_total;	/* Input size for the ETA, 0 if unknown. */
+	uint64_t progress_start, progress_last_ns, progress_last_bytes;
+	pthread_t progress_thr;
+	pthread_mutex_t progress_lock;
+	pthread_cond_t progress_cv;
+
+	/*
+	 * Caller supplied descriptors used in place of the input and output
+	 * files, -1 if not set.
+	 */
+	int in_fd, out_fd;
+
+	/*
+	 * Buffer and callback interface. The input and output streams go
+	 * through these callbacks instead of descriptors. The input size is
+	 * -1 for a stream. Output can only be read back, as Global Dedupe
+	 * data needs, if mem_pread is set. mem_opts holds the options that
+	 * are put back before each call.
+	 */
+	int mem_io;
+	pc_read_func_t mem_read;
+	pc_write_func_t mem_write;
+	pc_pread_func_t mem_pread;
+	void *mem_cookie;
+	int64_t mem_insize;
+	void *mem_opts;
+
+	/*
+	 * Chunk slots and worker threads kept from the previous run.
+	 */
+	struct slot_pool *pool;
 } pc_ctx_t;
 
 /*
@@ -287,8 +458,12 @@ struct cmp_data {
 	uchar_t *uncompressed_chunk;
 	dedupe_context_t *rctx;
 	int64_t rbytes;
+	uint64_t in_bytes;	/* Bytes read for this chunk, rbytes may change. */
 	uint64_t chunksize;
 	uint64_t len_cmp, len_cmp_be;
+	uint64_t dedupe_index_sz, index_size_cmp, prep_len;
+	uchar_t preproc_type;
+	analyzer_ctx_t actx;
 	uchar_t checksum[CKSUM_MAX_BYTES];
 	int level, cksum_mt, out_fd;
 	unsigned int id;
@@ -300,25 +475,79 @@ struct cmp_data {
 	Sem_t cmp_done_sem;
 	Sem_t write_done_sem;
 	Sem_t index_sem;
+	Sem_t prep_done_sem;
 	void *data;
 	pthread_t thr;
+	Sem_t park_sem;
 	mac_ctx_t chunk_hmac;
+	cksum_ctx_t chunk_cksum;
 	algo_props_t *props;
 	int decompressing;
 	int btype;
+	stage_stats_t stats;
+	pc_ctx_t *pctx;
+};
+
+/*
+ * Chunk compression stages. A stage thread runs one or both of these on
+ * every step'th slot of the chunk ring.
+ */
+#define	CMP_STAGE_PREP	1
+#define	CMP_STAGE_CODEC	2
+#define	CMP_STAGE_ALL	(CMP_STAGE_PREP | CMP_STAGE_CODEC)
+
+struct cmp_stage {
+	struct cmp_data **dary;
+	uint32_t nslots, first, step;
+	int stage;
+	pthread_t thr;
+	Sem_t park_sem;
 	pc_ctx_t *pctx;
 };
 
+/*
+ * Chunk slots, with their buffers and codec state, and the worker threads
+ * serving them. At the end of a run the workers park instead of exiting and
+ * the context keeps the whole set. A later run with the same number and
+ * layout of slots takes it over. Buffers are only reallocated if they are
+ * too small and codec state only if the codec parameters changed, so setup
+ * is mostly paid once rather than per file or buffer.
+ */
+struct slot_pool {
+	int do_compress, level, version, nthreads, nstages;
+	int single_chunk, dedupe, keep, quit, regrow, reinit;
+	uint32_t nslots, nworkers;
+	uint64_t chunksize, cmp_size;
+	init_func_ptr init;
+	deinit_func_ptr deinit;
+	compress_func_ptr codec;
+	struct cmp_data **dary;
+	struct cmp_stage *sary;
+	uchar_t *spare;
+	Sem_t parked;
+};
+
 void usage(pc_ctx_t *pctx);
 pc_ctx_t *create_pc_context(void);
 int init_pc_context_argstr(pc_ctx_t *pctx, char *args);
 int init_pc_context(pc_ctx_t *pctx, int argc, char *argv[]);
 void destroy_pc_context(pc_ctx_t *pctx);
 void pc_set_userpw(pc_ctx_t *pctx, unsigned char *pwdata, int pwlen);
+void pc_set_fds(pc_ctx_t *pctx, int in_fd, int out_fd);
+void pc_set_progress(pc_ctx_t *pctx, int secs, int log_line, const char *path);
+
+int init_pc_context_mem(pc_ctx_t *pctx, char *args);
+int pc_process_buffer(pc_ctx_t *pctx, const void *src, uint64_t srclen, void **dst,
+    uint64_t *dstlen);
+int pc_process_stream(pc_ctx_t *pctx, pc_read_func_t rd, pc_write_func_t wr, void *cookie);
+int create_mem_file(const char *name);
+int64_t mem_io_read(void *ctx, void *buf, uint64_t count);
+int64_t mem_io_write(void *ctx, const void *buf, uint64_t count);
 
 int start_pcompress(pc_ctx_t *pctx);
 int start_compress(pc_ctx_t *pctx, const char *filename, uint64_t chunksize, int level);
 int start_decompress(pc_ctx_t *pctx, const char *filename, char *to_filename);
+int start_bench(int argc, char *argv[]);
 
 #ifdef	__cplusplus
 }
@@ -116,8 +116,18 @@ ppmd_stats(int show)
 {
 }
 
+uint64_t
+ppmd_state_mem(int level)
+{
+	if (level < 0) level = 0;
+	if (level > 14) level = 14;
+	return (ppmd8_mem_sz[level]);
+}
+
 void
 ppmd_props(algo_props_t *data, int level, uint64_t chunksize) {
+	data->state_mem = ppmd_state_mem(level);
+	data->dstate_mem = data->state_mem;
 	data->delta2_span = 100;
 	data->deltac_min_distance = FOURM;
 }
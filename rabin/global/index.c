@@ -270,6 +270,7 @@ init_global_db_s(char *path, char *tmppath, uint32_t chunksize, uint64_t user_ch
 			free(cfg);
 			return (NULL);
 		}
+		slab_hugepage_hint(indx->list[i].tab, indx->hash_slots * sizeof (hash_entry_t *));
 		indx->memused += ((indx->hash_slots) * (sizeof (hash_entry_t *)));
 	}
 
@@ -0,0 +1,527 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Cross-chunk block reference tracking for Global Dedupe archives.
+ *
+ * During compression every reference to a block in an earlier chunk is
+ * counted in a hashtable keyed by the block's offset in the data stream.
+ * The table is sorted by offset and written after the end of the compressed
+ * data.
+ *
+ * During extraction the table is read back incrementally as the decompressed
+ * stream is written out in order. Each listed block is captured as it passes
+ * by and held till its reference count drops to zero. Blocks are held in
+ * memory up to a limit, beyond which they go to a scratch file. So scratch
+ * space is only needed for the overflow, not for the whole stream.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "utils/utils.h"
+#include "lzma/lzma_crc.h"
+#include "reftab.h"
+
+#define	REFTAB_INIT_SLOTS	(64 * 1024)
+#define	REFTAB_BATCH		4096
+#define	REFCACHE_HSZ		(16 * 1024)
+
+static uint64_t
+ref_hash(uint64_t offset)
+{
+	offset ^= offset >> 33;
+	offset *= 0xff51afd7ed558ccdULL;
+	offset ^= offset >> 33;
+	return (offset);
+}
+
+reftab_t *
+reftab_create(void)
+{
+	reftab_t *rt;
+
+	rt = (reftab_t *)malloc(sizeof (reftab_t));
+	if (!rt)
+		return (NULL);
+	rt->nslots = REFTAB_INIT_SLOTS;
+	rt->count = 0;
+	rt->err = 0;
+	rt->ents = (dedupe_ref_t *)calloc(rt->nslots, sizeof (dedupe_ref_t));
+	if (!rt->ents) {
+		free(rt);
+		return (NULL);
+	}
+	pthread_mutex_init(&rt->lock, NULL);
+	return (rt);
+}
+
+/*
+ * Open addressed table. A zero reference count marks an empty slot.
+ */
+static dedupe_ref_t *
+reftab_slot(dedupe_ref_t *ents, uint64_t nslots, uint64_t offset)
+{
+	uint64_t s;
+
+	s = ref_hash(offset) & (nslots - 1);
+	while (ents[s].refcnt != 0 && ents[s].offset != offset)
+		s = (s + 1) & (nslots - 1);
+	return (&ents[s]);
+}
+
+static int
+reftab_grow(reftab_t *rt)
+{
+	dedupe_ref_t *ents, *e;
+	uint64_t i, nslots;
+
+	nslots = rt->nslots * 2;
+	ents = (dedupe_ref_t *)calloc(nslots, sizeof (dedupe_ref_t));
+	if (!ents)
+		return (-1);
+	for (i = 0; i < rt->nslots; i++) {
+		if (rt->ents[i].refcnt == 0)
+			continue;
+		e = reftab_slot(ents, nslots, rt->ents[i].offset);
+		*e = rt->ents[i];
+	}
+	free(rt->ents);
+	rt->ents = ents;
+	rt->nslots = nslots;
+	return (0);
+}
+
+/*
+ * Count one more reference to the block at the given stream offset. A failure
+ * is remembered so that reftab_write() can fail the compression later.
+ */
+int
+reftab_add(reftab_t *rt, uint64_t offset, uint32_t length)
+{
+	dedupe_ref_t *e;
+	int rv = 0;
+
+	pthread_mutex_lock(&rt->lock);
+	if (rt->count >= rt->nslots / 2 && reftab_grow(rt) == -1) {
+		log_msg(LOG_ERR, 0, "Out of memory recording dedupe references.\n");
+		rt->err = 1;
+		rv = -1;
+	} else {
+		e = reftab_slot(rt->ents, rt->nslots, offset);
+		if (e->refcnt == 0) {
+			e->offset = offset;
+			e->length = length;
+			rt->count++;
+		}
+		if (e->refcnt < UINT32_MAX)
+			e->refcnt++;
+	}
+	pthread_mutex_unlock(&rt->lock);
+	return (rv);
+}
+
+static int
+cmp_ref(const void *a, const void *b)
+{
+	const dedupe_ref_t *r1 = (const dedupe_ref_t *)a;
+	const dedupe_ref_t *r2 = (const dedupe_ref_t *)b;
+
+	if (r1->offset < r2->offset)
+		return (-1);
+	return (r1->offset > r2->offset);
+}
+
+/*
+ * Sort the references by offset and write the table out.
+ */
+int
+reftab_write(reftab_t *rt, int fd)
+{
+	uchar_t *buf, *pos;
+	uint64_t i, j, k, n;
+	uint32_t crc;
+
+	if (rt->err)
+		return (-1);
+
+	/*
+	 * Compact the used slots to the front.
+	 */
+	for (i = 0, j = 0; i < rt->nslots; i++) {
+		if (rt->ents[i].refcnt != 0)
+			rt->ents[j++] = rt->ents[i];
+	}
+	qsort(rt->ents, j, sizeof (dedupe_ref_t), cmp_ref);
+
+	buf = (uchar_t *)malloc(REFTAB_BATCH * REFTAB_ENTRY_SZ);
+	if (!buf) {
+		log_msg(LOG_ERR, 0, "Out of memory writing dedupe references.\n");
+		return (-1);
+	}
+	crc = 0;
+	for (i = 0; i < j; i += n) {
+		n = j - i;
+		if (n > REFTAB_BATCH)
+			n = REFTAB_BATCH;
+		pos = buf;
+		for (k = i; k < i + n; k++) {
+			U64_P(pos) = htonll(rt->ents[k].offset);
+			U32_P(pos + 8) = htonl(rt->ents[k].length);
+			U32_P(pos + 12) = htonl(rt->ents[k].refcnt);
+			pos += REFTAB_ENTRY_SZ;
+		}
+		crc = lzma_crc32(buf, n * REFTAB_ENTRY_SZ, crc);
+		if (Write(fd, buf, n * REFTAB_ENTRY_SZ) != n * REFTAB_ENTRY_SZ)
+			goto wr_err;
+	}
+
+	U64_P(buf) = htonll(j);
+	crc = lzma_crc32(buf, 8, crc);
+	U32_P(buf + 8) = htonl(crc);
+	memcpy(buf + 12, REFTAB_MAGIC, REFTAB_MAGIC_SZ);
+	if (Write(fd, buf, REFTAB_FOOTER_SZ) != REFTAB_FOOTER_SZ)
+		goto wr_err;
+	free(buf);
+	return (0);
+
+wr_err:
+	log_msg(LOG_ERR, 1, "Writing dedupe references: ");
+	free(buf);
+	return (-1);
+}
+
+void
+reftab_destroy(reftab_t *rt)
+{
+	if (!rt)
+		return;
+	free(rt->ents);
+	pthread_mutex_destroy(&rt->lock);
+	free(rt);
+}
+
+/*
+ * Locate and verify the reference table at the end of the given file. The fd
+ * is only used with pread() so the caller's file position is not disturbed.
+ */
+refcache_t *
+refcache_create(int fd, uint64_t max_mem, char *spill_path)
+{
+	refcache_t *rc;
+	struct stat sbuf;
+	uchar_t *buf;
+	uint64_t nent, pos, i, n;
+	uint32_t crc, crc1;
+
+	if (fstat(fd, &sbuf) == -1 || !S_ISREG(sbuf.st_mode) ||
+	    sbuf.st_size < REFTAB_FOOTER_SZ)
+		return (NULL);
+
+	buf = (uchar_t *)malloc(REFTAB_BATCH * REFTAB_ENTRY_SZ);
+	if (!buf)
+		return (NULL);
+	if (pread(fd, buf, REFTAB_FOOTER_SZ, sbuf.st_size - REFTAB_FOOTER_SZ) !=
+	    REFTAB_FOOTER_SZ || memcmp(buf + 12, REFTAB_MAGIC, REFTAB_MAGIC_SZ) != 0) {
+		free(buf);
+		return (NULL);
+	}
+	nent = ntohll(U64_P(buf));
+	if (nent > (sbuf.st_size - REFTAB_FOOTER_SZ) / REFTAB_ENTRY_SZ) {
+		free(buf);
+		return (NULL);
+	}
+	crc = ntohl(U32_P(buf + 8));
+
+	/*
+	 * Verify the whole table upfront since it is consumed incrementally later.
+	 */
+	pos = sbuf.st_size - REFTAB_FOOTER_SZ - nent * REFTAB_ENTRY_SZ;
+	rc = (refcache_t *)calloc(1, sizeof (refcache_t));
+	if (!rc) {
+		free(buf);
+		return (NULL);
+	}
+	rc->tab_pos = pos;
+	crc1 = 0;
+	for (i = 0; i < nent; i += n) {
+		n = nent - i;
+		if (n > REFTAB_BATCH)
+			n = REFTAB_BATCH;
+		if (pread(fd, buf, n * REFTAB_ENTRY_SZ, pos) != n * REFTAB_ENTRY_SZ)
+			goto cr_err;
+		crc1 = lzma_crc32(buf, n * REFTAB_ENTRY_SZ, crc1);
+		pos += n * REFTAB_ENTRY_SZ;
+	}
+	U64_P(buf) = htonll(nent);
+	if (lzma_crc32(buf, 8, crc1) != crc)
+		goto cr_err;
+
+	rc->fd = fd;
+	rc->nent = nent;
+	rc->batch = (dedupe_ref_t *)buf;
+	rc->hsz = REFCACHE_HSZ;
+	rc->htab = (refblk_t **)calloc(rc->hsz, sizeof (refblk_t *));
+	if (!rc->htab)
+		goto cr_err;
+	rc->max_mem = max_mem;
+	rc->spill_fd = -1;
+	strncpy(rc->spill_path, spill_path, sizeof (rc->spill_path) - 1);
+	pthread_mutex_init(&rc->lock, NULL);
+	return (rc);
+
+cr_err:
+	free(rc);
+	free(buf);
+	return (NULL);
+}
+
+static int
+refcache_grow(refcache_t *rc)
+{
+	refblk_t **htab, *blk, *nxt;
+	uint64_t i, hsz, h;
+
+	hsz = rc->hsz * 2;
+	htab = (refblk_t **)calloc(hsz, sizeof (refblk_t *));
+	if (!htab)
+		return (-1);
+	for (i = 0; i < rc->hsz; i++) {
+		for (blk = rc->htab[i]; blk; blk = nxt) {
+			nxt = blk->next;
+			h = ref_hash(blk->offset) & (hsz - 1);
+			blk->next = htab[h];
+			htab[h] = blk;
+		}
+	}
+	free(rc->htab);
+	rc->htab = htab;
+	rc->hsz = hsz;
+	return (0);
+}
+
+/*
+ * Set up the next block from the table for capture. Table entries are decoded
+ * in place in the batch buffer.
+ */
+static int
+refcache_next(refcache_t *rc)
+{
+	dedupe_ref_t *e;
+	refblk_t *blk;
+	uchar_t *pos;
+	uint64_t h;
+	uint32_t i;
+
+	if (rc->bpos == rc->blen) {
+		if (rc->nread == rc->nent)
+			return (0);
+		rc->blen = REFTAB_BATCH;
+		if (rc->blen > rc->nent - rc->nread)
+			rc->blen = rc->nent - rc->nread;
+		if (pread(rc->fd, rc->batch, rc->blen * REFTAB_ENTRY_SZ, rc->tab_pos) !=
+		    rc->blen * REFTAB_ENTRY_SZ) {
+			log_msg(LOG_ERR, 1, "Reading dedupe references: ");
+			return (-1);
+		}
+		rc->tab_pos += rc->blen * REFTAB_ENTRY_SZ;
+		rc->nread += rc->blen;
+		pos = (uchar_t *)rc->batch;
+		for (i = 0; i < rc->blen; i++) {
+			uint64_t off = ntohll(U64_P(pos));
+			uint32_t len = ntohl(U32_P(pos + 8));
+			uint32_t cnt = ntohl(U32_P(pos + 12));
+
+			rc->batch[i].offset = off;
+			rc->batch[i].length = len;
+			rc->batch[i].refcnt = cnt;
+			pos += REFTAB_ENTRY_SZ;
+		}
+		rc->bpos = 0;
+	}
+	e = &rc->batch[rc->bpos++];
+	if (e->offset < rc->last_end || e->length == 0 || e->refcnt == 0) {
+		log_msg(LOG_ERR, 0, "Invalid dedupe reference table.\n");
+		return (-1);
+	}
+
+	if (rc->hcount >= rc->hsz * 2 && refcache_grow(rc) == -1)
+		goto nomem;
+	blk = (refblk_t *)malloc(sizeof (refblk_t));
+	if (!blk)
+		goto nomem;
+	blk->offset = e->offset;
+	blk->length = e->length;
+	blk->refcnt = e->refcnt;
+	blk->data = NULL;
+	blk->spill_pos = 0;
+	if (rc->mem + e->length <= rc->max_mem) {
+		blk->data = (uchar_t *)malloc(e->length);
+		if (blk->data)
+			rc->mem += e->length;
+	}
+	if (!blk->data) {
+		if (rc->spill_fd == -1) {
+			rc->spill_fd = open(rc->spill_path, O_RDWR|O_CREAT|O_TRUNC,
+			    S_IRUSR|S_IWUSR);
+			if (rc->spill_fd == -1) {
+				log_msg(LOG_ERR, 1, "Cannot open dedupe scratch file: ");
+				free(blk);
+				return (-1);
+			}
+		}
+		blk->spill_pos = rc->spill_end;
+		rc->spill_end += e->length;
+	}
+	h = ref_hash(blk->offset) & (rc->hsz - 1);
+	blk->next = rc->htab[h];
+	rc->htab[h] = blk;
+	rc->hcount++;
+	rc->cur = blk;
+	rc->cur_fill = 0;
+	return (1);
+
+nomem:
+	log_msg(LOG_ERR, 0, "Out of memory caching dedupe references.\n");
+	return (-1);
+}
+
+/*
+ * Pass the next piece of the decompressed data stream through the cache.
+ * Referenced blocks in it are copied into memory or the scratch file.
+ */
+int
+refcache_feed(refcache_t *rc, uchar_t *data, uint64_t len)
+{
+	uint64_t end, start, n;
+	refblk_t *blk;
+	int rv = 0;
+
+	pthread_mutex_lock(&rc->lock);
+	end = rc->pos + len;
+	while (1) {
+		if (!rc->cur) {
+			rv = refcache_next(rc);
+			if (rv <= 0)
+				break;
+			rv = 0;
+		}
+		blk = rc->cur;
+		start = blk->offset + rc->cur_fill;
+		if (start >= end)
+			break;
+		n = blk->length - rc->cur_fill;
+		if (n > end - start)
+			n = end - start;
+		if (blk->data) {
+			memcpy(blk->data + rc->cur_fill, data + (start - rc->pos), n);
+		} else if (pwrite(rc->spill_fd, data + (start - rc->pos), n,
+		    blk->spill_pos + rc->cur_fill) != n) {
+			log_msg(LOG_ERR, 1, "Writing dedupe scratch file: ");
+			rv = -1;
+			break;
+		}
+		rc->cur_fill += n;
+		if (rc->cur_fill < blk->length)
+			break;
+		rc->cur = NULL;
+		rc->last_end = blk->offset + blk->length;
+	}
+	rc->pos = end;
+	pthread_mutex_unlock(&rc->lock);
+	return (rv);
+}
+
+/*
+ * Copy out a referenced block and drop it once all its references are done.
+ */
+int
+refcache_get(refcache_t *rc, uint64_t offset, uint32_t length, uchar_t *dst)
+{
+	refblk_t *blk, **pp;
+	int rv = 0;
+
+	pthread_mutex_lock(&rc->lock);
+	pp = &rc->htab[ref_hash(offset) & (rc->hsz - 1)];
+	while (*pp && (*pp)->offset != offset)
+		pp = &((*pp)->next);
+	blk = *pp;
+	if (!blk || blk->length != length || (blk == rc->cur && rc->cur_fill < length)) {
+		log_msg(LOG_ERR, 0, "Dedupe reference at %" PRIu64 " not found.\n", offset);
+		pthread_mutex_unlock(&rc->lock);
+		return (-1);
+	}
+
+	if (blk->data) {
+		memcpy(dst, blk->data, length);
+	} else if (pread(rc->spill_fd, dst, length, blk->spill_pos) != length) {
+		log_msg(LOG_ERR, 1, "Reading dedupe scratch file: ");
+		rv = -1;
+	}
+
+	if (--blk->refcnt == 0) {
+		*pp = blk->next;
+		rc->hcount--;
+		if (blk->data) {
+			free(blk->data);
+			rc->mem -= length;
+		}
+		free(blk);
+	}
+	pthread_mutex_unlock(&rc->lock);
+	return (rv);
+}
+
+void
+refcache_destroy(refcache_t *rc)
+{
+	refblk_t *blk, *nxt;
+	uint64_t i;
+
+	if (!rc)
+		return;
+	for (i = 0; i < rc->hsz; i++) {
+		for (blk = rc->htab[i]; blk; blk = nxt) {
+			nxt = blk->next;
+			free(blk->data);
+			free(blk);
+		}
+	}
+	if (rc->spill_fd != -1) {
+		close(rc->spill_fd);
+		unlink(rc->spill_path);
+	}
+	free(rc->htab);
+	free(rc->batch);
+	pthread_mutex_destroy(&rc->lock);
+	free(rc);
+}
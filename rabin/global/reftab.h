@@ -0,0 +1,114 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_REFTAB_H
+#define	_REFTAB_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <utils.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Table of blocks referenced across chunks by Global Dedupe in archive mode.
+ * It is appended to the compressed file after the zero length trailer so that
+ * extraction can keep just the referenced blocks, for just as long as they are
+ * needed, rather than the whole uncompressed stream.
+ *
+ * Layout:
+ * N entries of: 8 Bytes stream offset, 4 Bytes block length, 4 Bytes reference count
+ * 8 Bytes - Number of entries N
+ * 4 Bytes - CRC32 of the entries and the count
+ * 8 Bytes - Magic string
+ */
+#define	REFTAB_MAGIC		"PZREFTAB"
+#define	REFTAB_MAGIC_SZ		8
+#define	REFTAB_ENTRY_SZ		16
+#define	REFTAB_FOOTER_SZ	(8 + 4 + REFTAB_MAGIC_SZ)
+
+typedef struct {
+	uint64_t offset;
+	uint32_t length;
+	uint32_t refcnt;
+} dedupe_ref_t;
+
+/*
+ * Reference recording during compression.
+ */
+typedef struct reftab {
+	dedupe_ref_t *ents;
+	uint64_t nslots, count;
+	int err; // Set if a reference could not be recorded
+	pthread_mutex_t lock;
+} reftab_t;
+
+/*
+ * Bounded cache of referenced blocks during extraction.
+ */
+typedef struct refblk {
+	uint64_t offset;
+	uint32_t length;
+	uint32_t refcnt;
+	uchar_t *data; // NULL if the block is in the scratch file
+	uint64_t spill_pos;
+	struct refblk *next;
+} refblk_t;
+
+typedef struct refcache {
+	int fd;
+	uint64_t tab_pos, nent, nread;
+	dedupe_ref_t *batch;
+	uint32_t bpos, blen;
+	refblk_t *cur;
+	uint32_t cur_fill;
+	uint64_t pos, last_end;
+	refblk_t **htab;
+	uint64_t hsz, hcount;
+	uint64_t mem, max_mem;
+	int spill_fd;
+	uint64_t spill_end;
+	char spill_path[MAXPATHLEN];
+	pthread_mutex_t lock;
+} refcache_t;
+
+reftab_t *reftab_create(void);
+int reftab_add(reftab_t *rt, uint64_t offset, uint32_t length);
+int reftab_write(reftab_t *rt, int fd);
+void reftab_destroy(reftab_t *rt);
+
+refcache_t *refcache_create(int fd, uint64_t max_mem, char *spill_path);
+int refcache_feed(refcache_t *rc, uchar_t *data, uint64_t len);
+int refcache_get(refcache_t *rc, uint64_t offset, uint32_t length, uchar_t *dst);
+void refcache_destroy(refcache_t *rc);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -70,6 +70,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <allocator.h>
 #include <utils.h>
 #include <pthread.h>
@@ -98,6 +99,11 @@
 #define	DELTA_EXTRA_PCT(x) (((x) >> 1) + ((x) >> 3))
 #define	DELTA_NORMAL_PCT(x) (((x) >> 1) + ((x) >> 2) + ((x) >> 3))
 
+/*
+ * Number of blocks passed in one call to the multi-buffer block hashing routine.
+ */
+#define	GLOBAL_CKSUM_BATCH	64
+
 extern int lzma_init(void **data, int *level, int nthreads, int64_t chunksize,
 		     int file_version, compress_op_t op);
 extern int lzma_compress(void *src, uint64_t srclen, void *dst,
@@ -105,11 +111,17 @@ extern int lzma_compress(void *src, uint64_t srclen, void *dst,
 extern int lzma_decompress(void *src, uint64_t srclen, void *dst,
 	uint64_t *dstlen, int level, uchar_t chdr, void *data);
 extern int lzma_deinit(void **data);
+extern uint64_t lzma_state_mem(int level, uint64_t chunksize);
 extern int bsdiff(u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t newsize,
        u_char *diff, u_char *scratch, bsize_t scratchsize);
 extern bsize_t get_bsdiff_sz(u_char *pbuf);
 extern int bspatch(u_char *pbuf, u_char *oldbuf, bsize_t oldsize, u_char *newbuf,
 	bsize_t *_newsize);
+extern bsize_t hdiff(u_char *oldbuf, bsize_t oldsize, u_char *newbuf, bsize_t newsize,
+	u_char *diff);
+extern bsize_t get_hdiff_sz(u_char *pbuf);
+extern int hpatch(u_char *pbuf, u_char *oldbuf, bsize_t oldsize, u_char *newbuf,
+	bsize_t *_newsize);
 
 static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
 uint64_t ir[256], out[256];
@@ -134,6 +146,25 @@ dedupe_buf_extra(uint64_t chunksize, int rab_blk_sz, const char *algo, int delta
 	return ((chunksize / dedupe_min_blksz(rab_blk_sz)) * sizeof (uint32_t));
 }
 
+/*
+ * Approximate memory held by a dedupe context for its block list. When
+ * compressing this includes the LZMA encoder used for the dedupe index.
+ */
+uint64_t
+dedupe_ctx_mem(uint64_t chunksize, int rab_blk_sz, compress_op_t op)
+{
+	uint64_t mem;
+
+	if (rab_blk_sz < 0 || rab_blk_sz > 5)
+		rab_blk_sz = RAB_BLK_DEFAULT;
+
+	mem = (chunksize / dedupe_min_blksz(rab_blk_sz) + 1) *
+	    (sizeof (rabin_blockentry_t *) + sizeof (rabin_blockentry_t));
+	if (op == COMPRESS)
+		mem += lzma_state_mem(14, chunksize);
+	return (mem);
+}
+
 /*
  * Helper function to let caller size the the user specific compression chunk/segment
  * to align with deduplication requirements.
@@ -172,11 +203,8 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 	if (rab_blk_sz < 0 || rab_blk_sz > 5)
 		rab_blk_sz = RAB_BLK_DEFAULT;
 
-	if (dedupe_flag == RABIN_DEDUPE_FIXED || dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL) {
+	if (dedupe_flag == RABIN_DEDUPE_FIXED || dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL)
 		delta_flag = 0;
-		if (dedupe_flag != RABIN_DEDUPE_FILE_GLOBAL)
-			inited = 1;
-	}
 
 	/*
 	 * Pre-compute a table of irreducible polynomial evaluations for each
@@ -206,47 +234,50 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 			}
 			ir[j] = val;
 		}
+		inited = 1;
+	}
 
-		/*
-		 * If Global Deduplication is enabled initialize the in-memory index.
-		 * It is essentially a hashtable that is used for crypto-hash based
-		 * chunk matching.
-		 */
-		if (dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL && op == COMPRESS && rab_blk_sz >= 0) {
-			int pct_interval, chunk_cksum, cksum_bytes, mac_bytes;
-			char *ck;
-
-			pct_interval = 0;
-			if (pipe_mode)
-				pct_interval = DEFAULT_PCT_INTERVAL;
-
-			chunk_cksum = 0;
-			if ((ck = getenv("PCOMPRESS_CHUNK_HASH_GLOBAL")) != NULL) {
-				if (get_checksum_props(ck, &chunk_cksum, &cksum_bytes, &mac_bytes, 1) != 0 ||
-				    strcmp(ck, "CRC64") == 0) {
-					log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_CHUNK_HASH_GLOBAL.\n");
-					chunk_cksum = DEFAULT_CHUNK_CKSUM;
-					pthread_mutex_unlock(&init_lock);
-					return (NULL);
-				}
-			}
-			if (chunk_cksum == 0) {
+	/*
+	 * If Global Deduplication is enabled initialize the in-memory index.
+	 * It is essentially a hashtable that is used for crypto-hash based
+	 * chunk matching. The index is shared by all the contexts of one
+	 * operation and released when they are destroyed, so that a later
+	 * operation in the same process gets a fresh one.
+	 */
+	if (dedupe_flag == RABIN_DEDUPE_FILE_GLOBAL && op == COMPRESS && rab_blk_sz >= 0 &&
+	    arc == NULL) {
+		int pct_interval, chunk_cksum, cksum_bytes, mac_bytes;
+		char *ck;
+
+		pct_interval = 0;
+		if (pipe_mode)
+			pct_interval = DEFAULT_PCT_INTERVAL;
+
+		chunk_cksum = 0;
+		if ((ck = getenv("PCOMPRESS_CHUNK_HASH_GLOBAL")) != NULL) {
+			if (get_checksum_props(ck, &chunk_cksum, &cksum_bytes, &mac_bytes, 1) != 0 ||
+			    strcmp(ck, "CRC64") == 0) {
+				log_msg(LOG_ERR, 0, "Invalid PCOMPRESS_CHUNK_HASH_GLOBAL.\n");
 				chunk_cksum = DEFAULT_CHUNK_CKSUM;
-				if (get_checksum_props(NULL, &chunk_cksum, &cksum_bytes, &mac_bytes, 0) != 0) {
-					log_msg(LOG_ERR, 0, "Invalid default chunk checksum: %d\n", DEFAULT_CHUNK_CKSUM);
-					pthread_mutex_unlock(&init_lock);
-					return (NULL);
-				}
+				pthread_mutex_unlock(&init_lock);
+				return (NULL);
 			}
-			arc = init_global_db_s(NULL, tmppath, rab_blk_sz, chunksize, pct_interval,
-					      algo, chunk_cksum, GLOBAL_SIM_CKSUM, file_size,
-					      freeram, nthreads);
-			if (arc == NULL) {
+		}
+		if (chunk_cksum == 0) {
+			chunk_cksum = DEFAULT_CHUNK_CKSUM;
+			if (get_checksum_props(NULL, &chunk_cksum, &cksum_bytes, &mac_bytes, 0) != 0) {
+				log_msg(LOG_ERR, 0, "Invalid default chunk checksum: %d\n", DEFAULT_CHUNK_CKSUM);
 				pthread_mutex_unlock(&init_lock);
 				return (NULL);
 			}
 		}
-		inited = 1;
+		arc = init_global_db_s(NULL, tmppath, rab_blk_sz, chunksize, pct_interval,
+				      algo, chunk_cksum, GLOBAL_SIM_CKSUM, file_size,
+				      freeram, nthreads);
+		if (arc == NULL) {
+			pthread_mutex_unlock(&init_lock);
+			return (NULL);
+		}
 	}
 	pthread_mutex_unlock(&init_lock);
 
@@ -262,6 +293,10 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 		if (chunksize < RAB_MIN_CHUNK_SIZE_GLOBAL) {
 			log_msg(LOG_ERR, 0, "Minimum chunk size for Global Dedup must be %" PRIu64 " bytes\n",
 			RAB_MIN_CHUNK_SIZE_GLOBAL);
+			pthread_mutex_lock(&init_lock);
+			destroy_global_db_s(arc);
+			arc = NULL;
+			pthread_mutex_unlock(&init_lock);
 			return (NULL);
 		}
 	} else {
@@ -288,10 +323,13 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 	ctx->rabin_avg_block_mask = RAB_BLK_MASK;
 	ctx->rabin_poly_min_block_size = dedupe_min_blksz(rab_blk_sz);
 	ctx->delta_flag = 0;
+	ctx->delta_enc = DELTA_ENC_BSDIFF;
 	ctx->deltac_min_distance = props->deltac_min_distance;
 	ctx->pagesize = sysconf(_SC_PAGE_SIZE);
 	ctx->similarity_cksums = NULL;
 	ctx->show_chunks = 0;
+	ctx->data_cksum = NULL;
+	ctx->data_cksum_done = 0;
 	if (arc) {
 		arc->pagesize = ctx->pagesize;
 		if (rab_blk_sz < 3)
@@ -333,12 +371,30 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 	ctx->current_window_data = (uchar_t *)1;
 #endif
 	ctx->blocks = NULL;
+	ctx->block_pool = NULL;
+	ctx->reftab = NULL;
+	ctx->refcache = NULL;
+	ctx->out_pread = NULL;
+	ctx->out_cookie = NULL;
 	if (real_chunksize > 0 && dedupe_flag != RABIN_DEDUPE_FILE_GLOBAL) {
-		ctx->blocks = (rabin_blockentry_t **)slab_calloc(NULL,
-			ctx->blknum, sizeof (rabin_blockentry_t *));
+		ctx->blocks = (rabin_blockentry_t **)slab_alloc(NULL,
+			ctx->blknum * sizeof (rabin_blockentry_t *));
+
+		/*
+		 * Block entries are carved out of one per-context pool rather
+		 * than allocated one by one. They are reused for every chunk
+		 * handled by this context.
+		 */
+		ctx->block_pool = (rabin_blockentry_t *)slab_alloc(NULL,
+			ctx->blknum * sizeof (rabin_blockentry_t));
+		if (ctx->blocks && ctx->block_pool) {
+			for (i = 0; i < ctx->blknum; i++)
+				ctx->blocks[i] = &(ctx->block_pool[i]);
+		}
 	}
 	if(ctx == NULL || ctx->current_window_data == NULL ||
-	    (ctx->blocks == NULL && real_chunksize > 0 && dedupe_flag != RABIN_DEDUPE_FILE_GLOBAL)) {
+	    ((ctx->blocks == NULL || ctx->block_pool == NULL) && real_chunksize > 0 &&
+	    dedupe_flag != RABIN_DEDUPE_FILE_GLOBAL)) {
 		log_msg(LOG_ERR, 0,
 		    "Could not allocate rabin polynomial context, out of memory\n");
 		destroy_dedupe_context(ctx);
@@ -371,7 +427,6 @@ create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, int rab_blk_s
 		}
 	}
 
-	slab_cache_add(sizeof (rabin_blockentry_t));
 	ctx->real_chunksize = real_chunksize;
 	reset_dedupe_context(ctx);
 	return (ctx);
@@ -390,7 +445,6 @@ void
 destroy_dedupe_context(dedupe_context_t *ctx)
 {
 	if (ctx) {
-		uint32_t i;
 #ifndef SSE_MODE
 		if (ctx->current_window_data) slab_free(NULL, ctx->current_window_data);
 #endif
@@ -402,12 +456,8 @@ destroy_dedupe_context(dedupe_context_t *ctx)
 		arc = NULL;
 		pthread_mutex_unlock(&init_lock);
 
-		if (ctx->blocks) {
-			for (i=0; i<ctx->blknum && ctx->blocks[i] != NULL; i++) {
-				slab_free(NULL, ctx->blocks[i]);
-			}
-			slab_free(NULL, ctx->blocks);
-		}
+		if (ctx->blocks) slab_free(NULL, ctx->blocks);
+		if (ctx->block_pool) slab_free(NULL, ctx->block_pool);
 		if (ctx->similarity_cksums) slab_free(NULL, ctx->similarity_cksums);
 		if (ctx->lzma_data) lzma_deinit(&(ctx->lzma_data));
 		slab_free(NULL, ctx);
@@ -496,6 +546,7 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 	blknum = 0;
 	window_pos = 0;
 	ctx->valid = 0;
+	ctx->data_cksum_done = 0;
 	cur_roll_checksum = 0;
 	if (*size < ctx->rabin_poly_avg_block_size) {
 		/*
@@ -524,10 +575,6 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 			if (i == blknum-1) {
 				length = j;
 			}
-			if (ctx->blocks[i] == 0) {
-				ctx->blocks[i] = (rabin_blockentry_t *)slab_alloc(NULL,
-				    sizeof (rabin_blockentry_t));
-			}
 			ctx->blocks[i]->offset = last_offset;
 			ctx->blocks[i]->index = i; // Need to store for sorting
 			ctx->blocks[i]->length = length;
@@ -666,9 +713,6 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 		    length >= ctx->rabin_poly_max_block_size) {
 
 			if (!(ctx->arc)) {
-				if (ctx->blocks[blknum] == 0)
-					ctx->blocks[blknum] = (rabin_blockentry_t *)slab_alloc(NULL,
-					    sizeof (rabin_blockentry_t));
 				ctx->blocks[blknum]->offset = last_offset;
 				ctx->blocks[blknum]->index = blknum; // Need to store for sorting
 				ctx->blocks[blknum]->length = length;
@@ -717,9 +761,6 @@ dedupe_compress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size, uint64_t of
 	if (last_offset < *size) {
 		length = *size - last_offset;
 		if (!(ctx->arc)) {
-			if (ctx->blocks[blknum] == 0)
-				ctx->blocks[blknum] = (rabin_blockentry_t *)slab_alloc(NULL,
-					sizeof (rabin_blockentry_t));
 			ctx->blocks[blknum]->offset = last_offset;
 			ctx->blocks[blknum]->index = blknum;
 			ctx->blocks[blknum]->length = length;
@@ -786,14 +827,26 @@ process_blocks:
 
 			/*
 			 * First compute all the rabin chunk/block cryptographic hashes.
+			 * Blocks are handed over in batches to the multi-buffer hashing
+			 * routine which hashes several of them together in SIMD lanes.
 			 */
 #if defined(_OPENMP)
 #	pragma omp parallel for
 #endif
-			for (i=0; i<blknum; i++) {
-				compute_checksum(ctx->g_blocks[i].cksum,
-					ctx->arc->chunk_cksum_type, buf1+ctx->g_blocks[i].offset,
-					ctx->g_blocks[i].length, 0, 0);
+			for (i=0; i<blknum; i+=GLOBAL_CKSUM_BATCH) {
+				uchar_t *cks[GLOBAL_CKSUM_BATCH], *bufs[GLOBAL_CKSUM_BATCH];
+				uint64_t lens[GLOBAL_CKSUM_BATCH];
+				uint32_t k, n;
+
+				n = blknum - i;
+				if (n > GLOBAL_CKSUM_BATCH)
+					n = GLOBAL_CKSUM_BATCH;
+				for (k=0; k<n; k++) {
+					cks[k] = ctx->g_blocks[i+k].cksum;
+					bufs[k] = buf1+ctx->g_blocks[i+k].offset;
+					lens[k] = ctx->g_blocks[i+k].length;
+				}
+				compute_checksum_mb(cks, ctx->arc->chunk_cksum_type, bufs, lens, n);
 			}
 
 			/*
@@ -869,6 +922,8 @@ process_blocks:
 						g_dedupe_idx += (RABIN_ENTRY_SIZE * 2);
 						matchlen += he->item_size;
 						dedupe_index_sz += 3;
+						if (ctx->reftab && he->item_offset < ctx->file_offset)
+							reftab_add(ctx->reftab, he->item_offset, he->item_size);
 					}
 				}
 
@@ -1223,6 +1278,9 @@ next_ent:
 						g_dedupe_idx += (RABIN_ENTRY_SIZE * 2);
 						matchlen += (ctx->g_blocks[i].length & RABIN_INDEX_VALUE);
 						dedupe_index_sz += 3;
+						if (ctx->reftab && ctx->g_blocks[i].offset < ctx->file_offset)
+							reftab_add(ctx->reftab, ctx->g_blocks[i].offset,
+							    ctx->g_blocks[i].length & RABIN_INDEX_VALUE);
 					}
 				}
 
@@ -1288,8 +1346,28 @@ next_ent:
 		/*
 		 * Compute hash signature for each block. We do this in a separate loop to 
 		 * have a fast linear scan through the buffer.
+		 * If requested the chunk digest is also updated with each block right
+		 * after hashing it, while the block is still in cache. This needs the
+		 * blocks to be visited in order so it is only done for a serial scan.
 		 */
-		if (ctx->delta_flag) {
+		if (ctx->data_cksum && !mt) {
+			uint64_t tot = 0;
+
+			cksum_reinit(ctx->data_cksum);
+			for (i=0; i<blknum; i++) {
+				uchar_t *blk = buf1+ctx->blocks[i]->offset;
+
+				ctx->blocks[i]->hash = XXH32(blk, ctx->blocks[i]->length, 0);
+				if (!ctx->delta_flag)
+					ctx->blocks[i]->similarity_hash = ctx->blocks[i]->hash;
+				if (ctx->blocks[i]->offset == tot) {
+					cksum_update(ctx->data_cksum, blk, ctx->blocks[i]->length);
+					tot += ctx->blocks[i]->length;
+				}
+			}
+			ctx->data_cksum_done = (tot == *size);
+
+		} else if (ctx->delta_flag) {
 #if defined(_OPENMP)
 #	pragma omp parallel for if (mt)
 #endif
@@ -1469,14 +1547,20 @@ next_ent:
 					uchar_t *oldbuf, *newbuf;
 					int32_t bsz;
 					/*
-					 * Perform bsdiff.
+					 * Perform bsdiff or the faster hash based delta.
 					 */
 					oldbuf = buf1 + be->other->offset;
 					newbuf = buf1 + be->offset;
 					DEBUG_STAT_EN(++delta_calls);
 
-					bsz = bsdiff(oldbuf, be->other->length, newbuf, be->length,
-					    ctx->cbuf + pos1, buf1 + *size, matchlen);
+					if (ctx->delta_enc == DELTA_ENC_HDIFF) {
+						bsz = hdiff(oldbuf, be->other->length, newbuf,
+						    be->length, ctx->cbuf + pos1);
+					} else {
+						bsz = bsdiff(oldbuf, be->other->length, newbuf,
+						    be->length, ctx->cbuf + pos1, buf1 + *size,
+						    matchlen);
+					}
 					if (bsz == 0) {
 						DEBUG_STAT_EN(++delta_fails);
 						memcpy(ctx->cbuf + pos1, newbuf, be->length);
@@ -1565,6 +1649,14 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 	sz = 0;
 	ctx->valid = 1;
 
+	/*
+	 * If requested the chunk digest is updated with each recovered block right
+	 * after it is copied or patched into place, while it is still in cache.
+	 */
+	ctx->data_cksum_done = 0;
+	if (ctx->data_cksum)
+		cksum_reinit(ctx->data_cksum);
+
 	/*
 	 * Handling for Global Deduplication.
 	 */
@@ -1595,6 +1687,8 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 			}
 			if (flag == 0) {
 				memcpy(pos2, src1, len);
+				if (ctx->data_cksum)
+					cksum_update(ctx->data_cksum, pos2, len);
 				pos2 += len;
 				src1 += len;
 				sz += len;
@@ -1615,11 +1709,37 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 				 * 
 				 * However this approach precludes pipe-mode streamed decompression since
 				 * it requires random access to the output file.
+				 *
+				 * Archives that carry a reference table are extracted with a reference
+				 * cache instead. It holds just the referenced blocks till their last use.
+				 * Output that goes to a memory buffer is read back through out_pread.
 				 */
 				if (pos1 >= offset) {
 					src2 = ctx->cbuf + (pos1 - offset);
 					memcpy(pos2, src2, len);
+				} else if (ctx->refcache) {
+					if (refcache_get(ctx->refcache, pos1, len, pos2) == -1) {
+						ctx->valid = 0;
+						break;
+					}
+				} else if (ctx->out_pread) {
+					if (ctx->out_pread(ctx->out_cookie, pos2, len, pos1) != len) {
+						log_msg(LOG_ERR, 0, "Invalid dedupe reference.");
+						ctx->valid = 0;
+						break;
+					}
 				} else {
+					struct stat sbuf;
+
+					/*
+					 * A corrupt index or a failed earlier chunk can lead past
+					 * the data written so far. Mapping that would fault.
+					 */
+					if (fstat(ctx->out_fd, &sbuf) == -1 || pos1 + len > sbuf.st_size) {
+						log_msg(LOG_ERR, 0, "Invalid dedupe reference.");
+						ctx->valid = 0;
+						break;
+					}
 					adj = pos1 % ctx->pagesize;
 					src2 = mmap(NULL, len + adj, PROT_READ, MAP_SHARED, ctx->out_fd, pos1 - adj);
 					if (src2 == NULL) {
@@ -1630,10 +1750,14 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 					memcpy(pos2, src2 + adj, len);
 					munmap(src2, len + adj);
 				}
+				if (ctx->data_cksum)
+					cksum_update(ctx->data_cksum, pos2, len);
 				pos2 += len;
 				sz += len;
 			}
 		}
+		if (ctx->data_cksum && ctx->valid && sz == data_sz)
+			ctx->data_cksum_done = 1;
 		*size = data_sz;
 		return;
 	}
@@ -1643,10 +1767,7 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 	 * First pass re-create the rabin block array from the index metadata.
 	 * Second pass copy over blocks to the target buffer to re-create the original segment.
 	 */
-	slab_cache_add(sizeof (rabin_blockentry_t));
 	for (blk = 0; blk < blknum; blk++) {
-		if (ctx->blocks[blk] == 0)
-			ctx->blocks[blk] = (rabin_blockentry_t *)slab_alloc(NULL, sizeof (rabin_blockentry_t));
 		len = ntohl(dedupe_index[blk]);
 		ctx->blocks[blk]->hash = 0;
 		if (len == 0) {
@@ -1663,7 +1784,10 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 			if (len & GET_SIMILARITY_FLAG) {
 				ctx->blocks[blk]->offset = pos1;
 				ctx->blocks[blk]->index = (len & RABIN_INDEX_VALUE) | SET_SIMILARITY_FLAG;
-				blen = get_bsdiff_sz(buf + pos1);
+				if (ctx->delta_enc == DELTA_ENC_HDIFF)
+					blen = get_hdiff_sz(buf + pos1);
+				else
+					blen = get_bsdiff_sz(buf + pos1);
 				pos1 += blen;
 			} else {
 				ctx->blocks[blk]->index = len & RABIN_INDEX_VALUE;
@@ -1687,12 +1811,19 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 				len = ctx->blocks[oblk]->length;
 				pos1 = ctx->blocks[oblk]->offset;
 				newsz = data_sz - sz;
-				rv = bspatch(buf + ctx->blocks[blk]->offset, buf + pos1, len, pos2, &newsz);
+				if (ctx->delta_enc == DELTA_ENC_HDIFF)
+					rv = hpatch(buf + ctx->blocks[blk]->offset, buf + pos1,
+					    len, pos2, &newsz);
+				else
+					rv = bspatch(buf + ctx->blocks[blk]->offset, buf + pos1,
+					    len, pos2, &newsz);
 				if (rv == 0) {
-					log_msg(LOG_ERR, 0, "Failed to bspatch block.\n");
+					log_msg(LOG_ERR, 0, "Failed to patch block.\n");
 					ctx->valid = 0;
 					break;
 				}
+				if (ctx->data_cksum)
+					cksum_update(ctx->data_cksum, pos2, newsz);
 				pos2 += newsz;
 				sz += newsz;
 				if (sz > data_sz) {
@@ -1707,6 +1838,8 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 			}
 		}
 		memcpy(pos2, buf + pos1, len);
+		if (ctx->data_cksum)
+			cksum_update(ctx->data_cksum, pos2, len);
 		pos2 += len;
 		sz += len;
 		if (sz > data_sz) {
@@ -1719,5 +1852,7 @@ dedupe_decompress(dedupe_context_t *ctx, uchar_t *buf, uint64_t *size)
 		log_msg(LOG_ERR, 0, "Too little dedup data processed.\n");
 		ctx->valid = 0;
 	}
+	if (ctx->data_cksum && ctx->valid)
+		ctx->data_cksum_done = 1;
 	*size = data_sz;
 }
@@ -65,6 +65,7 @@
 
 #include <utils.h>
 #include <index.h>
+#include <reftab.h>
 #include <crypto_utils.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -148,6 +149,14 @@
 #define	DELTA_NORMAL	1
 #define	DELTA_EXTRA	2
 
+/*
+ * Encoders for Delta Compression of similar blocks.
+ * DELTA_ENC_BSDIFF = Suffix array based bsdiff. Slower, smaller patches.
+ * DELTA_ENC_HDIFF  = Hash indexed copy/insert encoder. Much faster.
+ */
+#define	DELTA_ENC_BSDIFF	0
+#define	DELTA_ENC_HDIFF		1
+
 /*
  * Irreducible polynomial for Rabin modulus. This value is from the
  * Low Bandwidth Filesystem.
@@ -168,6 +177,7 @@ typedef struct rab_blockentry {
 typedef struct {
 	unsigned char *current_window_data;
 	rabin_blockentry_t **blocks;
+	rabin_blockentry_t *block_pool;
 	global_blockentry_t *g_blocks;
 	uint32_t blknum;
 	unsigned char *cbuf;
@@ -180,6 +190,7 @@ typedef struct {
 	short valid;
 	void *lzma_data;
 	int level, delta_flag, dedupe_flag, deltac_min_distance;
+	int delta_enc;
 	uint64_t file_offset; // For global dedupe
 	archive_config_t *arc;
 	Sem_t *index_sem;
@@ -187,8 +198,14 @@ typedef struct {
 	uchar_t *similarity_cksums;
 	uint32_t pagesize;
 	int out_fd;
+	int64_t (*out_pread)(void *cookie, void *buf, uint64_t len, uint64_t off); // Reads back output that is not in out_fd
+	void *out_cookie;
+	reftab_t *reftab; // Records cross-chunk references when compressing archives
+	refcache_t *refcache; // Serves cross-chunk references when extracting archives
 	int id;
 	int show_chunks; // Debug display of chunks (offset, length)
+	cksum_ctx_t *data_cksum; // If set, chunk digest is fed while scanning blocks
+	int data_cksum_done;
 } dedupe_context_t;
 
 extern dedupe_context_t *create_dedupe_context(uint64_t chunksize, uint64_t real_chunksize, 
@@ -207,6 +224,7 @@ extern void update_dedupe_hdr(uchar_t *buf, uint64_t dedupe_index_sz_cmp,
 extern void reset_dedupe_context(dedupe_context_t *ctx);
 extern uint32_t dedupe_buf_extra(uint64_t chunksize, int rab_blk_sz, const char *algo,
 	int delta_flag);
+extern uint64_t dedupe_ctx_mem(uint64_t chunksize, int rab_blk_sz, compress_op_t op);
 extern int global_dedupe_bufadjust(uint32_t rab_blk_sz, uint64_t *user_chunk_sz, int pct_interval,
 		 const char *algo, cksum_t ck, cksum_t ck_sim, size_t file_sz,
 		 size_t memlimit, int nthreads, int pipe_mode);
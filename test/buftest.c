@@ -0,0 +1,266 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2026 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * Test driver for the library buffer interface. Usage:
+ *
+ *   buftest <file> <calls> "<compress options>" [<password>]
+ *
+ * Parts of the file of varying size are compressed and decompressed the
+ * given number of times on one pair of contexts, so that the pooled slots
+ * are reused. Even calls use pc_process_buffer(), odd calls decompress with
+ * pc_process_stream(). Without a password the output of every call must be
+ * the same as from a fresh context. With a password it is set before every
+ * call and one more compression without it must fail, after which the
+ * context must still work.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "pcompress.h"
+#include <utils.h>
+
+struct mem_cookie {
+	uchar_t *in, *out;
+	uint64_t inlen, inpos, outlen, outsz;
+};
+
+static int64_t
+mem_read(void *cookie, void *buf, uint64_t len)
+{
+	struct mem_cookie *mc = (struct mem_cookie *)cookie;
+
+	if (len > mc->inlen - mc->inpos)
+		len = mc->inlen - mc->inpos;
+	memcpy(buf, mc->in + mc->inpos, len);
+	mc->inpos += len;
+	return (len);
+}
+
+static int64_t
+mem_write(void *cookie, const void *buf, uint64_t len)
+{
+	struct mem_cookie *mc = (struct mem_cookie *)cookie;
+
+	if (len > mc->outsz - mc->outlen)
+		return (-1);
+	memcpy(mc->out + mc->outlen, buf, len);
+	mc->outlen += len;
+	return (len);
+}
+
+/*
+ * Hand a fresh copy of the password to the context, the library zeroes it
+ * after use. Returns the copy so that the caller can check that.
+ */
+static unsigned char *
+set_pw(pc_ctx_t *pctx, const char *pw)
+{
+	unsigned char *pwbuf;
+
+	if (pw == NULL)
+		return (NULL);
+	pwbuf = (unsigned char *)strdup(pw);
+	if (pwbuf == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	pc_set_userpw(pctx, pwbuf, strlen(pw));
+	return (pwbuf);
+}
+
+/*
+ * Compress on a new context and compare with the output of the pooled one.
+ * The argument string is split up in place, so a copy is passed.
+ */
+static int
+same_as_fresh(const char *opts, uchar_t *src, uint64_t len, uchar_t *cbuf, uint64_t clen)
+{
+	char cargs[512];
+	pc_ctx_t *pctx;
+	uchar_t *fbuf;
+	uint64_t flen;
+	int rv;
+
+	snprintf(cargs, sizeof (cargs), "pcompress %s", opts);
+	pctx = create_pc_context();
+	if (init_pc_context_mem(pctx, cargs) != 0) {
+		destroy_pc_context(pctx);
+		return (0);
+	}
+	fbuf = NULL;
+	rv = 0;
+	if (pc_process_buffer(pctx, src, len, (void **)&fbuf, &flen) == 0)
+		rv = (flen == clen && memcmp(fbuf, cbuf, clen) == 0);
+	free(fbuf);
+	destroy_pc_context(pctx);
+	return (rv);
+}
+
+static int
+pw_zeroed(unsigned char *pwbuf, const char *pw)
+{
+	size_t i;
+
+	if (pwbuf == NULL)
+		return (1);
+	for (i = 0; i < strlen(pw); i++) {
+		if (pwbuf[i] != 0)
+			return (0);
+	}
+	return (1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char cargs[512], dargs[] = "pcompress -d";
+	pc_ctx_t *cctx, *dctx;
+	unsigned char *cpw, *dpw;
+	uchar_t *src, *cbuf, *dbuf;
+	uint64_t srclen, len, clen, dlen;
+	const char *pw;
+	int i, calls, err;
+	FILE *fp;
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s <file> <calls> \"<compress options>\" "
+		    "[<password>]\n", argv[0]);
+		return (1);
+	}
+	calls = atoi(argv[2]);
+	pw = argc > 4 ? argv[4] : NULL;
+
+	fp = fopen(argv[1], "rb");
+	if (fp == NULL) {
+		perror(argv[1]);
+		return (1);
+	}
+	fseek(fp, 0, SEEK_END);
+	srclen = ftell(fp);
+	rewind(fp);
+	src = (uchar_t *)malloc(srclen);
+	if (src == NULL || fread(src, 1, srclen, fp) != srclen) {
+		fprintf(stderr, "Cannot read %s\n", argv[1]);
+		return (1);
+	}
+	fclose(fp);
+
+	snprintf(cargs, sizeof (cargs), "pcompress %s", argv[3]);
+	cctx = create_pc_context();
+	dctx = create_pc_context();
+	if (init_pc_context_mem(cctx, cargs) != 0 || init_pc_context_mem(dctx, dargs) != 0) {
+		fprintf(stderr, "Cannot set up contexts\n");
+		return (1);
+	}
+
+	err = 0;
+	for (i = 0; i < calls && !err; i++) {
+		len = srclen >> (i % 4);
+		if (len == 0)
+			len = srclen;
+		cbuf = NULL;
+		dbuf = NULL;
+		cpw = set_pw(cctx, pw);
+		if (pc_process_buffer(cctx, src, len, (void **)&cbuf, &clen) != 0) {
+			fprintf(stderr, "Call %d: compression failed\n", i);
+			err = 1;
+			break;
+		}
+		if (pw && !pw_zeroed(cpw, pw)) {
+			fprintf(stderr, "Call %d: password was not zeroed\n", i);
+			err = 1;
+		}
+		free(cpw);
+		if (!pw && !same_as_fresh(argv[3], src, len, cbuf, clen)) {
+			fprintf(stderr, "Call %d: output differs from a fresh context\n", i);
+			err = 1;
+		}
+
+		dpw = set_pw(dctx, pw);
+		if (i & 1) {
+			struct mem_cookie mc;
+
+			mc.in = cbuf;
+			mc.inlen = clen;
+			mc.inpos = 0;
+			mc.outsz = len;
+			mc.outlen = 0;
+			mc.out = dbuf = (uchar_t *)malloc(len);
+			if (dbuf == NULL || pc_process_stream(dctx, mem_read, mem_write, &mc) != 0) {
+				fprintf(stderr, "Call %d: stream decompression failed\n", i);
+				err = 1;
+			}
+			dlen = mc.outlen;
+		} else {
+			if (pc_process_buffer(dctx, cbuf, clen, (void **)&dbuf, &dlen) != 0) {
+				fprintf(stderr, "Call %d: decompression failed\n", i);
+				err = 1;
+			}
+		}
+		free(dpw);
+		if (!err && (dlen != len || memcmp(src, dbuf, len) != 0)) {
+			fprintf(stderr, "Call %d: decompression was not correct\n", i);
+			err = 1;
+		}
+		free(cbuf);
+		free(dbuf);
+	}
+
+	/*
+	 * The password was used up by the previous call. The failed call drops
+	 * the pool, a call with a new password must still work.
+	 */
+	if (!err && pw) {
+		cbuf = NULL;
+		if (pc_process_buffer(cctx, src, srclen, (void **)&cbuf, &clen) == 0) {
+			fprintf(stderr, "Compression without a password did not fail\n");
+			free(cbuf);
+			err = 1;
+		} else {
+			cbuf = NULL;
+			dbuf = NULL;
+			cpw = set_pw(cctx, pw);
+			dpw = set_pw(dctx, pw);
+			if (pc_process_buffer(cctx, src, srclen, (void **)&cbuf, &clen) != 0 ||
+			    pc_process_buffer(dctx, cbuf, clen, (void **)&dbuf, &dlen) != 0 ||
+			    dlen != srclen || memcmp(src, dbuf, srclen) != 0) {
+				fprintf(stderr, "Call after a failed call did not work\n");
+				err = 1;
+			}
+			free(cpw);
+			free(dpw);
+			free(cbuf);
+			free(dbuf);
+		}
+	}
+
+	destroy_pc_context(cctx);
+	destroy_pc_context(dctx);
+	free(src);
+	return (err);
+}
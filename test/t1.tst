@@ -5,7 +5,7 @@ echo "#################################################"
 echo "# Simple compress and decompress"
 echo "#################################################"
 
-for algo in lzfx lz4 zlib bzip2 lzma lzmaMt libbsc ppmd adapt adapt2
+for algo in lzfx lz4 zlib bzip2 zstd lzma lzmaMt libbsc ppmd adapt adapt2
 do
 	../../pcompress 2>&1 | grep $algo > /dev/null
 	[ $? -ne 0 ] && continue
@@ -47,6 +47,165 @@ do
 	done
 done
 
+#
+# Fast lz4 levels and shared dictionary priming
+#
+for level in 0 2 3
+do
+	for tf in `cat files.lst`
+	do
+		for feat in "-s 1m" "-s 1m -Z" "-s 128k -Z"
+		do
+			cmd="../../pcompress -c lz4 -l ${level} ${feat} ${tf}"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Compression failed."
+				rm -f ${tf}.pz
+				continue
+			fi
+			cmd="../../pcompress -d ${tf}.pz ${tf}.1"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression failed."
+				rm -f ${tf}.pz ${tf}.1
+				continue
+			fi
+			diff ${tf} ${tf}.1 > /dev/null
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Decompression was not correct"
+			fi
+			rm -f ${tf}.pz ${tf}.1
+		done
+	done
+done
+
+#
+# Chunks of 64MB or more are split by lzmaMt into sub-streams that are
+# decompressed in parallel. The offset table sits right after the chunk
+# header, at byte 51 with a CRC64 checksum, and a corrupt table must be
+# rejected.
+#
+tf=`head -1 files.lst`
+bigf=`dirname ${tf}`/lzmamt_big.dat
+rm -f ${bigf} ${bigf}.pz ${bigf}.1
+bsz=0
+while [ $bsz -lt 100000000 ]
+do
+	for f in `cat files.lst`
+	do
+		cat ${f} >> ${bigf}
+	done
+	bsz=`ls -l ${bigf} | awk '{ print $5 }'`
+done
+
+for tbyte in 0 51 59
+do
+	cmd="../../pcompress -c lzmaMt -l 1 -s 128m -S CRC64 ${bigf}"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Compression failed."
+		rm -f ${bigf}.pz
+		continue
+	fi
+	if [ $tbyte -gt 0 ]
+	then
+		echo "Corrupting sub-stream offset table ..."
+		printf '\377\377\377\377\377\377\377\377' | \
+		    dd conv=notrunc of=${bigf}.pz bs=1 seek=${tbyte}
+	fi
+	cmd="../../pcompress -d ${bigf}.pz ${bigf}.1"
+	echo "Running $cmd"
+	eval $cmd
+	rv=$?
+	if [ -f core* ]
+	then
+		echo "FATAL: Decompression crashed"
+		rm -f core*
+	fi
+	if [ $tbyte -gt 0 ]
+	then
+		if [ $rv -eq 0 ]
+		then
+			echo "FATAL: Decompression DID NOT ERROR where expected."
+		fi
+	elif [ $rv -ne 0 ]
+	then
+		echo "FATAL: Decompression failed."
+	else
+		diff ${bigf} ${bigf}.1 > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression was not correct"
+		fi
+	fi
+	rm -f ${bigf}.pz ${bigf}.1
+done
+rm -f ${bigf}
+
+#
+# With --estimate adapt2 picks the algorithm of each chunk from samples. Source
+# code must go to the context modelling backends, PPMd or libbsc when built in,
+# and object files to LZMA. The chunk counts come from the -C statistics.
+#
+tdir=`dirname ${tf}`
+for ftype in txt obj
+do
+	estf=${tdir}/estimate.${ftype}
+	rm -f ${estf} ${estf}.pz ${estf}.1
+	if [ "$ftype" = "txt" ]
+	then
+		find ../.. -name '*.[ch]' | sort | xargs cat 2> /dev/null | head -c 4194304 > ${estf}
+	else
+		find ../.. -name '*.o' | sort | xargs cat 2> /dev/null | head -c 4194304 > ${estf}
+	fi
+
+	cmd="../../pcompress -c adapt2 -l 3 -s 1m -C --estimate ${estf}"
+	echo "Running $cmd"
+	eval $cmd > ${estf}.log 2>&1
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Compression failed."
+		rm -f ${estf} ${estf}.pz ${estf}.log
+		continue
+	fi
+	nlzma=`grep "LZMA chunk count" ${estf}.log | awk '{ print $NF }'`
+	nctx=`egrep "PPMd chunk count|LIBBSC chunk count" ${estf}.log | awk '{ n += $NF } END { print n }'`
+	if [ "$ftype" = "txt" ]
+	then
+		if [ $nlzma -ne 0 -o $nctx -eq 0 ]
+		then
+			echo "FATAL: Text was not compressed with PPMd or libbsc"
+		fi
+	else
+		if [ $nlzma -eq 0 -o $nctx -ne 0 ]
+		then
+			echo "FATAL: Binary data was not compressed with LZMA"
+		fi
+	fi
+
+	cmd="../../pcompress -d ${estf}.pz ${estf}.1"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Decompression failed."
+	else
+		diff ${estf} ${estf}.1 > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression was not correct"
+		fi
+	fi
+	rm -f ${estf} ${estf}.pz ${estf}.1 ${estf}.log
+done
+
 echo "#################################################"
 echo ""
 
@@ -0,0 +1,49 @@
+#
+# Library buffer interface
+#
+echo "#################################################"
+echo "# Library buffer and stream calls"
+echo "#################################################"
+
+LD_LIBRARY_PATH=../..
+export LD_LIBRARY_PATH
+
+for algo in lz4 zlib adapt2
+do
+	for tf in `cat files.lst`
+	do
+		for feat in "-S CRC64" "-S SHA256 -D" "-S CRC64 -e AES"
+		do
+			pw=
+			echo "$feat" | grep -- "-e" > /dev/null
+			[ $? -eq 0 ] && pw="plainpass"
+			cmd="../buftest ${tf} 6 \"-c ${algo} -l 3 -s 1m ${feat}\" ${pw}"
+			echo "Running $cmd"
+			eval $cmd
+			if [ $? -ne 0 ]
+			then
+				echo "FATAL: Buffer interface test failed."
+			fi
+		done
+	done
+done
+
+#
+# Global Dedupe data cannot be decompressed from a stream since references to
+# earlier chunks are read back from the output. So only one buffer call is made.
+#
+for tf in `cat files.lst`
+do
+	cmd="../buftest ${tf} 1 \"-c lz4 -l 3 -s 2m -S SHA256 -G -D\""
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Buffer interface test failed."
+	fi
+done
+
+unset LD_LIBRARY_PATH
+
+echo "#################################################"
+echo ""
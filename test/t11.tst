@@ -0,0 +1,121 @@
+#
+# Benchmark mode and run time options
+#
+echo "#################################################"
+echo "# Test benchmark mode and run time options"
+echo "#################################################"
+
+#
+# Select the smallest file from the list
+#
+tstf=
+tsz=0
+for tf in `cat files.lst`
+do
+	sz=`ls -l ${tf} | awk '{ print $5 }'`
+	if [ $tsz -eq 0 -o $sz -lt $tsz ]
+	then
+		tsz=$sz
+		tstf="$tf"
+	fi
+done
+
+for feat in "-s 1m -f none" "-s 2m -f none,D,GD -S SHA256" "-s 1m -f P,L -t 1,2"
+do
+	cmd="../../pcompress --bench -c lz4,zlib -l 1,3 $feat $tstf"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Benchmark failed."
+	fi
+done
+
+#
+# Compression options are given before the colon and decompression
+# options after it.
+#
+for feat in "-s 1m -R 64m:-R 64m" "-s 1m -D -R 64m:-R 64m" "-s 2m -G -D -R 64m:-R 64m" "-s 1m -D -P -R 64m:-R 64m" \
+		"-s 1m -N:-N" "-s 1m -N -D:-N" "-s 1m -N -t 1:-N" \
+		"-s 1m -H:-H" "-s 1m -H -D:-H" "-s 2m -H -G -D:-H" "-s 1m -H -M:-H" \
+		"-s 1m --progress=1 --progress-file=${tstf}.prog:--progress-file=${tstf}.prog"
+do
+	copts=`echo "$feat" | cut -d: -f1`
+	dopts=`echo "$feat" | cut -d: -f2`
+	rm -f ${tstf}.pz ${tstf}.1 ${tstf}.prog
+
+	cmd="../../pcompress -c zlib -l 3 $copts $tstf"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Compression errored."
+		rm -f ${tstf}.pz
+		continue
+	fi
+	if [ -f ${tstf}.prog ]
+	then
+		grep '"state":"done","op":"compress"' ${tstf}.prog > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Progress file was not correct after compression"
+		fi
+	fi
+
+	cmd="../../pcompress -d $dopts ${tstf}.pz ${tstf}.1"
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Decompression errored."
+		rm -f ${tstf}.pz ${tstf}.1
+		continue
+	fi
+	diff ${tstf} ${tstf}.1 > /dev/null
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Decompression was not correct"
+	fi
+	if [ -f ${tstf}.prog ]
+	then
+		grep '"state":"done","op":"decompress"' ${tstf}.prog > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Progress file was not correct after decompression"
+		fi
+	fi
+	rm -f ${tstf}.pz ${tstf}.1 ${tstf}.prog
+done
+
+#
+# Runs that must fail. The first one uses this archive, later ones must
+# not find it.
+#
+../../pcompress -c zlib -l 3 -s 1m $tstf
+for cmd in "../../pcompress -d -R 4m ${tstf}.pz ${tstf}.1" "../../pcompress --bench -c dummy $tstf" \
+		"../../pcompress -c zlib -l 3 -s 1m -R 4m $tstf" "../../pcompress -c zlib -l 3 -s 1m -D -R 4m $tstf" \
+		"../../pcompress -d --progress-file=${tstf}.prog ${tstf} ${tstf}.1"
+do
+	echo "Running $cmd"
+	eval $cmd
+	if [ $? -eq 0 ]
+	then
+		echo "FATAL: Command DID NOT ERROR where expected"
+	fi
+	if [ -f core* ]
+	then
+		echo "FATAL: Command crashed"
+		rm -f core*
+	fi
+	rm -f ${tstf}.pz ${tstf}.1
+done
+
+grep '"state":"failed"' ${tstf}.prog > /dev/null
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Progress file did not show the failure"
+fi
+rm -f ${tstf}.prog
+
+echo "#################################################"
+echo ""
@@ -0,0 +1,124 @@
+#
+# Archive mode with Global Dedupe
+#
+echo "#################################################"
+echo "# Test archiving with Global Deduplication"
+echo "#################################################"
+
+#
+# Select a large file from the list
+#
+tstf=
+tsz=0
+for tf in `cat files.lst`
+do
+	sz=`ls -l ${tf} | awk '{ print $5 }'`
+	if [ $sz -gt $tsz ]
+	then
+		tsz=$sz
+		tstf="$tf"
+	fi
+done
+
+#
+# Build a tree of the test files with a second copy of the large file, so
+# that later chunks reference blocks in earlier ones.
+#
+tdir=arctree
+rm -rf ${tdir} ${tdir}.pz ${tdir}.1.pz ${tdir}.out
+mkdir -p ${tdir}/a ${tdir}/b
+for tf in `cat files.lst`
+do
+	cp ${tf} ${tdir}/a
+done
+cp ${tstf} ${tdir}/b
+asz=`cat ${tdir}/a/* ${tdir}/b/* | wc -c`
+
+cmd="../../pcompress -a -G -D -c lz4 -l 3 -s 4m ${tdir} ${tdir}.pz"
+echo "Running $cmd"
+eval $cmd
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Compression errored."
+	rm -rf ${tdir} ${tdir}.pz
+	exit
+fi
+
+#
+# With a memory budget the referenced blocks that do not fit in memory
+# go to the .data scratch file in the target directory. It only holds
+# those blocks, so it must stay well under the size of the tree.
+#
+mkdir ${tdir}.out
+cmd="../../pcompress -d -R 64m ${tdir}.pz ${tdir}.out"
+echo "Running $cmd"
+eval $cmd &
+pid=$!
+maxsz=0
+while kill -0 $pid 2> /dev/null
+do
+	if [ -f ${tdir}.out/.data ]
+	then
+		sz=`ls -l ${tdir}.out/.data | awk '{ print $5 }'`
+		[ $sz -gt $maxsz ] && maxsz=$sz
+	fi
+	sleep 0.1
+done
+wait $pid
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Decompression errored."
+else
+	diff -r ${tdir} ${tdir}.out/${tdir} > /dev/null
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Decompression was not correct"
+	fi
+	if [ $maxsz -gt $((asz / 2)) ]
+	then
+		echo "FATAL: Scratch file grew to ${maxsz} bytes for ${asz} bytes of data"
+	fi
+fi
+rm -rf ${tdir}.out
+
+#
+# A truncated or corrupt reference table must make extraction fall back
+# to staging the whole data stream, or fail cleanly.
+#
+asz=`ls -l ${tdir}.pz | awk '{ print $5 }'`
+for cut in 10 40 0
+do
+	if [ $cut -gt 0 ]
+	then
+		echo "Truncating reference table by ${cut} bytes ..."
+		head -c $((asz - cut)) ${tdir}.pz > ${tdir}.1.pz
+	else
+		echo "Corrupting reference table ..."
+		cp ${tdir}.pz ${tdir}.1.pz
+		dd if=/dev/urandom conv=notrunc of=${tdir}.1.pz bs=1 count=4 \
+		    seek=$((asz - 28))
+	fi
+	mkdir ${tdir}.out
+	cmd="../../pcompress -d ${tdir}.1.pz ${tdir}.out"
+	echo "Running $cmd"
+	eval $cmd
+	rv=$?
+	if [ -f core* ]
+	then
+		echo "FATAL: Decompression crashed"
+		rm -f core*
+	elif [ $rv -eq 0 ]
+	then
+		diff -r ${tdir} ${tdir}.out/${tdir} > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression was not correct"
+		fi
+	fi
+	rm -rf ${tdir}.out ${tdir}.1.pz
+done
+
+rm -rf ${tdir} ${tdir}.pz
+echo "#################################################"
+echo ""
+
@@ -10,7 +10,7 @@ do
 	for tf in `cat files.lst`
 	do
 		rm -f ${tf}.*
-		for feat in "-D" "-D -B3 -L" "-D -B4 -E" "-D -B0 -EE" "-D -B5 -EE -L" "-D -B2" "-P" "-D -P" "-D -L -P" \
+		for feat in "-D" "-D -B3 -L" "-D -B4 -E" "-D -B4 -E -b" "-D -B0 -EE" "-D -B5 -EE -L" "-D -B2" "-P" "-D -P" "-D -L -P" \
 				"-G -D" "-G -F" "-G -L -P" "-G -B2"
 		do
 			for seg in 2m 11m
@@ -45,6 +45,95 @@ do
 	done
 done
 
+#
+# Preprocessing filters on a file of several chunks. With fewer chunk
+# threads than CPUs the text filters split each chunk over the spare CPUs.
+# -P delta encodes or transposes the binary chunks. With --pipeline the
+# dedupe and filter stage of a chunk runs on its own thread, overlapped
+# with compression of the previous chunk.
+# Compression options are given before the colon and decompression
+# options after it.
+#
+echo "#################################################"
+echo "# Test preprocessing filters on multiple chunks"
+echo "#################################################"
+
+tstf=
+tsz=0
+for tf in `cat files.lst`
+do
+	sz=`ls -l ${tf} | awk '{ print $5 }'`
+	if [ $sz -gt $tsz ]
+	then
+		tsz=$sz
+		tstf="$tf"
+	fi
+done
+
+for feat in "-L:" "-L -t 1:-t 1" "-D -L -t 2:-t 2" "-P:" "-P -t 1:-t 1" "-D -L -P -t 2:-t 2" \
+		"-D -L -P --pipeline:" "-L -P --pipeline -t 2:-t 2" "-G -D -P --pipeline:"
+do
+	copts=`echo "$feat" | cut -d: -f1`
+	dopts=`echo "$feat" | cut -d: -f2`
+	for seg in 4m 16m
+	do
+		rm -f ${tstf}.pz ${tstf}.1
+		cmd="../../pcompress -c lz4 -l 3 -s ${seg} $copts ${tstf}"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Compression errored."
+			rm -f ${tstf}.pz
+			continue
+		fi
+		cmd="../../pcompress -d $dopts ${tstf}.pz ${tstf}.1"
+		echo "Running $cmd"
+		eval $cmd
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression errored."
+			rm -f ${tstf}.pz ${tstf}.1
+			continue
+		fi
+
+		diff ${tstf} ${tstf}.1 > /dev/null
+		if [ $? -ne 0 ]
+		then
+			echo "FATAL: Decompression was not correct"
+		fi
+		rm -f ${tstf}.pz ${tstf}.1
+	done
+done
+
+#
+# -J prints the stage counters as one line of JSON on stderr at exit.
+#
+rm -f ${tstf}.pz ${tstf}.1 ${tstf}.json
+for cmd in "../../pcompress -c lz4 -l 3 -s 4m -D -L -P --pipeline -J ${tstf}" \
+		"../../pcompress -d -J ${tstf}.pz ${tstf}.1"
+do
+	echo "Running $cmd"
+	eval $cmd 2> ${tstf}.json
+	if [ $? -ne 0 ]
+	then
+		echo "FATAL: Command errored."
+		break
+	fi
+	cnt=`grep '^{' ${tstf}.json | wc -l`
+	ecnt=`grep '^{"event":"exit",' ${tstf}.json | wc -l`
+	if [ $cnt -ne 1 -o $ecnt -ne 1 ]
+	then
+		echo "FATAL: Expected one JSON line at exit, got ${cnt}"
+	fi
+done
+diff ${tstf} ${tstf}.1 > /dev/null
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Decompression was not correct"
+fi
+rm -f ${tstf}.pz ${tstf}.1 ${tstf}.json
+
 #
 # Test Segmented Global Dedupe
 #
@@ -93,6 +182,13 @@ then
 	rm -f ${tstf}.pz
 	exit
 fi
+cmd="../../pcompress --verify ${tstf}.pz"
+echo "Running $cmd"
+eval $cmd
+if [ $? -ne 0 ]
+then
+	echo "FATAL: Verification failed."
+fi
 cmd="../../pcompress -d ${tstf}.pz ${tstf}.1"
 echo "Running $cmd"
 eval $cmd
@@ -59,7 +59,7 @@ do
 	rm -f ${tstf}.pz
 done
 
-for feat in "-B8 -s2m -l1" "-B-1 -s2m -l1" "-D -s10k -l1" "-D -F -s2m -l1" "-p -e AES -s2m -l1" "-s2m -l15" "-e AES -k64" "-e SALSA20 -k8" "-e AES -k8" "-e SALSA20 -k64"
+for feat in "-B8 -s2m -l1" "-B-1 -s2m -l1" "-D -s10k -l1" "-D -F -s2m -l1" "-p -e AES -s2m -l1" "-s2m -l15" "-e AES -k64" "-e SALSA20 -k8" "-e AES -k8" "-e SALSA20 -k64" "-Z -s2m -l1" "-s2m -l1 -R0" "-s2m -l1 -R1m"
 do
 	for algo in lzfx lz4 zlib bzip2 libbsc ppmd lzma
 	do
@@ -99,7 +99,7 @@ fi
 #
 for feat in "-E -M -C -s 2147480000" "-D -E -M -C -L -P -B 2 -s 2147480000"
 do
-	for algo in lz4 libbsc
+	for algo in libbsc
 	do
 		cmd="../../pcompress -c $algo $feat ${tstf}.1"
 		echo "Running $cmd"
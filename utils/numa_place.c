@@ -0,0 +1,250 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+/*
+ * NUMA placement of worker threads and their buffers. The node layout is
+ * read from sysfs and memory is moved with the mbind system call, so there
+ * is no dependency on libnuma. Everything here is best effort. On systems
+ * without NUMA support the functions do nothing.
+ */
+
+#ifdef __linux__
+#define	_GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "numa_place.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#define	NUMA_MAX_NODES	64
+
+/*
+ * From linux/mempolicy.h.
+ */
+#define	NUMA_MPOL_PREFERRED	1
+#define	NUMA_MPOL_MF_MOVE	(1 << 1)
+
+static pthread_mutex_t numa_lock = PTHREAD_MUTEX_INITIALIZER;
+static int numa_nnodes = -1;
+static int numa_ids[NUMA_MAX_NODES];
+static cpu_set_t numa_cpus[NUMA_MAX_NODES];
+static cpu_set_t numa_all_cpus;
+
+/*
+ * Parse a sysfs cpu list like "0-3,8-11".
+ */
+static void
+parse_cpulist(char *str, cpu_set_t *set)
+{
+	char *pos, *end;
+	long a, b;
+
+	CPU_ZERO(set);
+	pos = str;
+	while (*pos) {
+		a = strtol(pos, &end, 10);
+		if (end == pos)
+			break;
+		b = a;
+		if (*end == '-') {
+			pos = end + 1;
+			b = strtol(pos, &end, 10);
+			if (end == pos)
+				break;
+		}
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a, set);
+		pos = end;
+		if (*pos == ',')
+			pos++;
+		else
+			break;
+	}
+}
+
+/*
+ * Discover the nodes that have some of the CPUs this process may run on.
+ * Returns the number of such nodes, 0 if unknown.
+ */
+int
+numa_topo_init(void)
+{
+	char path[PATH_MAX], buf[1024];
+	cpu_set_t set;
+	FILE *fp;
+	int n;
+
+	pthread_mutex_lock(&numa_lock);
+	if (numa_nnodes >= 0) {
+		pthread_mutex_unlock(&numa_lock);
+		return (numa_nnodes);
+	}
+	numa_nnodes = 0;
+	if (sched_getaffinity(0, sizeof (numa_all_cpus), &numa_all_cpus) == -1) {
+		pthread_mutex_unlock(&numa_lock);
+		return (0);
+	}
+
+	for (n = 0; n < NUMA_MAX_NODES; n++) {
+		snprintf(path, sizeof (path), "/sys/devices/system/node/node%d/cpulist", n);
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			continue;
+		if (fgets(buf, sizeof (buf), fp) == NULL) {
+			fclose(fp);
+			continue;
+		}
+		fclose(fp);
+		parse_cpulist(buf, &set);
+		CPU_AND(&set, &set, &numa_all_cpus);
+		if (CPU_COUNT(&set) == 0)
+			continue;
+		numa_ids[numa_nnodes] = n;
+		numa_cpus[numa_nnodes] = set;
+		numa_nnodes++;
+	}
+	pthread_mutex_unlock(&numa_lock);
+	return (numa_nnodes);
+}
+
+/*
+ * Restrict a thread to the CPUs of a node.
+ */
+void
+numa_place_thread(pthread_t thr, int node)
+{
+	if (numa_nnodes <= 0)
+		return;
+	if (node < 0)
+		(void) pthread_setaffinity_np(thr, sizeof (cpu_set_t), &numa_all_cpus);
+	else
+		(void) pthread_setaffinity_np(thr, sizeof (cpu_set_t),
+		    &numa_cpus[node % numa_nnodes]);
+}
+
+/*
+ * Prefer a node for the pages of a buffer and move the pages that are already
+ * present. Only whole pages inside the buffer are affected.
+ */
+void
+numa_place_mem(void *addr, size_t len, int node)
+{
+	unsigned long mask[NUMA_MAX_NODES / (8 * sizeof (unsigned long))];
+	uintptr_t start, end, pgsz;
+	int id;
+
+	if (numa_nnodes <= 0 || addr == NULL || node < 0)
+		return;
+	pgsz = sysconf(_SC_PAGESIZE);
+	start = ((uintptr_t)addr + pgsz - 1) & ~(pgsz - 1);
+	end = ((uintptr_t)addr + len) & ~(pgsz - 1);
+	if (end <= start)
+		return;
+
+	id = numa_ids[node % numa_nnodes];
+	memset(mask, 0, sizeof (mask));
+	mask[id / (8 * sizeof (unsigned long))] |= 1UL << (id % (8 * sizeof (unsigned long)));
+	(void) syscall(SYS_mbind, start, end - start, NUMA_MPOL_PREFERRED, mask,
+	    NUMA_MAX_NODES + 1, NUMA_MPOL_MF_MOVE);
+}
+
+/*
+ * Find the node of the device behind a file. The sysfs device path is walked
+ * up until a numa_node attribute is found. Returns the node index or -1.
+ */
+int
+numa_fd_node(int fd)
+{
+	char path[PATH_MAX], rpath[PATH_MAX], attr[PATH_MAX + 16];
+	struct stat sbuf;
+	char *pos;
+	FILE *fp;
+	int id, n;
+	dev_t dev;
+
+	if (numa_nnodes <= 0 || fstat(fd, &sbuf) == -1)
+		return (-1);
+	if (S_ISBLK(sbuf.st_mode))
+		dev = sbuf.st_rdev;
+	else if (S_ISREG(sbuf.st_mode))
+		dev = sbuf.st_dev;
+	else
+		return (-1);
+
+	snprintf(path, sizeof (path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+	if (realpath(path, rpath) == NULL)
+		return (-1);
+
+	id = -1;
+	while ((pos = strrchr(rpath, '/')) != NULL && pos - rpath > 12) {
+		*pos = '\0';
+		snprintf(attr, sizeof (attr), "%s/numa_node", rpath);
+		fp = fopen(attr, "r");
+		if (fp == NULL)
+			continue;
+		if (fscanf(fp, "%d", &id) != 1)
+			id = -1;
+		fclose(fp);
+		break;
+	}
+	if (id < 0)
+		return (-1);
+	for (n = 0; n < numa_nnodes; n++) {
+		if (numa_ids[n] == id)
+			return (n);
+	}
+	return (-1);
+}
+
+#else
+int
+numa_topo_init(void)
+{
+	return (0);
+}
+
+void
+numa_place_thread(pthread_t thr, int node) {}
+
+void
+numa_place_mem(void *addr, size_t len, int node) {}
+
+int
+numa_fd_node(int fd)
+{
+	return (-1);
+}
+#endif
@@ -0,0 +1,49 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#ifndef	_NUMA_PLACE_H_
+#define	_NUMA_PLACE_H_
+
+#include <pthread.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Best effort NUMA placement helpers. Nodes are referred to by an index from
+ * 0 to numa_topo_init() - 1 and larger indexes wrap around. An index of -1
+ * stands for all the CPUs the process was started with.
+ */
+int numa_topo_init(void);
+void numa_place_thread(pthread_t thr, int node);
+void numa_place_mem(void *addr, size_t len, int node);
+int numa_fd_node(int fd);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -229,18 +229,20 @@ Read(int fd, void *buf, uint64_t count)
  * Read the requested chunk and return the last rabin boundary in the chunk.
  * This helps in splitting chunks at rabin boundaries rather than fixed points.
  * The request buffer may have some data at the beginning carried over from
- * after the previous rabin boundary.
+ * after the previous rabin boundary. If read_func is given the data comes
+ * from it instead of fd.
  */
 int64_t
-Read_Adjusted(int fd, uchar_t *buf, uint64_t count, int64_t *rabin_count, void *ctx, void *pctx)
+Read_Adjusted(int fd, uchar_t *buf, uint64_t count, int64_t *rabin_count, void *ctx,
+    read_func_t read_func, void *rdata)
 {
         uchar_t *buf2;
         int64_t rcount;
         dedupe_context_t *rctx = (dedupe_context_t *)ctx;
 
         if (!ctx) {
-		if (pctx)
-			return (archiver_read(pctx, buf, count));
+		if (read_func)
+			return (read_func(rdata, buf, count));
 		else
 			return (Read(fd, buf, count));
 	}
@@ -249,8 +251,8 @@ Read_Adjusted(int fd, uchar_t *buf, uint64_t count, int64_t *rabin_count, void *
                 buf2 = buf + *rabin_count;
                 count -= *rabin_count;
         }
-	if (pctx)
-		rcount = archiver_read(pctx, buf2, count);
+	if (read_func)
+		rcount = read_func(rdata, buf2, count);
 	else
 		rcount = Read(fd, buf2, count);
         if (rcount > 0) {
@@ -306,6 +308,8 @@ init_algo_props(algo_props_t *props)
 	props->c_max_threads = 1;
 	props->d_max_threads = 1;
 	props->delta2_span = 0;
+	props->state_mem = 0;
+	props->dstate_mem = 0;
 }
 
 /*
@@ -411,6 +415,16 @@ get_wtime_millis(void)
 	return (1);
 }
 
+uint64_t
+get_wtime_nanos(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+	return (0);
+}
+
 double
 get_mb_s(uint64_t bytes, double strt, double en)
 {
@@ -763,6 +777,12 @@ Sem_Wait(Sem_t *sem)
 	return (sem_wait(sem->sem1));
 }
 
+int
+Sem_TryWait(Sem_t *sem)
+{
+	return (sem_trywait(sem->sem1));
+}
+
 #else
 
 int
@@ -788,5 +808,11 @@ Sem_Wait(Sem_t *sem)
 {
 	return (sem_wait(&sem->sem));
 }
+
+int
+Sem_TryWait(Sem_t *sem)
+{
+	return (sem_trywait(&sem->sem));
+}
 #endif
 
@@ -243,6 +243,8 @@ typedef struct {
 	int delta2_span;
 	int deltac_min_distance;
 	cksum_t cksum;
+	uint64_t state_mem;	/* Approximate codec state memory per chunk slot. */
+	uint64_t dstate_mem;	/* Same when decompressing. */
 } algo_props_t;
 
 typedef enum {
@@ -336,6 +338,9 @@ typedef enum {
 extern processor_cap_t proc_info;
 #endif
 
+/* Pointer type for reads that do not come from a descriptor. */
+typedef int64_t (*read_func_t)(void *data, void *buf, uint64_t count);
+
 extern void err_exit(int show_errno, const char *format, ...);
 extern void err_print(int show_errno, const char *format, ...);
 extern const char *get_execname(const char *);
@@ -343,12 +348,13 @@ extern int parse_numeric(int64_t *val, const char *str);
 extern char *bytes_to_size(uint64_t bytes);
 extern int64_t Read(int fd, void *buf, uint64_t count);
 extern int64_t Read_Adjusted(int fd, uchar_t *buf, uint64_t count,
-	int64_t *rabin_count, void *ctx, void *pctx);
+	int64_t *rabin_count, void *ctx, read_func_t read_func, void *rdata);
 extern int64_t Write(int fd, const void *buf, uint64_t count);
 extern void set_threadcounts(algo_props_t *props, int *nthreads, int nprocs,
 	algo_threads_type_t typ);
 extern uint64_t get_total_ram();
 extern double get_wtime_millis(void);
+extern uint64_t get_wtime_nanos(void);
 extern double get_mb_s(uint64_t bytes, double strt, double en);
 extern void get_sys_limits(my_sysinfo *msys_info);
 extern int chk_dir(char *dir);
@@ -377,6 +383,9 @@ typedef int (*init_func_ptr)(void **data, int *level, int nthreads, uint64_t chu
 typedef int (*deinit_func_ptr)(void **data);
 typedef void (*stats_func_ptr)(int show);
 typedef void (*props_func_ptr)(algo_props_t *data, int level, uint64_t chunksize);
+typedef int (*dict_train_func_ptr)(uchar_t *buf, uint64_t buflen, uint64_t samplelen,
+				   uint64_t nchunks, int level, uchar_t *dict);
+typedef int (*dict_set_func_ptr)(void *data, uchar_t *dict, int dictlen);
 
 /*
  * Logging definitions.
@@ -435,6 +444,7 @@ int Sem_Init(Sem_t *sem, int pshared, int value);
 int Sem_Destroy(Sem_t *sem);
 int Sem_Post(Sem_t *sem);
 int Sem_Wait(Sem_t *sem);
+int Sem_TryWait(Sem_t *sem);
 
 
 /*
@@ -0,0 +1,230 @@
+/*
+ * This file is a part of Pcompress, a chunked parallel multi-
+ * algorithm lossless compression and decompression program.
+ *
+ * Copyright (C) 2012-2013 Moinak Ghosh. All rights reserved.
+ * Use is subject to license terms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * moinakg@belenix.org, http://moinakg.wordpress.com/
+ *
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <strings.h>
+#include <zstd.h>
+#include <zstd_errors.h>
+#include <utils.h>
+#include <pcompress.h>
+#include <allocator.h>
+
+/*
+ * Pcompress levels 0 - 14 mapped to Zstd levels. Levels 12 and above
+ * use the Zstd ultra levels which need larger windows.
+ */
+static const int zstd_levels[] = {1, 1, 2, 3, 4, 6, 8, 10, 12, 15, 17, 19, 20, 21, 22};
+
+/*
+ * Long distance matching is enabled from this level onwards. It helps
+ * large chunks having repeats further apart than the normal window.
+ */
+#define	ZSTD_LDM_LEVEL	10
+
+struct zstd_params {
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+};
+
+static void
+zstd_err(size_t ret)
+{
+	log_msg(LOG_ERR, 0, "Zstd: %s\n", ZSTD_getErrorName(ret));
+}
+
+int
+zstd_buf_extra(uint64_t buflen)
+{
+	return (ZSTD_compressBound(buflen) - buflen);
+}
+
+void
+zstd_stats(int show)
+{
+}
+
+void
+zstd_props(algo_props_t *data, int level, uint64_t chunksize) {
+	uint64_t wsize;
+
+	/*
+	 * Match state is roughly a few times the window, which spans the
+	 * chunk when long distance matching is used.
+	 */
+	wsize = (level >= ZSTD_LDM_LEVEL ? (1ULL << 27) : (1ULL << 23));
+	if (wsize > chunksize)
+		wsize = chunksize;
+	data->compress_mt_capable = 0;
+	data->decompress_mt_capable = 0;
+	data->state_mem = wsize * 4;
+	data->dstate_mem = wsize;
+	data->buf_extra = zstd_buf_extra(chunksize);
+	data->delta2_span = 100;
+	data->deltac_min_distance = EIGHTM;
+}
+
+int
+zstd_init(void **data, int *level, int nthreads, uint64_t chunksize,
+	  int file_version, compress_op_t op)
+{
+	struct zstd_params *zdat;
+	ZSTD_bounds wb;
+	size_t ret;
+	int wlog;
+
+	if (*level > 14) *level = 14;
+	zdat = (struct zstd_params *)slab_alloc(NULL, sizeof (struct zstd_params));
+	if (!zdat) {
+		log_msg(LOG_ERR, 0, "Zstd: Out of memory\n");
+		return (-1);
+	}
+	zdat->cctx = NULL;
+	zdat->dctx = NULL;
+
+	if (op == COMPRESS) {
+		zdat->cctx = ZSTD_createCCtx();
+		if (!zdat->cctx) {
+			slab_free(NULL, zdat);
+			log_msg(LOG_ERR, 0, "Zstd: Out of memory\n");
+			return (-1);
+		}
+
+		/*
+		 * Chunk size and checksum are already recorded in the chunk header.
+		 */
+		ret = ZSTD_CCtx_setParameter(zdat->cctx, ZSTD_c_compressionLevel,
+		    zstd_levels[*level]);
+		if (!ZSTD_isError(ret))
+			ret = ZSTD_CCtx_setParameter(zdat->cctx, ZSTD_c_contentSizeFlag, 0);
+		if (!ZSTD_isError(ret))
+			ret = ZSTD_CCtx_setParameter(zdat->cctx, ZSTD_c_checksumFlag, 0);
+		if (!ZSTD_isError(ret))
+			ret = ZSTD_CCtx_setParameter(zdat->cctx, ZSTD_c_dictIDFlag, 0);
+		if (!ZSTD_isError(ret) && *level >= ZSTD_LDM_LEVEL) {
+			/*
+			 * Window need not exceed the chunk size. Every chunk is an
+			 * independent Zstd frame.
+			 */
+			wb = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+			wlog = wb.lowerBound;
+			while (wlog < wb.upperBound && (1ULL << wlog) < chunksize)
+				wlog++;
+			ret = ZSTD_CCtx_setParameter(zdat->cctx,
+			    ZSTD_c_enableLongDistanceMatching, 1);
+			if (!ZSTD_isError(ret))
+				ret = ZSTD_CCtx_setParameter(zdat->cctx, ZSTD_c_windowLog, wlog);
+		}
+	} else {
+		zdat->dctx = ZSTD_createDCtx();
+		if (!zdat->dctx) {
+			slab_free(NULL, zdat);
+			log_msg(LOG_ERR, 0, "Zstd: Out of memory\n");
+			return (-1);
+		}
+		/*
+		 * Chunks are decoded in one shot into a buffer of the full chunk size,
+		 * so the window does not add to memory use. Accept any window.
+		 */
+		wb = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+		ret = ZSTD_DCtx_setParameter(zdat->dctx, ZSTD_d_windowLogMax, wb.upperBound);
+	}
+	if (ZSTD_isError(ret)) {
+		zstd_err(ret);
+		*data = zdat;
+		zstd_deinit(data);
+		return (-1);
+	}
+
+	*data = zdat;
+	return (0);
+}
+
+int
+zstd_deinit(void **data)
+{
+	struct zstd_params *zdat = (struct zstd_params *)(*data);
+
+	if (zdat) {
+		if (zdat->cctx)
+			ZSTD_freeCCtx(zdat->cctx);
+		if (zdat->dctx)
+			ZSTD_freeDCtx(zdat->dctx);
+		slab_free(NULL, zdat);
+	}
+	*data = NULL;
+	return (0);
+}
+
+int
+zstd_compress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
+	      int level, uchar_t chdr, int btype, void *data)
+{
+	size_t ret;
+	struct zstd_params *zdat = (struct zstd_params *)data;
+
+	/*
+	 * If the data is known to be compressed then certain types less compressed data
+	 * can be attempted to be compressed again for a possible gain. For others it is
+	 * a waste of time.
+	 */
+	if (PC_TYPE(btype) & TYPE_COMPRESSED && level < 7) {
+		int subtype = PC_SUBTYPE(btype);
+
+		if (subtype != TYPE_COMPRESSED_LZW &&
+		    subtype != TYPE_COMPRESSED_LZ && subtype != TYPE_COMPRESSED_LZO) {
+			return (-1);
+		}
+	}
+
+	ret = ZSTD_compress2(zdat->cctx, dst, *dstlen, src, srclen);
+	if (ZSTD_isError(ret)) {
+		/* Output not fitting is non-fatal. Chunk is stored uncompressed. */
+		if (ZSTD_getErrorCode(ret) != ZSTD_error_dstSize_tooSmall)
+			zstd_err(ret);
+		return (-1);
+	}
+	*dstlen = ret;
+	return (0);
+}
+
+int
+zstd_decompress(void *src, uint64_t srclen, void *dst, uint64_t *dstlen,
+		int level, uchar_t chdr, int btype, void *data)
+{
+	size_t ret;
+	struct zstd_params *zdat = (struct zstd_params *)data;
+
+	ret = ZSTD_decompressDCtx(zdat->dctx, dst, *dstlen, src, srclen);
+	if (ZSTD_isError(ret)) {
+		zstd_err(ret);
+		return (-1);
+	}
+	if (ret != *dstlen) {
+		log_msg(LOG_ERR, 0, "Zstd: Decompressed size mismatch\n");
+		return (-1);
+	}
+	return (0);
+}